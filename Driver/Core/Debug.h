@@ -50,16 +50,16 @@ extern ULONG g_debugLevel;
 #define OVS_VERIFY_WINL_MESSAGES    1
 #define OVS_USE_ASSERTS             0
 
-#ifdef DBG
+//set to 1 to record, for each refcounted object, which functions of which threads hold references to it.
+//it serializes all reference / dereference operations on a global lock, so it is off even in debug builds.
+#define OVS_USE_REFCOUNT_CALL_STACK    0
 
-#define OVS_USE_REFCOUNT_CALL_STACK    1
+#ifdef DBG
 
 #undef OVS_USE_ASSERTS
 #define OVS_USE_ASSERTS                1
 
 #else
-#define OVS_USE_REFCOUNT_CALL_STACK    0
-
 //we won't verify WINL messages on release mode
 #undef OVS_VERIFY_WINL_MESSAGES
 #define OVS_VERIFY_WINL_MESSAGES       0
@@ -122,4 +122,46 @@ OVS_SWITCH_INFO* Driver_GetDefaultSwitch_Ref(const char* funcName)
     DRIVER_UNLOCK();
 
     return pSwitchInfo;
-}
\ No newline at end of file
+}
+
+_Use_decl_annotations_
+ULONG Driver_ReadParameter(PCUNICODE_STRING pRegistryPath, PCWSTR valueName, ULONG defaultValue)
+{
+    RTL_QUERY_REGISTRY_TABLE queryTable[3];
+    ULONG value = defaultValue;
+    WCHAR* registryPath = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    RtlZeroMemory(queryTable, sizeof(queryTable));
+
+    //the registry path is not necessarily null terminated
+    registryPath = KAlloc(pRegistryPath->Length + sizeof(WCHAR));
+    if (!registryPath)
+    {
+        return defaultValue;
+    }
+
+    RtlCopyMemory(registryPath, pRegistryPath->Buffer, pRegistryPath->Length);
+    registryPath[pRegistryPath->Length / sizeof(WCHAR)] = L'\0';
+
+    queryTable[0].Flags = RTL_QUERY_REGISTRY_SUBKEY;
+    queryTable[0].Name = L"Parameters";
+
+    queryTable[1].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    queryTable[1].Name = (PWSTR)valueName;
+    queryTable[1].EntryContext = &value;
+    queryTable[1].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD;
+    queryTable[1].DefaultData = &defaultValue;
+    queryTable[1].DefaultLength = sizeof(ULONG);
+
+    status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, registryPath, queryTable, NULL, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        //i.e. there is no Parameters key
+        value = defaultValue;
+    }
+
+    KFree(registryPath);
+
+    return value;
+}
@@ -53,4 +53,7 @@ VOID Driver_RemoveDatapath();
 VOID Switch_DestroyNow_Unsafe(OVS_SWITCH_INFO* pSwitchInfo);
 
 BOOLEAN Driver_HaveDatapath();
-OVS_SWITCH_INFO* Driver_GetDefaultSwitch_Ref(const char* funcName);
\ No newline at end of file
+OVS_SWITCH_INFO* Driver_GetDefaultSwitch_Ref(const char* funcName);
+
+//reads a REG_DWORD value of the Parameters subkey of the driver's registry key. Returns defaultValue if the value or the key is missing.
+ULONG Driver_ReadParameter(_In_ PCUNICODE_STRING pRegistryPath, _In_z_ PCWSTR valueName, ULONG defaultValue);
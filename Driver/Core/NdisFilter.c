@@ -27,14 +27,18 @@ limitations under the License.
 #include "OvsCore.h"
 #include "OFPort.h"
 #include "OidPort.h"
+#include "Gre.h"
+#include "Vxlan.h"
+#include "RxCoalesce.h"
+#include "Ipv4Reassembly.h"
+#include "Random.h"
+#include "WinlPacket.h"
 
 #include <netioapi.h>
 
 NDIS_HANDLE g_driverHandle = NULL;
 NDIS_HANDLE g_driverObject;
 
-LIST_ENTRY g_arpTable;
-
 /*****************************************/
 NDIS_SPIN_LOCK g_nbPoolLock;
 NDIS_HANDLE g_hNblPool = NULL;
@@ -42,8 +46,6 @@ NDIS_HANDLE g_hNbPool = NULL;
 UINT g_tagNblPool = 'PsvO';
 UINT g_tagNbPool = 'PsvO';
 
-PNDIS_RW_LOCK_EX g_pArpRWLock = NULL;
-
 LONG g_requestID = 0xFFFFFFFE;
 
 /******************************/
@@ -55,8 +57,6 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING pRegistryPath
     NDIS_FILTER_DRIVER_CHARACTERISTICS driverChars = { 0 };
     NDIS_STRING serviceName = { 0 };
 
-    UNREFERENCED_PARAMETER(pRegistryPath);
-
     RtlInitUnicodeString(&serviceName, g_driverServiceName);
     RtlInitUnicodeString(&g_extensionFriendlyName, g_driverFriendlyName);
     RtlInitUnicodeString(&g_extensionGuid, g_driverUniqueName);
@@ -99,7 +99,9 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING pRegistryPath
 
     NdisAllocateSpinLock(&g_driver.lock);
     NdisAllocateSpinLock(&g_nbPoolLock);
+#if OVS_USE_REFCOUNT_CALL_STACK
     g_pRefRwLock = NdisAllocateRWLock(NULL);
+#endif
 
     InitializeListHead(&g_driver.switchList);
     InitializeListHead(&g_driver.datapathList);
@@ -119,8 +121,13 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING pRegistryPath
         goto Cleanup;
     }
 
-    g_pArpRWLock = NdisAllocateRWLock((NDIS_HANDLE)g_driverObject);
-    InitializeListHead(&g_arpTable);
+    Arp_InitTable();
+    Random_Initialize();
+    WinlPacket_InitializeSampling(g_driverHandle, pRegistryPath);
+    RxCoalesce_Initialize(pRegistryPath);
+    Gre_Initialize(pRegistryPath);
+    Vxlan_Initialize(pRegistryPath);
+    Ipv4Reassembly_Initialize(pRegistryPath);
 
 Cleanup:
 
@@ -132,7 +139,9 @@ Cleanup:
             g_driverHandle = NULL;
         }
 
+#if OVS_USE_REFCOUNT_CALL_STACK
         NdisFreeRWLock(g_pRefRwLock);
+#endif
         NdisFreeSpinLock(&g_driver.lock);
     }
 
@@ -146,15 +155,19 @@ VOID DriverUnload(PDRIVER_OBJECT pDriverObject)
 {
     UNREFERENCED_PARAMETER(pDriverObject);
 
+    //its timer writes to the devices
+    WinlPacket_UninitializeSampling();
     WinlDeleteDevices();
 
     Arp_DestroyTable();
-    NdisFreeRWLock(g_pArpRWLock);
-    g_pArpRWLock = NULL;
+    Ipv4Reassembly_Uninitialize();
+    Random_Uninitialize();
 
     NdisFDeregisterFilterDriver(g_driverHandle);
 
+#if OVS_USE_REFCOUNT_CALL_STACK
     NdisFreeRWLock(g_pRefRwLock);
+#endif
     NdisFreeSpinLock(&g_driver.lock);
     NdisFreeSpinLock(&g_nbPoolLock);
 }
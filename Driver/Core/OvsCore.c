@@ -25,7 +25,9 @@ limitations under the License.
 #include "OFPort.h"
 
 ULONG g_extAllocationTag = 'xsvO';
+#if OVS_USE_REFCOUNT_CALL_STACK
 NDIS_RW_LOCK_EX* g_pRefRwLock = NULL;
+#endif
 
 NDIS_STATUS OvsInit(NET_IFINDEX dpIfIndex)
 {
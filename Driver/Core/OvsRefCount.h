@@ -25,6 +25,11 @@ limitations under the License.
 C_ASSERT(OVS_REFCOUNT_MAX_THREAD_COUNT <= 64);
 #endif
 
+//the refCount value holds both the number of references and the 'deletion pending' flag,
+//so that both can be read and changed with a single interlocked operation.
+#define OVS_REFCOUNT_DELETION_PENDING      0x40000000L
+#define OVS_REFCOUNT_COUNT_MASK            0x3FFFFFFFL
+
 //NOTE: must be the first field of any struct using the OVS_REF_COUNT
 typedef struct _OVS_REF_COUNT
 {
@@ -38,199 +43,201 @@ typedef struct _OVS_REF_COUNT
     ULONG noOfThreads;
 #endif
 
-    //if refCount > 0, the object deletion will be postponed
+    //the low bits (OVS_REFCOUNT_COUNT_MASK) hold the number of references.
+    //if the number of references > 0, the object deletion will be postponed
     //it is used so that we can keep a pointer to the object, while allowing it to be modified (but not deleted) by other threads.
-    volatile ULONG refCount;
-    //if the object should be destroyed, but some thread currently holds a reference to it, it will be marked for deletion instead.
-    //when the refCount reaches 0, if deletetionPending is set, the dereference function will destroy the object.
-    volatile BOOLEAN deletionPending;
+    //OVS_REFCOUNT_DELETION_PENDING is set if the object should be destroyed, but some thread currently holds a reference to it.
+    //when the number of references reaches 0, if deletion is pending, the dereference function will destroy the object.
+    //once deletion is pending, the object cannot be referenced anymore.
+    volatile LONG refCount;
 
     VOID (*Destroy)(VOID*);
 }OVS_REF_COUNT;
 
+#if OVS_USE_REFCOUNT_CALL_STACK
+//serializes the call stack bookkeeping only: the refCount itself is always changed with interlocked operations.
 extern NDIS_RW_LOCK_EX* g_pRefRwLock;
+#endif
 
 /**************************************/
 
-static __inline VOID RefCount_DereferenceOnly(VOID* pObj)
+static __inline ULONG RefCount_GetCount(_In_ const OVS_REF_COUNT* pRefCount)
 {
-    LOCK_STATE_EX lockState;
-    OVS_REF_COUNT* pRefCount = pObj;
+    return (ULONG)(pRefCount->refCount & OVS_REFCOUNT_COUNT_MASK);
+}
 
-    if (!pObj)
-    {
-        return;
-    }
+static __inline BOOLEAN RefCount_IsDeletionPending(_In_ const OVS_REF_COUNT* pRefCount)
+{
+    return (pRefCount->refCount & OVS_REFCOUNT_DELETION_PENDING) ? TRUE : FALSE;
+}
+
+#if OVS_USE_REFCOUNT_CALL_STACK
+static __inline VOID _RefCount_TrackReference(_Inout_ OVS_REF_COUNT* pRefCount, const char* funcName)
+{
+    LOCK_STATE_EX lockState;
+    ULONG threadNumber = MAXULONG;
+    ULONG curThreadRefCount = 0;
+    PKTHREAD pThread = NULL;
 
     NdisAcquireRWLockWrite(g_pRefRwLock, &lockState, 0);
 
-    OVS_CHECK(pRefCount->refCount > 0);
-#if OVS_USE_REFCOUNT_CALL_STACK
+    OVS_CHECK(pRefCount->noOfThreads < OVS_REFCOUNT_MAX_THREAD_COUNT);
+
+    pThread = KeGetCurrentThread();
+
+    for (ULONG i = 0; i < OVS_REFCOUNT_MAX_THREAD_COUNT; ++i)
     {
-        ULONG threadNumber = MAXULONG;
-        ULONG curThreadRefCount = 0;
-        PKTHREAD pThread = NULL;
+        if (pRefCount->threads[i] == pThread)
+        {
+            threadNumber = i;
+            break;
+        }
+    }
 
-        OVS_CHECK(pRefCount->refCount < OVS_REFCOUNT_MAX_FUNC_COUNT);
-        pThread = KeGetCurrentThread();
+    if (threadNumber == MAXULONG)
+    {
+        OVS_CHECK(pRefCount->noOfThreads + 1 < OVS_REFCOUNT_MAX_THREAD_COUNT);
 
         for (ULONG i = 0; i < OVS_REFCOUNT_MAX_THREAD_COUNT; ++i)
         {
-            if (pRefCount->threads[i] == pThread)
+            if (pRefCount->threads[i] == NULL)
             {
+                pRefCount->threads[i] = pThread;
+                pRefCount->noOfThreads++;
+
                 threadNumber = i;
                 break;
             }
         }
+    }
 
-        OVS_CHECK(threadNumber != MAXULONG);
+    OVS_CHECK(threadNumber != MAXULONG);
 
-        OVS_CHECK(pRefCount->refCountsPerThread[threadNumber] > 0);
-        pRefCount->refCountsPerThread[threadNumber]--;
-        curThreadRefCount = pRefCount->refCountsPerThread[threadNumber];
-        pRefCount->funcs[threadNumber][curThreadRefCount] = NULL;
+    curThreadRefCount = pRefCount->refCountsPerThread[threadNumber];
+    OVS_CHECK(curThreadRefCount + 1 < OVS_REFCOUNT_MAX_FUNC_COUNT);
 
-        if (curThreadRefCount == 0)
-        {
-            pRefCount->threads[threadNumber] = NULL;
-            pRefCount->noOfThreads--;
-        }
-    }
-#endif
-    --pRefCount->refCount;
+    pRefCount->funcs[threadNumber][curThreadRefCount] = funcName;
+    pRefCount->refCountsPerThread[threadNumber]++;
 
     NdisReleaseRWLock(g_pRefRwLock, &lockState);
 }
 
-#define OVS_REFCOUNT_DEREFERENCE_ONLY(pObj)    RefCount_DereferenceOnly(pObj)
-
-static __inline VOID RefCount_Dereference(VOID* pObj)
+static __inline VOID _RefCount_TrackDereference(_Inout_ OVS_REF_COUNT* pRefCount)
 {
     LOCK_STATE_EX lockState;
-    OVS_REF_COUNT* pRefCount = pObj;
+    ULONG threadNumber = MAXULONG;
+    ULONG curThreadRefCount = 0;
+    PKTHREAD pThread = NULL;
 
-    if (!pObj)
+    NdisAcquireRWLockWrite(g_pRefRwLock, &lockState, 0);
+
+    pThread = KeGetCurrentThread();
+
+    for (ULONG i = 0; i < OVS_REFCOUNT_MAX_THREAD_COUNT; ++i)
     {
-        return;
+        if (pRefCount->threads[i] == pThread)
+        {
+            threadNumber = i;
+            break;
+        }
     }
 
-    OVS_CHECK(pRefCount->Destroy);
+    OVS_CHECK(threadNumber != MAXULONG);
 
-    NdisAcquireRWLockWrite(g_pRefRwLock, &lockState, 0);
+    OVS_CHECK(pRefCount->refCountsPerThread[threadNumber] > 0);
+    pRefCount->refCountsPerThread[threadNumber]--;
+    curThreadRefCount = pRefCount->refCountsPerThread[threadNumber];
+    pRefCount->funcs[threadNumber][curThreadRefCount] = NULL;
 
-    OVS_CHECK(pRefCount->refCount > 0);
-#if OVS_USE_REFCOUNT_CALL_STACK
+    if (curThreadRefCount == 0)
     {
-        ULONG threadNumber = MAXULONG;
-        ULONG curThreadRefCount = 0;
-        PKTHREAD pThread = NULL;
+        pRefCount->threads[threadNumber] = NULL;
+        pRefCount->noOfThreads--;
+    }
 
-        OVS_CHECK(pRefCount->refCount < OVS_REFCOUNT_MAX_FUNC_COUNT);
-        pThread = KeGetCurrentThread();
+    NdisReleaseRWLock(g_pRefRwLock, &lockState);
+}
+#else
+#define _RefCount_TrackReference(pRefCount, funcName)   UNREFERENCED_PARAMETER(funcName)
+#define _RefCount_TrackDereference(pRefCount)
+#endif
 
-        for (ULONG i = 0; i < OVS_REFCOUNT_MAX_THREAD_COUNT; ++i)
-        {
-            if (pRefCount->threads[i] == pThread)
-            {
-                threadNumber = i;
-                break;
-            }
-        }
+//drops the reference, and returns the new refCount value (i.e. including the OVS_REFCOUNT_DELETION_PENDING flag)
+static __inline LONG _RefCount_Decrement(_Inout_ OVS_REF_COUNT* pRefCount)
+{
+    LONG newValue = 0;
 
-        OVS_CHECK(threadNumber != MAXULONG);
+    OVS_CHECK(RefCount_GetCount(pRefCount) > 0);
 
-        OVS_CHECK(pRefCount->refCountsPerThread[threadNumber] > 0);
-        pRefCount->refCountsPerThread[threadNumber]--;
-        curThreadRefCount = pRefCount->refCountsPerThread[threadNumber];
-        pRefCount->funcs[threadNumber][curThreadRefCount] = NULL;
+    //the tracking must be done before the decrement: once we drop our reference, the object may be destroyed by a different thread.
+    _RefCount_TrackDereference(pRefCount);
 
-        if (curThreadRefCount == 0)
-        {
-            pRefCount->threads[threadNumber] = NULL;
-            pRefCount->noOfThreads--;
-        }
-    }
-#endif
-    --pRefCount->refCount;
+    newValue = InterlockedDecrement(&pRefCount->refCount);
 
-    if (pRefCount->refCount == 0 && pRefCount->deletionPending)
+    //the count must not wrap around into the flag bits
+    OVS_CHECK((newValue & OVS_REFCOUNT_COUNT_MASK) != OVS_REFCOUNT_COUNT_MASK);
+
+    return newValue;
+}
+
+static __inline VOID RefCount_DereferenceOnly(VOID* pObj)
+{
+    OVS_REF_COUNT* pRefCount = pObj;
+
+    if (!pObj)
     {
-        pRefCount->Destroy(pObj);
+        return;
     }
 
-    NdisReleaseRWLock(g_pRefRwLock, &lockState);
+    _RefCount_Decrement(pRefCount);
 }
 
-#define OVS_REFCOUNT_DEREFERENCE(pObj) {RefCount_Dereference(pObj); pObj = NULL; }
+#define OVS_REFCOUNT_DEREFERENCE_ONLY(pObj)    RefCount_DereferenceOnly(pObj)
 
-static __inline VOID* RefCount_Reference(VOID* pObj, const char* funcName)
+static __inline VOID RefCount_Dereference(VOID* pObj)
 {
-    LOCK_STATE_EX lockState;
     OVS_REF_COUNT* pRefCount = pObj;
 
     if (!pObj)
     {
-        return NULL;
+        return;
     }
 
-    NdisAcquireRWLockWrite(g_pRefRwLock, &lockState, 0);
+    OVS_CHECK(pRefCount->Destroy);
 
-    if (pRefCount->deletionPending)
+    //no other thread can reference the object once deletion is pending:
+    //only the thread dropping the last reference sees (count = 0 | pending)
+    if (_RefCount_Decrement(pRefCount) == OVS_REFCOUNT_DELETION_PENDING)
     {
-        pObj = NULL;
+        pRefCount->Destroy(pObj);
     }
-    else
-    {
-#if OVS_USE_REFCOUNT_CALL_STACK
-        ULONG threadNumber = MAXULONG;
-        ULONG curThreadRefCount = 0;
-        PKTHREAD pThread = NULL;
+}
 
-        OVS_CHECK(pRefCount->noOfThreads < OVS_REFCOUNT_MAX_THREAD_COUNT);
+#define OVS_REFCOUNT_DEREFERENCE(pObj) {RefCount_Dereference(pObj); pObj = NULL; }
 
-        pThread = KeGetCurrentThread();
+static __inline VOID* RefCount_Reference(VOID* pObj, const char* funcName)
+{
+    OVS_REF_COUNT* pRefCount = pObj;
+    LONG oldValue = 0;
 
-        for (ULONG i = 0; i < OVS_REFCOUNT_MAX_THREAD_COUNT; ++i)
-        {
-            if (pRefCount->threads[i] == pThread)
-            {
-                threadNumber = i;
-                break;
-            }
-        }
+    if (!pObj)
+    {
+        return NULL;
+    }
 
-        if (threadNumber == MAXULONG)
-        {
-            OVS_CHECK(pRefCount->noOfThreads + 1 < OVS_REFCOUNT_MAX_THREAD_COUNT);
+    do
+    {
+        oldValue = pRefCount->refCount;
 
-            for (ULONG i = 0; i < OVS_REFCOUNT_MAX_THREAD_COUNT; ++i)
-            {
-                if (pRefCount->threads[i] == NULL)
-                {
-                    pRefCount->threads[i] = pThread;
-                    pRefCount->noOfThreads++;
-
-                    threadNumber = i;
-                    break;
-                }
-            }
+        if (oldValue & OVS_REFCOUNT_DELETION_PENDING)
+        {
+            return NULL;
         }
 
-        OVS_CHECK(threadNumber != MAXULONG);
-
-        curThreadRefCount = pRefCount->refCountsPerThread[threadNumber];
-        OVS_CHECK(curThreadRefCount + 1 < OVS_REFCOUNT_MAX_FUNC_COUNT);
-
-        pRefCount->funcs[threadNumber][curThreadRefCount] = funcName;
-        pRefCount->refCountsPerThread[threadNumber]++;
-#else
-        UNREFERENCED_PARAMETER(funcName);
-#endif
-
-        ++pRefCount->refCount;
-    }
+        OVS_CHECK((oldValue & OVS_REFCOUNT_COUNT_MASK) < OVS_REFCOUNT_COUNT_MASK);
+    } while (InterlockedCompareExchange(&pRefCount->refCount, oldValue + 1, oldValue) != oldValue);
 
-    NdisReleaseRWLock(g_pRefRwLock, &lockState);
+    _RefCount_TrackReference(pRefCount, funcName);
 
     return pObj;
 }
@@ -239,8 +246,8 @@ static __inline VOID* RefCount_Reference(VOID* pObj, const char* funcName)
 
 static __inline VOID RefCount_Destroy(VOID* pObj)
 {
-    LOCK_STATE_EX lockState;
     OVS_REF_COUNT* pRefCount = pObj;
+    LONG oldValue = 0;
 
     if (!pObj)
     {
@@ -249,18 +256,21 @@ static __inline VOID RefCount_Destroy(VOID* pObj)
 
     OVS_CHECK(pRefCount->Destroy);
 
-    NdisAcquireRWLockWrite(g_pRefRwLock, &lockState, 0);
-
-    if (pRefCount->refCount > 0)
+    do
     {
-        pRefCount->deletionPending = TRUE;
-    }
-    else
+        oldValue = pRefCount->refCount;
+
+        //already marked for deletion: the thread dropping the last reference destroys it
+        if (oldValue & OVS_REFCOUNT_DELETION_PENDING)
+        {
+            return;
+        }
+    } while (InterlockedCompareExchange(&pRefCount->refCount, oldValue | OVS_REFCOUNT_DELETION_PENDING, oldValue) != oldValue);
+
+    if ((oldValue & OVS_REFCOUNT_COUNT_MASK) == 0)
     {
         pRefCount->Destroy(pObj);
     }
-
-    NdisReleaseRWLock(g_pRefRwLock, &lockState);
 }
 
 #define OVS_REFCOUNT_DESTROY(pObj) { RefCount_Destroy(pObj); pObj = NULL; }
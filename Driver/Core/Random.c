@@ -15,15 +15,90 @@ limitations under the License.
 */
 
 #include "Random.h"
+#include "OvsCore.h"
 
-UINT64 QuickRandom(UINT64 maxValue)
+//a state per cache line: the processors never write to the same line
+typedef struct _OVS_RANDOM_STATE
 {
-    LARGE_INTEGER currentCount = { 0 };
-    UINT64 value = 0;
+    UINT64      value;
+    BYTE        padding[56];
+}OVS_RANDOM_STATE, *POVS_RANDOM_STATE;
 
-    KeQuerySystemTime(&currentCount);
+C_ASSERT(sizeof(OVS_RANDOM_STATE) == 64);
 
-    value = currentCount.QuadPart * 1103515245 + 12345;
+static OVS_RANDOM_STATE* g_pRandomStates = NULL;
+static ULONG g_countRandomStates = 0;
 
-    return (value % ((unsigned int)maxValue + 1));
-}
\ No newline at end of file
+//used only before Random_Initialize, or if it failed
+static UINT64 g_fallbackRandomState = 0x9E3779B97F4A7C15;
+
+//splitmix64: spreads a poor seed (close counter values) over all the bits; never returns 0 for the seeds used here
+static UINT64 _Random_Mix(UINT64 seed)
+{
+    UINT64 z = seed + 0x9E3779B97F4A7C15;
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+
+    return z ^ (z >> 31);
+}
+
+VOID Random_Initialize()
+{
+    LARGE_INTEGER counter = KeQueryPerformanceCounter(NULL);
+    ULONG countProcessors = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    g_fallbackRandomState = _Random_Mix((UINT64)counter.QuadPart);
+    if (!g_fallbackRandomState)
+    {
+        g_fallbackRandomState = 1;
+    }
+
+    g_pRandomStates = KZAlloc(countProcessors * sizeof(OVS_RANDOM_STATE));
+    if (!g_pRandomStates)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to allocate the random states of %u processors\n", countProcessors);
+        return;
+    }
+
+    for (ULONG i = 0; i < countProcessors; ++i)
+    {
+        g_pRandomStates[i].value = _Random_Mix((UINT64)counter.QuadPart ^ ((UINT64)(i + 1) << 48));
+
+        //xorshift never leaves the 0 state
+        if (!g_pRandomStates[i].value)
+        {
+            g_pRandomStates[i].value = 1;
+        }
+    }
+
+    g_countRandomStates = countProcessors;
+}
+
+VOID Random_Uninitialize()
+{
+    g_countRandomStates = 0;
+
+    KFree(g_pRandomStates);
+    g_pRandomStates = NULL;
+}
+
+UINT32 Random_Next32()
+{
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    UINT64* pState = NULL;
+    UINT64 x = 0;
+
+    pState = (processor < g_countRandomStates ? &g_pRandomStates[processor].value : &g_fallbackRandomState);
+
+    x = *pState;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+
+    *pState = x;
+
+    //the high bits of the product are the best distributed
+    return (UINT32)((x * 0x2545F4914F6CDD1D) >> 32);
+}
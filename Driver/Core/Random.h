@@ -18,4 +18,13 @@ limitations under the License.
 
 #include "precomp.h"
 
-UINT64 QuickRandom(UINT64 maxValue);
\ No newline at end of file
+/* A fast, non-cryptographic generator (xorshift64*), with a state for each processor: the packet path does not share a cache line,
+nor takes a lock, to get a random value. Only good for statistical decisions, such as sampling. */
+
+//allocates and seeds the states of the processors. Called once, at driver load.
+//if the allocation fails, all the processors share a single state.
+VOID Random_Initialize();
+VOID Random_Uninitialize();
+
+//any IRQL. Two threads preempted on the same processor may, rarely, get the same value.
+UINT32 Random_Next32();
@@ -0,0 +1,98 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "precomp.h"
+
+/* SEQUENCE TABLES: the fixed size hash tables of the datapath (the arp table, the tunnel demux, the encapsulation cache, the mac table,
+the ipv4 reassembly cache) are arrays of buckets of a few ways. Each table keeps its own keys and values; these are the parts they share.
+
+Lookups take no lock: each entry has a sequence, odd while a writer updates it, and the writers are serialized by the lock of the table.
+A reader copies the entry between SeqTable_ReadBegin and SeqTable_ReadRetry:
+
+    for (i = 0; i < OVS_SEQTABLE_READ_RETRIES; ++i)
+    {
+        if (!SeqTable_ReadBegin(&pEntry->sequence, &sequence)) continue;
+        (copy the fields)
+        if (!SeqTable_ReadRetry(&pEntry->sequence, sequence)) return TRUE;
+    }
+
+A writer, under the lock, updates the fields between SeqTable_WriteBegin and SeqTable_WriteEnd. */
+
+//a reader gives up (and reports a miss) if an entry keeps changing under it
+#define OVS_SEQTABLE_READ_RETRIES       4
+
+//the bucket of a hash, out of countBuckets (a power of 2)
+static __inline ULONG SeqTable_GetBucketIndex(UINT64 hash, ULONG countBuckets)
+{
+    //fibonacci hashing: the high bits of the product are the well mixed ones
+    hash *= 0x9E3779B97F4A7C15ULL;
+
+    return (ULONG)(hash >> 32) & (countBuckets - 1);
+}
+
+//FALSE: a writer is updating the entry; *pSequence is to be passed to SeqTable_ReadRetry
+static __inline BOOLEAN SeqTable_ReadBegin(_In_ const volatile LONG* pEntrySequence, _Out_ LONG* pSequence)
+{
+    *pSequence = *pEntrySequence;
+
+    KeMemoryBarrier();
+
+    if (*pSequence & 1)
+    {
+        YieldProcessor();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//TRUE: the entry was written while it was copied: the copy is to be discarded
+static __inline BOOLEAN SeqTable_ReadRetry(_In_ const volatile LONG* pEntrySequence, LONG sequence)
+{
+    KeMemoryBarrier();
+
+    return *pEntrySequence != sequence;
+}
+
+//under the table lock. The interlocked operations are full barriers: readers see the odd sequence before any field changes
+static __inline VOID SeqTable_WriteBegin(_Inout_ volatile LONG* pEntrySequence)
+{
+    InterlockedIncrement(pEntrySequence);
+}
+
+static __inline VOID SeqTable_WriteEnd(_Inout_ volatile LONG* pEntrySequence)
+{
+    InterlockedIncrement(pEntrySequence);
+}
+
+//timestamps are KeQueryInterruptTime values; 0 = free entry
+static __inline BOOLEAN SeqTable_IsAlive(LONG64 timestamp, LONG64 now, LONG64 lifetime)
+{
+    return timestamp != 0 && now - timestamp < lifetime;
+}
+
+//updates the timestamp, unless it was updated less than interval ago; losing the race to another cpu is fine
+static __inline BOOLEAN SeqTable_Touch(_Inout_ volatile LONG64* pTimestamp, LONG64 oldValue, LONG64 now, LONG64 interval)
+{
+    if (now - oldValue < interval)
+    {
+        return FALSE;
+    }
+
+    return InterlockedCompareExchange64(pTimestamp, now, oldValue) == oldValue;
+}
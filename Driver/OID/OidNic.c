@@ -17,6 +17,7 @@ limitations under the License.
 #include "precomp.h"
 #include "OidNic.h"
 #include "Sctx_Nic.h"
+#include "Sctx_MacTable.h"
 #include "SwitchContext.h"
 
 _Use_decl_annotations_
@@ -195,6 +196,8 @@ VOID Nic_Disconnect(OVS_GLOBAL_FORWARD_INFO* pForwardInfo, const NDIS_SWITCH_NIC
         --(pForwardInfo->countNics);
 
         //we no longer need to 'unset' the of port: it will try (eventually) to send to this port id, but it will not find nic, so it will fail.
+        //the learned macs must go, though: the NORMAL action would otherwise keep sending unicasts to a disconnected nic.
+        Sctx_MacTable_FlushPort(pForwardInfo->pMacTable, pNic->PortId);
     }
 
     FWDINFO_UNLOCK(pForwardInfo, &lockState);
@@ -234,6 +237,7 @@ VOID Nic_Delete(OVS_GLOBAL_FORWARD_INFO* pForwardInfo, const NDIS_SWITCH_NIC_PAR
     }
 
     Sctx_DeleteNicUnsafe(pForwardInfo, pNic->PortId, pNic->NicIndex);
+    Sctx_MacTable_FlushPort(pForwardInfo->pMacTable, pNic->PortId);
 
     FWDINFO_UNLOCK(pForwardInfo, &lockState);
     return;
@@ -286,15 +290,53 @@ NDIS_STATUS status)
     return NDIS_STATUS_SUCCESS;
 }
 
+static ULONG _Nic_GetEncapsOffload(_In_ const NDIS_OFFLOAD* pOffload)
+{
+    ULONG encapsOffload = 0;
+
+    //the encapsulated packet task offload came with NDIS 6.30
+    if (pOffload->Header.Revision < NDIS_OFFLOAD_REVISION_3 || pOffload->Header.Size < NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_3)
+    {
+        return 0;
+    }
+
+    if (pOffload->EncapsulatedPacketTaskOffloadGre.TransmitChecksumOffloadSupported & NDIS_ENCAPSULATION_TYPE_GRE_MAC)
+    {
+        encapsOffload |= OVS_NIC_OFFLOAD_NVGRE_CHECKSUM;
+    }
+
+    return encapsOffload;
+}
+
 _Use_decl_annotations_
-NDIS_STATUS Nic_ProcessStatus(const OVS_GLOBAL_FORWARD_INFO* pForwardContext, const NDIS_STATUS_INDICATION* pStatusIndication,
+NDIS_STATUS Nic_ProcessStatus(OVS_GLOBAL_FORWARD_INFO* pForwardContext, const NDIS_STATUS_INDICATION* pStatusIndication,
 NDIS_SWITCH_PORT_ID sourcePortId,
 NDIS_SWITCH_NIC_INDEX sourceNicIndex)
 {
-    UNREFERENCED_PARAMETER(pForwardContext);
-    UNREFERENCED_PARAMETER(pStatusIndication);
-    UNREFERENCED_PARAMETER(sourcePortId);
-    UNREFERENCED_PARAMETER(sourceNicIndex);
+    OVS_NIC_LIST_ENTRY* pNicEntry = NULL;
+    LOCK_STATE_EX lockState = { 0 };
+    ULONG encapsOffload = 0;
+
+    //the offload config of a nic changed: we may leave the checksums of the packets we encapsulate to it
+    if (pStatusIndication->StatusCode != NDIS_STATUS_TASK_OFFLOAD_CURRENT_CONFIG ||
+        pStatusIndication->StatusBufferSize < NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_1)
+    {
+        return NDIS_STATUS_SUCCESS;
+    }
+
+    encapsOffload = _Nic_GetEncapsOffload((const NDIS_OFFLOAD*)pStatusIndication->StatusBuffer);
+
+    FWDINFO_LOCK_WRITE(pForwardContext, &lockState);
+
+    pNicEntry = Sctx_FindNicByPortIdAndNicIndex_Unsafe(pForwardContext, sourcePortId, sourceNicIndex);
+    if (pNicEntry)
+    {
+        DEBUGP(LOG_INFO, "NIC: port=%d; index=%d; encapsulated packet offload: 0x%x\n", sourcePortId, sourceNicIndex, encapsOffload);
+
+        pNicEntry->encapsOffload = encapsOffload;
+    }
+
+    FWDINFO_UNLOCK(pForwardContext, &lockState);
 
     return NDIS_STATUS_SUCCESS;
 }
@@ -46,5 +46,6 @@ NDIS_STATUS Nic_ProcessRequestComplete(_In_ const OVS_GLOBAL_FORWARD_INFO* pForw
     _In_ NDIS_SWITCH_PORT_ID destinationPortId, _In_ NDIS_SWITCH_NIC_INDEX destinationNicIndex,
     _In_ NDIS_STATUS status);
 
-NDIS_STATUS Nic_ProcessStatus(_In_ const OVS_GLOBAL_FORWARD_INFO* pForwardContext, _In_ const NDIS_STATUS_INDICATION* pStatusIndication,
+//keeps track of the task offload config of the nics
+NDIS_STATUS Nic_ProcessStatus(_In_ OVS_GLOBAL_FORWARD_INFO* pForwardContext, _In_ const NDIS_STATUS_INDICATION* pStatusIndication,
     _In_ NDIS_SWITCH_PORT_ID sourcePortId, _In_ NDIS_SWITCH_NIC_INDEX sourceNicIndex);
\ No newline at end of file
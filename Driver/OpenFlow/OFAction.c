@@ -39,10 +39,24 @@ limitations under the License.
 #include "Nbls.h"
 #include "Vlan.h"
 #include "ArgVerification.h"
+#include "OFFlowTable.h"
 
 #define OVS_ACTION_SAMPLE_MAX_DEPTH        3
+//the max number of times a packet may be recirculated (i.e. looked up again) in the same pass through the datapath
+#define OVS_ACTION_MAX_RECIRCULATIONS      4
+//the max number of consecutive output actions that can be collapsed into a single, multi-destination, NBL
+#define OVS_ACTION_MAX_GROUPED_OUTPUTS     16
 
-static BOOLEAN _ExecuteAction_OutToUserspace(OVS_DATAPATH* pDatapath, _In_ NET_BUFFER* pNb, _In_ const OVS_OFPACKET_INFO* pPacketInfo, _In_ const OVS_ARGUMENT_GROUP* pArguments)
+//the destination ports of consecutive output actions, with no other action in between
+typedef struct _OVS_OUTPUT_GROUP
+{
+    OVS_OFPORT*     ports[OVS_ACTION_MAX_GROUPED_OUTPUTS];
+    ULONG           count;
+}OVS_OUTPUT_GROUP, *POVS_OUTPUT_GROUP;
+
+//isSample: the upcall is part of a sample action, i.e. it is for monitoring: it is truncated and batched
+static BOOLEAN _ExecuteAction_OutToUserspace(OVS_DATAPATH* pDatapath, _In_ NET_BUFFER* pNb, _In_ const OVS_OFPACKET_INFO* pPacketInfo, _In_ const OVS_ACTION_UPCALL* pUpcall,
+    BOOLEAN isSample)
 {
     OVS_UPCALL_INFO upcallInfo = { 0 };
     BOOLEAN ok = FALSE;
@@ -51,195 +65,115 @@ static BOOLEAN _ExecuteAction_OutToUserspace(OVS_DATAPATH* pDatapath, _In_ NET_B
 
     upcallInfo.command = OVS_MESSAGE_COMMAND_PACKET_UPCALL_ACTION;
     upcallInfo.pPacketInfo = pPacketInfo;
-    upcallInfo.pUserData = NULL;
-    upcallInfo.portId = 0;
+    upcallInfo.pUserData = pUpcall->pUserData;
+    upcallInfo.portId = pUpcall->portId;
 
-    for (UINT i = 0; i < pArguments->count; ++i)
+    if (isSample)
     {
-        OVS_ARGUMENT* pArg = pArguments->args + i;
-        BOOLEAN ok = IsArgumentValid(pArg);
-        OVS_ARGTYPE argType = pArg->type;
-
-        if (!ok)
-        {
-            DEBUGP(LOG_ERROR, __FUNCTION__ "packet upcall action: arg of argtype %u is invalid!\n", argType);
-            OVS_CHECK(__UNEXPECTED__);
-            return FALSE;
-        }
-
-        switch (argType)
-        {
-        case OVS_ARGTYPE_ACTION_UPCALL_DATA:
-            //it is released in send packet to userspace
-            upcallInfo.pUserData = pArg;
-            break;
-
-        case OVS_ARGTYPE_ACTION_UPCALL_PORT_ID:
-            upcallInfo.portId = GET_ARG_DATA(pArg, UINT32);
-            break;
-        }
+        ok = QueueSampleToUserspace(pDatapath, pNb, &upcallInfo);
+    }
+    else
+    {
+        ok = QueuePacketToUserspace(pDatapath, pNb, &upcallInfo);
     }
-
-    ok = QueuePacketToUserspace(pDatapath, pNb, &upcallInfo);
 
     return ok;
 }
 
-static BOOLEAN _ExecuteAction_Set(OVS_NET_BUFFER* pONb, const OVS_ARGUMENT_GROUP* pArgs)
+static BOOLEAN _ExecuteAction_Hash(_Inout_ OVS_NET_BUFFER *pOvsNb, _In_ const OVS_ACTION_FLOW_HASH* pHash)
 {
-    BOOLEAN ok = TRUE;
-    OVS_ARGUMENT* pArg = NULL;
-    OVS_ARGTYPE argType = OVS_ARGTYPE_INVALID;
-
-    OVS_CHECK(pArgs->count == 1);
+    OVS_OFPACKET_INFO packetInfo = { 0 };
+    UINT32 hash = 0;
 
-    pArg = pArgs->args;
-    argType = pArg->type;
+    //the only algorithm the action verification lets through
+    OVS_CHECK(pHash->hashAlgorithm == OVS_HASH_ALGORITHM_TRANSPORT);
 
-    switch (argType)
+    //the set actions before the hash modify the frame, not pOriginalPacketInfo: the headers the packet has now are hashed
+    if (!PacketInfo_ReextractFromNb(ONB_GetNetBuffer(pOvsNb), pOvsNb->pOriginalPacketInfo->physical.ofInPort, &packetInfo))
     {
-        //NOTE FOR OVS 2.3: 
-        //OVS_ARGTYPE_PI_TCP_FLAGS and OVS_ARGTYPE_PI_DATAPATH_HASH and OVS_ARGTYPE_PI_DATAPATH_RECIRCULATION_ID
-        //are not settable
-    case OVS_ARGTYPE_PI_PACKET_MARK:
-        pONb->packetMark = GET_ARG_DATA(pArg, UINT32);
-        break;
-
-    case OVS_ARGTYPE_PI_PACKET_PRIORITY:
-        pONb->packetPriority = GET_ARG_DATA(pArg, UINT32);
-        break;
-
-    case OVS_ARGTYPE_PI_IPV4_TUNNEL:
-        pONb->pTunnelInfo = pArg->data;
-        break;
-
-    case OVS_ARGTYPE_PI_ETH_ADDRESS:
-        ok = ONB_SetEthernetAddress(pONb, pArg->data);
-        break;
-
-    case OVS_ARGTYPE_PI_IPV4:
-        ok = ONB_SetIpv4(pONb, pArg->data);
-        break;
-
-    case OVS_ARGTYPE_PI_IPV6:
-        ok = ONB_SetIpv6(pONb, pArg->data);
-        break;
-
-    case OVS_ARGTYPE_PI_TCP:
-        ok = ONB_SetTcp(pONb, pArg->data);
-        break;
-
-    case OVS_ARGTYPE_PI_UDP:
-        ok = ONB_SetUdp(pONb, pArg->data);
-        break;
+        return FALSE;
+    }
 
-    case OVS_ARGTYPE_PI_SCTP:
-        ok = ONB_SetSctp(pONb, pArg->data);
-        break;
+    hash = PacketInfo_HashTransport(&packetInfo, pHash->basis);
 
-    case OVS_ARGTYPE_PI_MPLS:
-        OVS_CHECK(__NOT_IMPLEMENTED__);
-        //TODO:
-        //ok = ONB_SetMpls(pOvsNb, pArg->data);
-        break;
+    //0 means "no hash": a flow that matches on the hash must never match a packet that has not been hashed
+    if (!hash)
+    {
+        hash = 1;
     }
 
-    return ok;
+    //read by the lookup after a recirculation, and for the flow entropy of the encapsulation
+    pOvsNb->pOriginalPacketInfo->flowHash = hash;
+
+    return TRUE;
 }
 
-//TODO: this function was never tested, and is likely to contain errors
-static BOOLEAN _ExecuteAction_Sample(_Inout_ OVS_NET_BUFFER *pOvsNb, _In_ const OVS_ARGUMENT_GROUP* pArguments,
-    _In_ const OutputToPortCallback outputToPort)
+//resolves the destination ports of all the output instructions, for the given of ports generation
+static VOID _Actions_ResolveOutputPorts_Unsafe(_Inout_ OVS_ACTIONS* pActions, LONG generation)
 {
-    OVS_ARGUMENT_GROUP* pSampleActionsArgs = NULL;
-    OVS_ARGUMENT_GROUP* pOldActionsArgs = NULL;
-    BOOLEAN ok = TRUE;
-
-    for (UINT i = 0; i < pArguments->count; ++i)
+    for (ULONG i = 0; i < pActions->countInstructions; ++i)
     {
-        OVS_ARGUMENT* pArg = pArguments->args + i;
-        OVS_ARGTYPE argType = pArg->type;
+        OVS_ACTION_INSTRUCTION* pInstruction = pActions->pInstructions + i;
 
-        switch (argType)
-        {
-        case OVS_ARGTYPE_ACTION_SAMPLE_PROBABILITY:
+        if (pInstruction->opcode != OVS_ACTION_OPCODE_OUTPUT)
         {
-            UINT32 value = GET_ARG_DATA(pArg, UINT32);
-
-            if ((UINT32)QuickRandom(100) >= value)
-                return TRUE;
+            continue;
         }
-            break;
 
-        case OVS_ARGTYPE_ACTION_SAMPLE_ACTIONS_GROUP:
-            pSampleActionsArgs = pArg->data;
-            break;
+        if (pInstruction->output.pPort)
+        {
+            OVS_REFCOUNT_DEREFERENCE(pInstruction->output.pPort);
         }
-    }
-
-    //we must execute the actions in pSampleActionsArgs, so we must save the original
-    //actions arg group, and put it back later (to have a correct cleanup at the end)
-    if (pSampleActionsArgs)
-    {
-        pOldActionsArgs = pOvsNb->pActions->pActionGroup;
-        pOvsNb->pActions->pActionGroup = pSampleActionsArgs;
-    }
-
-    //TODO: the actions in the sample are expected to be:
-    // a) no actions (i.e. pSampleActionsArgs count = 0 and size = 0)
-    // b) send to userspace
-    //In the cases above, it is safe to use this net buffer.
-    //An unexpected case is, if there is an action that modified the ONB. In this case,
-    //we should duplicate the ONB and send the ONB. OR, we might be able to implement 
-    //some copy-on-write functionality for OVS_NET_BUFFER
-    ok = ExecuteActions(pOvsNb, outputToPort);
 
-    if (pSampleActionsArgs)
-    {
-        pOvsNb->pActions->pActionGroup = pOldActionsArgs;
+        pInstruction->output.pPort = OFPort_FindByNumber_Ref(pInstruction->output.portNumber);
     }
 
-    return ok;
+    pActions->portsGeneration = generation;
 }
 
-static BOOLEAN _ExecuteAction_Hash(_Inout_ OVS_NET_BUFFER *pOvsNb, _In_ const OVS_ARGUMENT_GROUP* pArguments)
+//returns the port of the output instruction, referenced.
+//the ports are looked up again only if the of ports have changed since they were last resolved.
+static OVS_OFPORT* _Actions_GetOutputPort_Ref(_Inout_ OVS_ACTIONS* pActions, _In_ const OVS_ACTION_INSTRUCTION* pInstruction)
 {
-    UNREFERENCED_PARAMETER(pOvsNb);
-    UNREFERENCED_PARAMETER(pArguments);
+    LOCK_STATE_EX lockState = { 0 };
+    LONG generation = OFPort_GetGeneration();
+    OVS_OFPORT* pPort = NULL;
 
-    OVS_CHECK(__NOT_IMPLEMENTED__);
+    OVS_CHECK(pActions->pPortsLock);
 
-    return FALSE;
-}
+    NdisAcquireRWLockRead(pActions->pPortsLock, &lockState, 0);
 
-static BOOLEAN _ExecuteAction_Recirculation(_Inout_ OVS_NET_BUFFER *pOvsNb, _In_ const OVS_ARGUMENT_GROUP* pArguments)
-{
-    UNREFERENCED_PARAMETER(pOvsNb);
-    UNREFERENCED_PARAMETER(pArguments);
+    if (pActions->portsGeneration != generation)
+    {
+        NdisReleaseRWLock(pActions->pPortsLock, &lockState);
+        NdisAcquireRWLockWrite(pActions->pPortsLock, &lockState, 0);
+
+        //another thread may have resolved them meanwhile
+        if (pActions->portsGeneration != generation)
+        {
+            _Actions_ResolveOutputPorts_Unsafe(pActions, generation);
+        }
+    }
+
+    if (pInstruction->output.pPort)
+    {
+        pPort = OVS_REFCOUNT_REFERENCE(pInstruction->output.pPort);
+    }
 
-    OVS_CHECK(__NOT_IMPLEMENTED__);
+    NdisReleaseRWLock(pActions->pPortsLock, &lockState);
 
-    return FALSE;
+    return pPort;
 }
 
-static OVS_OFPORT* _FindDestPort_Ref(_In_ const OVS_OFPORT* pSourcePort, UINT32 ofPortNumber)
+static OVS_OFPORT* _FindDestPort_Ref(_Inout_ OVS_ACTIONS* pActions, _In_ const OVS_OFPORT* pSourcePort, _In_ const OVS_ACTION_INSTRUCTION* pInstruction)
 {
-    UINT16 validPortNumber = OVS_INVALID_PORT_NUMBER;
     OVS_OFPORT* pDestOFPort = NULL;
 
     //NOTE: we don't need to lock neither pSourcePort, nor pDestPort, because these fields (id, type, isExternal) never change
-    if (ofPortNumber >= OVS_MAX_PORTS)
-    {
-        DEBUGP(LOG_ERROR, __FUNCTION__ " invalid port number from userspace: %u\n", ofPortNumber);
-        return NULL;
-    }
-
-    validPortNumber = (UINT16)ofPortNumber;
-
-    pDestOFPort = OFPort_FindByNumber_Ref(validPortNumber);
+    pDestOFPort = _Actions_GetOutputPort_Ref(pActions, pInstruction);
     if (!pDestOFPort)
     {
-        DEBUGP(LOG_ERROR, "could not find of port: %u!\n", validPortNumber);
+        DEBUGP(LOG_ERROR, "could not find of port: %u!\n", pInstruction->output.portNumber);
         return NULL;
     }
 
@@ -286,122 +220,351 @@ static OVS_OFPORT* _FindDestPort_Ref(_In_ const OVS_OFPORT* pSourcePort, UINT32
     return pDestOFPort;
 }
 
-BOOLEAN ExecuteActions(_Inout_ OVS_NET_BUFFER* pOvsNb, _In_ const OutputToPortCallback outputToPort)
+//the hyper-v switch delivers to these ports directly, so a single NBL can have several of them as destinations.
+//A tunnel port needs an NBL of its own, because the packet is encapsulated.
+static __inline BOOLEAN _OutputGroup_CanShareNbl(_In_ const OVS_OFPORT* pPort)
 {
-    BOOLEAN ok = TRUE;
-    const OVS_ARGUMENT_GROUP* pActionArgs = pOvsNb->pActions->pActionGroup;
-    OVS_OFPORT* pDestOFPort = NULL;
-    UINT32 ofPortNumber = (UINT32)-1;
+    return (pPort->ofPortType == OVS_OFPORT_TYPE_PHYSICAL || pPort->ofPortType == OVS_OFPORT_TYPE_MANAG_OS);
+}
 
-    for (UINT16 i = 0; i < pActionArgs->count; ++i)
+static BOOLEAN _OutputGroup_CanAdd(_In_ const OVS_OUTPUT_GROUP* pGroup, _In_ const OVS_OFPORT* pPort)
+{
+    if (pGroup->count == 0)
     {
-        const OVS_ARGUMENT* pArg = pActionArgs->args + i;
-        OVS_ARGTYPE argType = pArg->type;
+        return TRUE;
+    }
 
-        ok = TRUE;
+    if (pGroup->count == OVS_ACTION_MAX_GROUPED_OUTPUTS)
+    {
+        return FALSE;
+    }
 
-        if (pDestOFPort)
+    if (!_OutputGroup_CanShareNbl(pPort) || !_OutputGroup_CanShareNbl(pGroup->ports[0]))
+    {
+        return FALSE;
+    }
+
+    //an NBL must not have the same destination twice
+    for (ULONG i = 0; i < pGroup->count; ++i)
+    {
+        if (pGroup->ports[i] == pPort)
         {
-            OVS_NET_BUFFER* pDuplicateOnb = ONB_Duplicate(pOvsNb);
-            OVS_CHECK(pDuplicateOnb);
+            return FALSE;
+        }
+    }
 
-            if (pDuplicateOnb)
-            {
-                pDuplicateOnb->pDestinationPort = pDestOFPort;
-                pDuplicateOnb->sendToPortNormal = FALSE;
+    return TRUE;
+}
 
-                //output = output packet to port
-                ok = (*outputToPort)(pDuplicateOnb);
+static VOID _OutputGroup_Clear(_Inout_ OVS_OUTPUT_GROUP* pGroup)
+{
+    for (ULONG i = 0; i < pGroup->count; ++i)
+    {
+        OVS_REFCOUNT_DEREFERENCE(pGroup->ports[i]);
+    }
 
-                if (ok)
-                {
-                    KFree(pDuplicateOnb);
-                }
-                else
-                {
-                    ONB_Destroy(pDuplicateOnb->pSwitchInfo, &pDuplicateOnb);
-                }
+    pGroup->count = 0;
+}
 
-                ok = TRUE;
+//outputs the packet, as a single NBL, to all the ports of the group.
+//if useOriginal, pOvsNb itself is output (i.e. there are no more actions); otherwise, a duplicate of it, which shares the packet data.
+//returns TRUE if the packet was output.
+static BOOLEAN _OutputGroup_Flush(_Inout_ OVS_OUTPUT_GROUP* pGroup, _Inout_ OVS_NET_BUFFER* pOvsNb, BOOLEAN useOriginal,
+    _In_ const OutputToPortCallback outputToPort)
+{
+    OVS_NET_BUFFER* pOutOnb = pOvsNb;
+    BOOLEAN ok = FALSE;
 
-                OVS_REFCOUNT_DEREFERENCE(pDestOFPort);
-                pDestOFPort = NULL;
-            }
-        }
+    OVS_CHECK(pGroup->count > 0);
 
-        switch (argType)
-        {
-        case OVS_ARGTYPE_ACTION_OUTPUT_TO_PORT:
-            ofPortNumber = GET_ARG_DATA(pArg, UINT32);
+    if (!useOriginal)
+    {
+        pOutOnb = ONB_Duplicate(pOvsNb);
+        OVS_CHECK(pOutOnb);
+    }
+
+    if (pOutOnb)
+    {
+        pOutOnb->pDestinationPort = pGroup->ports[0];
+        pOutOnb->ppDestinationPorts = (pGroup->count > 1 ? pGroup->ports : NULL);
+        pOutOnb->countDestinationPorts = pGroup->count;
+        pOutOnb->sendToPortNormal = FALSE;
+
+        //output = output packet to port(s)
+        ok = (*outputToPort)(pOutOnb);
 
-            if (ofPortNumber < OVS_MAX_PORTS)
+        pOutOnb->ppDestinationPorts = NULL;
+        pOutOnb->countDestinationPorts = 0;
+
+        if (!useOriginal)
+        {
+            if (ok)
             {
-                pDestOFPort = _FindDestPort_Ref(pOvsNb->pSourcePort, ofPortNumber);
+                KFree(pOutOnb);
             }
             else
             {
-                DEBUGP(LOG_ERROR, __FUNCTION__ " invalid port number from userspace: %u\n", ofPortNumber);
-                ok = FALSE;
+                ONB_Destroy(pOutOnb->pSwitchInfo, &pOutOnb);
             }
+        }
+    }
 
-            break;
+    _OutputGroup_Clear(pGroup);
 
-        case OVS_ARGTYPE_ACTION_UPCALL_GROUP:
+    return ok;
+}
+
+static BOOLEAN _ExecuteProgram(_Inout_ OVS_NET_BUFFER* pOvsNb, _In_ const OVS_ACTION_INSTRUCTION* pInstructions, ULONG countInstructions,
+    BOOLEAN isSample, ULONG recirculationDepth, _In_ const OutputToPortCallback outputToPort);
+
+//TODO: this function was never tested, and is likely to contain errors
+static BOOLEAN _ExecuteAction_Sample(_Inout_ OVS_NET_BUFFER *pOvsNb, _In_ const OVS_ACTION_INSTRUCTION* pInstruction,
+    ULONG recirculationDepth, _In_ const OutputToPortCallback outputToPort)
+{
+    const OVS_ACTION_SAMPLE* pSample = &pInstruction->sample;
+    OVS_NET_BUFFER* pSampleOnb = pOvsNb;
+    BOOLEAN ok = TRUE;
+
+    if (pSample->probability != MAXUINT32 && Random_Next32() >= pSample->probability)
+    {
+        return TRUE;
+    }
+
+    //the modifications done by the sample actions must not be seen by the actions that follow the sample
+    if (pSample->modifiesPacket)
+    {
+        pSampleOnb = ONB_Duplicate(pOvsNb);
+        if (!pSampleOnb)
+        {
+            return FALSE;
+        }
+    }
+
+    ok = _ExecuteProgram(pSampleOnb, pInstruction + 1, pSample->countInstructions, /*isSample*/ TRUE, recirculationDepth, outputToPort);
+
+    if (pSampleOnb != pOvsNb)
+    {
+        ONB_Destroy(pSampleOnb->pSwitchInfo, &pSampleOnb);
+    }
+
+    return ok;
+}
+
+/* The packet is looked up again, in place: its packet info is extracted again, because the actions before may have modified its headers;
+it keeps the in port, the tunnel it was received on and the flow hash, and gets the recirculation id. The actions of the flow it matches
+are executed on it, as the rest of its actions. Returns TRUE if pOvsNb was output; on a miss, the packet is queued to userspace. */
+static BOOLEAN _ExecuteAction_Recirculation(_Inout_ OVS_NET_BUFFER *pOvsNb, UINT32 recirculationId, ULONG recirculationDepth,
+    _In_ const OutputToPortCallback outputToPort)
+{
+    OVS_OFPACKET_INFO packetInfo = { 0 };
+    OVS_OFPACKET_INFO* pPreviousPacketInfo = pOvsNb->pOriginalPacketInfo;
+    OVS_ACTIONS* pPreviousActions = pOvsNb->pActions;
+    OVS_DATAPATH* pDatapath = pOvsNb->pDatapath;
+    OVS_FLOW_TABLE* pFlowTable = NULL;
+    OVS_FLOW* pFlow = NULL;
+    LOCK_STATE_EX lockState = { 0 };
+    BOOLEAN sent = FALSE;
+
+    if (recirculationDepth >= OVS_ACTION_MAX_RECIRCULATIONS)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " recirculation id %u: too many recirculations, dropping\n", recirculationId);
+        return FALSE;
+    }
+
+    //the frame may be shared with clones of the packet: it is only read
+    if (!pDatapath || !PacketInfo_ReextractFromNb(ONB_GetNetBuffer(pOvsNb), pPreviousPacketInfo->physical.ofInPort, &packetInfo))
+    {
+        return FALSE;
+    }
+
+    packetInfo.tunnelInfo = pPreviousPacketInfo->tunnelInfo;
+    packetInfo.physical.packetMark = pOvsNb->packetMark;
+    packetInfo.physical.packetPriority = pOvsNb->packetPriority;
+    packetInfo.flowHash = pPreviousPacketInfo->flowHash;
+    packetInfo.recirculationId = recirculationId;
+
+    pFlowTable = Datapath_ReferenceFlowTable(pDatapath);
+    if (!pFlowTable)
+    {
+        return FALSE;
+    }
+
+    pFlow = FlowTable_FindFlowMatchingMaskedPI_Ref(pFlowTable, &packetInfo);
+
+    OVS_REFCOUNT_DEREFERENCE(pFlowTable);
+
+    if (!pFlow)
+    {
+        OVS_UPCALL_INFO upcallInfo = { 0 };
+        const OVS_OFPORT* pSourcePort = pOvsNb->pSourcePort;
+
+        upcallInfo.command = OVS_MESSAGE_COMMAND_PACKET_UPCALL_MISS;
+        upcallInfo.pPacketInfo = &packetInfo;
+        upcallInfo.portId = (pSourcePort ? OFPort_GetUpcallPortId(pSourcePort) : 0);
+
+        if (pDatapath->name && !pDatapath->deleted && pSourcePort)
         {
-            NET_BUFFER* pNb = ONB_GetNetBuffer(pOvsNb);
-            OVS_OFPACKET_INFO* pPacketInfo = pOvsNb->pOriginalPacketInfo;
+            QueuePacketToUserspace(pDatapath, ONB_GetNetBuffer(pOvsNb), &upcallInfo);
+        }
+
+        return FALSE;
+    }
+
+    FLOW_LOCK_READ(pFlow, &lockState);
+
+    pOvsNb->pActions = OVS_REFCOUNT_REFERENCE(pFlow->pActions);
+
+    Flow_UpdateStats_Unsafe(pFlow, pOvsNb);
+
+    FLOW_UNLOCK(pFlow, &lockState);
 
-            _ExecuteAction_OutToUserspace(pOvsNb->pDatapath, pNb, pPacketInfo, pArg->data);
+    pOvsNb->pOriginalPacketInfo = &packetInfo;
+
+    sent = _ExecuteProgram(pOvsNb, pOvsNb->pActions->pInstructions, pOvsNb->pActions->countInstructions, /*isSample*/ FALSE,
+        recirculationDepth + 1, outputToPort);
+
+    //the caller goes on with the packet info and the actions of the flow that recirculated the packet
+    OVS_REFCOUNT_DEREFERENCE(pOvsNb->pActions);
+    pOvsNb->pActions = pPreviousActions;
+    pOvsNb->pOriginalPacketInfo = pPreviousPacketInfo;
+
+    OVS_REFCOUNT_DEREFERENCE(pFlow);
+
+    return sent;
+}
+
+//if isSample, pOvsNb is never output itself, and it returns TRUE if the instructions were executed successfully.
+//otherwise, it returns TRUE if pOvsNb was output
+//recirculationDepth: the number of recirculations the packet went through, before these instructions
+static BOOLEAN _ExecuteProgram(_Inout_ OVS_NET_BUFFER* pOvsNb, _In_ const OVS_ACTION_INSTRUCTION* pInstructions, ULONG countInstructions,
+    BOOLEAN isSample, ULONG recirculationDepth, _In_ const OutputToPortCallback outputToPort)
+{
+    BOOLEAN ok = TRUE;
+    OVS_OUTPUT_GROUP outputGroup = { 0 };
+
+    for (ULONG i = 0; i < countInstructions; ++i)
+    {
+        const OVS_ACTION_INSTRUCTION* pInstruction = pInstructions + i;
+
+        ok = TRUE;
+
+        //consecutive output actions are collapsed into a single NBL: the packet is output when an action of a different kind follows.
+        //NOTE: a failure to output a duplicate does not stop the execution of the actions
+        if (pInstruction->opcode != OVS_ACTION_OPCODE_OUTPUT && outputGroup.count > 0)
+        {
+            _OutputGroup_Flush(&outputGroup, pOvsNb, /*useOriginal*/ FALSE, outputToPort);
+        }
+
+        switch (pInstruction->opcode)
+        {
+        case OVS_ACTION_OPCODE_OUTPUT:
+        {
+            OVS_OFPORT* pDestOFPort = _FindDestPort_Ref(pOvsNb->pActions, pOvsNb->pSourcePort, pInstruction);
+
+            if (pDestOFPort)
+            {
+                if (!_OutputGroup_CanAdd(&outputGroup, pDestOFPort))
+                {
+                    _OutputGroup_Flush(&outputGroup, pOvsNb, /*useOriginal*/ FALSE, outputToPort);
+                }
+
+                outputGroup.ports[outputGroup.count++] = pDestOFPort;
+            }
         }
             break;
 
-        case OVS_ARGTYPE_ACTION_SETINFO_GROUP:
-            ok = _ExecuteAction_Set(pOvsNb, pArg->data);
+        case OVS_ACTION_OPCODE_UPCALL:
+            _ExecuteAction_OutToUserspace(pOvsNb->pDatapath, ONB_GetNetBuffer(pOvsNb), pOvsNb->pOriginalPacketInfo, &pInstruction->upcall, isSample);
             break;
 
-        case OVS_ARGTYPE_ACTION_SAMPLE_GROUP:
-            ok = _ExecuteAction_Sample(pOvsNb, pArg->data, outputToPort);
+        case OVS_ACTION_OPCODE_SET_PACKET_MARK:
+            pOvsNb->packetMark = pInstruction->packetMark;
             break;
 
-        case OVS_ARGTYPE_ACTION_PUSH_VLAN:
-            ok = Vlan_Push(pOvsNb, pArg->data);
-            if (!ok)
-            {
-                goto Cleanup;
-            }
+        case OVS_ACTION_OPCODE_SET_PACKET_PRIORITY:
+            pOvsNb->packetPriority = pInstruction->packetPriority;
             break;
 
-        case OVS_ARGTYPE_ACTION_POP_VLAN:
-            ok = Vlan_Pop(pOvsNb);
+        case OVS_ACTION_OPCODE_SET_TUNNEL:
+            //the tunnel info is only read, when the packet is encapsulated
+            pOvsNb->pTunnelInfo = (OF_PI_IPV4_TUNNEL*)&pInstruction->tunnelInfo;
             break;
 
-        case OVS_ARGTYPE_ACTION_PUSH_MPLS:
-            OVS_CHECK(__NOT_IMPLEMENTED__);
+        //the packet data may be shared with the ONBs already output
+        case OVS_ACTION_OPCODE_SET_ETH_ADDRESS:
+            ok = ONB_MakeWritable(pOvsNb) && ONB_SetEthernetAddress(pOvsNb, &pInstruction->ethAddress);
             break;
 
-        case OVS_ARGTYPE_ACTION_POP_MPLS:
-            OVS_CHECK(__NOT_IMPLEMENTED__);
+        case OVS_ACTION_OPCODE_SET_IPV4:
+            ok = ONB_MakeWritable(pOvsNb) && ONB_SetIpv4(pOvsNb, &pInstruction->ipv4);
             break;
 
-        case OVS_ARGTYPE_ACTION_HASH:
-            ok = _ExecuteAction_Hash(pOvsNb, pArg->data);
+        case OVS_ACTION_OPCODE_SET_IPV6:
+            ok = ONB_MakeWritable(pOvsNb) && ONB_SetIpv6(pOvsNb, &pInstruction->ipv6);
             break;
 
-        case OVS_ARGTYPE_ACTION_RECIRCULATION:
-            //TODO: use copy-on-write for OVS_NET_BUFFER, OR
-            //copy the ONB only if there are more arguments in pArg->data
-            if (i < pActionArgs->count - 1)
+        case OVS_ACTION_OPCODE_SET_TCP:
+            ok = ONB_MakeWritable(pOvsNb) && ONB_SetTcp(pOvsNb, &pInstruction->tcp);
+            break;
+
+        case OVS_ACTION_OPCODE_SET_UDP:
+            ok = ONB_MakeWritable(pOvsNb) && ONB_SetUdp(pOvsNb, &pInstruction->udp);
+            break;
+
+        case OVS_ACTION_OPCODE_SET_SCTP:
+            ok = ONB_MakeWritable(pOvsNb) && ONB_SetSctp(pOvsNb, &pInstruction->sctp);
+            break;
+
+        case OVS_ACTION_OPCODE_PUSH_VLAN:
+            ok = ONB_MakeWritable(pOvsNb) && Vlan_Push(pOvsNb, &pInstruction->pushVlan);
+            break;
+
+        case OVS_ACTION_OPCODE_POP_VLAN:
+            ok = ONB_MakeWritable(pOvsNb) && Vlan_Pop(pOvsNb);
+            break;
+
+        case OVS_ACTION_OPCODE_SAMPLE:
+            ok = _ExecuteAction_Sample(pOvsNb, pInstruction, recirculationDepth, outputToPort);
+
+            //skip the sample actions
+            i += pInstruction->sample.countInstructions;
+            break;
+
+        case OVS_ACTION_OPCODE_HASH:
+            ok = _ExecuteAction_Hash(pOvsNb, &pInstruction->hash);
+            break;
+
+        case OVS_ACTION_OPCODE_RECIRCULATION:
+            //the actions that follow (or those that follow the sample) still need the packet: a duplicate, which shares the packet data,
+            //is recirculated. NOTE: a failure to recirculate a duplicate does not stop the execution of the actions
+            if (i < countInstructions - 1 || isSample)
             {
                 OVS_NET_BUFFER* pDuplicateOnb = ONB_Duplicate(pOvsNb);
-                if (pDuplicateOnb)
+                if (!pDuplicateOnb)
+                {
+                    ok = FALSE;
+                    break;
+                }
+
+                if (_ExecuteAction_Recirculation(pDuplicateOnb, pInstruction->recirculationId, recirculationDepth, outputToPort))
+                {
+                    KFree(pDuplicateOnb);
+                }
+                else
                 {
-                    ok = _ExecuteAction_Recirculation(pDuplicateOnb, pArg->data);
-                    continue;
+                    ONB_Destroy(pDuplicateOnb->pSwitchInfo, &pDuplicateOnb);
                 }
+
+                break;
             }
 
-            ok = _ExecuteAction_Recirculation(pOvsNb, pArg->data);
-            break;
+            //the last action: the packet itself goes through the actions of the flow it matches now
+            ok = _ExecuteAction_Recirculation(pOvsNb, pInstruction->recirculationId, recirculationDepth, outputToPort);
+            goto Cleanup;
+
+        default:
+            OVS_CHECK(__UNEXPECTED__);
+            ok = FALSE;
         }
 
         if (!ok)
@@ -410,28 +573,31 @@ BOOLEAN ExecuteActions(_Inout_ OVS_NET_BUFFER* pOvsNb, _In_ const OutputToPortCa
         }
     }
 
-    if (pDestOFPort)
+    if (outputGroup.count > 0)
     {
-        pOvsNb->pDestinationPort = pDestOFPort;
-        pOvsNb->sendToPortNormal = FALSE;
-
-        ok = (*outputToPort)(pOvsNb);
-
-        OVS_REFCOUNT_DEREFERENCE(pDestOFPort);
-        pDestOFPort = NULL;
+        //a sample outputs duplicates: pOvsNb is still used by the actions that follow the sample
+        ok = _OutputGroup_Flush(&outputGroup, pOvsNb, /*useOriginal*/ !isSample, outputToPort);
+        ok = ok || isSample;
     }
     else
     {
         //i.e. did not send pOvsNb, _ProcessAllNblsIngress will destroy it.
-        ok = FALSE;
+        ok = isSample;
     }
 
 Cleanup:
-    OVS_REFCOUNT_DEREFERENCE(pDestOFPort);
+    _OutputGroup_Clear(&outputGroup);
 
     return ok;
 }
 
+BOOLEAN ExecuteActions(_Inout_ OVS_NET_BUFFER* pOvsNb, _In_ const OutputToPortCallback outputToPort)
+{
+    const OVS_ACTIONS* pActions = pOvsNb->pActions;
+
+    return _ExecuteProgram(pOvsNb, pActions->pInstructions, pActions->countInstructions, /*isSample*/ FALSE, /*recirculationDepth*/ 0, outputToPort);
+}
+
 /********************************************************************************************/
 
 static BOOLEAN _VerifyAction_Upcall(const OVS_ARGUMENT* pArg)
@@ -582,7 +748,7 @@ static BOOLEAN _Action_SetInfo(_Inout_ OVS_ARGUMENT_GROUP* pActionGroup, const O
     OVS_ARGTYPE argType = OVS_ARGTYPE_INVALID;
     OVS_ARGUMENT* pTunnelArg = NULL;
     OF_PI_IPV4_TUNNEL* pTunnel;
-    const BYTE* pMac = NULL;
+    BYTE mac[OVS_ETHERNET_ADDRESS_LENGTH] = { 0 };
     const OVS_PI_IPV4* pIpv4Info = NULL;
     const OVS_PI_IPV6* pIpv6Info = NULL;
     BOOLEAN ok = FALSE;
@@ -618,8 +784,7 @@ static BOOLEAN _Action_SetInfo(_Inout_ OVS_ARGUMENT_GROUP* pActionGroup, const O
         }
 
         pTunnel = pTunnelArg->data;
-        pMac = Arp_FindTableEntry((const BYTE*)&pTunnel->ipv4Destination);
-        if (!pMac)
+        if (!Arp_FindTableEntry((const BYTE*)&pTunnel->ipv4Destination, mac, NULL))
         {
             ONB_OriginateArpRequest((const BYTE*)&pTunnel->ipv4Destination);
         }
@@ -839,12 +1004,370 @@ BOOLEAN ProcessReceivedActions(_Inout_ OVS_ARGUMENT_GROUP* pActionGroup, const O
     return TRUE;
 }
 
+/********************************************************************************************/
+
+//an upper bound of the number of instructions the action group compiles to
+static ULONG _Actions_CountInstructions(_In_ const OVS_ARGUMENT_GROUP* pActionGroup, int recursivityDepth)
+{
+    ULONG count = pActionGroup->count;
+
+    if (recursivityDepth >= OVS_ACTION_SAMPLE_MAX_DEPTH)
+    {
+        return count;
+    }
+
+    for (UINT i = 0; i < pActionGroup->count; ++i)
+    {
+        const OVS_ARGUMENT* pArg = pActionGroup->args + i;
+        const OVS_ARGUMENT* pSampleActionsArg = NULL;
+
+        if (pArg->type != OVS_ARGTYPE_ACTION_SAMPLE_GROUP)
+        {
+            continue;
+        }
+
+        pSampleActionsArg = FindArgument(pArg->data, OVS_ARGTYPE_ACTION_SAMPLE_ACTIONS_GROUP);
+        if (pSampleActionsArg)
+        {
+            count += _Actions_CountInstructions(pSampleActionsArg->data, recursivityDepth + 1);
+        }
+    }
+
+    return count;
+}
+
+static BOOLEAN _Actions_CompileUpcall(_In_ const OVS_ARGUMENT_GROUP* pArguments, _Out_ OVS_ACTION_UPCALL* pUpcall)
+{
+    pUpcall->portId = 0;
+    pUpcall->pUserData = NULL;
+
+    for (UINT i = 0; i < pArguments->count; ++i)
+    {
+        const OVS_ARGUMENT* pArg = pArguments->args + i;
+
+        if (!IsArgumentValid(pArg))
+        {
+            DEBUGP(LOG_ERROR, __FUNCTION__ " packet upcall action: arg of argtype %u is invalid!\n", pArg->type);
+            return FALSE;
+        }
+
+        switch (pArg->type)
+        {
+        case OVS_ARGTYPE_ACTION_UPCALL_DATA:
+            pUpcall->pUserData = pArg;
+            break;
+
+        case OVS_ARGTYPE_ACTION_UPCALL_PORT_ID:
+            pUpcall->portId = GET_ARG_DATA(pArg, UINT32);
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+//returns FALSE on error. If the set action does not need to do anything on the packet, *pEmitted is FALSE
+static BOOLEAN _Actions_CompileSet(_In_ const OVS_ARGUMENT_GROUP* pArguments, _Out_ OVS_ACTION_INSTRUCTION* pInstruction, _Out_ BOOLEAN* pEmitted)
+{
+    const OVS_ARGUMENT* pArg = NULL;
+
+    *pEmitted = TRUE;
+
+    OVS_CHECK_RET(pArguments->count == 1, FALSE);
+    pArg = pArguments->args;
+
+    switch (pArg->type)
+    {
+        //NOTE FOR OVS 2.3:
+        //OVS_ARGTYPE_PI_TCP_FLAGS and OVS_ARGTYPE_PI_DATAPATH_HASH and OVS_ARGTYPE_PI_DATAPATH_RECIRCULATION_ID
+        //are not settable
+    case OVS_ARGTYPE_PI_TCP_FLAGS:
+    case OVS_ARGTYPE_PI_DATAPATH_HASH:
+    case OVS_ARGTYPE_PI_DATAPATH_RECIRCULATION_ID:
+        *pEmitted = FALSE;
+        break;
+
+    case OVS_ARGTYPE_PI_PACKET_MARK:
+        pInstruction->opcode = OVS_ACTION_OPCODE_SET_PACKET_MARK;
+        pInstruction->packetMark = GET_ARG_DATA(pArg, UINT32);
+        break;
+
+    case OVS_ARGTYPE_PI_PACKET_PRIORITY:
+        pInstruction->opcode = OVS_ACTION_OPCODE_SET_PACKET_PRIORITY;
+        pInstruction->packetPriority = GET_ARG_DATA(pArg, UINT32);
+        break;
+
+    //ProcessReceivedActions has replaced the OVS_ARGTYPE_PI_TUNNEL_GROUP
+    case OVS_ARGTYPE_PI_IPV4_TUNNEL:
+        pInstruction->opcode = OVS_ACTION_OPCODE_SET_TUNNEL;
+        pInstruction->tunnelInfo = GET_ARG_DATA(pArg, OF_PI_IPV4_TUNNEL);
+        break;
+
+    case OVS_ARGTYPE_PI_ETH_ADDRESS:
+        pInstruction->opcode = OVS_ACTION_OPCODE_SET_ETH_ADDRESS;
+        pInstruction->ethAddress = GET_ARG_DATA(pArg, OVS_PI_ETH_ADDRESS);
+        break;
+
+    case OVS_ARGTYPE_PI_IPV4:
+        pInstruction->opcode = OVS_ACTION_OPCODE_SET_IPV4;
+        pInstruction->ipv4 = GET_ARG_DATA(pArg, OVS_PI_IPV4);
+        break;
+
+    case OVS_ARGTYPE_PI_IPV6:
+        pInstruction->opcode = OVS_ACTION_OPCODE_SET_IPV6;
+        pInstruction->ipv6 = GET_ARG_DATA(pArg, OVS_PI_IPV6);
+        break;
+
+    case OVS_ARGTYPE_PI_TCP:
+        pInstruction->opcode = OVS_ACTION_OPCODE_SET_TCP;
+        pInstruction->tcp = GET_ARG_DATA(pArg, OVS_PI_TCP);
+        break;
+
+    case OVS_ARGTYPE_PI_UDP:
+        pInstruction->opcode = OVS_ACTION_OPCODE_SET_UDP;
+        pInstruction->udp = GET_ARG_DATA(pArg, OVS_PI_UDP);
+        break;
+
+    case OVS_ARGTYPE_PI_SCTP:
+        pInstruction->opcode = OVS_ACTION_OPCODE_SET_SCTP;
+        pInstruction->sctp = GET_ARG_DATA(pArg, OVS_PI_SCTP);
+        break;
+
+    default:
+        DEBUGP(LOG_ERROR, __FUNCTION__ " cannot compile set action of type: 0x%x\n", pArg->type);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN _Actions_CompileGroup(_In_ const OVS_ARGUMENT_GROUP* pActionGroup, _Inout_ OVS_ACTION_INSTRUCTION* pInstructions,
+    ULONG maxInstructions, _Inout_ ULONG* pCount, int recursivityDepth);
+
+static BOOLEAN _Actions_CompileSample(_In_ const OVS_ARGUMENT_GROUP* pArguments, _Inout_ OVS_ACTION_INSTRUCTION* pInstructions,
+    ULONG maxInstructions, _Inout_ ULONG* pCount, int recursivityDepth)
+{
+    OVS_ACTION_INSTRUCTION* pSampleInstruction = pInstructions + *pCount;
+    const OVS_ARGUMENT_GROUP* pSampleActions = NULL;
+    ULONG first = 0;
+
+    pSampleInstruction->opcode = OVS_ACTION_OPCODE_SAMPLE;
+    ++(*pCount);
+    first = *pCount;
+
+    for (UINT i = 0; i < pArguments->count; ++i)
+    {
+        const OVS_ARGUMENT* pArg = pArguments->args + i;
+
+        switch (pArg->type)
+        {
+        case OVS_ARGTYPE_ACTION_SAMPLE_PROBABILITY:
+            pSampleInstruction->sample.probability = GET_ARG_DATA(pArg, UINT32);
+            break;
+
+        case OVS_ARGTYPE_ACTION_SAMPLE_ACTIONS_GROUP:
+            pSampleActions = pArg->data;
+            break;
+        }
+    }
+
+    if (pSampleActions)
+    {
+        if (!_Actions_CompileGroup(pSampleActions, pInstructions, maxInstructions, pCount, recursivityDepth + 1))
+        {
+            return FALSE;
+        }
+    }
+
+    pSampleInstruction->sample.countInstructions = *pCount - first;
+
+    for (ULONG i = first; i < *pCount; ++i)
+    {
+        switch (pInstructions[i].opcode)
+        {
+        case OVS_ACTION_OPCODE_OUTPUT:
+        case OVS_ACTION_OPCODE_UPCALL:
+        case OVS_ACTION_OPCODE_SAMPLE:
+            break;
+
+        default:
+            pSampleInstruction->sample.modifiesPacket = TRUE;
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN _Actions_CompileGroup(_In_ const OVS_ARGUMENT_GROUP* pActionGroup, _Inout_ OVS_ACTION_INSTRUCTION* pInstructions,
+    ULONG maxInstructions, _Inout_ ULONG* pCount, int recursivityDepth)
+{
+    if (recursivityDepth >= OVS_ACTION_SAMPLE_MAX_DEPTH)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " sample actions nested too deep\n");
+        return FALSE;
+    }
+
+    for (UINT i = 0; i < pActionGroup->count; ++i)
+    {
+        const OVS_ARGUMENT* pArg = pActionGroup->args + i;
+        OVS_ACTION_INSTRUCTION* pInstruction = pInstructions + *pCount;
+        BOOLEAN emitted = TRUE;
+        BOOLEAN ok = TRUE;
+
+        OVS_CHECK_RET(*pCount < maxInstructions, FALSE);
+
+        switch (pArg->type)
+        {
+        case OVS_ARGTYPE_ACTION_OUTPUT_TO_PORT:
+        {
+            UINT32 portNumber = GET_ARG_DATA(pArg, UINT32);
+
+            if (portNumber >= OVS_MAX_PORTS)
+            {
+                DEBUGP(LOG_ERROR, __FUNCTION__ " invalid port number from userspace: %u\n", portNumber);
+                return FALSE;
+            }
+
+            pInstruction->opcode = OVS_ACTION_OPCODE_OUTPUT;
+            pInstruction->output.portNumber = (UINT16)portNumber;
+            pInstruction->output.pPort = NULL;
+        }
+            break;
+
+        case OVS_ARGTYPE_ACTION_UPCALL_GROUP:
+            pInstruction->opcode = OVS_ACTION_OPCODE_UPCALL;
+            ok = _Actions_CompileUpcall(pArg->data, &pInstruction->upcall);
+            break;
+
+        case OVS_ARGTYPE_ACTION_SETINFO_GROUP:
+            ok = _Actions_CompileSet(pArg->data, pInstruction, &emitted);
+            break;
+
+        case OVS_ARGTYPE_ACTION_SAMPLE_GROUP:
+            //the sample instruction is followed by its actions
+            ok = _Actions_CompileSample(pArg->data, pInstructions, maxInstructions, pCount, recursivityDepth);
+            emitted = FALSE;
+            break;
+
+        case OVS_ARGTYPE_ACTION_PUSH_VLAN:
+            pInstruction->opcode = OVS_ACTION_OPCODE_PUSH_VLAN;
+            pInstruction->pushVlan = GET_ARG_DATA(pArg, OVS_ACTION_PUSH_VLAN);
+            break;
+
+        case OVS_ARGTYPE_ACTION_POP_VLAN:
+            pInstruction->opcode = OVS_ACTION_OPCODE_POP_VLAN;
+            break;
+
+        case OVS_ARGTYPE_ACTION_HASH:
+            pInstruction->opcode = OVS_ACTION_OPCODE_HASH;
+            pInstruction->hash = GET_ARG_DATA(pArg, OVS_ACTION_FLOW_HASH);
+            break;
+
+        case OVS_ARGTYPE_ACTION_RECIRCULATION:
+            pInstruction->opcode = OVS_ACTION_OPCODE_RECIRCULATION;
+            pInstruction->recirculationId = GET_ARG_DATA(pArg, UINT32);
+            break;
+
+        default:
+            DEBUGP(LOG_ERROR, __FUNCTION__ " cannot compile action of type: 0x%x\n", pArg->type);
+            return FALSE;
+        }
+
+        if (!ok)
+        {
+            return FALSE;
+        }
+
+        if (emitted)
+        {
+            ++(*pCount);
+        }
+    }
+
+    return TRUE;
+}
+
+_Use_decl_annotations_
+BOOLEAN Actions_Compile(OVS_ACTIONS* pActions)
+{
+    OVS_ACTION_INSTRUCTION* pInstructions = NULL;
+    ULONG maxInstructions = 0, count = 0;
+    BOOLEAN haveOutput = FALSE;
+
+    OVS_CHECK(pActions);
+    OVS_CHECK(!pActions->pInstructions);
+
+    maxInstructions = _Actions_CountInstructions(pActions->pActionGroup, /*recursivity depth*/0);
+    if (maxInstructions == 0)
+    {
+        return TRUE;
+    }
+
+    pInstructions = KZAlloc(maxInstructions * sizeof(OVS_ACTION_INSTRUCTION));
+    if (!pInstructions)
+    {
+        return FALSE;
+    }
+
+    if (!_Actions_CompileGroup(pActions->pActionGroup, pInstructions, maxInstructions, &count, /*recursivity depth*/0))
+    {
+        KFree(pInstructions);
+        return FALSE;
+    }
+
+    pActions->pInstructions = pInstructions;
+    pActions->countInstructions = count;
+
+    for (ULONG i = 0; i < count; ++i)
+    {
+        if (pInstructions[i].opcode == OVS_ACTION_OPCODE_OUTPUT)
+        {
+            haveOutput = TRUE;
+            break;
+        }
+    }
+
+    //the destination ports are resolved now, and again only when the of ports change
+    if (haveOutput)
+    {
+        pActions->pPortsLock = NdisAllocateRWLock(NULL);
+        if (!pActions->pPortsLock)
+        {
+            return FALSE;
+        }
+
+        _Actions_ResolveOutputPorts_Unsafe(pActions, OFPort_GetGeneration());
+    }
+
+    return TRUE;
+}
+
 VOID Actions_DestroyNow_Unsafe(_Inout_ OVS_ACTIONS* pActions)
 {
     OVS_CHECK(pActions);
 
     DestroyArgumentGroup(pActions->pActionGroup);
 
+    if (pActions->pInstructions)
+    {
+        for (ULONG i = 0; i < pActions->countInstructions; ++i)
+        {
+            OVS_ACTION_INSTRUCTION* pInstruction = pActions->pInstructions + i;
+
+            if (pInstruction->opcode == OVS_ACTION_OPCODE_OUTPUT && pInstruction->output.pPort)
+            {
+                OVS_REFCOUNT_DEREFERENCE(pInstruction->output.pPort);
+            }
+        }
+
+        KFree(pActions->pInstructions);
+    }
+
+    if (pActions->pPortsLock)
+    {
+        NdisFreeRWLock(pActions->pPortsLock);
+    }
+
     KFree(pActions);
 }
 
@@ -25,6 +25,9 @@ typedef struct _OVS_NET_BUFFER OVS_NET_BUFFER;
 typedef struct _OVS_ARGUMENT_GROUP OVS_ARGUMENT_GROUP;
 typedef struct _OVS_SWITCH_INFO OVS_SWITCH_INFO;
 typedef struct _OVS_NIC_INFO OVS_NIC_INFO;
+typedef struct _OVS_OFPORT OVS_OFPORT;
+
+typedef struct _OVS_ACTION_INSTRUCTION OVS_ACTION_INSTRUCTION;
 
 typedef struct _OVS_ACTIONS
 {
@@ -32,7 +35,17 @@ typedef struct _OVS_ACTIONS
     OVS_REF_COUNT refCount;
 
     //once set, it cannot be modified. Also, the pointer cannot be changed, unless the OVS_ACTIONS struct is destroyed
+    //it is kept only for dumping the flow's actions back to userspace: the packets are processed using pInstructions
     OVS_ARGUMENT_GROUP* pActionGroup;
+
+    //the action group, compiled by Actions_Compile into a flat program. It is NULL if there are no actions (i.e. drop).
+    OVS_ACTION_INSTRUCTION* pInstructions;
+    ULONG countInstructions;
+
+    //protects the destination ports cached by the output instructions. NULL if there are no output instructions.
+    NDIS_RW_LOCK_EX* pPortsLock;
+    //the of ports generation the cached destination ports were resolved for (see OFPort_GetGeneration)
+    LONG portsGeneration;
 } OVS_ACTIONS, *POVS_ACTIONS;
 
 typedef struct _OVS_ACTION_PUSH_VLAN
@@ -61,6 +74,85 @@ typedef struct _OVS_ACTION_FLOW_HASH {
     UINT32        basis;
 }OVS_ACTION_FLOW_HASH, *POVS_ACTION_FLOW_HASH;
 
+typedef enum _OVS_ACTION_OPCODE
+{
+    OVS_ACTION_OPCODE_INVALID = 0,
+
+    OVS_ACTION_OPCODE_OUTPUT,
+    OVS_ACTION_OPCODE_UPCALL,
+
+    OVS_ACTION_OPCODE_SET_PACKET_MARK,
+    OVS_ACTION_OPCODE_SET_PACKET_PRIORITY,
+    OVS_ACTION_OPCODE_SET_TUNNEL,
+    OVS_ACTION_OPCODE_SET_ETH_ADDRESS,
+    OVS_ACTION_OPCODE_SET_IPV4,
+    OVS_ACTION_OPCODE_SET_IPV6,
+    OVS_ACTION_OPCODE_SET_TCP,
+    OVS_ACTION_OPCODE_SET_UDP,
+    OVS_ACTION_OPCODE_SET_SCTP,
+
+    OVS_ACTION_OPCODE_PUSH_VLAN,
+    OVS_ACTION_OPCODE_POP_VLAN,
+
+    OVS_ACTION_OPCODE_SAMPLE,
+    OVS_ACTION_OPCODE_HASH,
+    OVS_ACTION_OPCODE_RECIRCULATION,
+}OVS_ACTION_OPCODE;
+
+typedef struct _OVS_ACTION_OUTPUT
+{
+    //always < OVS_MAX_PORTS
+    UINT16 portNumber;
+    //the port having portNumber, referenced, or NULL if there is no such port.
+    //valid only while OVS_ACTIONS::portsGeneration is the current of ports generation.
+    OVS_OFPORT* pPort;
+}OVS_ACTION_OUTPUT, *POVS_ACTION_OUTPUT;
+
+typedef struct _OVS_ACTION_UPCALL
+{
+    UINT32 portId;
+    //the OVS_ARGTYPE_ACTION_UPCALL_DATA arg of pActionGroup, or NULL
+    const OVS_ARGUMENT* pUserData;
+}OVS_ACTION_UPCALL, *POVS_ACTION_UPCALL;
+
+typedef struct _OVS_ACTION_SAMPLE
+{
+    //the sample actions are executed with the chance probability / 2^32; MAXUINT32 = always
+    UINT32 probability;
+    //the sample actions are the countInstructions instructions that follow the sample instruction
+    ULONG countInstructions;
+    //if the sample actions modify the packet, they are executed on a duplicate of it
+    BOOLEAN modifiesPacket;
+}OVS_ACTION_SAMPLE, *POVS_ACTION_SAMPLE;
+
+//an instruction of a compiled action program: an opcode and its operand, validated at flow install time
+typedef struct _OVS_ACTION_INSTRUCTION
+{
+    OVS_ACTION_OPCODE opcode;
+
+    union
+    {
+        OVS_ACTION_OUTPUT       output;
+        OVS_ACTION_UPCALL       upcall;
+
+        UINT32                  packetMark;
+        UINT32                  packetPriority;
+        OF_PI_IPV4_TUNNEL       tunnelInfo;
+        OVS_PI_ETH_ADDRESS      ethAddress;
+        OVS_PI_IPV4             ipv4;
+        OVS_PI_IPV6             ipv6;
+        OVS_PI_TCP              tcp;
+        OVS_PI_UDP              udp;
+        OVS_PI_SCTP             sctp;
+
+        OVS_ACTION_PUSH_VLAN    pushVlan;
+
+        OVS_ACTION_SAMPLE       sample;
+        OVS_ACTION_FLOW_HASH    hash;
+        UINT32                  recirculationId;
+    };
+}OVS_ACTION_INSTRUCTION, *POVS_ACTION_INSTRUCTION;
+
 /**********************************************/
 
 typedef BOOLEAN(*OutputToPortCallback)(_Inout_ OVS_NET_BUFFER* pOvsNb);
@@ -69,5 +161,8 @@ BOOLEAN ExecuteActions(_Inout_ OVS_NET_BUFFER* pOvsNb, _In_ const OutputToPortCa
 
 BOOLEAN ProcessReceivedActions(_Inout_ OVS_ARGUMENT_GROUP* pActionGroup, const OVS_OFPACKET_INFO* pPacketInfo, int recursivityDepth);
 
+//builds pActions->pInstructions from pActions->pActionGroup. The action group must have been processed by ProcessReceivedActions.
+BOOLEAN Actions_Compile(_Inout_ OVS_ACTIONS* pActions);
+
 OVS_ACTIONS* Actions_Create();
 VOID Actions_DestroyNow_Unsafe(_Inout_ OVS_ACTIONS* pActions);
\ No newline at end of file
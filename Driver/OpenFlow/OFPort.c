@@ -18,145 +18,159 @@ limitations under the License.
 #include "Sctx_Nic.h"
 #include "Sctx_Port.h"
 #include "List.h"
+#include "TunnelDemux.h"
+#include "EncapsCache.h"
+#include "Ipv4.h"
 #include <ntstrsafe.h>
 
 extern OVS_SWITCH_INFO* g_pSwitchInfo;
 
-static LIST_ENTRY g_grePorts;
-static LIST_ENTRY g_vxlanPorts;
+//incremented each time an of port is created, deleted or reconfigured
+static volatile LONG g_ofPortsGeneration = 0;
 
-NDIS_RW_LOCK_EX* g_pLogicalPortsLock = NULL;
+/******************************** TUNNELS ********************************/
 
-/******************************** LOGICAL PORTS & TUNNELS /********************************/
-
-static BOOLEAN _AddOFPort_Logical(LIST_ENTRY* pList, _In_ const OVS_OFPORT* pPort)
+//the demux key a tunnel port receives on, with the given options. FALSE if it is not a tunnel port, or if it is not configured enough to receive.
+static BOOLEAN _OFPort_GetTunnelDemuxKey(OVS_OFPORT_TYPE portType, _In_opt_ const OVS_TUNNELING_PORT_OPTIONS* pOptions,
+    _Out_ OVS_TUNNEL_DEMUX_KEY* pKey)
 {
-    OVS_LOGICAL_PORT_ENTRY* pPortEntry = NULL;
-    LOCK_STATE_EX lockState = { 0 };
+    RtlZeroMemory(pKey, sizeof(OVS_TUNNEL_DEMUX_KEY));
 
-    pPortEntry = KAlloc(sizeof(OVS_LOGICAL_PORT_ENTRY));
-    if (!pPortEntry)
+    if (portType == OVS_OFPORT_TYPE_GRE)
+    {
+        pKey->protocol = OVS_IPPROTO_GRE;
+    }
+    else if (portType == OVS_OFPORT_TYPE_VXLAN)
+    {
+        //the udp port comes with the options, after the port has been created
+        if (!pOptions || !(pOptions->optionsFlags & OVS_TUNNEL_OPTIONS_HAVE_UDP_DST_PORT))
+        {
+            return FALSE;
+        }
+
+        pKey->protocol = OVS_IPPROTO_UDP;
+        pKey->udpDestPort = pOptions->udpDestPort;
+    }
+    else
     {
         return FALSE;
     }
 
-    pPortEntry->pPort = (OVS_OFPORT*)pPort;
+    if (pOptions && (pOptions->optionsFlags & OVS_TUNNEL_OPTIONS_HAVE_IN_KEY))
+    {
+        pKey->haveKey = TRUE;
+        pKey->key = (UINT32)RtlUlonglongByteSwap(pOptions->inKey);
+    }
 
-    NdisAcquireRWLockWrite(g_pLogicalPortsLock, &lockState, 0);
-    InsertTailList(pList, &pPortEntry->listEntry);
-    NdisReleaseRWLock(g_pLogicalPortsLock, &lockState);
+    if (pOptions && (pOptions->optionsFlags & OVS_TUNNEL_OPTIONS_HAVE_REMOTE_IP))
+    {
+        pKey->remoteIpv4 = pOptions->destIpv4;
+    }
 
     return TRUE;
 }
 
-static BOOLEAN _RemoveOFPort_Logical(LIST_ENTRY* pList, _In_ const OVS_OFPORT* pPort)
+//(re)registers the port in the tunnel demux table, as it would receive with pOptions. On failure, e.g. another port already receives on
+//the same key, the port keeps its previous entry. The ports array is locked for write.
+static BOOLEAN _OFPort_UpdateTunnelDemux_Unsafe(_In_ const OVS_OFPORT* pPort, _In_opt_ const OVS_TUNNELING_PORT_OPTIONS* pOptions)
 {
-    OVS_LOGICAL_PORT_ENTRY* pPortEntry = NULL;
-    BOOLEAN ok = FALSE;
-    LOCK_STATE_EX lockState = { 0 };
+    OVS_TUNNEL_DEMUX_KEY key = { 0 };
 
-    NdisAcquireRWLockWrite(g_pLogicalPortsLock, &lockState, 0);
-
-    OVS_LIST_FOR_EACH(OVS_LOGICAL_PORT_ENTRY, pPortEntry, pList)
+    if (!_OFPort_GetTunnelDemuxKey(pPort->ofPortType, pOptions, &key))
     {
-        if (pPortEntry->pPort == pPort)
-        {
-            RemoveEntryList(&pPortEntry->listEntry);
-
-            KFree(pPortEntry);
-            ok = TRUE;
-            goto Cleanup;
-        }
+        return TunnelDemux_Set(NULL, pPort->ofPortNumber);
     }
 
-Cleanup:
-    NdisReleaseRWLock(g_pLogicalPortsLock, &lockState);
-    return ok;
-}
-
-static BOOLEAN _AddOFPort_Gre(_In_ const OVS_OFPORT* pPort)
-{
-    return _AddOFPort_Logical(&g_grePorts, pPort);
-}
-
-static BOOLEAN _AddOFPort_Vxlan(_In_ const OVS_OFPORT* pPort)
-{
-    return _AddOFPort_Logical(&g_vxlanPorts, pPort);
-}
-
-static BOOLEAN _RemoveOFPort_Gre(_In_ const OVS_OFPORT* pPort)
-{
-    return _RemoveOFPort_Logical(&g_grePorts, pPort);
-}
-
-static BOOLEAN _RemoveOFPort_Vxlan(_In_ const OVS_OFPORT* pPort)
-{
-    return _RemoveOFPort_Logical(&g_vxlanPorts, pPort);
+    return TunnelDemux_Set(&key, pPort->ofPortNumber);
 }
 
 _Use_decl_annotations_
-OVS_OFPORT* OFPort_FindGre_Ref()
+OVS_ERROR OFPort_SetOptions(OVS_OFPORT* pPort, const OVS_TUNNELING_PORT_OPTIONS* pOptions)
 {
-    OVS_LOGICAL_PORT_ENTRY* pPortEntry = NULL;
-    OVS_OFPORT* pOutPort = NULL;
+    OVS_SWITCH_INFO* pSwitchInfo = NULL;
+    OVS_FIXED_SIZED_ARRAY* pPortsArray = NULL;
     LOCK_STATE_EX lockState = { 0 };
+    LOCK_STATE_EX portLockState = { 0 };
+    OVS_TUNNELING_PORT_OPTIONS* pNewOptions = NULL;
+    OVS_ERROR error = OVS_ERROR_NOERROR;
 
-    NdisAcquireRWLockRead(g_pLogicalPortsLock, &lockState, 0);
-
-    pPortEntry = CONTAINING_RECORD(g_grePorts.Flink, OVS_LOGICAL_PORT_ENTRY, listEntry);
-    pOutPort = OVS_REFCOUNT_REFERENCE(pPortEntry->pPort);
+    pSwitchInfo = Driver_GetDefaultSwitch_Ref(__FUNCTION__);
+    if (!pSwitchInfo)
+    {
+        return OVS_ERROR_NODEV;
+    }
 
-    NdisReleaseRWLock(g_pLogicalPortsLock, &lockState);
+    pPortsArray = &pSwitchInfo->pForwardInfo->ofPorts;
 
-    return pOutPort;
-}
+    //the ports array lock orders this against OFPort_Delete: a deleted port must not get back in the demux table
+    FXARRAY_LOCK_WRITE(pPortsArray, &lockState);
 
-_Use_decl_annotations_
-OVS_OFPORT* OFPort_FindVxlan_Ref(LE16 udpDestPort)
-{
-    OVS_LOGICAL_PORT_ENTRY* pPortEntry = NULL;
-    OVS_OFPORT* pOutPort = NULL;
-    LOCK_STATE_EX lockState = { 0 };
+    if (pPortsArray->array[pPort->ofPortNumber] != (OVS_FXARRAY_ITEM*)pPort)
+    {
+        error = OVS_ERROR_NODEV;
+        goto Cleanup;
+    }
 
-    NdisAcquireRWLockRead(g_pLogicalPortsLock, &lockState, 0);
+    if (!pPort->pOptions)
+    {
+        pNewOptions = KZAlloc(sizeof(OVS_TUNNELING_PORT_OPTIONS));
+        if (!pNewOptions)
+        {
+            error = OVS_ERROR_NOMEM;
+            goto Cleanup;
+        }
+    }
 
-    OVS_LIST_FOR_EACH(OVS_LOGICAL_PORT_ENTRY, pPortEntry, &g_vxlanPorts)
+    //the options are checked against the other ports before the port gets them
+    if (!_OFPort_UpdateTunnelDemux_Unsafe(pPort, pOptions))
     {
-        OVS_TUNNELING_PORT_OPTIONS* pOptions = NULL;
+        error = OVS_ERROR_EXIST;
+        goto Cleanup;
+    }
 
-        pOptions = pPortEntry->pPort->pOptions;
-        OVS_CHECK(pOptions);
+    //updated in place: the packet path reads the options without locking the port
+    PORT_LOCK_WRITE(pPort, &portLockState);
 
-        if (pOptions->udpDestPort == udpDestPort)
-        {
-            pOutPort = OVS_REFCOUNT_REFERENCE(pPortEntry->pPort);
-            break;
-        }
+    if (pNewOptions)
+    {
+        *pNewOptions = *pOptions;
+        pPort->pOptions = pNewOptions;
+        pNewOptions = NULL;
+    }
+    else
+    {
+        *pPort->pOptions = *pOptions;
     }
 
-    NdisReleaseRWLock(g_pLogicalPortsLock, &lockState);
+    PORT_UNLOCK(pPort, &portLockState);
 
-    return pOutPort;
+    EncapsCache_RemovePort(pPort->ofPortNumber);
+    OFPort_IncrementGeneration();
+
+Cleanup:
+    FXARRAY_UNLOCK(pPortsArray, &lockState);
+
+    KFree(pNewOptions);
+
+    OVS_REFCOUNT_DEREFERENCE(pSwitchInfo);
+
+    return error;
 }
 
 /******************************** INIT AND UNINIT ********************************/
 
 BOOLEAN OFPort_Initialize()
 {
-    InitializeListHead(&g_grePorts);
-    InitializeListHead(&g_vxlanPorts);
-
-    g_pLogicalPortsLock = NdisAllocateRWLock(NULL);
+    TunnelDemux_Initialize();
+    EncapsCache_Initialize();
 
     return TRUE;
 }
 
 VOID OFPort_Uninitialize()
 {
-    OVS_CHECK(g_pLogicalPortsLock);
-
-    NdisFreeRWLock(g_pLogicalPortsLock);
-    g_pLogicalPortsLock = NULL;
+    EncapsCache_Uninitialize();
+    TunnelDemux_Uninitialize();
 }
 
 /******************************** UTILITTY FUNCS ********************************/
@@ -249,6 +263,92 @@ static VOID _OFPort_SetNicAndPort_Unsafe(OVS_GLOBAL_FORWARD_INFO* pForwardInfo,
     FWDINFO_UNLOCK(pForwardInfo, &lockState);
 }
 
+/******************************** PORT ID INDEX ********************************/
+
+static __inline OVS_OFPORT** _OFPort_GetIdBucket(_In_ const OVS_GLOBAL_FORWARD_INFO* pForwardInfo, NDIS_SWITCH_PORT_ID portId)
+{
+    //hyper-v switch port ids are small, consecutive numbers
+    return (OVS_OFPORT**)&pForwardInfo->ofPortsById[portId & (OVS_OFPORT_ID_BUCKETS - 1)];
+}
+
+//Unsafe = the of ports array must be locked for write
+static VOID _OFPort_IndexById_Unsafe(_Inout_ OVS_GLOBAL_FORWARD_INFO* pForwardInfo, _Inout_ OVS_OFPORT* pPort)
+{
+    OVS_OFPORT** ppBucket = NULL;
+
+    //logical ports and ports not connected yet are not found by id
+    if (pPort->portId == NDIS_SWITCH_DEFAULT_PORT_ID)
+    {
+        return;
+    }
+
+    ppBucket = _OFPort_GetIdBucket(pForwardInfo, pPort->portId);
+
+    pPort->pNextById = *ppBucket;
+    *ppBucket = pPort;
+}
+
+//Unsafe = the of ports array must be locked for write
+static VOID _OFPort_UnindexById_Unsafe(_Inout_ OVS_GLOBAL_FORWARD_INFO* pForwardInfo, _Inout_ OVS_OFPORT* pPort)
+{
+    OVS_OFPORT** ppCur = NULL;
+
+    if (pPort->portId == NDIS_SWITCH_DEFAULT_PORT_ID)
+    {
+        return;
+    }
+
+    for (ppCur = _OFPort_GetIdBucket(pForwardInfo, pPort->portId); *ppCur; ppCur = &(*ppCur)->pNextById)
+    {
+        if (*ppCur == pPort)
+        {
+            *ppCur = pPort->pNextById;
+            break;
+        }
+    }
+
+    pPort->pNextById = NULL;
+}
+
+_Use_decl_annotations_
+VOID OFPort_SetPortId(OVS_OFPORT* pPort, NDIS_SWITCH_PORT_ID portId)
+{
+    OVS_SWITCH_INFO* pSwitchInfo = NULL;
+    OVS_FIXED_SIZED_ARRAY* pPortsArray = NULL;
+    LOCK_STATE_EX lockState = { 0 };
+    LOCK_STATE_EX portLockState = { 0 };
+
+    pSwitchInfo = Driver_GetDefaultSwitch_Ref(__FUNCTION__);
+    if (!pSwitchInfo)
+    {
+        return;
+    }
+
+    pPortsArray = &pSwitchInfo->pForwardInfo->ofPorts;
+
+    FXARRAY_LOCK_WRITE(pPortsArray, &lockState);
+
+    //the port may have been deleted since the caller found it: it must not get back in the index
+    if (pPortsArray->array[pPort->ofPortNumber] == (OVS_FXARRAY_ITEM*)pPort)
+    {
+        _OFPort_UnindexById_Unsafe(pSwitchInfo->pForwardInfo, pPort);
+
+        PORT_LOCK_WRITE(pPort, &portLockState);
+        pPort->portId = portId;
+        PORT_UNLOCK(pPort, &portLockState);
+
+        _OFPort_IndexById_Unsafe(pSwitchInfo->pForwardInfo, pPort);
+
+        OFPort_IncrementGeneration();
+    }
+
+    FXARRAY_UNLOCK(pPortsArray, &lockState);
+
+    OVS_REFCOUNT_DEREFERENCE(pSwitchInfo);
+}
+
+/******************************** CREATE ********************************/
+
 OVS_OFPORT* OFPort_Create_Ref(_In_opt_ const char* portName, _In_opt_ const UINT16* pPortNumber, OVS_OFPORT_TYPE portType)
 {
     BOOLEAN ok = TRUE;
@@ -339,24 +439,6 @@ OVS_OFPORT* OFPort_Create_Ref(_In_opt_ const char* portName, _In_opt_ const UINT
 
     pPort = OVS_REFCOUNT_REFERENCE(pPort);
 
-    if (portType == OVS_OFPORT_TYPE_GRE)
-    {
-        if (IsListEmpty(&g_grePorts))
-        {
-            _AddOFPort_Gre(pPort);
-        }
-        else
-        {
-            DEBUGP(LOG_ERROR, "we already have gre vport!\n");
-            ok = FALSE;//TODO: return EEXISTS!
-            goto Cleanup;
-        }
-    }
-    else if (portType == OVS_OFPORT_TYPE_VXLAN)
-    {
-        _AddOFPort_Vxlan(pPort);
-    }
-
     //NOTE: we may have more of ports than NICS: logical ports don't have nics associated
     //the same goes with hyper-v switch ports
 
@@ -389,6 +471,17 @@ OVS_OFPORT* OFPort_Create_Ref(_In_opt_ const char* portName, _In_opt_ const UINT
         goto Cleanup;
     }
 
+    //e.g. a second GRE port that would receive the same packets as an existing one
+    if (!_OFPort_UpdateTunnelDemux_Unsafe(pPort, pPort->pOptions))
+    {
+        FXArray_Remove_Unsafe(pPortsArray, (OVS_FXARRAY_ITEM*)pPort, pPort->ofPortNumber);
+        ok = FALSE;
+        goto Cleanup;
+    }
+
+    _OFPort_IndexById_Unsafe(pForwardInfo, pPort);
+    OFPort_IncrementGeneration();
+
 Cleanup:
     if (!ok)
     {
@@ -419,10 +512,17 @@ static __inline BOOLEAN _OFPort_IsExternal(OVS_FXARRAY_ITEM* pItem, UINT_PTR dat
     return pCurPort->isExternal == TRUE && pCurPort->portId != NDIS_SWITCH_DEFAULT_PORT_ID;
 }
 
+_Use_decl_annotations_
+OVS_OFPORT* OFPort_FindExternalOnSwitch_Ref(const OVS_SWITCH_INFO* pSwitchInfo)
+{
+    OVS_CHECK(pSwitchInfo->pForwardInfo);
+
+    return (OVS_OFPORT*)FXArray_Find_Ref(&pSwitchInfo->pForwardInfo->ofPorts, _OFPort_IsExternal, NULL);
+}
+
 _Use_decl_annotations_
 OVS_OFPORT* OFPort_FindExternal_Ref()
 {
-    OVS_FIXED_SIZED_ARRAY* pPortsArray = NULL;
     OVS_OFPORT* pOutPort = NULL;
     OVS_SWITCH_INFO* pSwitchInfo = NULL;
 
@@ -432,11 +532,7 @@ OVS_OFPORT* OFPort_FindExternal_Ref()
         goto Cleanup;
     }
 
-    OVS_CHECK(pSwitchInfo->pForwardInfo);
-
-    pPortsArray = &pSwitchInfo->pForwardInfo->ofPorts;
-
-    pOutPort = (OVS_OFPORT*)FXArray_Find_Ref(pPortsArray, _OFPort_IsExternal, NULL);
+    pOutPort = OFPort_FindExternalOnSwitch_Ref(pSwitchInfo);
 
 Cleanup:
     OVS_REFCOUNT_DEREFERENCE(pSwitchInfo);
@@ -454,10 +550,17 @@ static __inline BOOLEAN _OFPort_IsInternal(OVS_FXARRAY_ITEM* pItem, UINT_PTR dat
         pCurPort->portId != NDIS_SWITCH_DEFAULT_PORT_ID);
 }
 
+_Use_decl_annotations_
+OVS_OFPORT* OFPort_FindInternalOnSwitch_Ref(const OVS_SWITCH_INFO* pSwitchInfo)
+{
+    OVS_CHECK(pSwitchInfo->pForwardInfo);
+
+    return (OVS_OFPORT*)FXArray_Find_Ref(&pSwitchInfo->pForwardInfo->ofPorts, _OFPort_IsInternal, NULL);
+}
+
 _Use_decl_annotations_
 OVS_OFPORT* OFPort_FindInternal_Ref()
 {
-    OVS_FIXED_SIZED_ARRAY* pPortsArray = NULL;
     OVS_OFPORT* pOutPort = NULL;
     OVS_SWITCH_INFO* pSwitchInfo = NULL;
 
@@ -467,9 +570,7 @@ OVS_OFPORT* OFPort_FindInternal_Ref()
         goto Cleanup;
     }
 
-    pPortsArray = &pSwitchInfo->pForwardInfo->ofPorts;
-
-    pOutPort = (OVS_OFPORT*)FXArray_Find_Ref(pPortsArray, _OFPort_IsInternal, NULL);
+    pOutPort = OFPort_FindInternalOnSwitch_Ref(pSwitchInfo);
 
 Cleanup:
     OVS_REFCOUNT_DEREFERENCE(pSwitchInfo);
@@ -509,55 +610,64 @@ Cleanup:
     return pOutPort;
 }
 
-static __inline BOOLEAN _OFPort_PortIdEquals(OVS_FXARRAY_ITEM* pItem, UINT_PTR data)
+_Use_decl_annotations_
+OVS_OFPORT* OFPort_FindById_Unsafe(const OVS_GLOBAL_FORWARD_INFO* pForwardInfo, NDIS_SWITCH_PORT_ID portId)
 {
-    OVS_OFPORT* pCurPort = (OVS_OFPORT*)pItem;
-    NDIS_SWITCH_PORT_ID portId = (NDIS_SWITCH_PORT_ID)data;
+    OVS_OFPORT* pPort = NULL;
+
+    if (portId == NDIS_SWITCH_DEFAULT_PORT_ID)
+    {
+        return NULL;
+    }
+
+    for (pPort = *_OFPort_GetIdBucket(pForwardInfo, portId); pPort; pPort = pPort->pNextById)
+    {
+        if (pPort->portId == portId)
+        {
+            return pPort;
+        }
+    }
 
-    return (pCurPort->portId == portId);
+    return NULL;
 }
 
-OVS_OFPORT* OFPort_FindById_Ref(NDIS_SWITCH_PORT_ID portId)
+_Use_decl_annotations_
+OVS_OFPORT* OFPort_FindByIdOnSwitch_Ref(const OVS_SWITCH_INFO* pSwitchInfo, NDIS_SWITCH_PORT_ID portId)
 {
     OVS_FIXED_SIZED_ARRAY* pPortsArray = NULL;
-    BOOLEAN ok = TRUE;
     OVS_OFPORT* pOutPort = NULL;
-    OVS_SWITCH_INFO* pSwitchInfo = NULL;
+    LOCK_STATE_EX lockState = { 0 };
 
-    pSwitchInfo = Driver_GetDefaultSwitch_Ref(__FUNCTION__);
-    if (!pSwitchInfo)
-    {
-        ok = FALSE;
-        goto Cleanup;
-    }
+    OVS_CHECK(pSwitchInfo->pForwardInfo);
 
     pPortsArray = &pSwitchInfo->pForwardInfo->ofPorts;
 
-    pOutPort = (OVS_OFPORT*)FXArray_Find_Ref(pPortsArray, _OFPort_PortIdEquals, &portId);
+    //the index is protected by the array lock: the ports themselves need not be locked
+    FXARRAY_LOCK_READ(pPortsArray, &lockState);
 
-Cleanup:
-    OVS_REFCOUNT_DEREFERENCE(pSwitchInfo);
+    pOutPort = OFPort_FindById_Unsafe(pSwitchInfo->pForwardInfo, portId);
+    if (pOutPort)
+    {
+        pOutPort = OVS_REFCOUNT_REFERENCE(pOutPort);
+    }
+
+    FXARRAY_UNLOCK(pPortsArray, &lockState);
 
     return pOutPort;
 }
 
-OVS_OFPORT* OFPort_FindById_Unsafe(NDIS_SWITCH_PORT_ID portId)
+OVS_OFPORT* OFPort_FindById_Ref(NDIS_SWITCH_PORT_ID portId)
 {
-    OVS_FIXED_SIZED_ARRAY* pPortsArray = NULL;
-    BOOLEAN ok = TRUE;
     OVS_OFPORT* pOutPort = NULL;
     OVS_SWITCH_INFO* pSwitchInfo = NULL;
 
     pSwitchInfo = Driver_GetDefaultSwitch_Ref(__FUNCTION__);
     if (!pSwitchInfo)
     {
-        ok = FALSE;
         goto Cleanup;
     }
 
-    pPortsArray = &pSwitchInfo->pForwardInfo->ofPorts;
-
-    pOutPort = (OVS_OFPORT*)FXArray_Find_Unsafe(pPortsArray, _OFPort_PortIdEquals, &portId);
+    pOutPort = OFPort_FindByIdOnSwitch_Ref(pSwitchInfo, portId);
 
 Cleanup:
     OVS_REFCOUNT_DEREFERENCE(pSwitchInfo);
@@ -565,31 +675,30 @@ Cleanup:
     return pOutPort;
 }
 
-static __inline BOOLEAN _OFPort_PortNumberEquals(OVS_FXARRAY_ITEM* pItem, UINT_PTR data)
-{
-    OVS_OFPORT* pCurPort = (OVS_OFPORT*)pItem;
-    UINT16 portNumber = (UINT16)data;
-
-    return (pCurPort->ofPortNumber == portNumber);
-}
-
 OVS_OFPORT* OFPort_FindByNumber_Ref(UINT16 portNumber)
 {
     OVS_FIXED_SIZED_ARRAY* pPortsArray = NULL;
     OVS_OFPORT* pOutPort = NULL;
     OVS_SWITCH_INFO* pSwitchInfo = NULL;
-    BOOLEAN ok = TRUE;
+    LOCK_STATE_EX lockState = { 0 };
 
     pSwitchInfo = Driver_GetDefaultSwitch_Ref(__FUNCTION__);
     if (!pSwitchInfo)
     {
-        ok = FALSE;
         goto Cleanup;
     }
 
     pPortsArray = &pSwitchInfo->pForwardInfo->ofPorts;
 
-    pOutPort = (OVS_OFPORT*)FXArray_Find_Ref(pPortsArray, _OFPort_PortNumberEquals, &portNumber);
+    //the of ports array is indexed by port number
+    FXARRAY_LOCK_READ(pPortsArray, &lockState);
+
+    if (portNumber < OVS_MAX_ARRAY_SIZE && pPortsArray->array[portNumber])
+    {
+        pOutPort = OVS_REFCOUNT_REFERENCE((OVS_OFPORT*)pPortsArray->array[portNumber]);
+    }
+
+    FXARRAY_UNLOCK(pPortsArray, &lockState);
 
 Cleanup:
     OVS_REFCOUNT_DEREFERENCE(pSwitchInfo);
@@ -597,6 +706,33 @@ Cleanup:
     return pOutPort;
 }
 
+/******************************** GENERATION ********************************/
+
+LONG OFPort_GetGeneration()
+{
+    return g_ofPortsGeneration;
+}
+
+VOID OFPort_IncrementGeneration()
+{
+    InterlockedIncrement(&g_ofPortsGeneration);
+}
+
+_Use_decl_annotations_
+UINT OFPort_GetUpcallPortId(const OVS_OFPORT* pPort)
+{
+    UINT count = pPort->upcallPortIds.count;
+
+    if (!count)
+    {
+        return 0;
+    }
+
+    //userspace gives one upcall port id per handler: spreading the processors over them, the upcalls of a processor do not
+    //queue behind those of the other processors
+    return pPort->upcallPortIds.ids[KeGetCurrentProcessorNumberEx(NULL) % count];
+}
+
 /******************************** DELETE FUNCTIONS ********************************/
 
 //TODO: if it comes here unreferenced, then it means it might have been deleted, I think
@@ -622,21 +758,18 @@ BOOLEAN OFPort_Delete(OVS_OFPORT* pPort)
     FXARRAY_LOCK_WRITE(pPortsArray, &lockState);
     portsLocked = TRUE;
 
-    if (pPort->ofPortType == OVS_OFPORT_TYPE_GRE)
-    {
-        _RemoveOFPort_Gre(pPort);
-    }
-    else if (pPort->ofPortType == OVS_OFPORT_TYPE_VXLAN)
-    {
-        _RemoveOFPort_Vxlan(pPort);
-    }
-
     ok = FXArray_Remove_Unsafe(pPortsArray, (OVS_FXARRAY_ITEM*)pPort, pPort->ofPortNumber);
     if (!ok)
     {
         goto Cleanup;
     }
 
+    _OFPort_UnindexById_Unsafe(pSwitchInfo->pForwardInfo, pPort);
+    TunnelDemux_Remove(pPort->ofPortNumber);
+    EncapsCache_RemovePort(pPort->ofPortNumber);
+
+    OFPort_IncrementGeneration();
+
     OVS_REFCOUNT_DEREF_AND_DESTROY(pPort);
 
 Cleanup:
@@ -24,13 +24,19 @@ limitations under the License.
 #define OVS_MAX_PORTS                    MAXUINT16
 #define OVS_INVALID_PORT_NUMBER          OVS_MAX_PORTS
 
+#define OVS_TUNNEL_OPTIONS_HAVE_IN_KEY          0x02
+#define OVS_TUNNEL_OPTIONS_HAVE_REMOTE_IP       0x04
 #define OVS_TUNNEL_OPTIONS_HAVE_UDP_DST_PORT    0x80
 
+//buckets of the NDIS_SWITCH_PORT_ID -> of port index; must be a power of 2
+#define OVS_OFPORT_ID_BUCKETS            256
+
 typedef struct _OVS_NIC_LIST_ENTRY OVS_NIC_LIST_ENTRY;
 typedef struct _OVS_PORT_LIST_ENTRY OVS_PORT_LIST_ENTRY;
 
 typedef struct _OVS_TUNNELING_PORT_OPTIONS OVS_TUNNELING_PORT_OPTIONS;
 typedef struct _OVS_SWITCH_INFO OVS_SWITCH_INFO;
+typedef struct _OVS_GLOBAL_FORWARD_INFO OVS_GLOBAL_FORWARD_INFO;
 
 typedef enum
 {
@@ -117,6 +123,9 @@ typedef struct _OVS_OFPORT
 
     //if it's the external port of the switch or not
     BOOLEAN                        isExternal;
+
+    //next port in the same bucket of the port id index. protected by the of ports array lock.
+    struct _OVS_OFPORT*            pNextById;
 }OVS_OFPORT;
 
 #define PORT_LOCK_READ(pPort, pLockState) NdisAcquireRWLockRead(((OVS_FXARRAY_ITEM*)pPort)->pRwLock, pLockState, 0)
@@ -156,22 +165,42 @@ OVS_OFPORT* OFPort_Create_Ref(_In_opt_ const char* portName, _In_opt_ const UINT
 OVS_OFPORT* OFPort_FindByName_Ref(const char* ofPortName);
 OVS_OFPORT* OFPort_FindByNumber_Ref(UINT16 portNumber);
 
-OVS_OFPORT* OFPort_FindById_Unsafe(NDIS_SWITCH_PORT_ID portId);
+//unsafe = you must lock the of ports array; the port is not referenced
+OVS_OFPORT* OFPort_FindById_Unsafe(_In_ const OVS_GLOBAL_FORWARD_INFO* pForwardInfo, NDIS_SWITCH_PORT_ID portId);
 OVS_OFPORT* OFPort_FindById_Ref(NDIS_SWITCH_PORT_ID portId);
 
-BOOLEAN OFPort_Delete(OVS_OFPORT* pOFPort);
+//changes the port id of the port, keeping the port id index consistent
+VOID OFPort_SetPortId(_Inout_ OVS_OFPORT* pPort, NDIS_SWITCH_PORT_ID portId);
+
+//the *OnSwitch_Ref variants look up the port on a switch the caller already holds (e.g. the switch of an NDIS send callback),
+//instead of referencing the default switch for each lookup.
+OVS_OFPORT* OFPort_FindByIdOnSwitch_Ref(_In_ const OVS_SWITCH_INFO* pSwitchInfo, NDIS_SWITCH_PORT_ID portId);
 
 _Ret_maybenull_
-OVS_OFPORT* OFPort_FindExternal_Ref();
+OVS_OFPORT* OFPort_FindExternalOnSwitch_Ref(_In_ const OVS_SWITCH_INFO* pSwitchInfo);
 
 _Ret_maybenull_
-OVS_OFPORT* OFPort_FindInternal_Ref();
+OVS_OFPORT* OFPort_FindInternalOnSwitch_Ref(_In_ const OVS_SWITCH_INFO* pSwitchInfo);
+
+BOOLEAN OFPort_Delete(OVS_OFPORT* pOFPort);
+
+//the generation of the of ports changes each time a port is created, deleted or reconfigured (port id, nic, options).
+//anyone caching OVS_OFPORT references (e.g. the output actions of flows) must drop them when the generation changes.
+LONG OFPort_GetGeneration();
+VOID OFPort_IncrementGeneration();
+
+//the upcall port id for the packets received on the port, on the current processor; 0 if the port has none
+UINT OFPort_GetUpcallPortId(_In_ const OVS_OFPORT* pPort);
 
 _Ret_maybenull_
-OVS_OFPORT* OFPort_FindGre_Ref();
+OVS_OFPORT* OFPort_FindExternal_Ref();
 
 _Ret_maybenull_
-OVS_OFPORT* OFPort_FindVxlan_Ref(LE16 udpDestPort);
+OVS_OFPORT* OFPort_FindInternal_Ref();
+
+//gives the port new tunnel options, and (re)registers it in the tunnel demux table. EXIST: another port already receives on the same key;
+//the port keeps its options and its demux entry. NODEV: the port was deleted. Must not be called with the port locked.
+OVS_ERROR OFPort_SetOptions(_Inout_ OVS_OFPORT* pPort, _In_ const OVS_TUNNELING_PORT_OPTIONS* pOptions);
 
 BOOLEAN OFPort_Initialize();
 VOID OFPort_Uninitialize();
@@ -29,6 +29,8 @@ limitations under the License.
 #include "Icmp6.h"
 #include "Gre.h"
 #include "Checksum.h"
+#include "NbCursor.h"
+#include "SpookyHash.h"
 
 #define OVS_PI_ARG_IN_ARRAY(args, argType) args[OVS_ARG_TOINDEX(argType, PI)]
 
@@ -38,28 +40,12 @@ limitations under the License.
     (pPacketInfo)->tpInfo.destinationPort = (pTpHeader)->destinationPort;           \
 }
 
-#define _OVS_PI_SET_IPV4_TP(Type, pTpHeader, pIpv4Head, pPacketInfo)            \
-Type* pTpHeader = (Type*)AdvanceIpv4Header((pIpv4Header));                      \
-                                                                                \
-OVS_PI_SET_TP((pPacketInfo), (pTpHeader))                                       \
-
-#define OVS_PI_SET_IPV4_TP(Type, pIpv4Head, pPacketInfo)                            \
-{                                                                                   \
-    _OVS_PI_SET_IPV4_TP(Type, pTpHeader, pIpv4Head, pPacketInfo)                    \
-}
-
-#define OVS_PI_SET_IPV6_TP_TCP(pPacketInfo, pTpHeader)                          \
+#define OVS_PI_SET_TP_TCP(pPacketInfo, pTpHeader)                               \
 {                                                                               \
     OVS_PI_SET_TP(pPacketInfo, pTpHeader)                                       \
     (pPacketInfo)->tpInfo.tcpFlags = GetTcpFlags((pTpHeader)->flagsAndOffset);  \
 }
 
-#define OVS_PI_SET_IPV4_TP_TCP(pIpv4Head, pPacketInfo)                              \
-{                                                                                   \
-    _OVS_PI_SET_IPV4_TP(OVS_TCP_HEADER, pTpHeader, pIpv4Head, pPacketInfo)          \
-    (pPacketInfo)->tpInfo.tcpFlags = GetTcpFlags(pTpHeader->flagsAndOffset);        \
-}
-
 /*************************************************/
 
 #define OVS_PI_UPDATE_ELEM_VALUE(pPacketInfo, pPiRange, ElemType, elem, field, value)           \
@@ -192,58 +178,143 @@ static void _UpdateRange(_Inout_ OVS_PI_RANGE* pPiRange, SIZE_T offset, SIZE_T s
     }
 }
 
-static VOID _ExtractIpv4_Icmp(const OVS_IPV4_HEADER* pIpv4Header, OVS_OFPACKET_INFO* pPacketInfo)
+//packet too big and DF is set:
+//if the packet that arrived was encapsulated in GRE (i.e. the packet, encapsulated, was too big for mtu),
+//then we must update the ICMP's nextHopMtu in the packet, to account for the encapsulation bytes overhead
+//(i.e. the protocol driver does not know we intend to encapsulate the packet, when considering the mtu)
+//TODO: we should do similar for VXLAN!
+static VOID _ExtractIpv4_IcmpFragmentationNeeded(_In_ const OVS_NB_CURSOR* pCursor)
 {
-    OVS_ICMP_HEADER* const pIcmpHeader = (OVS_ICMP_HEADER*)AdvanceIpv4Header(pIpv4Header);
+    BYTE scratch[OVS_NB_CURSOR_MAX_HEADER_SIZE];
+    OVS_ICMP_MESSAGE_DEST_UNREACH* pIcmpT3C4 = NULL;
+    UINT16 nextHopMtu = 0;
+    ULONG ipv4Size = 0, icmpHeaderSize = 0, greSize = 0;
 
-    //packet too big and DF is set:
-    //if the packet that arrived was encapsulated in GRE (i.e. the packet, encapsulated, was too big for mtu),
-    //then we must update the ICMP's nextHopMtu in the packet, to account for the encapsulation bytes overhead
-    //(i.e. the protocol driver does not know we intend to encapsulate the packet, when considering the mtu)
-    //TODO: we should do similar for VXLAN!
-    if (pIcmpHeader->type == 3 && pIcmpHeader->code == 4)
+    pIcmpT3C4 = NbCursor_Peek(pCursor, sizeof(OVS_ICMP_MESSAGE_DEST_UNREACH), scratch);
+    if (!pIcmpT3C4 || pIcmpT3C4->ipv4Header.Protocol != OVS_IPPROTO_GRE)
     {
-        OVS_ICMP_MESSAGE_DEST_UNREACH* pIcmpT3C4 = (OVS_ICMP_MESSAGE_DEST_UNREACH*)pIcmpHeader;
+        return;
+    }
 
-        if (pIcmpT3C4->ipv4Header.Protocol == OVS_IPPROTO_GRE)
-        {
-            UINT16 nextHopMtu = pIcmpT3C4->nextHopMtu;
-            nextHopMtu = RtlUshortByteSwap(nextHopMtu);
+    nextHopMtu = RtlUshortByteSwap(pIcmpT3C4->nextHopMtu);
+    if (!nextHopMtu)
+    {
+        return;
+    }
 
-            if (nextHopMtu)
-            {
-                const OVS_GRE_HEADER_2890* pGre = AdvanceIpv4Header(&pIcmpT3C4->ipv4Header);
-                ULONG greSize = Gre_FrameHeaderSize(pGre);
-                OVS_CHECK(greSize <= OVS_MAX_GRE_HEADER_SIZE);
+    //the icmp message carries the ipv4 header of the original datagram + its first 8 bytes (i.e. the GRE header)
+    ipv4Size = pIcmpT3C4->ipv4Header.HeaderLength * sizeof(DWORD);
+    icmpHeaderSize = OVS_ICMP_MESSAGE_DEST_UNREACH_SIZE_BARE + ipv4Size + 8;
+    OVS_CHECK(icmpHeaderSize <= OVS_NB_CURSOR_MAX_HEADER_SIZE);
 
-                if (nextHopMtu > greSize + pIcmpT3C4->ipv4Header.HeaderLength * sizeof(DWORD))
-                {
-                    ULONG icmpHeaderSize;
-                    nextHopMtu -= (UINT16)greSize;
+    pIcmpT3C4 = NbCursor_Peek(pCursor, icmpHeaderSize, scratch);
+    if (!pIcmpT3C4)
+    {
+        return;
+    }
 
-                    pIcmpT3C4->nextHopMtu = RtlUshortByteSwap(nextHopMtu);
+    greSize = Gre_FrameHeaderSize(AdvanceIpv4Header(&pIcmpT3C4->ipv4Header));
+    OVS_CHECK(greSize <= OVS_MAX_GRE_HEADER_SIZE);
 
-                    icmpHeaderSize = OVS_ICMP_MESSAGE_DEST_UNREACH_SIZE_BARE + pIcmpT3C4->ipv4Header.HeaderLength * sizeof(DWORD)+8;
-                    pIcmpT3C4->header.checksum = (UINT16)ComputeIpChecksum((BYTE*)pIcmpT3C4, icmpHeaderSize);
-                    pIcmpT3C4->header.checksum = RtlUshortByteSwap(pIcmpT3C4->header.checksum);
-                }
-            }
-        }
+    if (nextHopMtu > greSize + ipv4Size)
+    {
+        nextHopMtu -= (UINT16)greSize;
+
+        pIcmpT3C4->nextHopMtu = RtlUshortByteSwap(nextHopMtu);
+
+        pIcmpT3C4->header.checksum = 0;
+        pIcmpT3C4->header.checksum = (UINT16)ComputeIpChecksum((BYTE*)pIcmpT3C4, icmpHeaderSize);
+        pIcmpT3C4->header.checksum = RtlUshortByteSwap(pIcmpT3C4->header.checksum);
+
+        //if the icmp header straddled an mdl boundary, we have modified a copy
+        NbCursor_Write(pCursor, pIcmpT3C4, icmpHeaderSize);
+    }
+}
+
+//fixupFrame: FALSE for a packet that was extracted before (e.g. recirculated): its frame is not modified again
+static VOID _ExtractIpv4_Icmp(_In_ const OVS_NB_CURSOR* pCursor, BOOLEAN fixupFrame, OVS_OFPACKET_INFO* pPacketInfo)
+{
+    OVS_ICMP_HEADER icmpScratch = { 0 };
+    const OVS_ICMP_HEADER* pIcmpHeader = NULL;
+    UINT8 type = 0, code = 0;
+
+    pIcmpHeader = NbCursor_Peek(pCursor, sizeof(OVS_ICMP_HEADER), &icmpScratch);
+    if (!pIcmpHeader)
+    {
+        return;
+    }
+
+    type = pIcmpHeader->type;
+    code = pIcmpHeader->code;
+
+    if (type == 3 && code == 4 && fixupFrame)
+    {
+        _ExtractIpv4_IcmpFragmentationNeeded(pCursor);
     }
 
     //turn each byte as word & turn to BE
-    pPacketInfo->tpInfo.sourcePort = RtlUshortByteSwap(pIcmpHeader->type);
-    pPacketInfo->tpInfo.destinationPort = RtlUshortByteSwap(pIcmpHeader->code);
+    pPacketInfo->tpInfo.sourcePort = RtlUshortByteSwap(type);
+    pPacketInfo->tpInfo.destinationPort = RtlUshortByteSwap(code);
 }
 
-static BOOLEAN _ExtractIpv4(VOID* pNbBuffer, _Inout_ OVS_OFPACKET_INFO* pPacketInfo)
+//TCP, UDP and SCTP: the protocol numbers are the same for ipv4 and ipv6
+static VOID _ExtractTransportPorts(_In_ const OVS_NB_CURSOR* pCursor, UINT8 protocol, _Inout_ OVS_OFPACKET_INFO* pPacketInfo)
 {
-    OVS_ETHERNET_HEADER* pEthHeader = (OVS_ETHERNET_HEADER*)pNbBuffer;
-    //assuming ipv4 is ok (in length, that is not corrupted, etc.)
+    OVS_TCP_HEADER tcpScratch = { 0 };
+    OVS_UDP_HEADER udpScratch = { 0 };
+    OVS_SCTP_HEADER sctpScratch = { 0 };
+    const OVS_TCP_HEADER* pTcpHeader = NULL;
+    const OVS_UDP_HEADER* pUdpHeader = NULL;
+    const OVS_SCTP_HEADER* pSctpHeader = NULL;
+
+    switch (protocol)
+    {
+    case OVS_IPPROTO_TCP:
+        pTcpHeader = NbCursor_Peek(pCursor, sizeof(OVS_TCP_HEADER), &tcpScratch);
+        if (pTcpHeader)
+        {
+            OVS_PI_SET_TP_TCP(pPacketInfo, pTcpHeader);
+        }
+        break;
+
+    case OVS_IPPROTO_UDP:
+        pUdpHeader = NbCursor_Peek(pCursor, sizeof(OVS_UDP_HEADER), &udpScratch);
+        if (pUdpHeader)
+        {
+            OVS_PI_SET_TP(pPacketInfo, pUdpHeader);
+        }
+        break;
+
+    case OVS_IPPROTO_SCTP:
+        pSctpHeader = NbCursor_Peek(pCursor, sizeof(OVS_SCTP_HEADER), &sctpScratch);
+        if (pSctpHeader)
+        {
+            OVS_PI_SET_TP(pPacketInfo, pSctpHeader);
+        }
+        break;
+    }
+}
+
+static BOOLEAN _ExtractIpv4(_Inout_ OVS_NB_CURSOR* pCursor, BOOLEAN fixupFrame, _Inout_ OVS_OFPACKET_INFO* pPacketInfo)
+{
+    OVS_IPV4_HEADER ipv4Scratch = { 0 };
     const OVS_IPV4_HEADER* pIpv4Header = NULL;
+    ULONG ipv4Size = 0;
     UINT16 offset = 0;
 
-    pIpv4Header = ReadIpv4Header(pEthHeader);
+    pIpv4Header = NbCursor_Peek(pCursor, sizeof(OVS_IPV4_HEADER), &ipv4Scratch);
+    if (!pIpv4Header)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " frame too small for the ipv4 header\n");
+        return FALSE;
+    }
+
+    ipv4Size = pIpv4Header->HeaderLength * sizeof(DWORD);
+    if (ipv4Size < sizeof(OVS_IPV4_HEADER))
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " invalid ipv4 IHL: %u\n", pIpv4Header->HeaderLength);
+        return FALSE;
+    }
 
     pPacketInfo->netProto.ipv4Info.source = pIpv4Header->SourceAddress;
     pPacketInfo->netProto.ipv4Info.destination = pIpv4Header->DestinationAddress;
@@ -264,123 +335,134 @@ static BOOLEAN _ExtractIpv4(VOID* pNbBuffer, _Inout_ OVS_OFPACKET_INFO* pPacketI
         pPacketInfo->ipInfo.fragment = OVS_FRAGMENT_TYPE_FIRST_FRAG;
     }
 
+    //a truncated transport header is not an error: the transport fields simply remain 0
+    if (!NbCursor_Advance(pCursor, ipv4Size))
+    {
+        return TRUE;
+    }
+
     switch (pPacketInfo->ipInfo.protocol)
     {
     case OVS_IPPROTO_TCP:
-        OVS_PI_SET_IPV4_TP_TCP(pIpv4Header, pPacketInfo);
-        break;
-
     case OVS_IPPROTO_UDP:
-        OVS_PI_SET_IPV4_TP(OVS_UDP_HEADER, pIpv4Header, pPacketInfo);
-        break;
-
     case OVS_IPPROTO_SCTP:
-        OVS_PI_SET_IPV4_TP(OVS_SCTP_HEADER, pIpv4Header, pPacketInfo);
+        _ExtractTransportPorts(pCursor, pPacketInfo->ipInfo.protocol, pPacketInfo);
         break;
 
     case OVS_IPPROTO_ICMP:
-        _ExtractIpv4_Icmp(pIpv4Header, pPacketInfo);
+        _ExtractIpv4_Icmp(pCursor, fixupFrame, pPacketInfo);
         break;
     }
 
     return TRUE;
 }
 
-static VOID _ExtractIcmp6_NeighborSolicitation(OVS_ICMP_HEADER* pIcmpHeader, OVS_OFPACKET_INFO* pPacketInfo, ULONG icmpLen)
+//looks through the neighbor discovery options, which follow the ND message, for the link address option
+static VOID _ExtractIcmp6_LinkAddressOption(_Inout_ OVS_NB_CURSOR* pCursor, BYTE optionType, _Out_writes_(OVS_ETHERNET_ADDRESS_LENGTH) UINT8* pMacAddress)
 {
-    OVS_ICMP6_ND_OPTION* pOption = NULL;
-    OVS_ICMP6_NEIGHBOR_SOLICITATION* pNS = (OVS_ICMP6_NEIGHBOR_SOLICITATION*)pIcmpHeader;
-    BOOLEAN haveSourceMac = FALSE;
-    UINT optionLen = 0;
-
-    pPacketInfo->netProto.ipv6Info.neighborDiscovery.ndTargetIp = pNS->targetIp;
-    pOption = (OVS_ICMP6_ND_OPTION*)((BYTE*)pNS + sizeof(OVS_ICMP6_NEIGHBOR_SOLICITATION));
-
-    icmpLen -= sizeof(OVS_ICMP6_NEIGHBOR_SOLICITATION);
-    while (icmpLen > 0)
+    while (NbCursor_BytesLeft(pCursor) >= sizeof(OVS_ICMP6_ND_OPTION_LINK_ADDRESS))
     {
-        OVS_CHECK(icmpLen >= 8);
+        OVS_ICMP6_ND_OPTION_LINK_ADDRESS optionScratch = { 0 };
+        const OVS_ICMP6_ND_OPTION_LINK_ADDRESS* pOption = NULL;
+        ULONG optionLen = 0;
 
-        if (pOption->type == OVS_ICMP6_ND_OPTION_SOURCE_LINK_ADDRESS)
+        pOption = NbCursor_Peek(pCursor, sizeof(OVS_ICMP6_ND_OPTION_LINK_ADDRESS), &optionScratch);
+        if (!pOption)
         {
-            haveSourceMac = TRUE;
+            return;
+        }
 
-            OVS_ICMP6_ND_OPTION_LINK_ADDRESS* pLinkAddrOption = (OVS_ICMP6_ND_OPTION_LINK_ADDRESS*)pOption;
-            RtlCopyMemory(pPacketInfo->netProto.ipv6Info.neighborDiscovery.ndSourceMac, pLinkAddrOption->macAddress, OVS_ETHERNET_ADDRESS_LENGTH);
-            break;
+        if (pOption->type == optionType)
+        {
+            RtlCopyMemory(pMacAddress, pOption->macAddress, OVS_ETHERNET_ADDRESS_LENGTH);
+            return;
         }
 
+        //the option length is in units of 8 bytes. A 0 length option is invalid.
         optionLen = pOption->length * 8;
-        icmpLen -= optionLen;
-        pOption = (OVS_ICMP6_ND_OPTION*)((BYTE*)pOption + optionLen);
+        if (!optionLen || !NbCursor_Advance(pCursor, optionLen))
+        {
+            return;
+        }
     }
 }
 
-static VOID _ExtractIcmp6_NeighborAdvertisment(OVS_ICMP_HEADER* pIcmpHeader, OVS_OFPACKET_INFO* pPacketInfo, ULONG icmpLen)
+static VOID _ExtractIcmp6_NeighborSolicitation(_Inout_ OVS_NB_CURSOR* pCursor, OVS_OFPACKET_INFO* pPacketInfo)
 {
-    OVS_ICMP6_ND_OPTION* pOption = NULL;
-    OVS_ICMP6_NEIGHBOR_ADVERTISMENT* pNA = (OVS_ICMP6_NEIGHBOR_ADVERTISMENT*)pIcmpHeader;
-    BOOLEAN haveTargetMac = FALSE;
-    UINT optionLen = 0;
+    OVS_ICMP6_NEIGHBOR_SOLICITATION nsScratch = { 0 };
+    const OVS_ICMP6_NEIGHBOR_SOLICITATION* pNS = NULL;
 
-    pPacketInfo->netProto.ipv6Info.neighborDiscovery.ndTargetIp = pNA->targetIp;
-    pOption = (OVS_ICMP6_ND_OPTION*)((BYTE*)pNA + sizeof(OVS_ICMP6_NEIGHBOR_ADVERTISMENT));
-
-    icmpLen -= sizeof(OVS_ICMP6_NEIGHBOR_ADVERTISMENT);
-    while (icmpLen > 0)
+    pNS = NbCursor_Pull(pCursor, sizeof(OVS_ICMP6_NEIGHBOR_SOLICITATION), &nsScratch);
+    if (!pNS)
     {
-        OVS_CHECK(icmpLen >= 8);
+        return;
+    }
 
-        if (pOption->type == OVS_ICMP6_ND_OPTION_TARGET_LINK_ADDRESS)
-        {
-            haveTargetMac = TRUE;
+    pPacketInfo->netProto.ipv6Info.neighborDiscovery.ndTargetIp = pNS->targetIp;
 
-            OVS_ICMP6_ND_OPTION_LINK_ADDRESS* pLinkAddrOption = (OVS_ICMP6_ND_OPTION_LINK_ADDRESS*)pOption;
-            RtlCopyMemory(pPacketInfo->netProto.ipv6Info.neighborDiscovery.ndTargetMac, pLinkAddrOption->macAddress, OVS_ETHERNET_ADDRESS_LENGTH);
-            break;
-        }
+    _ExtractIcmp6_LinkAddressOption(pCursor, OVS_ICMP6_ND_OPTION_SOURCE_LINK_ADDRESS, pPacketInfo->netProto.ipv6Info.neighborDiscovery.ndSourceMac);
+}
 
-        optionLen = pOption->length * 8;
-        icmpLen -= optionLen;
-        pOption = (OVS_ICMP6_ND_OPTION*)((BYTE*)pOption + optionLen);
+static VOID _ExtractIcmp6_NeighborAdvertisment(_Inout_ OVS_NB_CURSOR* pCursor, OVS_OFPACKET_INFO* pPacketInfo)
+{
+    OVS_ICMP6_NEIGHBOR_ADVERTISMENT naScratch = { 0 };
+    const OVS_ICMP6_NEIGHBOR_ADVERTISMENT* pNA = NULL;
+
+    pNA = NbCursor_Pull(pCursor, sizeof(OVS_ICMP6_NEIGHBOR_ADVERTISMENT), &naScratch);
+    if (!pNA)
+    {
+        return;
     }
+
+    pPacketInfo->netProto.ipv6Info.neighborDiscovery.ndTargetIp = pNA->targetIp;
+
+    _ExtractIcmp6_LinkAddressOption(pCursor, OVS_ICMP6_ND_OPTION_TARGET_LINK_ADDRESS, pPacketInfo->netProto.ipv6Info.neighborDiscovery.ndTargetMac);
 }
 
-static VOID _ExtractIcmp6(VOID* pNbBuffer, ULONG nbLen, OVS_ICMP_HEADER* pIcmpHeader, _Inout_ OVS_OFPACKET_INFO* pPacketInfo)
+static VOID _ExtractIcmp6(_Inout_ OVS_NB_CURSOR* pCursor, _Inout_ OVS_OFPACKET_INFO* pPacketInfo)
 {
-    if (pIcmpHeader->code == 0)
+    OVS_ICMP_HEADER icmpScratch = { 0 };
+    const OVS_ICMP_HEADER* pIcmpHeader = NULL;
+    UINT8 type = 0, code = 0;
+
+    pIcmpHeader = NbCursor_Peek(pCursor, sizeof(OVS_ICMP_HEADER), &icmpScratch);
+    if (!pIcmpHeader)
     {
-        if (pIcmpHeader->type == OVS_ICMP6_ND_NEIGHBOR_ADVERTISMENT ||
-            pIcmpHeader->type == OVS_ICMP6_ND_NEIGHBOR_SOLICITATION)
-        {
-            ULONG offset = (ULONG)((BYTE*)pIcmpHeader - (BYTE*)pNbBuffer);
-            ULONG icmpLen = nbLen - offset;
+        return;
+    }
 
-            if (pIcmpHeader->type == OVS_ICMP6_ND_NEIGHBOR_SOLICITATION)
-            {
-                _ExtractIcmp6_NeighborSolicitation(pIcmpHeader, pPacketInfo, icmpLen);
-            }
-            else if (pIcmpHeader->type == OVS_ICMP6_ND_NEIGHBOR_ADVERTISMENT)
-            {
-                _ExtractIcmp6_NeighborAdvertisment(pIcmpHeader, pPacketInfo, icmpLen);
-            }
+    type = pIcmpHeader->type;
+    code = pIcmpHeader->code;
+
+    if (code == 0)
+    {
+        if (type == OVS_ICMP6_ND_NEIGHBOR_SOLICITATION)
+        {
+            _ExtractIcmp6_NeighborSolicitation(pCursor, pPacketInfo);
+        }
+        else if (type == OVS_ICMP6_ND_NEIGHBOR_ADVERTISMENT)
+        {
+            _ExtractIcmp6_NeighborAdvertisment(pCursor, pPacketInfo);
         }
     }
 
     //turn each byte as word & turn to BE
-    pPacketInfo->tpInfo.sourcePort = RtlUshortByteSwap(pIcmpHeader->type);
-    pPacketInfo->tpInfo.destinationPort = RtlUshortByteSwap(pIcmpHeader->code);
+    pPacketInfo->tpInfo.sourcePort = RtlUshortByteSwap(type);
+    pPacketInfo->tpInfo.destinationPort = RtlUshortByteSwap(code);
 }
 
-static BOOLEAN _ExtractIpv6(VOID* pNbBuffer, ULONG nbLen, _Inout_ OVS_OFPACKET_INFO* pPacketInfo)
+static BOOLEAN _ExtractIpv6(_Inout_ OVS_NB_CURSOR* pCursor, _Inout_ OVS_OFPACKET_INFO* pPacketInfo)
 {
-    OVS_ETHERNET_HEADER* pEthHeader = (OVS_ETHERNET_HEADER*)pNbBuffer;
-
-    OVS_IPV6_HEADER* pIpv6Header = NULL;
+    OVS_IPV6_HEADER ipv6Scratch = { 0 };
+    const OVS_IPV6_HEADER* pIpv6Header = NULL;
     BYTE extensionType = 0;
-    VOID* buffer = NULL;
 
-    pIpv6Header = ReadIpv6Header(pEthHeader);
+    pIpv6Header = NbCursor_Pull(pCursor, sizeof(OVS_IPV6_HEADER), &ipv6Scratch);
+    if (!pIpv6Header)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " frame too small for the ipv6 header\n");
+        return FALSE;
+    }
 
     pPacketInfo->netProto.ipv6Info.source = pIpv6Header->sourceAddress;
     pPacketInfo->netProto.ipv6Info.destination = pIpv6Header->destinationAddress;
@@ -390,16 +472,28 @@ static BOOLEAN _ExtractIpv6(VOID* pNbBuffer, ULONG nbLen, _Inout_ OVS_OFPACKET_I
     pPacketInfo->ipInfo.typeOfService = (UINT8)GetIpv6TrafficClass(pIpv6Header->vcf);
     pPacketInfo->ipInfo.timeToLive = pIpv6Header->hopLimit;
 
-    buffer = GetFirstIpv6Extension(pIpv6Header, &extensionType);
-    while (IsIpv6Extension(extensionType))
+    extensionType = pIpv6Header->nextHeader;
+
+    while (IsIpv6Extension(extensionType) && extensionType != OVS_IPV6_EXTH_NONE)
     {
+        //all extension headers are at least 8 bytes long, and start with the 'next header' byte
+        BYTE extensionScratch[8] = { 0 };
+        const BYTE* pExtension = NULL;
+        ULONG extensionSize = 0;
+
+        pExtension = NbCursor_Peek(pCursor, sizeof(extensionScratch), extensionScratch);
+        if (!pExtension)
+        {
+            return TRUE;
+        }
+
         if (extensionType == OVS_IPV6_EXTH_FRAGMENTATION)
         {
             UINT16 fragOff = 0;
             // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
             //| Next Header | Reserved | Fragment Offset | Res | M |
             // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-            OVS_IPV6_FRAGMENT_HEADER* pFragmentHeader = (OVS_IPV6_FRAGMENT_HEADER*)buffer;
+            OVS_IPV6_FRAGMENT_HEADER* pFragmentHeader = (OVS_IPV6_FRAGMENT_HEADER*)pExtension;
 
             fragOff = GetIpv6FragmentHeader_Offset(pFragmentHeader);
             if (fragOff == 0)
@@ -422,39 +516,56 @@ static BOOLEAN _ExtractIpv6(VOID* pNbBuffer, ULONG nbLen, _Inout_ OVS_OFPACKET_I
                 //so we must return now.
                 return TRUE;
             }
+
+            extensionSize = sizeof(OVS_IPV6_FRAGMENT_HEADER);
+        }
+        else if (extensionType == OVS_IPV6_EXTH_AH)
+        {
+            //the AH length is in 4-byte units, not counting the first 2 units
+            extensionSize = (pExtension[1] + 2) * 4;
+        }
+        else
+        {
+            //the length is in 8-byte units, not counting the first 8 bytes
+            extensionSize = (pExtension[1] + 1) * 8;
         }
 
-        buffer = GetNextIpv6Extension(buffer, &extensionType);
-    }
+        extensionType = pExtension[0];
 
+        if (!NbCursor_Advance(pCursor, extensionSize))
+        {
+            return TRUE;
+        }
+    }
 
     pPacketInfo->ipInfo.protocol = extensionType;
 
     switch (extensionType)
     {
     case OVS_IPV6_EXTH_TCP:
-        OVS_PI_SET_IPV6_TP_TCP(pPacketInfo, (OVS_TCP_HEADER*)buffer);
-        break;
-
     case OVS_IPV6_EXTH_UDP:
-        OVS_PI_SET_TP(pPacketInfo, (OVS_TCP_HEADER*)buffer);
-        break;
-
     case OVS_IPV6_EXTH_SCTP:
-        OVS_PI_SET_TP(pPacketInfo, (OVS_TCP_HEADER*)buffer);
+        _ExtractTransportPorts(pCursor, extensionType, pPacketInfo);
         break;
 
     case OVS_IPV6_EXTH_ICMP6:
-        _ExtractIcmp6(pNbBuffer, nbLen, buffer, pPacketInfo);
+        _ExtractIcmp6(pCursor, pPacketInfo);
         break;
     }
 
     return TRUE;
 }
 
-static VOID _ExtractArp(OVS_ETHERNET_HEADER* pEthHeader, OVS_OFPACKET_INFO* pPacketInfo)
+static VOID _ExtractArp(_In_ const OVS_NB_CURSOR* pCursor, OVS_OFPACKET_INFO* pPacketInfo)
 {
-    OVS_ARP_HEADER* pArp = GetArpHeader(pEthHeader);
+    OVS_ARP_HEADER arpScratch = { 0 };
+    OVS_ARP_HEADER* pArp = NULL;
+
+    pArp = NbCursor_Peek(pCursor, sizeof(OVS_ARP_HEADER), &arpScratch);
+    if (!pArp)
+    {
+        return;
+    }
 
     if (pArp->hardwareType == RtlUshortByteSwap(OVS_ARP_HARDWARE_TYPE_ETHERNET) &&
         pArp->protocolType == RtlUshortByteSwap(OVS_ETHERTYPE_IPV4) &&
@@ -477,10 +588,12 @@ static VOID _ExtractArp(OVS_ETHERNET_HEADER* pEthHeader, OVS_OFPACKET_INFO* pPac
     }
 }
 
-BOOLEAN PacketInfo_Extract(_In_ VOID* pNbBuffer, ULONG nbLen, UINT16 ofSourcePort, _Out_ OVS_OFPACKET_INFO* pPacketInfo)
+static BOOLEAN _PacketInfo_ExtractFromCursor(_Inout_ OVS_NB_CURSOR* pCursor, UINT16 ofSourcePort, BOOLEAN fixupFrame,
+    _Out_ OVS_OFPACKET_INFO* pPacketInfo)
 {
-    OVS_ETHERNET_HEADER* pEthHeader = NULL;
-    OVS_ETHERNET_HEADER_TAGGED* pEthHeaderTagged = NULL;
+    OVS_ETHERNET_HEADER_TAGGED ethScratch = { 0 };
+    const OVS_ETHERNET_HEADER* pEthHeader = NULL;
+    const OVS_ETHERNET_HEADER_TAGGED* pEthHeaderTagged = NULL;
 
     OVS_CHECK(pPacketInfo);
     RtlZeroMemory(pPacketInfo, sizeof(OVS_OFPACKET_INFO));
@@ -490,34 +603,50 @@ BOOLEAN PacketInfo_Extract(_In_ VOID* pNbBuffer, ULONG nbLen, UINT16 ofSourcePor
     pPacketInfo->physical.ofInPort = ofSourcePort;
 
     //I. LINK LAYER
-    pEthHeader = (OVS_ETHERNET_HEADER*)pNbBuffer;
+    pEthHeader = NbCursor_Peek(pCursor, sizeof(OVS_ETHERNET_HEADER), &ethScratch);
+    if (!pEthHeader)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " frame too small for the ethernet header\n");
+        return FALSE;
+    }
+
     RtlCopyMemory(pPacketInfo->ethInfo.source, pEthHeader->source_addr, OVS_ETHERNET_ADDRESS_LENGTH);
     RtlCopyMemory(pPacketInfo->ethInfo.destination, pEthHeader->destination_addr, OVS_ETHERNET_ADDRESS_LENGTH);
 
     //vlan
     if (RtlUshortByteSwap(pEthHeader->type) == OVS_ETHERTYPE_QTAG)
     {
-        pEthHeaderTagged = (OVS_ETHERNET_HEADER_TAGGED*)pEthHeader;
-        pPacketInfo->ethInfo.tci = pEthHeaderTagged->tci;
+        pEthHeaderTagged = NbCursor_Pull(pCursor, sizeof(OVS_ETHERNET_HEADER_TAGGED), &ethScratch);
+        if (!pEthHeaderTagged)
+        {
+            DEBUGP(LOG_ERROR, __FUNCTION__ " frame too small for the tagged ethernet header\n");
+            return FALSE;
+        }
 
+        pPacketInfo->ethInfo.tci = pEthHeaderTagged->tci;
         OVS_CHECK(RtlUshortByteSwap(pPacketInfo->ethInfo.tci) & OVS_VLAN_TAG_PRESENT);
-        pEthHeader = (OVS_ETHERNET_HEADER*)((BYTE*)pEthHeader + OVS_ETHERNET_VLAN_LEN);
+
+        //TODO: we don't support 802.2 frames (LLC). We may need to support them, in the future.
+        //The NDIS filter part only cares about the 802.3 frames (ATM)
+        pPacketInfo->ethInfo.type = pEthHeaderTagged->clientType;
     }
+    else
+    {
+        pPacketInfo->ethInfo.type = pEthHeader->type;
 
-    //TODO: we don't support 802.2 frames (LLC). We may need to support them, in the future.
-    //The NDIS filter part only cares about the 802.3 frames (ATM)
-    pPacketInfo->ethInfo.type = pEthHeader->type;
+        NbCursor_Advance(pCursor, sizeof(OVS_ETHERNET_HEADER));
+    }
 
     switch (RtlUshortByteSwap(pPacketInfo->ethInfo.type))
     {
     case OVS_ETHERTYPE_IPV4:
-        return _ExtractIpv4(pNbBuffer, pPacketInfo);
+        return _ExtractIpv4(pCursor, fixupFrame, pPacketInfo);
 
     case OVS_ETHERTYPE_IPV6:
-        return _ExtractIpv6(pNbBuffer, nbLen, pPacketInfo);
+        return _ExtractIpv6(pCursor, pPacketInfo);
 
     case OVS_ETHERTYPE_ARP:
-        _ExtractArp(pEthHeader, pPacketInfo);
+        _ExtractArp(pCursor, pPacketInfo);
         break;
 
     default:
@@ -527,6 +656,95 @@ BOOLEAN PacketInfo_Extract(_In_ VOID* pNbBuffer, ULONG nbLen, UINT16 ofSourcePor
     return TRUE;
 }
 
+BOOLEAN PacketInfo_Extract(_In_ VOID* pNbBuffer, ULONG nbLen, UINT16 ofSourcePort, _Out_ OVS_OFPACKET_INFO* pPacketInfo)
+{
+    OVS_NB_CURSOR cursor = { 0 };
+
+    NbCursor_InitFromBuffer(&cursor, pNbBuffer, nbLen);
+
+    return _PacketInfo_ExtractFromCursor(&cursor, ofSourcePort, /*fixupFrame*/ TRUE, pPacketInfo);
+}
+
+BOOLEAN PacketInfo_ExtractFromNb(_In_ NET_BUFFER* pNb, UINT16 ofSourcePort, _Out_ OVS_OFPACKET_INFO* pPacketInfo)
+{
+    OVS_NB_CURSOR cursor = { 0 };
+
+    if (!NbCursor_InitFromNb(&cursor, pNb))
+    {
+        RtlZeroMemory(pPacketInfo, sizeof(OVS_OFPACKET_INFO));
+        return FALSE;
+    }
+
+    return _PacketInfo_ExtractFromCursor(&cursor, ofSourcePort, /*fixupFrame*/ TRUE, pPacketInfo);
+}
+
+BOOLEAN PacketInfo_ReextractFromNb(_In_ NET_BUFFER* pNb, UINT16 ofSourcePort, _Out_ OVS_OFPACKET_INFO* pPacketInfo)
+{
+    OVS_NB_CURSOR cursor = { 0 };
+
+    if (!NbCursor_InitFromNb(&cursor, pNb))
+    {
+        RtlZeroMemory(pPacketInfo, sizeof(OVS_OFPACKET_INFO));
+        return FALSE;
+    }
+
+    return _PacketInfo_ExtractFromCursor(&cursor, ofSourcePort, /*fixupFrame*/ FALSE, pPacketInfo);
+}
+
+//the addresses, protocol and ports of a packet: see PacketInfo_HashTransport
+typedef struct _OVS_PI_TRANSPORT_HASH_KEY
+{
+    BYTE    source[sizeof(IN6_ADDR)];
+    BYTE    destination[sizeof(IN6_ADDR)];
+    BE16    sourcePort;
+    BE16    destinationPort;
+    BE16    ethType;
+    UINT8   protocol;
+    UINT8   padding;
+}OVS_PI_TRANSPORT_HASH_KEY, *POVS_PI_TRANSPORT_HASH_KEY;
+
+_Use_decl_annotations_
+UINT32 PacketInfo_HashTransport(const OVS_OFPACKET_INFO* pPacketInfo, UINT32 basis)
+{
+    OVS_PI_TRANSPORT_HASH_KEY key;
+    UINT16 ethType = 0;
+
+    RtlZeroMemory(&key, sizeof(OVS_PI_TRANSPORT_HASH_KEY));
+
+    key.ethType = pPacketInfo->ethInfo.type;
+    ethType = RtlUshortByteSwap(pPacketInfo->ethInfo.type);
+
+    if (ethType == OVS_ETHERTYPE_IPV4)
+    {
+        RtlCopyMemory(key.source, &pPacketInfo->netProto.ipv4Info.source, sizeof(IN_ADDR));
+        RtlCopyMemory(key.destination, &pPacketInfo->netProto.ipv4Info.destination, sizeof(IN_ADDR));
+    }
+    else if (ethType == OVS_ETHERTYPE_IPV6)
+    {
+        RtlCopyMemory(key.source, &pPacketInfo->netProto.ipv6Info.source, sizeof(IN6_ADDR));
+        RtlCopyMemory(key.destination, &pPacketInfo->netProto.ipv6Info.destination, sizeof(IN6_ADDR));
+    }
+    else
+    {
+        RtlCopyMemory(key.source, pPacketInfo->ethInfo.source, OVS_ETHERNET_ADDRESS_LENGTH);
+        RtlCopyMemory(key.destination, pPacketInfo->ethInfo.destination, OVS_ETHERNET_ADDRESS_LENGTH);
+    }
+
+    if (ethType == OVS_ETHERTYPE_IPV4 || ethType == OVS_ETHERTYPE_IPV6)
+    {
+        key.protocol = pPacketInfo->ipInfo.protocol;
+
+        //only the first fragment has the ports: all the fragments of a packet must take the same path
+        if (pPacketInfo->ipInfo.fragment == OVS_FRAGMENT_TYPE_NOT_FRAG)
+        {
+            key.sourcePort = pPacketInfo->tpInfo.sourcePort;
+            key.destinationPort = pPacketInfo->tpInfo.destinationPort;
+        }
+    }
+
+    return Spooky_Hash32(&key, sizeof(OVS_PI_TRANSPORT_HASH_KEY), basis);
+}
+
 static BOOLEAN _PIFromArg_Tunnel(const OVS_ARGUMENT_GROUP* pArgs, _Inout_ OVS_OFPACKET_INFO* pPacketInfo, _Inout_ OVS_PI_RANGE* pPiRange, BOOLEAN isMask)
 {
     BOOLEAN haveTtl = FALSE;
@@ -271,6 +271,14 @@ BOOLEAN GetPacketInfoFromArguments(_Inout_ OVS_OFPACKET_INFO* pPacketInfo, _Inou
 VOID ApplyMaskToPacketInfo(_Inout_ OVS_OFPACKET_INFO* pDestinationPI, _In_ const OVS_OFPACKET_INFO* pSourcePI, _In_ const OVS_FLOW_MASK* pMask);
 
 BOOLEAN PacketInfo_Extract(_In_ VOID* pNbBuffer, ULONG nbLen, UINT16 ofSourcePort, _Out_ OVS_OFPACKET_INFO* pPacketInfo);
+//extracts the packet info directly from the NET_BUFFER: the frame may be spread over any number of MDLs
+BOOLEAN PacketInfo_ExtractFromNb(_In_ NET_BUFFER* pNb, UINT16 ofSourcePort, _Out_ OVS_OFPACKET_INFO* pPacketInfo);
+//for a packet whose info was extracted before (e.g. recirculated): only reads the frame, which may be shared with other packets.
+//the fixups done at the first extraction (the ICMP 'fragmentation needed' mtu) are not applied again.
+BOOLEAN PacketInfo_ReextractFromNb(_In_ NET_BUFFER* pNb, UINT16 ofSourcePort, _Out_ OVS_OFPACKET_INFO* pPacketInfo);
+//the hash of the addresses, the protocol and (if not a fragment) the ports: the packets of a transport connection have the same hash.
+//used by the hash action, and for the flow entropy of encapsulated packets
+UINT32 PacketInfo_HashTransport(_In_ const OVS_OFPACKET_INFO* pPacketInfo, UINT32 basis);
 BOOLEAN PacketInfo_Equal(const OVS_OFPACKET_INFO* pLhs, const OVS_OFPACKET_INFO* pRhs, SIZE_T endRange);
 BOOLEAN PacketInfo_EqualAtRange(const OVS_OFPACKET_INFO* pLhsPI, const OVS_OFPACKET_INFO* pRhsPI, SIZE_T startRange, SIZE_T endRange);
 
@@ -0,0 +1,317 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "precomp.h"
+#include "TunnelDemux.h"
+#include "OFPort.h"
+#include "SeqTable.h"
+
+//the wildcarding of a port key: which of the optional fields it matches on
+#define OVS_TUNNEL_DEMUX_CLASS_KEY      0x1
+#define OVS_TUNNEL_DEMUX_CLASS_IP       0x2
+#define OVS_TUNNEL_DEMUX_CLASSES        4
+
+typedef struct _OVS_TUNNEL_DEMUX_ENTRY
+{
+    //odd while a writer updates the entry: readers retry
+    volatile LONG           sequence;
+
+    OVS_TUNNEL_DEMUX_KEY    key;
+    //OVS_INVALID_PORT_NUMBER = free entry
+    UINT16                  ofPortNumber;
+}OVS_TUNNEL_DEMUX_ENTRY, *POVS_TUNNEL_DEMUX_ENTRY;
+
+typedef struct _OVS_TUNNEL_DEMUX_TABLE
+{
+    //serializes the writers; readers never take it
+    NDIS_SPIN_LOCK          lock;
+
+    //number of port keys of each class: the lookup probes only the classes in use
+    volatile LONG           countByClass[OVS_TUNNEL_DEMUX_CLASSES];
+
+    OVS_TUNNEL_DEMUX_ENTRY  entries[OVS_TUNNEL_DEMUX_BUCKETS][OVS_TUNNEL_DEMUX_WAYS];
+}OVS_TUNNEL_DEMUX_TABLE, *POVS_TUNNEL_DEMUX_TABLE;
+
+static OVS_TUNNEL_DEMUX_TABLE g_tunnelDemux;
+
+//most specific first
+static const ULONG s_demuxClassOrder[OVS_TUNNEL_DEMUX_CLASSES] =
+{
+    OVS_TUNNEL_DEMUX_CLASS_KEY | OVS_TUNNEL_DEMUX_CLASS_IP,
+    OVS_TUNNEL_DEMUX_CLASS_KEY,
+    OVS_TUNNEL_DEMUX_CLASS_IP,
+    0
+};
+
+static __inline ULONG _TunnelDemux_GetClass(_In_ const OVS_TUNNEL_DEMUX_KEY* pKey)
+{
+    return (pKey->haveKey ? OVS_TUNNEL_DEMUX_CLASS_KEY : 0) | (pKey->remoteIpv4 ? OVS_TUNNEL_DEMUX_CLASS_IP : 0);
+}
+
+//the packet key, with the fields the class does not match on cleared
+static VOID _TunnelDemux_MaskKey(_In_ const OVS_TUNNEL_DEMUX_KEY* pKey, ULONG demuxClass, _Out_ OVS_TUNNEL_DEMUX_KEY* pMaskedKey)
+{
+    RtlZeroMemory(pMaskedKey, sizeof(OVS_TUNNEL_DEMUX_KEY));
+
+    pMaskedKey->protocol = pKey->protocol;
+    pMaskedKey->udpDestPort = pKey->udpDestPort;
+
+    if (demuxClass & OVS_TUNNEL_DEMUX_CLASS_KEY)
+    {
+        pMaskedKey->haveKey = TRUE;
+        pMaskedKey->key = pKey->key;
+    }
+
+    if (demuxClass & OVS_TUNNEL_DEMUX_CLASS_IP)
+    {
+        pMaskedKey->remoteIpv4 = pKey->remoteIpv4;
+    }
+}
+
+static __inline BOOLEAN _TunnelDemux_KeysEqual(_In_ const OVS_TUNNEL_DEMUX_KEY* pLhs, _In_ const OVS_TUNNEL_DEMUX_KEY* pRhs)
+{
+    return pLhs->protocol == pRhs->protocol && pLhs->udpDestPort == pRhs->udpDestPort &&
+        pLhs->haveKey == pRhs->haveKey && pLhs->key == pRhs->key && pLhs->remoteIpv4 == pRhs->remoteIpv4;
+}
+
+//pKey must be masked
+static OVS_TUNNEL_DEMUX_ENTRY* _TunnelDemux_GetBucket(_In_ const OVS_TUNNEL_DEMUX_KEY* pKey)
+{
+    UINT64 hash = pKey->protocol;
+
+    hash = (hash << 16) | pKey->udpDestPort;
+    hash ^= ((UINT64)pKey->key << 32) | pKey->remoteIpv4;
+    hash ^= pKey->haveKey;
+
+    return g_tunnelDemux.entries[SeqTable_GetBucketIndex(hash, OVS_TUNNEL_DEMUX_BUCKETS)];
+}
+
+//takes a consistent snapshot of the entry, without locking
+static BOOLEAN _TunnelDemux_ReadEntry(_In_ const OVS_TUNNEL_DEMUX_ENTRY* pEntry, _Out_ OVS_TUNNEL_DEMUX_ENTRY* pCopy)
+{
+    ULONG i = 0;
+
+    for (i = 0; i < OVS_SEQTABLE_READ_RETRIES; ++i)
+    {
+        LONG sequence = 0;
+
+        if (!SeqTable_ReadBegin(&pEntry->sequence, &sequence))
+        {
+            continue;
+        }
+
+        pCopy->key = pEntry->key;
+        pCopy->ofPortNumber = pEntry->ofPortNumber;
+
+        if (!SeqTable_ReadRetry(&pEntry->sequence, sequence))
+        {
+            pCopy->sequence = sequence;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//must be called under the table lock
+static VOID _TunnelDemux_WriteEntry_Unsafe(_Inout_ OVS_TUNNEL_DEMUX_ENTRY* pEntry, _In_opt_ const OVS_TUNNEL_DEMUX_KEY* pKey, UINT16 ofPortNumber)
+{
+    SeqTable_WriteBegin(&pEntry->sequence);
+
+    if (pKey)
+    {
+        pEntry->key = *pKey;
+    }
+    else
+    {
+        RtlZeroMemory(&pEntry->key, sizeof(OVS_TUNNEL_DEMUX_KEY));
+    }
+
+    pEntry->ofPortNumber = ofPortNumber;
+
+    SeqTable_WriteEnd(&pEntry->sequence);
+}
+
+VOID TunnelDemux_Initialize()
+{
+    ULONG i = 0, j = 0;
+
+    RtlZeroMemory(&g_tunnelDemux, sizeof(OVS_TUNNEL_DEMUX_TABLE));
+    NdisAllocateSpinLock(&g_tunnelDemux.lock);
+
+    for (i = 0; i < OVS_TUNNEL_DEMUX_BUCKETS; ++i)
+    {
+        for (j = 0; j < OVS_TUNNEL_DEMUX_WAYS; ++j)
+        {
+            g_tunnelDemux.entries[i][j].ofPortNumber = OVS_INVALID_PORT_NUMBER;
+        }
+    }
+}
+
+VOID TunnelDemux_Uninitialize()
+{
+    NdisFreeSpinLock(&g_tunnelDemux.lock);
+}
+
+//must be called under the table lock
+static VOID _TunnelDemux_RemovePort_Unsafe(UINT16 ofPortNumber)
+{
+    ULONG i = 0, j = 0;
+
+    for (i = 0; i < OVS_TUNNEL_DEMUX_BUCKETS; ++i)
+    {
+        for (j = 0; j < OVS_TUNNEL_DEMUX_WAYS; ++j)
+        {
+            OVS_TUNNEL_DEMUX_ENTRY* pEntry = &g_tunnelDemux.entries[i][j];
+
+            if (pEntry->ofPortNumber == ofPortNumber)
+            {
+                InterlockedDecrement(&g_tunnelDemux.countByClass[_TunnelDemux_GetClass(&pEntry->key)]);
+                _TunnelDemux_WriteEntry_Unsafe(pEntry, NULL, OVS_INVALID_PORT_NUMBER);
+            }
+        }
+    }
+}
+
+_Use_decl_annotations_
+BOOLEAN TunnelDemux_Set(const OVS_TUNNEL_DEMUX_KEY* pKey, UINT16 ofPortNumber)
+{
+    OVS_TUNNEL_DEMUX_KEY maskedKey = { 0 };
+    OVS_TUNNEL_DEMUX_ENTRY* pBucket = NULL;
+    OVS_TUNNEL_DEMUX_ENTRY* pFree = NULL;
+    ULONG demuxClass = 0;
+    BOOLEAN ok = TRUE;
+    ULONG i = 0;
+
+    if (pKey)
+    {
+        demuxClass = _TunnelDemux_GetClass(pKey);
+        _TunnelDemux_MaskKey(pKey, demuxClass, &maskedKey);
+        pBucket = _TunnelDemux_GetBucket(&maskedKey);
+    }
+
+    NdisAcquireSpinLock(&g_tunnelDemux.lock);
+
+    //the new key is checked before the port loses its current one
+    for (i = 0; pBucket && i < OVS_TUNNEL_DEMUX_WAYS; ++i)
+    {
+        //the entry the port has now is reused, if it is in the bucket
+        if (pBucket[i].ofPortNumber == OVS_INVALID_PORT_NUMBER || pBucket[i].ofPortNumber == ofPortNumber)
+        {
+            if (!pFree)
+            {
+                pFree = pBucket + i;
+            }
+        }
+        else if (_TunnelDemux_KeysEqual(&pBucket[i].key, &maskedKey))
+        {
+            DEBUGP(LOG_ERROR, __FUNCTION__ " of port %u already receives this tunnel's traffic\n", pBucket[i].ofPortNumber);
+            ok = FALSE;
+            goto Cleanup;
+        }
+    }
+
+    if (pBucket && !pFree)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " tunnel demux bucket is full\n");
+        ok = FALSE;
+        goto Cleanup;
+    }
+
+    _TunnelDemux_RemovePort_Unsafe(ofPortNumber);
+
+    if (pFree)
+    {
+        _TunnelDemux_WriteEntry_Unsafe(pFree, &maskedKey, ofPortNumber);
+        InterlockedIncrement(&g_tunnelDemux.countByClass[demuxClass]);
+    }
+
+Cleanup:
+    NdisReleaseSpinLock(&g_tunnelDemux.lock);
+
+    return ok;
+}
+
+VOID TunnelDemux_Remove(UINT16 ofPortNumber)
+{
+    NdisAcquireSpinLock(&g_tunnelDemux.lock);
+
+    _TunnelDemux_RemovePort_Unsafe(ofPortNumber);
+
+    NdisReleaseSpinLock(&g_tunnelDemux.lock);
+}
+
+_Use_decl_annotations_
+BOOLEAN TunnelDemux_Find(const OVS_TUNNEL_DEMUX_KEY* pPacketKey, UINT16* pOFPortNumber)
+{
+    ULONG c = 0, i = 0;
+
+    *pOFPortNumber = OVS_INVALID_PORT_NUMBER;
+
+    for (c = 0; c < OVS_TUNNEL_DEMUX_CLASSES; ++c)
+    {
+        ULONG demuxClass = s_demuxClassOrder[c];
+        OVS_TUNNEL_DEMUX_KEY maskedKey = { 0 };
+        const OVS_TUNNEL_DEMUX_ENTRY* pBucket = NULL;
+
+        if (!g_tunnelDemux.countByClass[demuxClass])
+        {
+            continue;
+        }
+
+        //a packet without a GRE key can only match the ports that do not match on keys
+        if ((demuxClass & OVS_TUNNEL_DEMUX_CLASS_KEY) && !pPacketKey->haveKey)
+        {
+            continue;
+        }
+
+        _TunnelDemux_MaskKey(pPacketKey, demuxClass, &maskedKey);
+        pBucket = _TunnelDemux_GetBucket(&maskedKey);
+
+        for (i = 0; i < OVS_TUNNEL_DEMUX_WAYS; ++i)
+        {
+            OVS_TUNNEL_DEMUX_ENTRY entry = { 0 };
+
+            if (!_TunnelDemux_ReadEntry(pBucket + i, &entry) || entry.ofPortNumber == OVS_INVALID_PORT_NUMBER)
+            {
+                continue;
+            }
+
+            if (_TunnelDemux_KeysEqual(&entry.key, &maskedKey))
+            {
+                *pOFPortNumber = entry.ofPortNumber;
+                return TRUE;
+            }
+        }
+    }
+
+    return FALSE;
+}
+
+BOOLEAN TunnelDemux_HavePorts()
+{
+    ULONG c = 0;
+
+    for (c = 0; c < OVS_TUNNEL_DEMUX_CLASSES; ++c)
+    {
+        if (g_tunnelDemux.countByClass[c])
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
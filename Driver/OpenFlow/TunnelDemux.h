@@ -0,0 +1,53 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "precomp.h"
+
+/* TUNNEL DEMULTIPLEXING: finds the GRE / VXLAN of port that receives an encapsulated packet */
+
+//must be a power of 2
+#define OVS_TUNNEL_DEMUX_BUCKETS        64
+#define OVS_TUNNEL_DEMUX_WAYS           4
+
+typedef struct _OVS_TUNNEL_DEMUX_KEY
+{
+    //OVS_IPPROTO_GRE or OVS_IPPROTO_UDP (VXLAN)
+    UINT8       protocol;
+    //LE; 0 for GRE
+    UINT16      udpDestPort;
+
+    //GRE key / VXLAN network id, in host order. a port with no key receives packets with any key.
+    BOOLEAN     haveKey;
+    UINT32      key;
+
+    //the remote end of the tunnel, i.e. the outer source address of the received packets. 0 for a port = any.
+    BE32        remoteIpv4;
+}OVS_TUNNEL_DEMUX_KEY, *POVS_TUNNEL_DEMUX_KEY;
+
+VOID TunnelDemux_Initialize();
+VOID TunnelDemux_Uninitialize();
+
+//registers the port on pKey, replacing the key it had, if any; pKey = NULL: the port receives nothing.
+//fails if another port already has the same key, or if the bucket of the key is full: the port keeps the key it had.
+BOOLEAN TunnelDemux_Set(_In_opt_ const OVS_TUNNEL_DEMUX_KEY* pKey, UINT16 ofPortNumber);
+VOID TunnelDemux_Remove(UINT16 ofPortNumber);
+
+//lock free. pPacketKey is built from the received packet: the most specific port key that matches it wins.
+BOOLEAN TunnelDemux_Find(_In_ const OVS_TUNNEL_DEMUX_KEY* pPacketKey, _Out_ UINT16* pOFPortNumber);
+//lock free. FALSE if there is no GRE / VXLAN port: nothing received is decapsulated
+BOOLEAN TunnelDemux_HavePorts();
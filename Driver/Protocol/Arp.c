@@ -16,17 +16,37 @@ limitations under the License.
 
 #include "Arp.h"
 #include "Ipv4.h"
+#include "SeqTable.h"
 
-extern PNDIS_RW_LOCK_EX g_pArpRWLock;
-extern LIST_ENTRY g_arpTable;
+//how often a timestamp that only orders the entries is refreshed (100ns units)
+#define OVS_ARP_TABLE_TOUCH_TIME        (1LL * 10000000LL)
 
 typedef struct _OVS_ARP_TABLE_ENTRY
 {
-    LIST_ENTRY listEntry;
-    BYTE ip[4];
-    BYTE mac[OVS_ETHERNET_ADDRESS_LENGTH];
+    //odd while a writer updates the entry: readers retry
+    volatile LONG   sequence;
+    BYTE            ip[OVS_IPV4_ADDRESS_LENGTH];
+    BYTE            mac[OVS_ETHERNET_ADDRESS_LENGTH];
+
+    //KeQueryInterruptTime of the last arp reply; 0 = free entry
+    volatile LONG64 lastUpdated;
+    //KeQueryInterruptTime of the last lookup: the least recently used entry of a bucket is evicted first
+    volatile LONG64 lastUsed;
+    //KeQueryInterruptTime of the last refresh handed out to a caller
+    volatile LONG64 lastRequested;
 }OVS_ARP_TABLE_ENTRY, *POVS_ARP_TABLE_ENTRY;
 
+typedef struct _OVS_ARP_TABLE
+{
+    //serializes the writers; readers never take it
+    NDIS_SPIN_LOCK          lock;
+    volatile LONG           generation;
+
+    OVS_ARP_TABLE_ENTRY     entries[OVS_ARP_TABLE_BUCKETS][OVS_ARP_TABLE_WAYS];
+}OVS_ARP_TABLE, *POVS_ARP_TABLE;
+
+static OVS_ARP_TABLE g_arpTable;
+
 OVS_ARP_HEADER* GetArpHeader(_In_ OVS_ETHERNET_HEADER* pEthHeader)
 {
     UINT8* buffer = (UINT8*)(pEthHeader)+sizeof(OVS_ETHERNET_HEADER);
@@ -78,93 +98,197 @@ BYTE* VerifyArpFrame(BYTE* buffer, ULONG* pLength)
     return buffer + sizeof(OVS_ARP_HEADER);
 }
 
-static BYTE* _Arp_FindTableEntry_Unsafe(_In_ const BYTE ip[4])
+static OVS_ARP_TABLE_ENTRY* _Arp_GetBucket(_In_ const BYTE ip[4])
 {
-    PLIST_ENTRY pCurEntry = g_arpTable.Flink;
+    UINT32 key = 0;
 
-    if (IsListEmpty(&g_arpTable))
-    {
-        return NULL;
-    }
+    RtlCopyMemory(&key, ip, OVS_IPV4_ADDRESS_LENGTH);
+
+    return g_arpTable.entries[SeqTable_GetBucketIndex(key, OVS_ARP_TABLE_BUCKETS)];
+}
 
-    do
+static __inline BOOLEAN _Arp_IsAlive(LONG64 lastUpdated, LONG64 now)
+{
+    return SeqTable_IsAlive(lastUpdated, now, OVS_ARP_TABLE_AGING_TIME);
+}
+
+static __inline BOOLEAN _Arp_Touch(_Inout_ volatile LONG64* pTimestamp, LONG64 oldValue, LONG64 now)
+{
+    return SeqTable_Touch(pTimestamp, oldValue, now, OVS_ARP_TABLE_TOUCH_TIME);
+}
+
+//takes a consistent snapshot of the entry, without locking
+static BOOLEAN _Arp_ReadEntry(_In_ const OVS_ARP_TABLE_ENTRY* pEntry, _Out_ OVS_ARP_TABLE_ENTRY* pCopy)
+{
+    ULONG i = 0;
+
+    for (i = 0; i < OVS_SEQTABLE_READ_RETRIES; ++i)
     {
-        OVS_ARP_TABLE_ENTRY* pArpEntry = CONTAINING_RECORD(pCurEntry, OVS_ARP_TABLE_ENTRY, listEntry);
+        LONG sequence = 0;
+
+        if (!SeqTable_ReadBegin(&pEntry->sequence, &sequence))
+        {
+            continue;
+        }
+
+        RtlCopyMemory(pCopy->ip, pEntry->ip, OVS_IPV4_ADDRESS_LENGTH);
+        RtlCopyMemory(pCopy->mac, pEntry->mac, OVS_ETHERNET_ADDRESS_LENGTH);
+        pCopy->lastUpdated = pEntry->lastUpdated;
+        pCopy->lastUsed = pEntry->lastUsed;
+        pCopy->lastRequested = pEntry->lastRequested;
 
-        if (RtlEqualMemory(ip, pArpEntry->ip, sizeof(OVS_IPV4_ADDRESS_LENGTH)))
+        if (!SeqTable_ReadRetry(&pEntry->sequence, sequence))
         {
-            OVS_CHECK(pArpEntry->mac);
-            return pArpEntry->mac;
+            pCopy->sequence = sequence;
+            return TRUE;
         }
+    }
+
+    return FALSE;
+}
+
+//must be called under the table lock
+static VOID _Arp_WriteEntry_Unsafe(_Inout_ OVS_ARP_TABLE_ENTRY* pEntry, _In_ const BYTE ip[4], _In_ const BYTE mac[OVS_ETHERNET_ADDRESS_LENGTH], LONG64 now)
+{
+    SeqTable_WriteBegin(&pEntry->sequence);
+
+    RtlCopyMemory(pEntry->ip, ip, OVS_IPV4_ADDRESS_LENGTH);
+    RtlCopyMemory(pEntry->mac, mac, OVS_ETHERNET_ADDRESS_LENGTH);
+    InterlockedExchange64(&pEntry->lastUpdated, now);
+    InterlockedExchange64(&pEntry->lastUsed, now);
+    InterlockedExchange64(&pEntry->lastRequested, 0);
 
-        pCurEntry = pCurEntry->Flink;
-    } while (pCurEntry != &g_arpTable);
+    SeqTable_WriteEnd(&pEntry->sequence);
 
-    return NULL;
+    InterlockedIncrement(&g_arpTable.generation);
 }
 
-VOID Arp_InsertTableEntry(_In_ const BYTE ip[4], _In_ const BYTE mac[OVS_ETHERNET_ADDRESS_LENGTH])
+VOID Arp_InitTable()
 {
-    LOCK_STATE_EX lockState = { 0 };
-    BYTE* pMacAddr = NULL;
+    RtlZeroMemory(&g_arpTable, sizeof(OVS_ARP_TABLE));
+    NdisAllocateSpinLock(&g_arpTable.lock);
+}
 
-    NdisAcquireRWLockWrite(g_pArpRWLock, &lockState, 0);
+VOID Arp_InsertTableEntry(_In_ const BYTE ip[4], _In_ const BYTE mac[OVS_ETHERNET_ADDRESS_LENGTH])
+{
+    OVS_ARP_TABLE_ENTRY* pBucket = _Arp_GetBucket(ip);
+    OVS_ARP_TABLE_ENTRY* pTarget = NULL;
+    OVS_ARP_TABLE_ENTRY* pFree = NULL;
+    OVS_ARP_TABLE_ENTRY* pLeastUsed = NULL;
+    LONG64 now = (LONG64)KeQueryInterruptTime();
+    ULONG i = 0;
+
+    //0.0.0.0 is the sender of arp probes
+    if (*(const UINT32*)ip == 0)
+    {
+        return;
+    }
 
-    pMacAddr = _Arp_FindTableEntry_Unsafe(ip);
-    if (!pMacAddr)
+    //fast path: the same ip -> mac mapping only needs its timestamp refreshed
+    for (i = 0; i < OVS_ARP_TABLE_WAYS; ++i)
     {
-        OVS_ARP_TABLE_ENTRY* pArpEntry = NULL;
-        
-        pArpEntry = KAlloc(sizeof(OVS_ARP_TABLE_ENTRY));
-        if (!pArpEntry)
+        OVS_ARP_TABLE_ENTRY entry = { 0 };
+
+        if (!_Arp_ReadEntry(&pBucket[i], &entry) || !_Arp_IsAlive(entry.lastUpdated, now) ||
+            !RtlEqualMemory(entry.ip, ip, OVS_IPV4_ADDRESS_LENGTH))
         {
-            DEBUGP(LOG_ERROR, "Failed to allocate arp table entry!\n");
-            return;
+            continue;
         }
 
-        RtlCopyMemory(pArpEntry->ip, ip, OVS_IPV4_ADDRESS_LENGTH);
-        RtlCopyMemory(pArpEntry->mac, mac, OVS_ETHERNET_ADDRESS_LENGTH);
+        if (RtlEqualMemory(entry.mac, mac, OVS_ETHERNET_ADDRESS_LENGTH))
+        {
+            _Arp_Touch(&pBucket[i].lastUpdated, entry.lastUpdated, now);
+            return;
+        }
 
-        InsertHeadList(&g_arpTable, &pArpEntry->listEntry);
+        //the ip moved to another mac
+        break;
     }
-    else
+
+    NdisAcquireSpinLock(&g_arpTable.lock);
+
+    for (i = 0; i < OVS_ARP_TABLE_WAYS; ++i)
     {
-        RtlCopyMemory(pMacAddr, mac, OVS_ETHERNET_ADDRESS_LENGTH);
-    }
+        OVS_ARP_TABLE_ENTRY* pEntry = &pBucket[i];
 
-    NdisReleaseRWLock(g_pArpRWLock, &lockState);
-}
+        if (!_Arp_IsAlive(pEntry->lastUpdated, now))
+        {
+            if (!pFree)
+            {
+                pFree = pEntry;
+            }
 
-const BYTE* Arp_FindTableEntry(_In_ const BYTE ip[4])
-{
-    LOCK_STATE_EX lockState = { 0 };
-    const BYTE* pMac = NULL;
+            continue;
+        }
 
-    NdisAcquireRWLockRead(g_pArpRWLock, &lockState, 0);
+        if (RtlEqualMemory(pEntry->ip, ip, OVS_IPV4_ADDRESS_LENGTH))
+        {
+            pTarget = pEntry;
+            break;
+        }
+
+        if (!pLeastUsed || pEntry->lastUsed < pLeastUsed->lastUsed)
+        {
+            pLeastUsed = pEntry;
+        }
+    }
+
+    if (!pTarget)
+    {
+        pTarget = (pFree ? pFree : pLeastUsed);
+    }
 
-    pMac = _Arp_FindTableEntry_Unsafe(ip);
+    OVS_CHECK(pTarget);
 
-    NdisReleaseRWLock(g_pArpRWLock, &lockState);
+    _Arp_WriteEntry_Unsafe(pTarget, ip, mac, now);
 
-    return pMac;
+    NdisReleaseSpinLock(&g_arpTable.lock);
 }
 
-VOID Arp_DestroyTable()
+BOOLEAN Arp_FindTableEntry(_In_ const BYTE ip[4], _Out_ BYTE mac[OVS_ETHERNET_ADDRESS_LENGTH], _Out_opt_ BOOLEAN* pNeedsRefresh)
 {
-    OVS_ARP_TABLE_ENTRY* pArpEntry = NULL;
-    PLIST_ENTRY headList = NULL;
-    LOCK_STATE_EX lockState = { 0 };
+    OVS_ARP_TABLE_ENTRY* pBucket = _Arp_GetBucket(ip);
+    LONG64 now = (LONG64)KeQueryInterruptTime();
+    ULONG i = 0;
 
-    NdisAcquireRWLockWrite(g_pArpRWLock, &lockState, 0);
+    if (pNeedsRefresh)
+    {
+        *pNeedsRefresh = FALSE;
+    }
 
-    while (!IsListEmpty(&g_arpTable))
+    for (i = 0; i < OVS_ARP_TABLE_WAYS; ++i)
     {
-        headList = RemoveHeadList(&g_arpTable);
+        OVS_ARP_TABLE_ENTRY entry = { 0 };
 
-        pArpEntry = CONTAINING_RECORD(headList, OVS_ARP_TABLE_ENTRY, listEntry);
+        if (!_Arp_ReadEntry(&pBucket[i], &entry) || !_Arp_IsAlive(entry.lastUpdated, now) ||
+            !RtlEqualMemory(entry.ip, ip, OVS_IPV4_ADDRESS_LENGTH))
+        {
+            continue;
+        }
+
+        RtlCopyMemory(mac, entry.mac, OVS_ETHERNET_ADDRESS_LENGTH);
+
+        _Arp_Touch(&pBucket[i].lastUsed, entry.lastUsed, now);
+
+        //only the caller that wins the timestamp update sends the arp request
+        if (pNeedsRefresh && now - entry.lastUpdated >= OVS_ARP_TABLE_REFRESH_TIME)
+        {
+            *pNeedsRefresh = _Arp_Touch(&pBucket[i].lastRequested, entry.lastRequested, now);
+        }
 
-        KFree(pArpEntry);
+        return TRUE;
     }
 
-    NdisReleaseRWLock(g_pArpRWLock, &lockState);
-}
\ No newline at end of file
+    return FALSE;
+}
+
+LONG Arp_GetGeneration()
+{
+    return g_arpTable.generation;
+}
+
+VOID Arp_DestroyTable()
+{
+    NdisFreeSpinLock(&g_arpTable.lock);
+    RtlZeroMemory(&g_arpTable, sizeof(OVS_ARP_TABLE));
+}
@@ -45,6 +45,22 @@ void DbgPrintArp(OVS_ARP_HEADER* pArpHeader);
 OVS_ARP_HEADER* GetArpHeader(_In_ OVS_ETHERNET_HEADER* pEthHeader);
 BYTE* VerifyArpFrame(BYTE* buffer, ULONG* pLength);
 
+/* ARP TABLE: fixed capacity, hashed on the ipv4 address; lookups take no lock */
+
+//must be a power of 2
+#define OVS_ARP_TABLE_BUCKETS           256
+#define OVS_ARP_TABLE_WAYS              4
+
+//entries not updated by an arp reply for this long are dropped (100ns units)
+#define OVS_ARP_TABLE_AGING_TIME        (600LL * 10000000LL)
+//entries older than this are still used, but lookups ask for a new arp request (100ns units)
+#define OVS_ARP_TABLE_REFRESH_TIME      (300LL * 10000000LL)
+
+VOID Arp_InitTable();
 VOID Arp_InsertTableEntry(_In_ const BYTE ip[4], _In_ const BYTE mac[OVS_ETHERNET_ADDRESS_LENGTH]);
-const BYTE* Arp_FindTableEntry(_In_ const BYTE ip[4]);
-VOID Arp_DestroyTable();
\ No newline at end of file
+//pNeedsRefresh: set to TRUE (for one caller at a time) if the entry is getting old and the caller should originate an arp request
+BOOLEAN Arp_FindTableEntry(_In_ const BYTE ip[4], _Out_writes_bytes_(OVS_ETHERNET_ADDRESS_LENGTH) BYTE mac[OVS_ETHERNET_ADDRESS_LENGTH],
+    _Out_opt_ BOOLEAN* pNeedsRefresh);
+//incremented each time an ip gets a new mapping: whoever caches a mac it has looked up must look it up again
+LONG Arp_GetGeneration();
+VOID Arp_DestroyTable();
@@ -21,70 +21,118 @@ limitations under the License.
 #include "Udp.h"
 #include "Nbls.h"
 #include "OvsNetBuffer.h"
+#include "NbCursor.h"
 
-UINT ComputeIpChecksum(const BYTE* buffer, UINT size)
+//adds the buffer to a 64-bit one's complement accumulator. The buffer is read 32 bits at a time, in machine order, at any alignment:
+//2^16 = 1 (mod 0xFFFF), so the sum of the 32-bit words is congruent to the sum of the 16-bit words. The carries are kept in the
+//upper half of the accumulator, and are folded only once, by Checksum_Fold64.
+//each addition adds less than 2^32, so the accumulator cannot overflow for a buffer of less than 16GB.
+static UINT64 _Checksum_Accumulate(UINT64 sum, _In_ const BYTE* buffer, ULONG size)
 {
-    UINT checksum = 0;
-
-    for (UINT i = 0; i < size; i += 2, buffer += 2)
+    while (size >= 4 * sizeof(UINT32))
     {
-        UINT16 value = 0;
+        sum += *(const UNALIGNED UINT32*)(buffer);
+        sum += *(const UNALIGNED UINT32*)(buffer + 4);
+        sum += *(const UNALIGNED UINT32*)(buffer + 8);
+        sum += *(const UNALIGNED UINT32*)(buffer + 12);
 
-        if (i <= size - 2)
-        {
-            value = *((UINT16*)buffer);
-        }
-        else
-        {
-            //if we have only one byte left, e.g. B3, we should add:
-            //B3 00 (i.e. 0xB3), and not 00 B3 (i.e. 0x00B3)
-            value = *((UINT8*)buffer);
-            //value <<= 8;
-        }
+        buffer += 4 * sizeof(UINT32);
+        size -= 4 * sizeof(UINT32);
+    }
 
-        checksum += RtlUshortByteSwap(value);
+    while (size >= sizeof(UINT32))
+    {
+        sum += *(const UNALIGNED UINT32*)buffer;
 
-        //checksum = 0x1A0B0
-        if (checksum > UINT16_MAX)
-        {
-            //should have 0x1xxxx, not 0x3xxxx or other digit > 1
-            OVS_CHECK(checksum >> 16 == 1);
+        buffer += sizeof(UINT32);
+        size -= sizeof(UINT32);
+    }
 
-            //tmp = 0xA0B0
-            UINT16 tmp = (UINT16)checksum;
+    if (size >= sizeof(UINT16))
+    {
+        sum += *(const UNALIGNED UINT16*)buffer;
 
-            //tmp = 0xA0B1
-            tmp += 1;
+        buffer += sizeof(UINT16);
+        size -= sizeof(UINT16);
+    }
 
-            checksum = tmp;
-        }
+    //if we have only one byte left, e.g. B3, we should add B3 00: in machine (little endian) order, that is 0x00B3
+    if (size)
+    {
+        sum += *buffer;
     }
 
-    OVS_CHECK(checksum >> 16 == 0);
+    return sum;
+}
+
+_Use_decl_annotations_
+UINT16 Checksum_Sum(const VOID* buffer, ULONG size)
+{
+    return Checksum_Fold64(_Checksum_Accumulate(0, buffer, size));
+}
+
+UINT ComputeIpChecksum(const BYTE* buffer, UINT size)
+{
+    UINT checksum = 0;
+
+    //the one's complement sum is byte order independent (RFC 1071): the sum of the words in machine order, swapped,
+    //is the sum of the words in network order
+    checksum = RtlUshortByteSwap(Checksum_Fold64(_Checksum_Accumulate(0, buffer, size)));
+
     checksum = ~checksum;
     return checksum;
 }
 
-static WORD _ChecksumSubCsum(UINT checksum, WORD csumToSub)
+_Use_decl_annotations_
+BOOLEAN ComputeIpChecksum_Nb(NET_BUFFER* pNb, ULONG offset, ULONG size, UINT* pChecksum)
 {
-    checksum -= csumToSub;
+    OVS_NB_CURSOR cursor = { 0 };
+    UINT64 sum = 0;
+    ULONG bytesAdded = 0;
 
-    //checksum = 0x1A0B0
-    if (checksum > 0xFFFF)
+    OVS_CHECK(pChecksum);
+
+    *pChecksum = 0;
+
+    if (!NbCursor_InitFromNb(&cursor, pNb) || !NbCursor_Advance(&cursor, offset))
     {
-        //should have 0x1xxxx, not 0x3xxxx or other digit > 1
-        OVS_CHECK(checksum >> 16 == 0xFFFF);
+        return FALSE;
+    }
 
-        //tmp = 0xA0B0
-        UINT16 tmp = (UINT16)checksum;
+    while (bytesAdded < size)
+    {
+        const BYTE* pChunk = NULL;
+        ULONG chunkSize = 0;
+        UINT16 chunkSum = 0;
 
-        //tmp = 0xA0B1
-        tmp -= 1;
+        pChunk = NbCursor_PeekContiguous(&cursor, size - bytesAdded, &chunkSize);
+        if (!pChunk)
+        {
+            DEBUGP(LOG_ERROR, __FUNCTION__ " the net buffer is shorter than offset + size: %d + %d\n", offset, size);
+            return FALSE;
+        }
 
-        checksum = tmp;
+        chunkSum = Checksum_Fold64(_Checksum_Accumulate(0, pChunk, chunkSize));
+
+        //a chunk that starts at an odd offset has its bytes in the other halves of the 16-bit words
+        if (bytesAdded & 1)
+        {
+            chunkSum = RtlUshortByteSwap(chunkSum);
+        }
+
+        sum += chunkSum;
+        bytesAdded += chunkSize;
+
+        if (!NbCursor_Advance(&cursor, chunkSize))
+        {
+            return FALSE;
+        }
     }
 
-    return (WORD)checksum;
+    *pChecksum = RtlUshortByteSwap(Checksum_Fold64(sum));
+    *pChecksum = ~*pChecksum;
+
+    return TRUE;
 }
 
 WORD ChecksumAddCsum(UINT checksum, WORD csumToAdd)
@@ -109,31 +157,6 @@ WORD ChecksumAddCsum(UINT checksum, WORD csumToAdd)
     return (WORD)checksum;
 }
 
-UINT RecomputeChecksum(const BYTE* oldBuffer, const BYTE* newBuffer, ULONG len, WORD checksum)
-{
-    WORD oldBufChecksum = 0, newBufChecksum = 0;
-
-    OVS_CHECK(len % 2 == 0);
-
-    oldBufChecksum = (WORD)ComputeIpChecksum(oldBuffer, len);
-    oldBufChecksum = RtlUshortByteSwap(oldBufChecksum);
-    oldBufChecksum = ~oldBufChecksum;
-
-    newBufChecksum = (WORD)ComputeIpChecksum(newBuffer, len);
-    newBufChecksum = RtlUshortByteSwap(newBufChecksum);
-    newBufChecksum = ~newBufChecksum;
-
-    checksum = ~checksum;
-
-    checksum = _ChecksumSubCsum(checksum, oldBufChecksum);
-    checksum = ChecksumAddCsum(checksum, newBufChecksum);
-    checksum = RtlUshortByteSwap(checksum);
-
-    checksum = ~checksum;
-
-    return checksum;
-}
-
 LE16 ComputeTransportChecksum(VOID* transportBuffer, VOID* protocolBuffer, LE16 ethType)
 {
     OVS_CHECK(transportBuffer);
@@ -218,7 +241,7 @@ static VOID _HandleChecksumOffload_Ipv4(_Inout_ VOID* netHeader, _Inout_ NDIS_TC
     pChecksumOffloadInfo->Transmit.IpHeaderChecksum = 0;
 }
 
-static VOID _HandleChecksumOffload_Tcp(LE16 ethType, ULONG ethSize, ULONG encapsSize, ULONG mtu,
+static VOID _HandleChecksumOffload_Tcp(LE16 ethType, ULONG ethSize, ULONG encapsSize, ULONG mtu, BOOLEAN keepOffload,
     _Inout_ BYTE* netHeader, _Inout_ NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO* pChecksumOffloadInfo)
 {
     UINT16 checksum = 0;
@@ -310,6 +333,12 @@ static VOID _HandleChecksumOffload_Tcp(LE16 ethType, ULONG ethSize, ULONG encaps
         }
     }
 
+    //the nic computes the checksum after the mss has been changed
+    if (keepOffload)
+    {
+        return;
+    }
+
     pTcpHeader->checksum = 0;
     checksum = ComputeTransportChecksum(pTcpHeader, netHeader, ethType);
     checksum = RtlUshortByteSwap(checksum);
@@ -352,7 +381,9 @@ static VOID _HandleChecksumOffload_Udp(LE16 ethType, BYTE* netHeader, _Inout_ ND
 //eth type: ipv4 / ipv6? (for computing pseudo header checksum)
 //eth size: the size of the eth_h in pOvsNb
 //encapsSize, mtu: if encaps > 0 && mss overflows mtu if we add encaps => tcp mss must be decreased
-VOID HandleChecksumOffload(_In_ OVS_NET_BUFFER* pOvsNb, BOOLEAN isFromExternal, ULONG encapsSize, ULONG mtu)
+//keepOffload: the nic computes the inner checksums of the encapsulated packet: the offload info is kept, with the offsets of the
+//encapsulated frame, instead of the checksums being computed here
+VOID HandleChecksumOffload(_In_ OVS_NET_BUFFER* pOvsNb, BOOLEAN isFromExternal, ULONG encapsSize, ULONG mtu, BOOLEAN keepOffload)
 {
     NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO* pChecksumOffloadInfo = NULL;
     BYTE* netBuffer = NULL;
@@ -368,15 +399,10 @@ VOID HandleChecksumOffload(_In_ OVS_NET_BUFFER* pOvsNb, BOOLEAN isFromExternal,
         return;
     }
 
-    netBuffer = ONB_GetData(pOvsNb);
-    pEthHeader = GetEthernetHeader(netBuffer, &ethSize);
-    ethType = RtlUshortByteSwap(pEthHeader->type);
-
-    //TODO: WATCH FOR PSEUDO HEADER - IT IS ALREADY COMPUTED!
-
     //if have tcp / udp csum offloading and we need to encapsulate: disable tcp / udp csum offloading, compute checksum for tcp / udp
     pChecksumOffloadInfo = GetChecksumOffloadInfo(pOvsNb->pNbl);
 
+    //checked before the data is read: the data of ipv4 fragments we built is not contiguous, and they never ask for offload
     if (pChecksumOffloadInfo->Value == 0)
     {
         return;
@@ -387,22 +413,39 @@ VOID HandleChecksumOffload(_In_ OVS_NET_BUFFER* pOvsNb, BOOLEAN isFromExternal,
         return;
     }
 
+    netBuffer = ONB_GetData(pOvsNb);
+    pEthHeader = GetEthernetHeader(netBuffer, &ethSize);
+    ethType = RtlUshortByteSwap(pEthHeader->type);
+
+    //TODO: WATCH FOR PSEUDO HEADER - IT IS ALREADY COMPUTED!
+
     netHeader = AdvanceEthernetHeader(pEthHeader, ethSize);
 
-    if (ethType == OVS_ETHERTYPE_IPV4 && pChecksumOffloadInfo->Transmit.IpHeaderChecksum)
+    if (ethType == OVS_ETHERTYPE_IPV4 && pChecksumOffloadInfo->Transmit.IpHeaderChecksum && !keepOffload)
     {
         _HandleChecksumOffload_Ipv4(netHeader, pChecksumOffloadInfo);
     }
 
     if (pChecksumOffloadInfo->Transmit.TcpChecksum)
     {
-        _HandleChecksumOffload_Tcp(ethType, ethSize, encapsSize, mtu, netHeader, pChecksumOffloadInfo);
+        _HandleChecksumOffload_Tcp(ethType, ethSize, encapsSize, mtu, keepOffload, netHeader, pChecksumOffloadInfo);
     }
-    else if (pChecksumOffloadInfo->Transmit.UdpChecksum)
+    else if (pChecksumOffloadInfo->Transmit.UdpChecksum && !keepOffload)
     {
         _HandleChecksumOffload_Udp(ethType, netHeader, pChecksumOffloadInfo);
     }
 
+    if (keepOffload)
+    {
+        //the header offsets are counted from the start of the frame, which will begin with the outer headers
+        if (pChecksumOffloadInfo->Transmit.TcpHeaderOffset)
+        {
+            pChecksumOffloadInfo->Transmit.TcpHeaderOffset += encapsSize;
+        }
+
+        return;
+    }
+
     //reset checksum value to 0: this NET_BUFFER_LIST info is disabled.
     pChecksumOffloadInfo->Value = 0;
 }
\ No newline at end of file
@@ -37,11 +37,84 @@ static __inline UINT32 Sctp_ComputeChecksum(const OVS_NET_BUFFER* pOvsNb, unsign
     return 0;
 }
 
+//folds a 64-bit one's complement accumulator into 16 bits. The result is 0 only if the accumulator is 0.
+static __inline UINT16 Checksum_Fold64(UINT64 sum)
+{
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (UINT16)sum;
+}
+
+/*********************************** incremental updates ***********************************/
+
+//Incremental checksum update (RFC 1624, eqn. 3): HC' = ~(~HC + ~m + m').
+//When a header is rewritten, the '~m + m'' of every field that changes is accumulated into a delta, and the delta is applied
+//to each checksum that covers those fields, once. The fields, the delta and the checksum are all kept in network order:
+//the one's complement sum is byte order independent, so no byte swapping is needed.
+typedef UINT64 OVS_CHECKSUM_DELTA;
+
+static __inline VOID ChecksumDelta_Replace2(_Inout_ OVS_CHECKSUM_DELTA* pDelta, BE16 oldValue, BE16 newValue)
+{
+    *pDelta += (UINT16)~oldValue;
+    *pDelta += newValue;
+}
+
+//2^16 = 1 (mod 0xFFFF): a 32-bit word adds the same as its two 16-bit halves, and its complement, the same as their complements
+static __inline VOID ChecksumDelta_Replace4(_Inout_ OVS_CHECKSUM_DELTA* pDelta, BE32 oldValue, BE32 newValue)
+{
+    *pDelta += (UINT32)~oldValue;
+    *pDelta += newValue;
+}
+
+static __inline VOID ChecksumDelta_Replace16(_Inout_ OVS_CHECKSUM_DELTA* pDelta, _In_ const BE32 oldValue[4], _In_ const BE32 newValue[4])
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        ChecksumDelta_Replace4(pDelta, oldValue[i], newValue[i]);
+    }
+}
+
+//returns the checksum, updated with the delta
+static __inline BE16 Checksum_ApplyDelta(BE16 checksum, OVS_CHECKSUM_DELTA delta)
+{
+    UINT64 sum = (UINT16)~checksum;
+
+    sum += delta;
+
+    return (BE16)~Checksum_Fold64(sum);
+}
+
+//a udp checksum of 0 means that the sender did not compute it; a computed checksum of 0 is transmitted as all ones.
+//NOTE: only udp checksum is optional, tcp checksum is NOT optional!
+static __inline BE16 Checksum_ApplyDelta_Udp(BE16 checksum, OVS_CHECKSUM_DELTA delta)
+{
+    if (!checksum)
+    {
+        return 0;
+    }
+
+    checksum = Checksum_ApplyDelta(checksum, delta);
+
+    return (checksum ? checksum : OVS_UDP_CHECKSUM_MANGLED);
+}
+
+/*******************************************************************************************/
+
+//the one's complement sum of the buffer, folded to 16 bits, and not complemented. Like the incremental updates, it is kept in network order:
+//the sum of a valid ipv4 header, or of a tcp segment and its pseudo header, is 0xFFFF
+UINT16 Checksum_Sum(_In_reads_bytes_(size) const VOID* buffer, ULONG size);
+
 //returns BE16 checksum value in UINT
 UINT ComputeIpChecksum(const BYTE* buffer, UINT size);
-UINT RecomputeChecksum(const BYTE* oldBuffer, const BYTE* newBuffer, ULONG len, WORD checksum);
+//ComputeIpChecksum over 'size' bytes of the NET_BUFFER data, starting at 'offset': the data may be spread over any number of MDLs
+BOOLEAN ComputeIpChecksum_Nb(_In_ NET_BUFFER* pNb, ULONG offset, ULONG size, _Out_ UINT* pChecksum);
 
 LE16 ComputeTransportChecksum(VOID* transportBuffer, VOID* protocolBuffer, LE16 ethType);
 WORD ChecksumAddCsum(UINT checksum, WORD csumToAdd);
 
-VOID HandleChecksumOffload(_In_ OVS_NET_BUFFER* pOvsNb, BOOLEAN isFromExternal, ULONG encapsSize, ULONG mtu);
\ No newline at end of file
+VOID HandleChecksumOffload(_In_ OVS_NET_BUFFER* pOvsNb, BOOLEAN isFromExternal, ULONG encapsSize, ULONG mtu, BOOLEAN keepOffload);
\ No newline at end of file
@@ -26,6 +26,8 @@ limitations under the License.
 //Canonical Format Indicator
 #define OVS_VLAN_CFI_MASK           0x1000
 #define OVS_VLAN_TAG_PRESENT        OVS_VLAN_CFI_MASK
+//VLAN identifier: the low 12 bits of the tci
+#define OVS_VLAN_VID_MASK           0x0FFF
 
 //If the value in the ethernet type is less than this value then the frame is Ethernet II. Else it is 802.3
 //we use 802.3, so all should be >= 0x600
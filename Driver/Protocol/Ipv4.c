@@ -51,113 +51,88 @@ OVS_IPV4_HEADER* GetIpv4Header(VOID* pPacketBuffer)
     return pIpv4Header;
 }
 
-static void _Ipv4_SetAddress(VOID* buffer, OVS_IPV4_HEADER* pIpv4Header, BE32* pIpAddress, BE32 newIpAddress)
+//the addresses are covered by the ip header checksum and by the transport pseudo header: pAddressDelta is applied to both
+static void _Ipv4_SetAddress(BE32* pIpAddress, BE32 newIpAddress, _Inout_ OVS_CHECKSUM_DELTA* pAddressDelta)
 {
-    UINT16 csumRecomp = 0;
-
-    if (pIpv4Header->Protocol == IPPROTO_TCP)
-    {
-        OVS_TCP_HEADER* pTcpHeader = GetTcpHeader(buffer);
-        csumRecomp = (WORD)RecomputeChecksum((BYTE*)pIpAddress, (BYTE*)&newIpAddress, OVS_IPV4_ADDRESS_LENGTH, pTcpHeader->checksum);
-        csumRecomp = RtlUshortByteSwap(csumRecomp);
-        pTcpHeader->checksum = csumRecomp;
-    }
-    else if (pIpv4Header->Protocol == IPPROTO_UDP)
-    {
-        OVS_UDP_HEADER* pUdpHeader = GetUdpHeader(buffer);
-
-        //for udp, if checksum == 0, it means it was not computed
-        //if the result of the checksum computation for udp is 0, the checksum must be set to 0xFFFF
-        if (pUdpHeader->checksum)
-        {
-            csumRecomp = (WORD)RecomputeChecksum((BYTE*)pIpAddress, (BYTE*)&newIpAddress, OVS_IPV4_ADDRESS_LENGTH, pUdpHeader->checksum);
-            csumRecomp = RtlUshortByteSwap(csumRecomp);
-            pUdpHeader->checksum = csumRecomp;
-
-            if (!pUdpHeader->checksum)
-            {
-                pUdpHeader->checksum = OVS_UDP_CHECKSUM_MANGLED;
-            }
-        }
-    }
-
-    csumRecomp = (WORD)RecomputeChecksum((BYTE*)pIpAddress, (BYTE*)&newIpAddress, OVS_IPV4_ADDRESS_LENGTH, pIpv4Header->HeaderChecksum);
-    csumRecomp = RtlUshortByteSwap(csumRecomp);
-    pIpv4Header->HeaderChecksum = csumRecomp;
+    ChecksumDelta_Replace4(pAddressDelta, *pIpAddress, newIpAddress);
 
     *pIpAddress = newIpAddress;
 }
 
-static void _Ipv4_SetTos(OVS_IPV4_HEADER* pIpv4Header, UINT8 mask, UINT8 value)
+//the tos is the low byte of the first 16-bit word of the header
+static void _Ipv4_SetTos(OVS_IPV4_HEADER* pIpv4Header, UINT8 mask, UINT8 value, _Inout_ OVS_CHECKSUM_DELTA* pHeaderDelta)
 {
-    UINT32 checksum = 0;
+    BE16 oldWord = *(const BE16*)pIpv4Header;
     UINT8 tos = 0;
 
-    checksum = RtlUshortByteSwap((BE16)pIpv4Header->HeaderChecksum);
-
     tos = pIpv4Header->TypeOfServiceAndEcnField & mask;
     tos |= value;
 
-    checksum += pIpv4Header->TypeOfServiceAndEcnField;
-
-    if ((checksum + 1) >> 16)
-    {
-        ++checksum;
-        checksum &= 0xffff;
-    }
-
-    checksum -= tos;
-    checksum += checksum >> 16;
-
-    pIpv4Header->HeaderChecksum = (UINT16)RtlUshortByteSwap(checksum);
     pIpv4Header->TypeOfServiceAndEcnField = tos;
+
+    ChecksumDelta_Replace2(pHeaderDelta, oldWord, *(const BE16*)pIpv4Header);
 }
 
-static void _Ipv4_SetTtl(OVS_IPV4_HEADER* pIpv4Header, UINT8 newTtl)
+//the ttl is the high byte of the 16-bit word (ttl, protocol)
+static void _Ipv4_SetTtl(OVS_IPV4_HEADER* pIpv4Header, UINT8 newTtl, _Inout_ OVS_CHECKSUM_DELTA* pHeaderDelta)
 {
-    WORD oldData = 0, newData = 0;
-    WORD csumRecomp = 0;
-
-    oldData = pIpv4Header->TimeToLive << 8;
-    oldData = RtlUshortByteSwap(oldData);
-
-    newData = newTtl << 8;
-    newData = RtlUshortByteSwap(newData);
-
-    csumRecomp = (WORD)RecomputeChecksum((BYTE*)&oldData, (BYTE*)&newData, 2, pIpv4Header->HeaderChecksum);
-    csumRecomp = RtlUshortByteSwap(csumRecomp);
-
-    pIpv4Header->HeaderChecksum = csumRecomp;
+    BE16* pWord = (BE16*)&pIpv4Header->TimeToLive;
+    BE16 oldWord = *pWord;
 
     pIpv4Header->TimeToLive = newTtl;
+
+    ChecksumDelta_Replace2(pHeaderDelta, oldWord, *pWord);
 }
 
 BOOLEAN ONB_SetIpv4(OVS_NET_BUFFER* pOvsNb, const OVS_PI_IPV4* pIpv4Info)
 {
     OVS_IPV4_HEADER* pIpv4Header = NULL;
     VOID* buffer = ONB_GetData(pOvsNb);
+    OVS_CHECKSUM_DELTA addressDelta = 0, headerDelta = 0;
 
     pIpv4Header = GetIpv4Header(buffer);
     OVS_CHECK(pIpv4Header);
 
     if (pIpv4Info->source != pIpv4Header->SourceAddress.S_un.S_addr)
     {
-        _Ipv4_SetAddress(buffer, pIpv4Header, (BE32*)&pIpv4Header->SourceAddress.S_un.S_addr, pIpv4Info->source);
+        _Ipv4_SetAddress((BE32*)&pIpv4Header->SourceAddress.S_un.S_addr, pIpv4Info->source, &addressDelta);
     }
 
     if (pIpv4Info->destination != pIpv4Header->DestinationAddress.S_un.S_addr)
     {
-        _Ipv4_SetAddress(buffer, pIpv4Header, (BE32*)&pIpv4Header->DestinationAddress.S_un.S_addr, pIpv4Info->destination);
+        _Ipv4_SetAddress((BE32*)&pIpv4Header->DestinationAddress.S_un.S_addr, pIpv4Info->destination, &addressDelta);
     }
 
     if (pIpv4Info->tos != pIpv4Header->TypeOfService)
     {
-        _Ipv4_SetTos(pIpv4Header, 0, pIpv4Info->tos);
+        _Ipv4_SetTos(pIpv4Header, 0, pIpv4Info->tos, &headerDelta);
     }
 
     if (pIpv4Info->ttl != pIpv4Header->TimeToLive)
     {
-        _Ipv4_SetTtl(pIpv4Header, pIpv4Info->ttl);
+        _Ipv4_SetTtl(pIpv4Header, pIpv4Info->ttl, &headerDelta);
+    }
+
+    //all the changes are applied to each checksum at once
+    if (addressDelta)
+    {
+        if (pIpv4Header->Protocol == IPPROTO_TCP)
+        {
+            OVS_TCP_HEADER* pTcpHeader = GetTcpHeader(buffer);
+
+            pTcpHeader->checksum = Checksum_ApplyDelta(pTcpHeader->checksum, addressDelta);
+        }
+        else if (pIpv4Header->Protocol == IPPROTO_UDP)
+        {
+            OVS_UDP_HEADER* pUdpHeader = GetUdpHeader(buffer);
+
+            pUdpHeader->checksum = Checksum_ApplyDelta_Udp(pUdpHeader->checksum, addressDelta);
+        }
+    }
+
+    if (addressDelta || headerDelta)
+    {
+        pIpv4Header->HeaderChecksum = Checksum_ApplyDelta(pIpv4Header->HeaderChecksum, addressDelta + headerDelta);
     }
 
     return TRUE;
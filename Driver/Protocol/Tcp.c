@@ -80,13 +80,11 @@ OVS_TCP_HEADER* GetTcpHeader(VOID* pPacketBuffer)
 BOOLEAN ONB_SetTcp(OVS_NET_BUFFER* pOvsNb, const OVS_PI_TCP* pTcpPI)
 {
     OVS_TCP_HEADER *pTcpHeader = NULL;
-    OVS_IPV4_HEADER* pIpv4Header = NULL;
     VOID* buffer = NULL;
-    UINT16 csumRecomp = 0;
+    OVS_CHECKSUM_DELTA delta = 0;
     UINT16 offset = 0, reserved = 0, flags = 0;
 
     buffer = ONB_GetData(pOvsNb);
-    pIpv4Header = GetIpv4Header(buffer);
     pTcpHeader = GetTcpHeader(buffer);
 
     if (pTcpPI->source != pTcpHeader->sourcePort)
@@ -94,10 +92,7 @@ BOOLEAN ONB_SetTcp(OVS_NET_BUFFER* pOvsNb, const OVS_PI_TCP* pTcpPI)
         DEBUGP_FRAMES(LOG_INFO, "src port (BE): 0x%x -> 0x%x\n", pTcpHeader->sourcePort, pTcpPI->source);
         DEBUGP_FRAMES(LOG_INFO, "dst port (BE): 0x%x\n", pTcpHeader->destinationPort);
 
-        csumRecomp = (WORD)RecomputeChecksum((BYTE*)&pTcpHeader->sourcePort, (BYTE*)&pTcpPI->source, 2, pTcpHeader->checksum);
-        csumRecomp = RtlUshortByteSwap(csumRecomp);
-
-        pTcpHeader->checksum = csumRecomp;
+        ChecksumDelta_Replace2(&delta, pTcpHeader->sourcePort, pTcpPI->source);
         pTcpHeader->sourcePort = pTcpPI->source;
     }
 
@@ -106,13 +101,16 @@ BOOLEAN ONB_SetTcp(OVS_NET_BUFFER* pOvsNb, const OVS_PI_TCP* pTcpPI)
         DEBUGP_FRAMES(LOG_INFO, "src port (BE): 0x%x\n", pTcpHeader->sourcePort);
         DEBUGP_FRAMES(LOG_INFO, "dst port (BE): 0x%x -> 0x%x\n", pTcpHeader->destinationPort, pTcpPI->destination);
 
-        csumRecomp = (WORD)RecomputeChecksum((BYTE*)&pTcpHeader->destinationPort, (BYTE*)&pTcpPI->destination, 2, pTcpHeader->checksum);
-        csumRecomp = RtlUshortByteSwap(csumRecomp);
-
-        pTcpHeader->checksum = csumRecomp;
+        ChecksumDelta_Replace2(&delta, pTcpHeader->destinationPort, pTcpPI->destination);
         pTcpHeader->destinationPort = pTcpPI->destination;
     }
 
+    //both ports are applied to the checksum at once
+    if (delta)
+    {
+        pTcpHeader->checksum = Checksum_ApplyDelta(pTcpHeader->checksum, delta);
+    }
+
     offset = GetTcpDataOffset(pTcpHeader->flagsAndOffset);
     reserved = GetTcpReserved(pTcpHeader->flagsAndOffset);
     flags = GetTcpFlags(pTcpHeader->flagsAndOffset);
@@ -24,6 +24,16 @@ typedef struct _OVS_PI_TCP OVS_PI_TCP;
 
 /*************************************/
 
+//tcp control bits, as returned by GetTcpFlags
+#define OVS_TCP_FLAG_FIN        0x001
+#define OVS_TCP_FLAG_SYN        0x002
+#define OVS_TCP_FLAG_RST        0x004
+#define OVS_TCP_FLAG_PSH        0x008
+#define OVS_TCP_FLAG_ACK        0x010
+#define OVS_TCP_FLAG_URG        0x020
+#define OVS_TCP_FLAG_ECE        0x040
+#define OVS_TCP_FLAG_CWR        0x080
+
 //TODO: must test to see if the bitfields are set ok (considering LE system)
 typedef struct _OVS_TCP_HEADER
 {
@@ -156,6 +166,13 @@ static __inline VOID SetTcpFlags(UINT16* pFlagsAndOffset, UINT16 flags)
     *pFlagsAndOffset |= temp;
 }
 
+static __inline VOID ClearTcpFlags(UINT16* pFlagsAndOffset, UINT16 flags)
+{
+    OVS_CHECK(flags <= 0x1FF);
+
+    *pFlagsAndOffset &= (UINT16)~_byteswap_ushort(flags);
+}
+
 //buffer: net buffer starting with the tcp header
 //dbgprints tcp info
 void DbgPrintTcpHeader(_In_ const VOID* buffer);
\ No newline at end of file
@@ -79,48 +79,30 @@ OVS_UDP_HEADER* GetUdpHeader(VOID* pPacketBuffer)
     return NULL;
 }
 
-static void _Udp_SetPort(OVS_NET_BUFFER* pOvsNb, BE16* pPort, BE16 newPort)
-{
-    OVS_UDP_HEADER* pUdpHeader = GetUdpHeader(pOvsNb);
-    UINT16 csumRecomp = 0;
-
-    if (pUdpHeader->checksum)
-    {
-        csumRecomp = (WORD)RecomputeChecksum((BYTE*)pPort, (BYTE*)&newPort, 2, pUdpHeader->checksum);
-        csumRecomp = RtlUshortByteSwap(csumRecomp);
-
-        pUdpHeader->checksum = csumRecomp;
-        *pPort = newPort;
-
-        //UDP NOTE: If the calculated checksum is 0, it is stored as all one bits (0xFFFF), which is equivalent in ones-complement arithmetic.
-        //If the transmitted checksum is 0, it indicates that the sender did not compute the checksum.
-        //NOTE: only udp checksum is optional, tcp checksum is NOT optional!
-        if (!pUdpHeader->checksum)
-        {
-            pUdpHeader->checksum = OVS_UDP_CHECKSUM_MANGLED;
-        }
-    }
-    else
-    {
-        *pPort = newPort;
-    }
-}
-
 BOOLEAN ONB_SetUdp(OVS_NET_BUFFER* pOvsNb, const OVS_PI_UDP* pUdpPI)
 {
     OVS_UDP_HEADER* pUdpHeader = NULL;
     VOID* buffer = ONB_GetData(pOvsNb);
+    OVS_CHECKSUM_DELTA delta = 0;
 
     pUdpHeader = GetUdpHeader(buffer);
 
     if (pUdpPI->source != pUdpHeader->sourcePort)
     {
-        _Udp_SetPort(pOvsNb, &pUdpHeader->sourcePort, pUdpPI->source);
+        ChecksumDelta_Replace2(&delta, pUdpHeader->sourcePort, pUdpPI->source);
+        pUdpHeader->sourcePort = pUdpPI->source;
     }
 
     if (pUdpPI->destination != pUdpHeader->destinationPort)
     {
-        _Udp_SetPort(pOvsNb, &pUdpHeader->destinationPort, pUdpPI->destination);
+        ChecksumDelta_Replace2(&delta, pUdpHeader->destinationPort, pUdpPI->destination);
+        pUdpHeader->destinationPort = pUdpPI->destination;
+    }
+
+    //both ports are applied to the checksum at once; if the sender did not compute the checksum, it is left 0
+    if (delta)
+    {
+        pUdpHeader->checksum = Checksum_ApplyDelta_Udp(pUdpHeader->checksum, delta);
     }
 
     return TRUE;
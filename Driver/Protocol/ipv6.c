@@ -51,39 +51,12 @@ OVS_IPV6_HEADER* GetIpv6Header(VOID* pPacketBuffer)
     return pIpv6Header;
 }
 
-static void _Ipv6_SetAddress(OVS_NET_BUFFER* pOvsNb, UINT8 protocol, BE32 oldAddress[4], const BE32 newAddress[4], BOOLEAN recomputeChecksum)
+//the addresses are covered by the transport pseudo header. If the change is to be reflected in the checksum, it is added to pDelta
+static void _Ipv6_SetAddress(BE32 oldAddress[4], const BE32 newAddress[4], _Inout_opt_ OVS_CHECKSUM_DELTA* pDelta)
 {
-    if (recomputeChecksum)
+    if (pDelta)
     {
-        VOID* buffer = ONB_GetData(pOvsNb);
-        UINT16 csumRecomp = 0;
-
-        if (protocol == IPPROTO_TCP)
-        {
-            OVS_TCP_HEADER* pTcpHeader = GetTcpHeader(buffer);
-
-            csumRecomp = (UINT16)RecomputeChecksum((BYTE*)oldAddress, (BYTE*)newAddress, 16, pTcpHeader->checksum);
-            csumRecomp = RtlUshortByteSwap(csumRecomp);
-            pTcpHeader->checksum = csumRecomp;
-        }
-        else if (protocol == IPPROTO_UDP)
-        {
-            OVS_UDP_HEADER* pUdpHeader = GetUdpHeader(buffer);
-
-            //for udp, if checksum == 0, it means it was not computed
-            //if the result of the checksum computation for udp is 0, the checksum must be set to 0xFFFF
-            if (pUdpHeader->checksum)
-            {
-                csumRecomp = (UINT16)RecomputeChecksum((BYTE*)oldAddress, (BYTE*)newAddress, 16, pUdpHeader->checksum);
-                csumRecomp = RtlUshortByteSwap(csumRecomp);
-                pUdpHeader->checksum = csumRecomp;
-
-                if (!pUdpHeader->checksum)
-                {
-                    pUdpHeader->checksum = OVS_UDP_CHECKSUM_MANGLED;
-                }
-            }
-        }
+        ChecksumDelta_Replace16(pDelta, oldAddress, newAddress);
     }
 
     RtlCopyMemory(oldAddress, newAddress, sizeof(BE32[4]));
@@ -94,8 +67,10 @@ BOOLEAN ONB_SetIpv6(OVS_NET_BUFFER* pOvsNb, const OVS_PI_IPV6* pIpv6Info)
     OVS_IPV6_HEADER* pIpv6Header = NULL;
     BE32* pSourceAddress = NULL;
     BE32* pDestinationAddress = NULL;
+    OVS_CHECKSUM_DELTA delta = 0;
 
-    VOID* buffer = ONB_GetData(pOvsNb);
+    VOID* frameBuffer = ONB_GetData(pOvsNb);
+    VOID* buffer = frameBuffer;
 
     pIpv6Header = GetIpv6Header(buffer);
     pSourceAddress = (BE32 *)&pIpv6Header->sourceAddress;
@@ -103,7 +78,7 @@ BOOLEAN ONB_SetIpv6(OVS_NET_BUFFER* pOvsNb, const OVS_PI_IPV6* pIpv6Info)
 
     if (memcmp(pIpv6Info->source, pSourceAddress, sizeof(pIpv6Info->source)) != 0)
     {
-        _Ipv6_SetAddress(pOvsNb, pIpv6Info->protocol, pSourceAddress, pIpv6Info->source, TRUE);
+        _Ipv6_SetAddress(pSourceAddress, pIpv6Info->source, &delta);
     }
 
     if (memcmp(pIpv6Info->destination, pDestinationAddress, sizeof(pIpv6Info->destination)) != 0)
@@ -134,7 +109,24 @@ BOOLEAN ONB_SetIpv6(OVS_NET_BUFFER* pOvsNb, const OVS_PI_IPV6* pIpv6Info)
             }
         }
 
-        _Ipv6_SetAddress(pOvsNb, pIpv6Info->protocol, pDestinationAddress, pIpv6Info->destination, recomputeChecksum);
+        _Ipv6_SetAddress(pDestinationAddress, pIpv6Info->destination, (recomputeChecksum ? &delta : NULL));
+    }
+
+    //both addresses are applied to the transport checksum at once
+    if (delta)
+    {
+        if (pIpv6Info->protocol == IPPROTO_TCP)
+        {
+            OVS_TCP_HEADER* pTcpHeader = GetTcpHeader(frameBuffer);
+
+            pTcpHeader->checksum = Checksum_ApplyDelta(pTcpHeader->checksum, delta);
+        }
+        else if (pIpv6Info->protocol == IPPROTO_UDP)
+        {
+            OVS_UDP_HEADER* pUdpHeader = GetUdpHeader(frameBuffer);
+
+            pUdpHeader->checksum = Checksum_ApplyDelta_Udp(pUdpHeader->checksum, delta);
+        }
     }
 
     SetIpv6TrafficClass(pIpv6Info->trafficClass, &pIpv6Header->vcf);
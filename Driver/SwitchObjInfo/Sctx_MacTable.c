@@ -0,0 +1,275 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "precomp.h"
+#include "Sctx_MacTable.h"
+#include "SeqTable.h"
+
+static OVS_MAC_TABLE_BUCKET* _MacTable_GetBucket(_In_ const OVS_MAC_TABLE* pMacTable, _In_reads_bytes_(6) const BYTE* mac, UINT16 vlanId)
+{
+    UINT64 key = 0;
+
+    RtlCopyMemory(&key, mac, OVS_ETHERNET_ADDRESS_LENGTH);
+    key |= ((UINT64)vlanId) << 48;
+
+    return (OVS_MAC_TABLE_BUCKET*)&pMacTable->buckets[SeqTable_GetBucketIndex(key, OVS_MAC_TABLE_BUCKETS)];
+}
+
+static __inline BOOLEAN _MacTable_EntryMatches(_In_ const OVS_MAC_TABLE_ENTRY* pEntry, _In_reads_bytes_(6) const BYTE* mac, UINT16 vlanId)
+{
+    return pEntry->vlanId == vlanId && RtlEqualMemory(pEntry->mac, mac, OVS_ETHERNET_ADDRESS_LENGTH);
+}
+
+static __inline BOOLEAN _MacTable_IsAlive(LONG64 lastSeen, LONG64 now)
+{
+    return SeqTable_IsAlive(lastSeen, now, OVS_MAC_TABLE_AGING_TIME);
+}
+
+//takes a consistent snapshot of the entry, without locking
+static BOOLEAN _MacTable_ReadEntry(_In_ const OVS_MAC_TABLE_ENTRY* pEntry, _Out_ OVS_MAC_TABLE_ENTRY* pCopy)
+{
+    ULONG i = 0;
+
+    for (i = 0; i < OVS_SEQTABLE_READ_RETRIES; ++i)
+    {
+        LONG sequence = 0;
+
+        if (!SeqTable_ReadBegin(&pEntry->sequence, &sequence))
+        {
+            continue;
+        }
+
+        pCopy->vlanId = pEntry->vlanId;
+        RtlCopyMemory(pCopy->mac, pEntry->mac, OVS_ETHERNET_ADDRESS_LENGTH);
+        pCopy->portId = pEntry->portId;
+        pCopy->nicIndex = pEntry->nicIndex;
+        pCopy->lastSeen = pEntry->lastSeen;
+
+        if (!SeqTable_ReadRetry(&pEntry->sequence, sequence))
+        {
+            pCopy->sequence = sequence;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//must be called under the table lock
+static VOID _MacTable_WriteEntry_Unsafe(_Inout_ OVS_MAC_TABLE_ENTRY* pEntry, _In_reads_bytes_(6) const BYTE* mac, UINT16 vlanId,
+    NDIS_SWITCH_PORT_ID portId, NDIS_SWITCH_NIC_INDEX nicIndex, LONG64 now)
+{
+    SeqTable_WriteBegin(&pEntry->sequence);
+
+    pEntry->vlanId = vlanId;
+    RtlCopyMemory(pEntry->mac, mac, OVS_ETHERNET_ADDRESS_LENGTH);
+    pEntry->portId = portId;
+    pEntry->nicIndex = nicIndex;
+    InterlockedExchange64(&pEntry->lastSeen, now);
+
+    SeqTable_WriteEnd(&pEntry->sequence);
+}
+
+OVS_MAC_TABLE* Sctx_MacTable_Create()
+{
+    OVS_MAC_TABLE* pMacTable = KAlloc(sizeof(OVS_MAC_TABLE));
+
+    if (!pMacTable)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " could not allocate the mac table\n");
+        return NULL;
+    }
+
+    RtlZeroMemory(pMacTable, sizeof(OVS_MAC_TABLE));
+    NdisAllocateSpinLock(&pMacTable->lock);
+
+    return pMacTable;
+}
+
+_Use_decl_annotations_
+VOID Sctx_MacTable_Destroy(OVS_MAC_TABLE* pMacTable)
+{
+    if (!pMacTable)
+    {
+        return;
+    }
+
+    DEBUGP(LOG_INFO, __FUNCTION__ " learned: %d; moved: %d; evicted: %d\n",
+        pMacTable->countLearned, pMacTable->countMoved, pMacTable->countEvicted);
+
+    NdisFreeSpinLock(&pMacTable->lock);
+    KFree(pMacTable);
+}
+
+_Use_decl_annotations_
+VOID Sctx_MacTable_Learn(OVS_MAC_TABLE* pMacTable, const BYTE* mac, UINT16 vlanId, NDIS_SWITCH_PORT_ID portId, NDIS_SWITCH_NIC_INDEX nicIndex)
+{
+    OVS_MAC_TABLE_BUCKET* pBucket = NULL;
+    OVS_MAC_TABLE_ENTRY* pTarget = NULL;
+    OVS_MAC_TABLE_ENTRY* pFree = NULL;
+    OVS_MAC_TABLE_ENTRY* pOldest = NULL;
+    LONG64 now = 0;
+    ULONG i = 0;
+
+    if (ETH_IS_MULTICAST(mac))
+    {
+        return;
+    }
+
+    now = (LONG64)KeQueryInterruptTime();
+    pBucket = _MacTable_GetBucket(pMacTable, mac, vlanId);
+
+    //fast path: the mac is known on this port, so at most the timestamp needs refreshing
+    for (i = 0; i < OVS_MAC_TABLE_WAYS; ++i)
+    {
+        OVS_MAC_TABLE_ENTRY* pEntry = &pBucket->entries[i];
+        OVS_MAC_TABLE_ENTRY entry = { 0 };
+
+        if (!_MacTable_ReadEntry(pEntry, &entry) || !_MacTable_IsAlive(entry.lastSeen, now) || !_MacTable_EntryMatches(&entry, mac, vlanId))
+        {
+            continue;
+        }
+
+        if (entry.portId == portId && entry.nicIndex == nicIndex)
+        {
+            SeqTable_Touch(&pEntry->lastSeen, entry.lastSeen, now, OVS_MAC_TABLE_REFRESH_TIME);
+            return;
+        }
+
+        //the mac moved to another port
+        break;
+    }
+
+    NdisAcquireSpinLock(&pMacTable->lock);
+
+    for (i = 0; i < OVS_MAC_TABLE_WAYS; ++i)
+    {
+        OVS_MAC_TABLE_ENTRY* pEntry = &pBucket->entries[i];
+
+        if (!_MacTable_IsAlive(pEntry->lastSeen, now))
+        {
+            if (!pFree)
+            {
+                pFree = pEntry;
+            }
+
+            continue;
+        }
+
+        if (_MacTable_EntryMatches(pEntry, mac, vlanId))
+        {
+            pTarget = pEntry;
+            break;
+        }
+
+        if (!pOldest || pEntry->lastSeen < pOldest->lastSeen)
+        {
+            pOldest = pEntry;
+        }
+    }
+
+    if (pTarget)
+    {
+        if (pTarget->portId != portId || pTarget->nicIndex != nicIndex)
+        {
+            _MacTable_WriteEntry_Unsafe(pTarget, mac, vlanId, portId, nicIndex, now);
+            InterlockedIncrement(&pMacTable->countMoved);
+        }
+        else
+        {
+            InterlockedExchange64(&pTarget->lastSeen, now);
+        }
+    }
+    else
+    {
+        if (!pFree)
+        {
+            OVS_CHECK(pOldest);
+
+            pFree = pOldest;
+            InterlockedIncrement(&pMacTable->countEvicted);
+        }
+
+        _MacTable_WriteEntry_Unsafe(pFree, mac, vlanId, portId, nicIndex, now);
+        InterlockedIncrement(&pMacTable->countLearned);
+    }
+
+    NdisReleaseSpinLock(&pMacTable->lock);
+}
+
+_Use_decl_annotations_
+BOOLEAN Sctx_MacTable_Find(const OVS_MAC_TABLE* pMacTable, const BYTE* mac, UINT16 vlanId, NDIS_SWITCH_PORT_ID* pPortId, NDIS_SWITCH_NIC_INDEX* pNicIndex)
+{
+    const OVS_MAC_TABLE_BUCKET* pBucket = NULL;
+    LONG64 now = 0;
+    ULONG i = 0;
+
+    *pPortId = NDIS_SWITCH_DEFAULT_PORT_ID;
+    *pNicIndex = 0;
+
+    if (ETH_IS_MULTICAST(mac))
+    {
+        return FALSE;
+    }
+
+    now = (LONG64)KeQueryInterruptTime();
+    pBucket = _MacTable_GetBucket(pMacTable, mac, vlanId);
+
+    for (i = 0; i < OVS_MAC_TABLE_WAYS; ++i)
+    {
+        OVS_MAC_TABLE_ENTRY entry = { 0 };
+
+        if (!_MacTable_ReadEntry(&pBucket->entries[i], &entry))
+        {
+            continue;
+        }
+
+        if (_MacTable_IsAlive(entry.lastSeen, now) && _MacTable_EntryMatches(&entry, mac, vlanId))
+        {
+            *pPortId = entry.portId;
+            *pNicIndex = entry.nicIndex;
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+_Use_decl_annotations_
+VOID Sctx_MacTable_FlushPort(OVS_MAC_TABLE* pMacTable, NDIS_SWITCH_PORT_ID portId)
+{
+    ULONG i = 0, j = 0;
+
+    NdisAcquireSpinLock(&pMacTable->lock);
+
+    for (i = 0; i < OVS_MAC_TABLE_BUCKETS; ++i)
+    {
+        for (j = 0; j < OVS_MAC_TABLE_WAYS; ++j)
+        {
+            OVS_MAC_TABLE_ENTRY* pEntry = &pMacTable->buckets[i].entries[j];
+
+            if (pEntry->lastSeen != 0 && pEntry->portId == portId)
+            {
+                SeqTable_WriteBegin(&pEntry->sequence);
+                InterlockedExchange64(&pEntry->lastSeen, 0);
+                SeqTable_WriteEnd(&pEntry->sequence);
+            }
+        }
+    }
+
+    NdisReleaseSpinLock(&pMacTable->lock);
+}
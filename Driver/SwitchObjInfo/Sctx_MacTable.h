@@ -0,0 +1,84 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "precomp.h"
+#include "Ethernet.h"
+
+/* L2 LEARNING TABLE: the source macs of the frames received, and the switch nic each was last seen on.
+It tells whether a frame received from the external nic is for a vm or the management os, i.e. whether it may be coalesced (RxCoalesce.h).
+GetDestinationInfo also looks it up, but only for the NORMAL path (sendToPortNormal), which is no longer taken. */
+
+//must be a power of 2
+#define OVS_MAC_TABLE_BUCKETS           1024
+#define OVS_MAC_TABLE_WAYS              4
+
+//entries not seen for this long are considered free (100ns units)
+#define OVS_MAC_TABLE_AGING_TIME        (300LL * 10000000LL)
+//the last seen time of an entry is refreshed at most this often (100ns units)
+#define OVS_MAC_TABLE_REFRESH_TIME      (1LL * 10000000LL)
+
+typedef struct _OVS_MAC_TABLE_ENTRY
+{
+    //odd while a writer updates the entry: readers retry
+    volatile LONG           sequence;
+
+    UINT16                  vlanId;
+    BYTE                    mac[OVS_ETHERNET_ADDRESS_LENGTH];
+    NDIS_SWITCH_PORT_ID     portId;
+    NDIS_SWITCH_NIC_INDEX   nicIndex;
+
+    //KeQueryInterruptTime of the last packet from this mac; 0 = free entry
+    volatile LONG64         lastSeen;
+}OVS_MAC_TABLE_ENTRY, *POVS_MAC_TABLE_ENTRY;
+
+typedef struct _OVS_MAC_TABLE_BUCKET
+{
+    OVS_MAC_TABLE_ENTRY     entries[OVS_MAC_TABLE_WAYS];
+}OVS_MAC_TABLE_BUCKET, *POVS_MAC_TABLE_BUCKET;
+
+typedef struct _OVS_MAC_TABLE
+{
+    //serializes the writers; readers never take it
+    NDIS_SPIN_LOCK          lock;
+
+    volatile LONG           countLearned;
+    volatile LONG           countMoved;
+    volatile LONG           countEvicted;
+
+    OVS_MAC_TABLE_BUCKET    buckets[OVS_MAC_TABLE_BUCKETS];
+}OVS_MAC_TABLE, *POVS_MAC_TABLE;
+
+//the vlan id of a frame, given its tci (BE); untagged frames (tci = 0) and priority tagged frames share vlan 0
+static __inline UINT16 Sctx_MacTable_VlanIdFromTci(BE16 tci)
+{
+    return RtlUshortByteSwap(tci) & OVS_VLAN_VID_MASK;
+}
+
+OVS_MAC_TABLE* Sctx_MacTable_Create();
+VOID Sctx_MacTable_Destroy(_In_opt_ OVS_MAC_TABLE* pMacTable);
+
+//records that 'mac' on 'vlanId' was seen on the given port / nic. multicast & broadcast sources are ignored.
+VOID Sctx_MacTable_Learn(_Inout_ OVS_MAC_TABLE* pMacTable, _In_reads_bytes_(6) const BYTE* mac, UINT16 vlanId,
+    NDIS_SWITCH_PORT_ID portId, NDIS_SWITCH_NIC_INDEX nicIndex);
+
+//lock free: does not take the table lock, nor the forward info lock
+BOOLEAN Sctx_MacTable_Find(_In_ const OVS_MAC_TABLE* pMacTable, _In_reads_bytes_(6) const BYTE* mac, UINT16 vlanId,
+    _Out_ NDIS_SWITCH_PORT_ID* pPortId, _Out_ NDIS_SWITCH_NIC_INDEX* pNicIndex);
+
+//forgets all macs learned on the port
+VOID Sctx_MacTable_FlushPort(_Inout_ OVS_MAC_TABLE* pMacTable, NDIS_SWITCH_PORT_ID portId);
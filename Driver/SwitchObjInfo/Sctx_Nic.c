@@ -339,7 +339,7 @@ UINT16 Sctx_Nic_SetOFPort(OVS_GLOBAL_FORWARD_INFO* pForwardInfo, NDIS_SWITCH_POR
 
     FXARRAY_LOCK_WRITE(&pForwardInfo->ofPorts, &lockState);
 
-    pPort = OFPort_FindById_Unsafe(portId);
+    pPort = OFPort_FindById_Unsafe(pForwardInfo, portId);
     if (pPort)
     {
         LOCK_STATE_EX lockState = { 0 };
@@ -351,6 +351,8 @@ UINT16 Sctx_Nic_SetOFPort(OVS_GLOBAL_FORWARD_INFO* pForwardInfo, NDIS_SWITCH_POR
         ofPortNumber = pPort->ofPortNumber;
 
         FXITEM_UNLOCK(pPort, &lockState);
+
+        OFPort_IncrementGeneration();
     }
 
     FXARRAY_UNLOCK(&pForwardInfo->ofPorts, &lockState);
@@ -23,12 +23,18 @@ limitations under the License.
 
 /* STRUCTS AND FUNCTIONS FOR HANDLING HYPER-V SWITCH NICS */
 
+//the checksums a nic computes on transmit, for the packets we encapsulate (see Nic_ProcessStatus)
+//NVGRE: the inner ipv4 / tcp / udp checksums of GRE (key, no checksum, no sequence) packets carrying eth frames
+#define OVS_NIC_OFFLOAD_NVGRE_CHECKSUM      0x1
+
 typedef struct _OVS_NIC_INFO
 {
     BYTE                    mac[OVS_ETHERNET_ADDRESS_LENGTH];
     NDIS_SWITCH_PORT_ID     portId;
     NDIS_SWITCH_NIC_INDEX   nicIndex;
     ULONG                   mtu;
+    //OVS_NIC_OFFLOAD_* flags
+    ULONG                   encapsOffload;
     BOOLEAN                 nicConnected;
 
 #ifdef DBG
@@ -49,6 +55,8 @@ typedef struct _OVS_NIC_LIST_ENTRY
 
     BOOLEAN                             connected;
     ULONG                               mtu;
+    //OVS_NIC_OFFLOAD_* flags; only the external nic reports them
+    ULONG                               encapsOffload;
 
     //OVS_OFPORT_STATS                  portStats;
 
@@ -75,6 +83,7 @@ static __inline VOID NicListEntry_To_NicInfo(_In_ const OVS_NIC_LIST_ENTRY* pNic
 
     pNicInfo->nicConnected = pNicListEntry->connected;
     pNicInfo->mtu = pNicListEntry->mtu;
+    pNicInfo->encapsOffload = pNicListEntry->encapsOffload;
 }
 
 /*****************************************************/
@@ -159,15 +159,9 @@ UINT16 Sctx_Port_SetOFPort(const char* ofPortName, NDIS_SWITCH_PORT_ID portId)
     pPort = OFPort_FindByName_Ref(ofPortName);
     if (pPort)
     {
-        LOCK_STATE_EX lockState = { 0 };
-
-        PORT_LOCK_WRITE(pPort, &lockState);
-
-        pPort->portId = portId;
+        OFPort_SetPortId(pPort, portId);
         ofPortNumber = pPort->ofPortNumber;
 
-        PORT_UNLOCK(pPort, &lockState);
-
         OVS_REFCOUNT_DEREFERENCE(pPort);
     }
 
@@ -17,7 +17,9 @@ limitations under the License.
 #include "precomp.h"
 #include "OIDRequest.h"
 #include "Sctx_Nic.h"
+#include "Sctx_MacTable.h"
 #include "SwitchContext.h"
+#include "Ipv4Reassembly.h"
 
 _Use_decl_annotations_
 NDIS_STATUS Switch_CreateForwardInfo(NDIS_HANDLE filterHandle, OVS_GLOBAL_FORWARD_INFO** ppForwardInfo)
@@ -44,13 +46,31 @@ NDIS_STATUS Switch_CreateForwardInfo(NDIS_HANDLE filterHandle, OVS_GLOBAL_FORWAR
     }
 
     pForwardInfo->ofPorts.pRwLock = NdisAllocateRWLock(filterHandle);
+
+    pForwardInfo->pMacTable = Sctx_MacTable_Create();
+    if (pForwardInfo->pMacTable == NULL)
+    {
+        status = NDIS_STATUS_RESOURCES;
+        goto Cleanup;
+    }
+
     pForwardInfo->isInitialRestart = TRUE;
 
     *ppForwardInfo = pForwardInfo;
 
 Cleanup:
-    if (status != NDIS_STATUS_SUCCESS)
+    if (status != NDIS_STATUS_SUCCESS && pForwardInfo)
     {
+        if (pForwardInfo->ofPorts.pRwLock)
+        {
+            NdisFreeRWLock(pForwardInfo->ofPorts.pRwLock);
+        }
+
+        if (pForwardInfo->pRwLock)
+        {
+            NdisFreeRWLock(pForwardInfo->pRwLock);
+        }
+
         KFree(pForwardInfo);
     }
 
@@ -61,6 +81,7 @@ _Use_decl_annotations_
 VOID Switch_DeleteForwardInfo(OVS_GLOBAL_FORWARD_INFO* pForwardInfo)
 {
     Sctx_ClearNicListUnsafe(pForwardInfo);
+    Sctx_MacTable_Destroy(pForwardInfo->pMacTable);
 
     NdisFreeRWLock(pForwardInfo->ofPorts.pRwLock);
     NdisFreeRWLock(pForwardInfo->pRwLock);
@@ -117,9 +138,8 @@ Cleanup:
 _Use_decl_annotations_
 VOID Switch_Pause(OVS_SWITCH_INFO* pSwitchInfo)
 {
-    UNREFERENCED_PARAMETER(pSwitchInfo);
-
-    return;
+    //the fragments held have forwarding contexts of the switch
+    Ipv4Reassembly_DropSwitch(pSwitchInfo);
 }
 
 _Use_decl_annotations_
@@ -22,6 +22,7 @@ limitations under the License.
 
 typedef struct _OVS_NIC_LIST_ENTRY OVS_NIC_LIST_ENTRY;
 typedef struct _OVS_PORT_LIST_ENTRY OVS_PORT_LIST_ENTRY;
+typedef struct _OVS_MAC_TABLE OVS_MAC_TABLE;
 
 typedef struct _OVS_GLOBAL_FORWARD_INFO
 {
@@ -44,6 +45,11 @@ typedef struct _OVS_GLOBAL_FORWARD_INFO
     BOOLEAN                 isInitialRestart;
 
     OVS_FIXED_SIZED_ARRAY   ofPorts;
+    //NDIS_SWITCH_PORT_ID -> of port (chained by pNextById). protected by the ofPorts lock.
+    OVS_OFPORT*             ofPortsById[OVS_OFPORT_ID_BUCKETS];
+
+    //learned (mac, vlan) -> (port id, nic index); it has its own lock and is read without pRwLock
+    OVS_MAC_TABLE*          pMacTable;
 } OVS_GLOBAL_FORWARD_INFO, *POVS_GLOBAL_FORWARD_INFO;
 
 typedef enum _OVS_SWITCH_DATAFLOW_STATE
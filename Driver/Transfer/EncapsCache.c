@@ -0,0 +1,222 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "precomp.h"
+#include "EncapsCache.h"
+#include "Arp.h"
+#include "SeqTable.h"
+
+typedef struct _OVS_ENCAPS_CACHE_ENTRY
+{
+    //odd while a writer updates the entry: readers retry
+    volatile LONG           sequence;
+    //the arp table generation the outer eth header was built with
+    LONG                    arpGeneration;
+
+    //KeQueryInterruptTime of the insertion; 0 = free entry
+    LONG64                  created;
+
+    OVS_ENCAPS_CACHE_KEY    key;
+    OVS_ENCAPS_TEMPLATE     encapsTemplate;
+}OVS_ENCAPS_CACHE_ENTRY, *POVS_ENCAPS_CACHE_ENTRY;
+
+typedef struct _OVS_ENCAPS_CACHE
+{
+    //serializes the writers; readers never take it
+    NDIS_SPIN_LOCK          lock;
+
+    OVS_ENCAPS_CACHE_ENTRY  entries[OVS_ENCAPS_CACHE_BUCKETS][OVS_ENCAPS_CACHE_WAYS];
+}OVS_ENCAPS_CACHE, *POVS_ENCAPS_CACHE;
+
+static OVS_ENCAPS_CACHE g_encapsCache;
+
+static OVS_ENCAPS_CACHE_ENTRY* _EncapsCache_GetBucket(_In_ const OVS_ENCAPS_CACHE_KEY* pKey)
+{
+    UINT64 hash = pKey->tunnelId;
+
+    hash ^= ((UINT64)pKey->ipv4Destination << 32) | pKey->ipv4Source;
+    hash ^= ((UINT64)pKey->ofPortNumber << 16) | pKey->tunnelFlags;
+
+    return g_encapsCache.entries[SeqTable_GetBucketIndex(hash, OVS_ENCAPS_CACHE_BUCKETS)];
+}
+
+static __inline BOOLEAN _EncapsCache_IsAlive(_In_ const OVS_ENCAPS_CACHE_ENTRY* pEntry, LONG64 now)
+{
+    return SeqTable_IsAlive(pEntry->created, now, OVS_ENCAPS_CACHE_REVALIDATE_TIME);
+}
+
+//takes a consistent snapshot of the entry, without locking
+static BOOLEAN _EncapsCache_ReadEntry(_In_ const OVS_ENCAPS_CACHE_ENTRY* pEntry, _Out_ OVS_ENCAPS_CACHE_ENTRY* pCopy)
+{
+    ULONG i = 0;
+
+    for (i = 0; i < OVS_SEQTABLE_READ_RETRIES; ++i)
+    {
+        LONG sequence = 0;
+
+        if (!SeqTable_ReadBegin(&pEntry->sequence, &sequence))
+        {
+            continue;
+        }
+
+        pCopy->arpGeneration = pEntry->arpGeneration;
+        pCopy->created = pEntry->created;
+        RtlCopyMemory(&pCopy->key, &pEntry->key, sizeof(OVS_ENCAPS_CACHE_KEY));
+        RtlCopyMemory(&pCopy->encapsTemplate, &pEntry->encapsTemplate, sizeof(OVS_ENCAPS_TEMPLATE));
+
+        if (!SeqTable_ReadRetry(&pEntry->sequence, sequence))
+        {
+            pCopy->sequence = sequence;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//must be called under the cache lock. pKey == NULL frees the entry
+static VOID _EncapsCache_WriteEntry_Unsafe(_Inout_ OVS_ENCAPS_CACHE_ENTRY* pEntry, _In_opt_ const OVS_ENCAPS_CACHE_KEY* pKey,
+    _In_opt_ const OVS_ENCAPS_TEMPLATE* pTemplate, LONG arpGeneration, LONG64 now)
+{
+    SeqTable_WriteBegin(&pEntry->sequence);
+
+    if (pKey)
+    {
+        OVS_CHECK(pTemplate);
+
+        pEntry->key = *pKey;
+        pEntry->encapsTemplate = *pTemplate;
+        pEntry->arpGeneration = arpGeneration;
+        pEntry->created = now;
+    }
+    else
+    {
+        RtlZeroMemory(&pEntry->key, sizeof(OVS_ENCAPS_CACHE_KEY));
+        pEntry->created = 0;
+    }
+
+    SeqTable_WriteEnd(&pEntry->sequence);
+}
+
+VOID EncapsCache_Initialize()
+{
+    RtlZeroMemory(&g_encapsCache, sizeof(OVS_ENCAPS_CACHE));
+    NdisAllocateSpinLock(&g_encapsCache.lock);
+}
+
+VOID EncapsCache_Uninitialize()
+{
+    NdisFreeSpinLock(&g_encapsCache.lock);
+}
+
+_Use_decl_annotations_
+BOOLEAN EncapsCache_Find(const OVS_ENCAPS_CACHE_KEY* pKey, OVS_ENCAPS_TEMPLATE* pTemplate)
+{
+    const OVS_ENCAPS_CACHE_ENTRY* pBucket = _EncapsCache_GetBucket(pKey);
+    LONG64 now = (LONG64)KeQueryInterruptTime();
+    LONG arpGeneration = Arp_GetGeneration();
+    ULONG i = 0;
+
+    for (i = 0; i < OVS_ENCAPS_CACHE_WAYS; ++i)
+    {
+        OVS_ENCAPS_CACHE_ENTRY entry;
+
+        if (!_EncapsCache_ReadEntry(pBucket + i, &entry) || !_EncapsCache_IsAlive(&entry, now))
+        {
+            continue;
+        }
+
+        if (!RtlEqualMemory(&entry.key, pKey, sizeof(OVS_ENCAPS_CACHE_KEY)))
+        {
+            continue;
+        }
+
+        //an ip got a new mac: the outer eth header may be stale
+        if (entry.arpGeneration != arpGeneration)
+        {
+            return FALSE;
+        }
+
+        *pTemplate = entry.encapsTemplate;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+_Use_decl_annotations_
+VOID EncapsCache_Insert(const OVS_ENCAPS_CACHE_KEY* pKey, const OVS_ENCAPS_TEMPLATE* pTemplate, LONG arpGeneration)
+{
+    OVS_ENCAPS_CACHE_ENTRY* pBucket = _EncapsCache_GetBucket(pKey);
+    OVS_ENCAPS_CACHE_ENTRY* pTarget = NULL;
+    OVS_ENCAPS_CACHE_ENTRY* pOldest = NULL;
+    LONG64 now = (LONG64)KeQueryInterruptTime();
+    ULONG i = 0;
+
+    OVS_CHECK(pTemplate->headerSize <= OVS_ENCAPS_TEMPLATE_MAX_SIZE);
+
+    NdisAcquireSpinLock(&g_encapsCache.lock);
+
+    for (i = 0; i < OVS_ENCAPS_CACHE_WAYS; ++i)
+    {
+        OVS_ENCAPS_CACHE_ENTRY* pEntry = &pBucket[i];
+
+        if (pEntry->created != 0 && RtlEqualMemory(&pEntry->key, pKey, sizeof(OVS_ENCAPS_CACHE_KEY)))
+        {
+            pTarget = pEntry;
+            break;
+        }
+
+        //free entries have created = 0: they are the oldest
+        if (!pOldest || pEntry->created < pOldest->created)
+        {
+            pOldest = pEntry;
+        }
+    }
+
+    if (!pTarget)
+    {
+        pTarget = pOldest;
+    }
+
+    OVS_CHECK(pTarget);
+
+    _EncapsCache_WriteEntry_Unsafe(pTarget, pKey, pTemplate, arpGeneration, now);
+
+    NdisReleaseSpinLock(&g_encapsCache.lock);
+}
+
+VOID EncapsCache_RemovePort(UINT16 ofPortNumber)
+{
+    ULONG i = 0, j = 0;
+
+    NdisAcquireSpinLock(&g_encapsCache.lock);
+
+    for (i = 0; i < OVS_ENCAPS_CACHE_BUCKETS; ++i)
+    {
+        for (j = 0; j < OVS_ENCAPS_CACHE_WAYS; ++j)
+        {
+            OVS_ENCAPS_CACHE_ENTRY* pEntry = &g_encapsCache.entries[i][j];
+
+            if (pEntry->created != 0 && pEntry->key.ofPortNumber == ofPortNumber)
+            {
+                _EncapsCache_WriteEntry_Unsafe(pEntry, NULL, NULL, 0, 0);
+            }
+        }
+    }
+
+    NdisReleaseSpinLock(&g_encapsCache.lock);
+}
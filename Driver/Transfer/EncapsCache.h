@@ -0,0 +1,79 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "precomp.h"
+#include "Ethernet.h"
+
+/* ENCAPSULATION CACHE: the outer headers built for a tunnel, ready to be copied in front of each packet; lookups take no lock */
+
+//must be a power of 2
+#define OVS_ENCAPS_CACHE_BUCKETS            64
+#define OVS_ENCAPS_CACHE_WAYS               4
+
+//a template is used for this long, before the arp mapping of its destination is looked up again (100ns units)
+#define OVS_ENCAPS_CACHE_REVALIDATE_TIME    (1LL * 10000000LL)
+
+//outer eth + outer ipv4 + the largest encapsulation header (GRE with all options; or UDP + VXLAN): 50 bytes
+#define OVS_ENCAPS_TEMPLATE_MAX_SIZE        64
+
+typedef struct _OVS_ENCAPS_CACHE_KEY
+{
+    //all the fields of the tunnel info that go in the outer headers
+    BE64        tunnelId;
+    BE32        ipv4Source;
+    BE32        ipv4Destination;
+    UINT16      tunnelFlags;
+    UINT8       ipv4TypeOfService;
+    UINT8       ipv4TimeToLive;
+
+    UINT16      ofPortNumber;
+    //LE; 0 for GRE
+    UINT16      udpDestPort;
+    //OVS_IPPROTO_GRE or OVS_IPPROTO_UDP (VXLAN)
+    UINT8       encapProtocol;
+    UINT8       reserved;
+
+    //the mac of the external nic: the outer source mac
+    UINT8       sourceMac[OVS_ETHERNET_ADDRESS_LENGTH];
+}OVS_ENCAPS_CACHE_KEY, *POVS_ENCAPS_CACHE_KEY;
+
+C_ASSERT(sizeof(OVS_ENCAPS_CACHE_KEY) == 32);
+
+typedef struct _OVS_ENCAPS_TEMPLATE
+{
+    //outer eth + outer ipv4 + encapsulation header. The outer ipv4 total length and identification are 0,
+    //and so are the payload length fields of the encapsulation header: they are set for each packet.
+    BYTE        header[OVS_ENCAPS_TEMPLATE_MAX_SIZE];
+    ULONG       headerSize;
+
+    //the outer ipv4 header checksum, computed with total length = 0 and identification = 0. BE
+    BE16        ipv4Checksum;
+    //the encapsulation header has a checksum over the payload (GRE): it is computed for each packet
+    BOOLEAN     haveChecksum;
+}OVS_ENCAPS_TEMPLATE, *POVS_ENCAPS_TEMPLATE;
+
+VOID EncapsCache_Initialize();
+VOID EncapsCache_Uninitialize();
+
+//lock free. fails if there is no template for the key, or if it must be revalidated
+BOOLEAN EncapsCache_Find(_In_ const OVS_ENCAPS_CACHE_KEY* pKey, _Out_ OVS_ENCAPS_TEMPLATE* pTemplate);
+//replaces the template of the key, if any; otherwise evicts the oldest template of the bucket, if it is full.
+//arpGeneration: Arp_GetGeneration(), read before the arp lookup of the outer eth header
+VOID EncapsCache_Insert(_In_ const OVS_ENCAPS_CACHE_KEY* pKey, _In_ const OVS_ENCAPS_TEMPLATE* pTemplate, LONG arpGeneration);
+//drops the templates of a port that is deleted or reconfigured
+VOID EncapsCache_RemovePort(UINT16 ofPortNumber);
@@ -24,6 +24,9 @@ limitations under the License.
 #include "Vxlan.h"
 #include "Udp.h"
 #include "OFPort.h"
+#include "TunnelDemux.h"
+#include "NbCursor.h"
+#include "Arp.h"
 
 volatile UINT16 g_uniqueIpv4Id = 0;
 
@@ -34,10 +37,12 @@ static __inline UINT16 _GenerateUniqueIpv4Id()
 
 static const OVS_DECAPSULATOR g_greDecapsulator = {
     .ReadEncapsHeader = Gre_ReadHeader,
+    .VerifyChecksum = Gre_VerifyChecksum,
 };
 
 static const OVS_DECAPSULATOR g_vxlanDecapsulator = {
     .ReadEncapsHeader = Vxlan_ReadHeader,
+    .VerifyChecksum = NULL,
 };
 
 const OVS_DECAPSULATOR* Encap_GetDecapsulator_Gre()
@@ -50,7 +55,8 @@ const OVS_DECAPSULATOR* Encap_GetDecapsulator_Vxlan()
     return &g_vxlanDecapsulator;
 }
 
-static VOID _BuildOuterIpv4Header(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _Out_ OVS_IPV4_HEADER* pDeliveryIp4Header, ULONG payloadSize, ULONG encapHeaderSize, BYTE encapProto)
+//the total length and the identification are set for each packet: see _WriteEncapsulation
+static VOID _BuildOuterIpv4Header(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _Out_ OVS_IPV4_HEADER* pDeliveryIp4Header, BYTE encapProto)
 {
     /*RFC1702:
     When IP is encapsulated in IP, the TTL, TOS, and IP security options
@@ -59,15 +65,9 @@ static VOID _BuildOuterIpv4Header(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _Out_ O
     the packet is decapsulated to insure that no packet lives forever.
     */
 
-    //576 is the minimum TL that any host / gateway should accept (i.e. MTU cannot be less than this anywhere)
-    UINT16 totalLength = 0;
-
     OVS_CHECK(pTunnel);
     OVS_CHECK(pDeliveryIp4Header);
 
-    OVS_CHECK(payloadSize <= 0xFFFF);
-    totalLength = (UINT16)(sizeof(OVS_IPV4_HEADER) + encapHeaderSize + payloadSize);
-
     pDeliveryIp4Header->FlagsAndOffset = 0;
     pDeliveryIp4Header->DontFragment = (pTunnel->tunnelFlags & OVS_TUNNEL_FLAG_DONT_FRAGMENT ? 1 : 0);
 
@@ -75,9 +75,7 @@ static VOID _BuildOuterIpv4Header(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _Out_ O
     //sizeof(OVS_IPV4_HEADER) in DWORDs = 5
     pDeliveryIp4Header->HeaderLength = sizeof(OVS_IPV4_HEADER) / sizeof(DWORD);
     pDeliveryIp4Header->TypeOfServiceAndEcnField = pTunnel->ipv4TypeOfService;
-    pDeliveryIp4Header->TotalLength = RtlUshortByteSwap(totalLength);
-    //TODO: try setting identification incrementally (i.e. 0, 1, ...)
-    //or perhaps it's ok to use the identification of the payload
+    pDeliveryIp4Header->TotalLength = 0;
 
     /*
     The originating protocol module of
@@ -95,7 +93,7 @@ static VOID _BuildOuterIpv4Header(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _Out_ O
     //i.e. identification is considered for the same ip src & dest + proto
     //update: RFC6864 - use only for fragmentation.
     //TODO: consider using FwpsConstructIpHeaderForTransport
-    pDeliveryIp4Header->Identification = _GenerateUniqueIpv4Id();
+    pDeliveryIp4Header->Identification = 0;
     // If TTL contains the value zero, then the datagram must be destroyed.
     pDeliveryIp4Header->TimeToLive = pTunnel->ipv4TimeToLive;
     pDeliveryIp4Header->Protocol = encapProto;
@@ -115,21 +113,22 @@ static VOID _BuildOuterIpv4Header(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _Out_ O
 
 static BOOLEAN _WriteEncapsulation(_In_ const OVS_ENCAPSULATOR* pEncapsulator, _Inout_ OVS_INNER_ENCAPSULATOR_DATA* pData, ULONG payloadLength)
 {
-    LONG to_write = 0;
-    OVS_IPV4_HEADER ipv4DeliveryHeader = { 0 };
+    const OVS_ENCAPS_TEMPLATE* pTemplate = pData->pTemplate;
     ULONG bufferSize = 0;
     BYTE* writeBuffer = NULL;
     UINT16 protocolType = 0;
     VOID* pEncHeader = NULL;
+    OVS_IPV4_HEADER* pIpv4DeliveryHeader = NULL;
     OVS_IPV4_HEADER* pIpv4PayloadHeader = NULL;
     ULONG encapHeaderSize = 0;
-    BOOLEAN haveChecksum = FALSE;
+    OVS_CHECKSUM_DELTA delta = 0;
     const OF_PI_IPV4_TUNNEL* pTunnelInfo;
 
     pTunnelInfo = pData->pTunnelInfo;
 
     //udp is included in encapHeaderSize, for vxlan
     encapHeaderSize = pData->encBytesNeeded - sizeof(OVS_ETHERNET_HEADER) - sizeof(OVS_IPV4_HEADER);
+    OVS_CHECK(pTemplate->headerSize == pData->encBytesNeeded);
 
     //buffer size = (eth_h + ipv4_h + gre_h / vxlan_h) + payload_eth_h
     bufferSize = sizeof(OVS_ETHERNET_HEADER) + pData->encBytesNeeded;
@@ -141,33 +140,34 @@ static BOOLEAN _WriteEncapsulation(_In_ const OVS_ENCAPSULATOR* pEncapsulator, _
     writeBuffer = NdisGetDataBuffer(pData->pNb, bufferSize, NULL, 1, 0);
     OVS_CHECK(writeBuffer);
 
-    //1. delivery eth frame: always write a standard eth header (non-vlan)
-    RtlCopyMemory(writeBuffer, pData->pDeliveryEthHeader, sizeof(OVS_ETHERNET_HEADER));
-    OVS_CHECK(pData->pDeliveryEthHeader->type == RtlUshortByteSwap(OVS_ETHERTYPE_IPV4));
-    writeBuffer += sizeof(OVS_ETHERNET_HEADER);
+    //1. delivery eth + ipv4 + encapsulation headers: always a standard eth header (non-vlan)
+    RtlCopyMemory(writeBuffer, pTemplate->header, pTemplate->headerSize);
+
+    //2. the fields of the delivery ipv4 header that are specific to the packet; the checksum is updated for them
+    pIpv4DeliveryHeader = (OVS_IPV4_HEADER*)(writeBuffer + sizeof(OVS_ETHERNET_HEADER));
 
-    //2. Add the Ipv4 - delivery protocol.
-    _BuildOuterIpv4Header(/*in*/pTunnelInfo, /*out*/ &ipv4DeliveryHeader, payloadLength, encapHeaderSize, pData->encapProtocol);
-    to_write = sizeof(OVS_IPV4_HEADER);
+    OVS_CHECK(payloadLength + sizeof(OVS_IPV4_HEADER) + encapHeaderSize <= 0xFFFF);
+    pIpv4DeliveryHeader->TotalLength = RtlUshortByteSwap((UINT16)(sizeof(OVS_IPV4_HEADER) + encapHeaderSize + payloadLength));
+    pIpv4DeliveryHeader->Identification = _GenerateUniqueIpv4Id();
 
-    RtlCopyMemory(writeBuffer, &ipv4DeliveryHeader, to_write);
-    writeBuffer += to_write;
+    ChecksumDelta_Replace2(&delta, 0, pIpv4DeliveryHeader->TotalLength);
+    ChecksumDelta_Replace2(&delta, 0, pIpv4DeliveryHeader->Identification);
+    pIpv4DeliveryHeader->HeaderChecksum = Checksum_ApplyDelta(pTemplate->ipv4Checksum, delta);
 
-    //3. Add the encapsulation header. TODO: GRE size will be variable, and GRE header will need to be returned by _BuildGreHeader()
-    pEncHeader = pEncapsulator->BuildEncapsulationHeader(pTunnelInfo, pData->pPortOptions, payloadLength, encapHeaderSize, &haveChecksum);
-    if (!pEncHeader)
+    //3. the fields of the encapsulation header that are specific to the packet
+    pEncHeader = (BYTE*)pIpv4DeliveryHeader + sizeof(OVS_IPV4_HEADER);
+
+    if (pEncapsulator->SetPayloadLength)
     {
-        DEBUGP(LOG_ERROR, "BuildGreHeader failed!\n");
-        return FALSE;
+        pEncapsulator->SetPayloadLength(pEncHeader, payloadLength);
     }
 
-    to_write = encapHeaderSize;
-    RtlCopyMemory(writeBuffer, pEncHeader, to_write);
-    KFree(pEncHeader);
-
-    pEncHeader = writeBuffer;
+    if (pEncapsulator->SetFlowEntropy)
+    {
+        pEncapsulator->SetFlowEntropy(pEncHeader, pData->flowHash);
+    }
 
-    writeBuffer += to_write;
+    writeBuffer += pTemplate->headerSize;
 
     //4. write payload eth header
     //TODO: no need to copy the payload eth header: it's the original!!
@@ -188,15 +188,25 @@ static BOOLEAN _WriteEncapsulation(_In_ const OVS_ENCAPSULATOR* pEncapsulator, _
         //2) when we send packets to the userspace, we cannot ATM send the associated NBL info, so the checksum offloading info is lost.
         //TODO: given this case, it is of CRITICAL importance to either send to userspace the NBL info as well, or,
         //handle the packet requirements (checksum offloading, LSO) -- if possible, before sending to userspace.
-        pIpv4PayloadHeader->HeaderChecksum = 0;
+        //When the external nic computes the inner checksums of the encapsulated packet, it computes this one as well.
+        if (!pData->ipChecksumOffloaded)
+        {
+            pIpv4PayloadHeader->HeaderChecksum = 0;
 
-        pIpv4PayloadHeader->HeaderChecksum = (UINT16)ComputeIpChecksum((BYTE*)pIpv4PayloadHeader, pIpv4PayloadHeader->HeaderLength * sizeof(DWORD));
-        pIpv4PayloadHeader->HeaderChecksum = RtlUshortByteSwap(pIpv4PayloadHeader->HeaderChecksum);
+            pIpv4PayloadHeader->HeaderChecksum = (UINT16)ComputeIpChecksum((BYTE*)pIpv4PayloadHeader, pIpv4PayloadHeader->HeaderLength * sizeof(DWORD));
+            pIpv4PayloadHeader->HeaderChecksum = RtlUshortByteSwap(pIpv4PayloadHeader->HeaderChecksum);
+        }
     }
 
-    if (haveChecksum)
+    if (pTemplate->haveChecksum)
     {
-        pEncapsulator->ComputeChecksum(pEncHeader, encapHeaderSize, payloadLength);
+        ULONG encapOffset = sizeof(OVS_ETHERNET_HEADER) + sizeof(OVS_IPV4_HEADER);
+
+        if (!pEncapsulator->ComputeChecksum(pData->pNb, encapOffset, encapHeaderSize, payloadLength, pEncHeader))
+        {
+            DEBUGP(LOG_ERROR, __FUNCTION__ " failed to compute the checksum of the encapsulation header\n");
+            return FALSE;
+        }
     }
 
     //D. Here, the next byte must be the start of the payload.
@@ -248,6 +258,25 @@ static BOOLEAN _Encaps_EncapsulateNb(_In_ const OVS_ENCAPSULATOR* pEncapsulator,
     return TRUE;
 }
 
+//the encapsulated packets of a flow get the same outer headers
+static UINT32 _Encaps_GetFlowHash(_In_ const OVS_NET_BUFFER* pOvsNb)
+{
+    const OVS_OFPACKET_INFO* pPacketInfo = pOvsNb->pOriginalPacketInfo;
+
+    if (!pPacketInfo)
+    {
+        return 0;
+    }
+
+    //set by the hash action, or by userspace (i.e. the datapath hash), if it computed one
+    if (pPacketInfo->flowHash)
+    {
+        return pPacketInfo->flowHash;
+    }
+
+    return PacketInfo_HashTransport(pPacketInfo, 0);
+}
+
 //there must be one NET_BUFFER_LIST in pOvsNb, with one NET_BUFFER (if the packet was not fragmented)
 //or one NET_BUFFER_LIST with multiple NET_BUFFER-s, for the case where the packet was fragmented by us
 //its buffer must begin with the ethernet header.
@@ -264,12 +293,13 @@ BOOLEAN Encaps_EncapsulateOnb(const OVS_ENCAPSULATOR* pEncapsulator, OVS_OUTER_E
     OVS_CHECK(pOvsNb->pNbl->Next == NULL);
 
     innerData.pPayloadEthHeader = pData->pPayloadEthHeader;
-    innerData.pDeliveryEthHeader = pData->pDeliveryEthHeader;
+    innerData.pTemplate = &pData->outerHeaders;
     innerData.pTunnelInfo = pOvsNb->pTunnelInfo;
     innerData.encapProtocol = pData->encapProtocol;
     innerData.isFromExternal = pData->isFromExternal;
     innerData.encBytesNeeded = pData->encapsHeadersSize;
-    innerData.pPortOptions = pOvsNb->pDestinationPort->pOptions;
+    //fragments and tcp segments are encapsulated in one call: they all get the hash of the original packet
+    innerData.flowHash = _Encaps_GetFlowHash(pOvsNb);
 
     len = ONB_GetDataLength(pOvsNb);
 
@@ -278,7 +308,8 @@ BOOLEAN Encaps_EncapsulateOnb(const OVS_ENCAPSULATOR* pEncapsulator, OVS_OUTER_E
 
     ethType = ReadEthernetType(pData->pPayloadEthHeader);
 
-    HandleChecksumOffload(pOvsNb, innerData.isFromExternal, innerData.encBytesNeeded, pData->mtu);
+    HandleChecksumOffload(pOvsNb, innerData.isFromExternal, innerData.encBytesNeeded, pData->mtu, pData->offloadChecksums);
+    innerData.ipChecksumOffloaded = (pData->offloadChecksums && GetChecksumOffloadInfo(pOvsNb->pNbl)->Transmit.IpHeaderChecksum);
 
     for (NET_BUFFER* pNb = NET_BUFFER_LIST_FIRST_NB(pOvsNb->pNbl); pNb != NULL; pNb = NET_BUFFER_NEXT_NB(pNb))
     {
@@ -296,208 +327,339 @@ BOOLEAN Encaps_EncapsulateOnb(const OVS_ENCAPSULATOR* pEncapsulator, OVS_OUTER_E
     return TRUE;
 }
 
-BOOLEAN Encaps_ComputeOuterEthHeader(_In_ const BYTE externalMacAddress[OVS_ETHERNET_ADDRESS_LENGTH], _In_ BYTE ipTargetOuter[4], _Inout_ OVS_ETHERNET_HEADER* pEthHeader)
+static VOID _Encaps_GetCacheKey(_In_ const OVS_OUTER_ENCAPSULATION_DATA* pData, _In_ const BYTE externalMacAddress[OVS_ETHERNET_ADDRESS_LENGTH],
+    _Out_ OVS_ENCAPS_CACHE_KEY* pKey)
 {
-    const BYTE* pDestHypervisorMac = Arp_FindTableEntry(ipTargetOuter);
-    if (!pDestHypervisorMac)
-    {
-        DEBUGP(LOG_ERROR, "Could not find dest eth addr for hypervisor of ip %d.%d.%d.%d\n", ipTargetOuter[0], ipTargetOuter[1], ipTargetOuter[2], ipTargetOuter[3]);
+    const OVS_NET_BUFFER* pOvsNb = pData->pOvsNb;
+    const OF_PI_IPV4_TUNNEL* pTunnelInfo = pOvsNb->pTunnelInfo;
+    const OVS_TUNNELING_PORT_OPTIONS* pPortOptions = pOvsNb->pDestinationPort->pOptions;
 
-        ONB_OriginateArpRequest(ipTargetOuter);
-        return FALSE;
-    }
+    RtlZeroMemory(pKey, sizeof(OVS_ENCAPS_CACHE_KEY));
 
-    pEthHeader->type = RtlUshortByteSwap(OVS_ETHERTYPE_IPV4);
-    RtlCopyMemory(pEthHeader->source_addr, externalMacAddress, OVS_ETHERNET_ADDRESS_LENGTH);
-    RtlCopyMemory(pEthHeader->destination_addr, pDestHypervisorMac, OVS_ETHERNET_ADDRESS_LENGTH);
+    pKey->tunnelId = pTunnelInfo->tunnelId;
+    pKey->ipv4Source = pTunnelInfo->ipv4Source;
+    pKey->ipv4Destination = pTunnelInfo->ipv4Destination;
+    pKey->tunnelFlags = pTunnelInfo->tunnelFlags;
+    pKey->ipv4TypeOfService = pTunnelInfo->ipv4TypeOfService;
+    pKey->ipv4TimeToLive = pTunnelInfo->ipv4TimeToLive;
 
-    return TRUE;
+    pKey->ofPortNumber = pOvsNb->pDestinationPort->ofPortNumber;
+    pKey->encapProtocol = pData->encapProtocol;
+
+    if (pPortOptions && (pPortOptions->optionsFlags & OVS_TUNNEL_OPTIONS_HAVE_UDP_DST_PORT))
+    {
+        pKey->udpDestPort = pPortOptions->udpDestPort;
+    }
+
+    RtlCopyMemory(pKey->sourceMac, externalMacAddress, OVS_ETHERNET_ADDRESS_LENGTH);
 }
 
-static BOOLEAN _Encaps_DecapsulateOnb(_In_ const OVS_DECAPSULATOR* pDecapsulator, _Inout_ OVS_DECAPSULATION_DATA* pData)
+//builds the outer headers, as they are for any packet of the tunnel: the length and identification fields are left 0
+static BOOLEAN _Encaps_BuildTemplate(_In_ const OVS_ENCAPSULATOR* pEncapsulator, _In_ const OVS_OUTER_ENCAPSULATION_DATA* pData,
+    _In_ const BYTE externalMacAddress[OVS_ETHERNET_ADDRESS_LENGTH], _Out_ OVS_ENCAPS_TEMPLATE* pTemplate)
 {
-    //IT IS GRE. No need to check against that.
-    ULONG offset = 0;
-    const OVS_IPV4_HEADER* pIpv4Header = NULL;
-    const VOID* pEncapHeader = NULL;
-    ULONG ethSize = 0;
-    ULONG ipPayloadLen = 0;
-    BOOLEAN ok = FALSE;
-    OF_PI_IPV4_TUNNEL* pTunnelInfo;
+    const OVS_NET_BUFFER* pOvsNb = pData->pOvsNb;
+    const OF_PI_IPV4_TUNNEL* pTunnelInfo = pOvsNb->pTunnelInfo;
+    OVS_ETHERNET_HEADER* pEthHeader = NULL;
+    OVS_IPV4_HEADER* pIpv4Header = NULL;
+    ULONG encapHeaderSize = 0;
 
-    /*
-      VXLAN:
-      * The outer VLAN tag is optional. If present, it may be used
-      * for delineating VXLAN traffic on the LAN.
-      */
+    RtlZeroMemory(pTemplate, sizeof(OVS_ENCAPS_TEMPLATE));
 
-    /*
-      NVGRE:
-      * The outer VLAN tag information is optional and can be used for traffic
-      * management and broadcast scalability on the physical network.
-      */
+    if (pData->encapsHeadersSize > OVS_ENCAPS_TEMPLATE_MAX_SIZE)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " encapsulation headers too large: %d\n", pData->encapsHeadersSize);
+        return FALSE;
+    }
 
-    //NOTE: however, we expect the vlan to have been popped by the hyper-v switch,
-    //so when we get here, we should never have an eth header qtagged
+    //udp is included in encapHeaderSize, for vxlan
+    encapHeaderSize = pData->encapsHeadersSize - sizeof(OVS_ETHERNET_HEADER) - sizeof(OVS_IPV4_HEADER);
+    pTemplate->headerSize = pData->encapsHeadersSize;
 
-    //TODO: the payload's TTL MUST be decremented (if one exists)
-    //(It might be that the need to do that was only in GRE1701 with routing... must check again the RFC)
+    //1. delivery eth frame: the mac of the remote end comes from the arp table
+    pEthHeader = (OVS_ETHERNET_HEADER*)pTemplate->header;
+    if (!Encaps_ComputeOuterEthHeader(externalMacAddress, (BYTE*)&pTunnelInfo->ipv4Destination, pEthHeader))
+    {
+        return FALSE;
+    }
 
-    ethSize = sizeof(OVS_ETHERNET_HEADER);
+    //2. delivery ipv4 header
+    pIpv4Header = (OVS_IPV4_HEADER*)(pTemplate->header + sizeof(OVS_ETHERNET_HEADER));
+    _BuildOuterIpv4Header(pTunnelInfo, pIpv4Header, pData->encapProtocol);
+    pTemplate->ipv4Checksum = pIpv4Header->HeaderChecksum;
 
-    //A. ETHERNET
-    if (pData->pOuterEthHeader->type == RtlUshortByteSwap(OVS_ETHERTYPE_QTAG))
+    //3. encapsulation header
+    if (!pEncapsulator->BuildEncapsulationHeader(pTunnelInfo, pOvsNb->pDestinationPort->pOptions, encapHeaderSize,
+        (BYTE*)pIpv4Header + sizeof(OVS_IPV4_HEADER), &pTemplate->haveChecksum))
     {
-        DEBUGP(LOG_ERROR, "packet decapsulation: did not expect eth qtagged frame!\n");
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to build the encapsulation header\n");
         return FALSE;
     }
 
-    offset += ethSize;
+    return TRUE;
+}
 
-    pTunnelInfo = pData->pTunnelInfo;
+_Use_decl_annotations_
+BOOLEAN Encaps_PrepareOuterHeaders(const OVS_ENCAPSULATOR* pEncapsulator, const BYTE externalMacAddress[OVS_ETHERNET_ADDRESS_LENGTH],
+    OVS_OUTER_ENCAPSULATION_DATA* pData)
+{
+    OVS_ENCAPS_CACHE_KEY key = { 0 };
+    LONG arpGeneration = 0;
 
-    //B. IP DELIVERY
-    pIpv4Header = ReadIpv4Header(pData->pOuterEthHeader);
-    offset += pIpv4Header->HeaderLength * sizeof(DWORD);
+    OVS_CHECK(pData->pOvsNb->pTunnelInfo);
 
-    OVS_CHECK(pIpv4Header->Protocol == pData->encapProtocolType);
+    _Encaps_GetCacheKey(pData, externalMacAddress, &key);
 
-    //C. ENCAP HEADER
-    pEncapHeader = AdvanceIpv4Header(pIpv4Header);
+    if (EncapsCache_Find(&key, &pData->outerHeaders))
+    {
+        return TRUE;
+    }
 
-    ipPayloadLen = RtlUshortByteSwap(pIpv4Header->TotalLength) - pIpv4Header->HeaderLength * sizeof(DWORD);
+    //read before the arp lookup: if the mapping changes meanwhile, the template is built again for the next packet
+    arpGeneration = Arp_GetGeneration();
 
-    ok = pDecapsulator->ReadEncapsHeader(pEncapHeader, &offset, ipPayloadLen, pTunnelInfo);
-    if (!ok)
+    if (!_Encaps_BuildTemplate(pEncapsulator, pData, externalMacAddress, &pData->outerHeaders))
     {
-        DEBUGP(LOG_ERROR, "reading encaps header failed\n");
         return FALSE;
     }
 
-    pTunnelInfo->ipv4Destination = pIpv4Header->DestinationAddress.S_un.S_addr;
-    pTunnelInfo->ipv4Source = pIpv4Header->SourceAddress.S_un.S_addr;
-    pTunnelInfo->ipv4TimeToLive = pIpv4Header->TimeToLive;
-    pTunnelInfo->ipv4TypeOfService = pIpv4Header->TypeOfServiceAndEcnField;
+    EncapsCache_Insert(&key, &pData->outerHeaders, arpGeneration);
 
-    if (pIpv4Header->DontFragment)
+    return TRUE;
+}
+
+BOOLEAN Encaps_ComputeOuterEthHeader(_In_ const BYTE externalMacAddress[OVS_ETHERNET_ADDRESS_LENGTH], _In_ BYTE ipTargetOuter[4], _Inout_ OVS_ETHERNET_HEADER* pEthHeader)
+{
+    BYTE destHypervisorMac[OVS_ETHERNET_ADDRESS_LENGTH] = { 0 };
+    BOOLEAN needsRefresh = FALSE;
+
+    if (!Arp_FindTableEntry(ipTargetOuter, destHypervisorMac, &needsRefresh))
     {
-        pTunnelInfo->tunnelFlags |= OVS_TUNNEL_FLAG_DONT_FRAGMENT;
+        DEBUGP(LOG_ERROR, "Could not find dest eth addr for hypervisor of ip %d.%d.%d.%d\n", ipTargetOuter[0], ipTargetOuter[1], ipTargetOuter[2], ipTargetOuter[3]);
+
+        ONB_OriginateArpRequest(ipTargetOuter);
+        return FALSE;
     }
 
-    ONB_Advance(pData->pOvsNb, offset);
+    //revalidate the mapping before it expires, so that the traffic to this hypervisor is not dropped meanwhile
+    if (needsRefresh)
+    {
+        ONB_OriginateArpRequest(ipTargetOuter);
+    }
 
-    DbgPrintOnbFrames(pData->pOvsNb, "decapsulated onb\n");
+    pEthHeader->type = RtlUshortByteSwap(OVS_ETHERTYPE_IPV4);
+    RtlCopyMemory(pEthHeader->source_addr, externalMacAddress, OVS_ETHERNET_ADDRESS_LENGTH);
+    RtlCopyMemory(pEthHeader->destination_addr, destHypervisorMac, OVS_ETHERNET_ADDRESS_LENGTH);
 
     return TRUE;
 }
 
 _Use_decl_annotations_
-BOOLEAN Encaps_DecapsulateOnb(const OVS_DECAPSULATOR* pDecapsulator, OVS_NET_BUFFER* pOvsNb, OF_PI_IPV4_TUNNEL* pTunnelInfo, BYTE encapProtocolType)
+BOOLEAN Encaps_DecapsulateOnb(OVS_NET_BUFFER* pOvsNb, const OVS_OUTER_HEADERS* pOuterHeaders)
 {
-    OVS_ETHERNET_HEADER* pEthHeader = NULL, ethHeader = { 0 };
-    BOOLEAN ok = TRUE;
-    OVS_DECAPSULATION_DATA decapsData = { 0 };
+    const OVS_DECAPSULATOR* pDecapsulator = NULL;
 
     OVS_CHECK(NET_BUFFER_LIST_NEXT_NBL(pOvsNb->pNbl) == NULL);
     OVS_CHECK(NET_BUFFER_NEXT_NB(NET_BUFFER_LIST_FIRST_NB(pOvsNb->pNbl)) == NULL);
 
-    pEthHeader = ONB_GetDataOfSize(pOvsNb, sizeof(OVS_ETHERNET_HEADER));
-    OVS_CHECK(pEthHeader);
+    pDecapsulator = pOuterHeaders->pDecapsulator;
+    OVS_CHECK_RET(pDecapsulator, FALSE);
 
-    RtlCopyMemory(&ethHeader, pEthHeader, sizeof(OVS_ETHERNET_HEADER));
+    //TODO: the payload's TTL MUST be decremented (if one exists)
+    //(It might be that the need to do that was only in GRE1701 with routing... must check again the RFC)
 
     DbgPrintOnbFrames(pOvsNb, "before decapsulation\n");
 
-    decapsData.pOuterEthHeader = pEthHeader;
-    decapsData.pOvsNb = pOvsNb;
-    decapsData.pTunnelInfo = pTunnelInfo;
-    decapsData.encapProtocolType = encapProtocolType;
-
-    ok = _Encaps_DecapsulateOnb(pDecapsulator, &decapsData);
-
-    if (ok)
+    //the checksum is the only part of the encapsulation that needs more than the headers
+    if ((pOuterHeaders->tunnelInfo.tunnelFlags & OVS_TUNNEL_FLAG_CHECKSUM) && pDecapsulator->VerifyChecksum)
     {
-        DbgPrintOnbFrames(pOvsNb, "after gre decapsulation\n");
+        if (!pDecapsulator->VerifyChecksum(ONB_GetNetBuffer(pOvsNb), pOuterHeaders->encapOffset, pOuterHeaders->ipPayloadLength))
+        {
+            DEBUGP(LOG_ERROR, "decapsulation: the encapsulation checksum is invalid\n");
+            return FALSE;
+        }
     }
 
-    return ok;
+    ONB_Advance(pOvsNb, pOuterHeaders->headersSize);
+
+    DbgPrintOnbFrames(pOvsNb, "after decapsulation\n");
+
+    return TRUE;
 }
 
 _Use_decl_annotations_
-const OVS_DECAPSULATOR* Encap_FindDecapsulator(NET_BUFFER* pNb, BYTE* pEncapProtoType, LE16* pUdpDestPort)
+BOOLEAN Encap_ParseOuterHeaders(NET_BUFFER* pNb, OVS_OUTER_HEADERS* pOuterHeaders)
 {
-    OVS_ETHERNET_HEADER* pEthHeader = NULL;
-    VOID* pPacketBuffer = NULL;
+    OVS_NB_CURSOR cursor = { 0 };
+    BYTE scratch[OVS_NB_CURSOR_MAX_HEADER_SIZE];
+    const OVS_ETHERNET_HEADER* pEthHeader = NULL;
+    const OVS_IPV4_HEADER* pIpv4Header = NULL;
+    const VOID* pEncapHeader = NULL;
     const OVS_DECAPSULATOR* pDecapsulator = NULL;
+    OVS_TUNNEL_DEMUX_KEY demuxKey = { 0 };
+    OF_PI_IPV4_TUNNEL* pTunnelInfo = NULL;
+    ULONG ipHeaderSize = 0, ipTotalLength = 0, encapBytes = 0, offset = 0;
+    BYTE protocol = 0, typeOfService = 0, timeToLive = 0;
+    BOOLEAN dontFragment = FALSE;
+    UINT32 ipv4Source = 0, ipv4Destination = 0;
 
-    OVS_CHECK(pEncapProtoType);
+    OVS_CHECK(pOuterHeaders);
 
-    pPacketBuffer = NdisGetDataBuffer(pNb, sizeof(OVS_ETHERNET_HEADER), NULL, 1, 0);
-    //the eth header of a packet cannot be fragmented, therefore pPacketBuffer cannot be NULL here
-    OVS_CHECK(pPacketBuffer);
-    if (!pPacketBuffer)
+    RtlZeroMemory(pOuterHeaders, sizeof(OVS_OUTER_HEADERS));
+    pOuterHeaders->ofPortNumber = OVS_INVALID_PORT_NUMBER;
+    pTunnelInfo = &pOuterHeaders->tunnelInfo;
+
+    if (!NbCursor_InitFromNb(&cursor, pNb))
+    {
+        return TRUE;
+    }
+
+    //A. ETHERNET
+    pEthHeader = NbCursor_Pull(&cursor, sizeof(OVS_ETHERNET_HEADER), scratch);
+    if (!pEthHeader)
     {
-        return NULL;
+        return TRUE;
     }
 
-    pEthHeader = pPacketBuffer;
+    /*
+      VXLAN:
+      * The outer VLAN tag is optional. If present, it may be used
+      * for delineating VXLAN traffic on the LAN.
+      */
+
+    /*
+      NVGRE:
+      * The outer VLAN tag information is optional and can be used for traffic
+      * management and broadcast scalability on the physical network.
+      */
 
+    //NOTE: however, we expect the vlan to have been popped by the hyper-v switch,
+    //so when we get here, we should never have an eth header qtagged
     if (pEthHeader->type == RtlUshortByteSwap(OVS_ETHERTYPE_QTAG))
     {
-        DEBUGP(LOG_ERROR, "Find Decapsulator: did not expect eth qtagged frame!\n");
-        return NULL;
+        DEBUGP(LOG_ERROR, "parse outer headers: did not expect eth qtagged frame!\n");
+        return TRUE;
     }
 
-    if (pEthHeader->type == RtlUshortByteSwap(OVS_ETHERTYPE_IPV4))
+    //ipv6, arp, etc: it is not encapsulated, goes to the same ip dest
+    if (pEthHeader->type != RtlUshortByteSwap(OVS_ETHERTYPE_IPV4))
     {
-        const OVS_IPV4_HEADER* pIpv4Header = NULL;
-        VOID* pAllocBuffer = NULL;
+        return TRUE;
+    }
 
-        pPacketBuffer = GetNbBufferData(pNb, &pAllocBuffer);
-        pEthHeader = pPacketBuffer;
+    //B. IP DELIVERY: the fields are copied out, because the scratch buffer is reused for the encapsulation header
+    pIpv4Header = NbCursor_Peek(&cursor, sizeof(OVS_IPV4_HEADER), scratch);
+    if (!pIpv4Header)
+    {
+        return TRUE;
+    }
+
+    protocol = pIpv4Header->Protocol;
+    if (protocol != OVS_IPPROTO_GRE && protocol != OVS_IPPROTO_UDP)
+    {
+        return TRUE;
+    }
+
+    ipHeaderSize = pIpv4Header->HeaderLength * sizeof(DWORD);
+    ipTotalLength = RtlUshortByteSwap(pIpv4Header->TotalLength);
+    ipv4Source = pIpv4Header->SourceAddress.S_un.S_addr;
+    ipv4Destination = pIpv4Header->DestinationAddress.S_un.S_addr;
+    typeOfService = pIpv4Header->TypeOfServiceAndEcnField;
+    timeToLive = pIpv4Header->TimeToLive;
+    dontFragment = (pIpv4Header->DontFragment ? TRUE : FALSE);
+
+    if (ipHeaderSize < sizeof(OVS_IPV4_HEADER) || ipTotalLength < ipHeaderSize ||
+        ipTotalLength > NbCursor_BytesLeft(&cursor) || !NbCursor_Advance(&cursor, ipHeaderSize))
+    {
+        return TRUE;
+    }
+
+    //C. ENCAP HEADER: only the header is peeked, never the payload
+    pOuterHeaders->encapOffset = NbCursor_GetOffset(&cursor);
+    pOuterHeaders->ipPayloadLength = ipTotalLength - ipHeaderSize;
+
+    demuxKey.remoteIpv4 = ipv4Source;
 
-        pIpv4Header = ReadIpv4Header(pEthHeader);
+    if (protocol == OVS_IPPROTO_GRE)
+    {
+        //gre has optional fields: peek the largest header that may be there; Gre_ReadHeader checks the actual size
+        encapBytes = min(OVS_MAX_GRE_HEADER_SIZE, pOuterHeaders->ipPayloadLength);
+
+        pEncapHeader = NbCursor_Peek(&cursor, encapBytes, scratch);
+        pDecapsulator = Encap_GetDecapsulator_Gre();
+    }
+    else
+    {
+        const OVS_UDP_HEADER* pUdpHeader = NULL;
+        const OVS_VXLAN_HEADER* pVxlanHeader = NULL;
 
-        if (pIpv4Header->Protocol == OVS_IPPROTO_GRE)
+        encapBytes = sizeof(OVS_UDP_HEADER) + sizeof(OVS_VXLAN_HEADER);
+
+        pEncapHeader = NbCursor_Peek(&cursor, encapBytes, scratch);
+        if (!pEncapHeader || pOuterHeaders->ipPayloadLength < encapBytes)
         {
-            *pEncapProtoType = OVS_IPPROTO_GRE;
-            pDecapsulator = Encap_GetDecapsulator_Gre();
+            return TRUE;
         }
-        else if (pIpv4Header->Protocol == OVS_IPPROTO_UDP)
-        {
-            OVS_UDP_HEADER* pUdpHeader = (OVS_UDP_HEADER*)AdvanceIpv4Header(pIpv4Header);
-            OVS_OFPORT* pPort = NULL;
-
-            pPort = OFPort_FindVxlan_Ref(RtlUshortByteSwap(pUdpHeader->destinationPort));
 
-            if (pPort)
-            {
-                if (pUdpDestPort)
-                {
-                    *pUdpDestPort = RtlUshortByteSwap(pUdpHeader->destinationPort);
-                }
+        pUdpHeader = pEncapHeader;
+        pVxlanHeader = (const OVS_VXLAN_HEADER*)(pUdpHeader + 1);
 
-                *pEncapProtoType = OVS_IPPROTO_UDP;
-                pDecapsulator = Encap_GetDecapsulator_Vxlan();
+        demuxKey.protocol = OVS_IPPROTO_UDP;
+        demuxKey.udpDestPort = RtlUshortByteSwap(pUdpHeader->destinationPort);
+        demuxKey.haveKey = TRUE;
+        demuxKey.key = (pVxlanHeader->vni[0] << 16) | (pVxlanHeader->vni[1] << 8) | pVxlanHeader->vni[2];
 
-                OVS_REFCOUNT_DEREFERENCE(pPort);
-            }
+        //udp traffic on ports no vxlan port listens on is not encapsulated
+        if (!TunnelDemux_Find(&demuxKey, &pOuterHeaders->ofPortNumber))
+        {
+            return TRUE;
         }
 
-        KFree(pAllocBuffer);
+        pDecapsulator = Encap_GetDecapsulator_Vxlan();
+    }
+
+    pOuterHeaders->pDecapsulator = pDecapsulator;
+    pOuterHeaders->encapProtocolType = protocol;
+
+    if (!pEncapHeader)
+    {
+        DEBUGP(LOG_ERROR, "parse outer headers: the encapsulation header is truncated\n");
+        return FALSE;
     }
-    else if (pEthHeader->type == RtlUshortByteSwap(OVS_ETHERTYPE_IPV6))
+
+    offset = pOuterHeaders->encapOffset;
+
+    if (!pDecapsulator->ReadEncapsHeader(pEncapHeader, &offset, encapBytes, pTunnelInfo))
     {
-        //do nothing: it is not encapsulated, goes to the same ip dest
+        DEBUGP(LOG_ERROR, "reading encaps header failed\n");
+        return FALSE;
     }
-    else if (pEthHeader->type == RtlUshortByteSwap(OVS_ETHERTYPE_ARP))
+
+    pOuterHeaders->headersSize = offset;
+
+    pTunnelInfo->ipv4Destination = ipv4Destination;
+    pTunnelInfo->ipv4Source = ipv4Source;
+    pTunnelInfo->ipv4TimeToLive = timeToLive;
+    pTunnelInfo->ipv4TypeOfService = typeOfService;
+
+    if (dontFragment)
     {
-        //do nothing: it is not encapsulated, goes to the same ip dest
+        pTunnelInfo->tunnelFlags |= OVS_TUNNEL_FLAG_DONT_FRAGMENT;
     }
-    else
+
+    //the gre key is known only now: Gre_ReadHeader stores it (BE) in the upper half of the tunnel id
+    if (protocol == OVS_IPPROTO_GRE)
     {
-        //do nothing: it is not encapsulated, goes to the same ip dest
+        demuxKey.protocol = OVS_IPPROTO_GRE;
+
+        if (pTunnelInfo->tunnelFlags & OVS_TUNNEL_FLAG_KEY)
+        {
+            demuxKey.haveKey = TRUE;
+            demuxKey.key = RtlUlongByteSwap((UINT32)(pTunnelInfo->tunnelId >> 32));
+        }
+
+        TunnelDemux_Find(&demuxKey, &pOuterHeaders->ofPortNumber);
     }
 
-    return pDecapsulator;
-}
\ No newline at end of file
+    return TRUE;
+}
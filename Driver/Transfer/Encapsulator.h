@@ -18,10 +18,11 @@ limitations under the License.
 
 #include "precomp.h"
 #include "Ethernet.h"
+#include "PacketInfo.h"
+#include "EncapsCache.h"
 
 typedef struct _OVS_NET_BUFFER OVS_NET_BUFFER;
 typedef struct _OVS_ETHERNET_HEADER OVS_ETHERNET_HEADER;
-typedef struct _OF_PI_IPV4_TUNNEL OF_PI_IPV4_TUNNEL;
 typedef struct _OVS_TUNNELING_PORT_OPTIONS OVS_TUNNELING_PORT_OPTIONS;
 
 typedef struct _OVS_INNER_ENCAPSULATOR_DATA
@@ -30,19 +31,23 @@ typedef struct _OVS_INNER_ENCAPSULATOR_DATA
     NET_BUFFER* pNb;
     //in
     const OF_PI_IPV4_TUNNEL* pTunnelInfo;
-    const OVS_TUNNELING_PORT_OPTIONS* pPortOptions;
 
     //in, must be copy, not ptr to eth header in the buffer
     const OVS_ETHERNET_HEADER* pPayloadEthHeader;
 
     //in
     BOOLEAN isFromExternal;
+    //in: the nic computes the inner ipv4 header checksum
+    BOOLEAN ipChecksumOffloaded;
 
-    //in
-    const OVS_ETHERNET_HEADER* pDeliveryEthHeader;
+    //in: the outer headers, to be copied in front of the payload
+    const OVS_ENCAPS_TEMPLATE* pTemplate;
 
     ULONG encBytesNeeded;
 
+    //in: the hash of the inner flow, the same for all the packets of the onb: see OVS_ENCAPSULATOR.SetFlowEntropy
+    UINT32 flowHash;
+
     //in
     BYTE encapProtocol;
 }OVS_INNER_ENCAPSULATOR_DATA, *POVS_INNER_ENCAPSULATOR_DATA;
@@ -60,8 +65,11 @@ typedef struct _OVS_OUTER_ENCAPSULATION_DATA
     //ULONG payloadEthSize;
     BOOLEAN isFromExternal;
 
-    //in
-    const OVS_ETHERNET_HEADER* pDeliveryEthHeader;
+    //in: the external nic computes the inner checksums of the encapsulated packets, if the NBL asks for checksum offload
+    BOOLEAN offloadChecksums;
+
+    //set by Encaps_PrepareOuterHeaders
+    OVS_ENCAPS_TEMPLATE outerHeaders;
 
     //e.g. gre_h size + outer_ip4_h size + outer_eth_h size
     ULONG encapsHeadersSize;
@@ -70,45 +78,70 @@ typedef struct _OVS_OUTER_ENCAPSULATION_DATA
     BYTE encapProtocol;
 }OVS_OUTER_ENCAPSULATION_DATA, *POVS_OUTER_ENCAPSULATION_DATA;
 
-typedef struct _OVS_DECAPSULATION_DATA
-{
-    //inout
-    OVS_NET_BUFFER* pOvsNb;
-
-    //in, copy of the outer eth header
-    const OVS_ETHERNET_HEADER* pOuterEthHeader;
-
-    //out: should not be dynamically allocated
-    OF_PI_IPV4_TUNNEL* pTunnelInfo;
-
-    BYTE encapProtocolType;
-}OVS_DECAPSULATION_DATA, *POVS_DECAPSULATION_DATA;
-
 typedef struct _OVS_ENCAPSULATOR
 {
     ULONG(*BytesNeeded)(UINT16 tunnelFlags);
 
-    VOID* (*BuildEncapsulationHeader)(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _In_ const OVS_TUNNELING_PORT_OPTIONS* pOptions,
-        ULONG payloadLength, ULONG encapHeaderSize, _Out_ BOOLEAN* pHaveChecksum);
+    //writes the encapsulation header of the outer header template
+    BOOLEAN(*BuildEncapsulationHeader)(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _In_ const OVS_TUNNELING_PORT_OPTIONS* pOptions,
+        ULONG encapHeaderSize, _Out_writes_bytes_(encapHeaderSize) VOID* pEncapHeader, _Out_ BOOLEAN* pHaveChecksum);
+
+    //optional: sets the fields of the encapsulation header that depend on the payload length, for each packet
+    VOID(*SetPayloadLength)(_Inout_ VOID* pEncapsulationHeader, ULONG payloadLength);
+
+    //optional: sets the fields of the encapsulation header that the underlay hashes (for ECMP / RSS), from the hash of the inner flow
+    VOID(*SetFlowEntropy)(_Inout_ VOID* pEncapsulationHeader, UINT32 flowHash);
 
-    VOID(*ComputeChecksum)(VOID* pEncapsulationHeader, ULONG encapHeaderSize, ULONG encapPayloadSize);
+    //encapOffset: the offset of the encapsulation header in the NET_BUFFER data, which may span several MDLs (e.g. ipv4 fragments)
+    BOOLEAN(*ComputeChecksum)(_In_ NET_BUFFER* pNb, ULONG encapOffset, ULONG encapHeaderSize, ULONG encapPayloadSize, _Inout_ VOID* pEncapsulationHeader);
 }OVS_ENCAPSULATOR, *POVS_ENCAPSULATOR;
 
 typedef struct _OVS_DECAPSULATOR
 {
+    //pEncapHeader may be a copy of the header only: ipPayloadLen is then the number of bytes available in it
     BOOLEAN(*ReadEncapsHeader)(_In_ const VOID* pEncapHeader, _Inout_ ULONG* pOffset, ULONG ipPayloadLen, _Out_ OF_PI_IPV4_TUNNEL* pTunnelInfo);
+
+    //optional: verifies the checksum of the encapsulation header, which covers its payload as well
+    BOOLEAN(*VerifyChecksum)(_In_ NET_BUFFER* pNb, ULONG encapOffset, ULONG encapFrameSize);
 }OVS_DECAPSULATOR, *POVS_DECAPSULATOR;
 
+//the outer headers of a received packet, parsed by Encap_ParseOuterHeaders
+typedef struct _OVS_OUTER_HEADERS
+{
+    //NULL if the packet is not encapsulated
+    const OVS_DECAPSULATOR* pDecapsulator;
+    BYTE encapProtocolType;
+
+    //the tunnel of port that receives the packet; OVS_INVALID_PORT_NUMBER if none
+    UINT16 ofPortNumber;
+
+    //the offset of the encapsulation header (GRE / UDP), from the start of the frame
+    ULONG encapOffset;
+    //the size of the outer ip payload, starting with the encapsulation header
+    ULONG ipPayloadLength;
+    //outer eth + ipv4 + encapsulation headers: the bytes removed by decapsulation
+    ULONG headersSize;
+
+    OF_PI_IPV4_TUNNEL tunnelInfo;
+}OVS_OUTER_HEADERS, *POVS_OUTER_HEADERS;
+
 /*************************************/
 
 BOOLEAN Encaps_EncapsulateOnb(_In_ const OVS_ENCAPSULATOR* pEncapsulator, _Inout_ OVS_OUTER_ENCAPSULATION_DATA* pData);
-VOID Gre_ComputeChecksum(VOID* pGreHeader, ULONG greHeaderSize, ULONG grePayloadSize);
+
+//finds, or builds and caches, the outer headers of the tunnel of pData->pOvsNb, in pData->outerHeaders.
+//pData->pOvsNb, encapProtocol and encapsHeadersSize must be set. fails if the mac of the remote end is not known yet.
+BOOLEAN Encaps_PrepareOuterHeaders(_In_ const OVS_ENCAPSULATOR* pEncapsulator, _In_ const BYTE externalMacAddress[OVS_ETHERNET_ADDRESS_LENGTH],
+    _Inout_ OVS_OUTER_ENCAPSULATION_DATA* pData);
 
 BOOLEAN Encaps_ComputeOuterEthHeader(_In_ const BYTE externalMacAddress[OVS_ETHERNET_ADDRESS_LENGTH], _In_ BYTE ipTargetOuter[4], _Inout_ OVS_ETHERNET_HEADER* pEthHeader);
 
-BOOLEAN Encaps_DecapsulateOnb(_In_ const OVS_DECAPSULATOR* pDecapsulator, _Inout_ OVS_NET_BUFFER* pOvsNb, _Out_ OF_PI_IPV4_TUNNEL* pTunnelInfo, BYTE encapProtocolType);
+//removes the outer headers parsed by Encap_ParseOuterHeaders
+BOOLEAN Encaps_DecapsulateOnb(_Inout_ OVS_NET_BUFFER* pOvsNb, _In_ const OVS_OUTER_HEADERS* pOuterHeaders);
 
-const OVS_DECAPSULATOR* Encap_FindDecapsulator(_In_ NET_BUFFER* pNb, _Inout_ BYTE* pEncapProtoType, _Inout_opt_ LE16* pUdpDestPort);
+//peeks only the outer headers of the packet: if it is encapsulated, pOuterHeaders->pDecapsulator is set and the tunnel info is read.
+//returns FALSE if the packet is encapsulated, but malformed
+BOOLEAN Encap_ParseOuterHeaders(_In_ NET_BUFFER* pNb, _Out_ OVS_OUTER_HEADERS* pOuterHeaders);
 
 const OVS_DECAPSULATOR* Encap_GetDecapsulator_Gre();
 const OVS_DECAPSULATOR* Encap_GetDecapsulator_Vxlan();
\ No newline at end of file
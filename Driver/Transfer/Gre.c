@@ -25,9 +25,35 @@ limitations under the License.
 #include "OvsNetBuffer.h"
 #include "Checksum.h"
 #include "Argument.h"
+#include "Driver.h"
+
+//the low 8 bits of the key (in network order), i.e. its last byte
+#define OVS_GRE_KEY_FLOW_ID_OFFSET      3
+
+static BOOLEAN g_greFlowId = FALSE;
 
 /*********************************************************************************/
 
+_Use_decl_annotations_
+VOID Gre_Initialize(PUNICODE_STRING pRegistryPath)
+{
+    g_greFlowId = (Driver_ReadParameter(pRegistryPath, OVS_GRE_FLOW_ID_VALUE, 0) != 0);
+
+    DEBUGP(LOG_INFO, "gre flow id: %s\n", g_greFlowId ? "on" : "off");
+}
+
+static __inline ULONG _Gre_KeyOffset(_In_ const OVS_GRE_HEADER_2890* pGreHeader)
+{
+    ULONG offset = sizeof(OVS_GRE_HEADER_2890);
+
+    if (pGreHeader->haveChecksum)
+    {
+        offset += sizeof(OVS_GRE2784_HEADER_OPT_CHECKSUM) + sizeof(OVS_GRE2784_HEADER_OPT_RESERVED1);
+    }
+
+    return offset;
+}
+
 ULONG Gre_HeaderSize(UINT16 tunnelFlags)
 {
     ULONG size = sizeof(OVS_GRE_HEADER_2890);
@@ -80,26 +106,19 @@ ULONG Gre_FrameHeaderSize(_In_ const OVS_GRE_HEADER_2890* pGre)
     return greSize;
 }
 
-OVS_GRE_HEADER_2890* Gre_BuildHeader(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _In_ const OVS_TUNNELING_PORT_OPTIONS* pPortOptions,
-    ULONG payloadLength, ULONG greHeaderSize, _Out_ BOOLEAN* pHaveChecksum)
+_Use_decl_annotations_
+BOOLEAN Gre_BuildHeader(const OF_PI_IPV4_TUNNEL* pTunnel, const OVS_TUNNELING_PORT_OPTIONS* pPortOptions,
+    ULONG greHeaderSize, VOID* pEncapHeader, BOOLEAN* pHaveChecksum)
 {
-    OVS_GRE_HEADER_2890* pGreHeader = NULL;
+    OVS_GRE_HEADER_2890* pGreHeader = pEncapHeader;
     ULONG computedSize = 0;
-    UINT16* pChecksum = NULL;
     UINT32* pSequence = NULL, *pKey = NULL;
     ULONG offset = sizeof(OVS_GRE_HEADER_2890);
 
-    UNREFERENCED_PARAMETER(payloadLength);
     UNREFERENCED_PARAMETER(pPortOptions);
 
     *pHaveChecksum = FALSE;
 
-    pGreHeader = KAlloc(greHeaderSize);
-    if (!pGreHeader)
-    {
-        return NULL;
-    }
-
     RtlZeroMemory(pGreHeader, greHeaderSize);
 
     //it's a word, therefore must be turned BE
@@ -112,8 +131,6 @@ OVS_GRE_HEADER_2890* Gre_BuildHeader(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _In_
 
     if (pTunnel->tunnelFlags & OVS_TUNNEL_FLAG_CHECKSUM)
     {
-        pChecksum = (UINT16*)((BYTE*)pGreHeader + offset);
-
         offset += sizeof(OVS_GRE2784_HEADER_OPT_CHECKSUM) + sizeof(OVS_GRE2784_HEADER_OPT_RESERVED1);
         pGreHeader->haveChecksum = 1;
         *pHaveChecksum = TRUE;
@@ -138,18 +155,48 @@ OVS_GRE_HEADER_2890* Gre_BuildHeader(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _In_
         pGreHeader->haveSeqNumber = 1;
     }
 
-    //NOTE: if checksum => checksum must be computed afterwards (due to ip checksum offload)
+    //NOTE: if checksum => checksum must be computed afterwards, for each packet
+
+    return TRUE;
+}
+
+_Use_decl_annotations_
+VOID Gre_SetFlowEntropy(VOID* pEncapHeader, UINT32 flowHash)
+{
+    OVS_GRE_HEADER_2890* pGreHeader = pEncapHeader;
+    BYTE* pKey = NULL;
+
+    if (!g_greFlowId || !pGreHeader->haveKey)
+    {
+        return;
+    }
+
+    pKey = (BYTE*)pGreHeader + _Gre_KeyOffset(pGreHeader);
+
+    //all 32 bits of the hash count
+    flowHash ^= flowHash >> 16;
+    flowHash ^= flowHash >> 8;
 
-    return pGreHeader;
+    pKey[OVS_GRE_KEY_FLOW_ID_OFFSET] = (BYTE)flowHash;
 }
 
-VOID Gre_ComputeChecksum(VOID* pGreHeader, ULONG greHeaderSize, ULONG grePayloadSize)
+_Use_decl_annotations_
+BOOLEAN Gre_ComputeChecksum(NET_BUFFER* pNb, ULONG greOffset, ULONG greHeaderSize, ULONG grePayloadSize, VOID* pGreHeader)
 {
     UINT16* pChecksum = (UINT16*)((BYTE*)pGreHeader + sizeof(OVS_GRE_HEADER_2890));
-    UINT16 checksum = (UINT16)ComputeIpChecksum((BYTE*)pGreHeader, grePayloadSize + greHeaderSize);
-    checksum = RtlUshortByteSwap(checksum);
+    UINT checksum = 0;
+
+    OVS_CHECK(*pChecksum == 0);
 
-    *pChecksum = checksum;
+    //the payload need not be contiguous with the header: the checksum is computed over the mdl chain
+    if (!ComputeIpChecksum_Nb(pNb, greOffset, greHeaderSize + grePayloadSize, &checksum))
+    {
+        return FALSE;
+    }
+
+    *pChecksum = RtlUshortByteSwap((UINT16)checksum);
+
+    return TRUE;
 }
 
 /*********************************************/
@@ -292,8 +339,8 @@ BOOLEAN Gre_ReadHeader(const VOID* pEncapHeader, ULONG* pOffset, ULONG outerIpPa
 {
     ULONG addOffset = sizeof(OVS_GRE_HEADER_2890);
     UINT32 key = 0, sequence = 0;
-    BYTE* pGreBuffer = (BYTE*)pEncapHeader;
-    OVS_GRE_HEADER_2890* pGreHeader = (OVS_GRE_HEADER_2890*)pEncapHeader;
+    const BYTE* pGreBuffer = (const BYTE*)pEncapHeader;
+    const OVS_GRE_HEADER_2890* pGreHeader = (const OVS_GRE_HEADER_2890*)pEncapHeader;
 
     OVS_CHECK(pOffset);
 
@@ -327,6 +374,13 @@ BOOLEAN Gre_ReadHeader(const VOID* pEncapHeader, ULONG* pOffset, ULONG outerIpPa
         return FALSE;
     }
 
+    //outerIpPayloadLen may be only the size of the peeked header: all optional fields must be within it
+    if (Gre_FrameHeaderSize(pGreHeader) > outerIpPayloadLen)
+    {
+        DEBUGP(LOG_ERROR, "gre header size (%d) > available bytes (%d)\n", Gre_FrameHeaderSize(pGreHeader), outerIpPayloadLen);
+        return FALSE;
+    }
+
     if (pGreHeader->haveChecksum)
     {
         /*
@@ -338,22 +392,9 @@ BOOLEAN Gre_ReadHeader(const VOID* pEncapHeader, ULONG* pOffset, ULONG outerIpPa
         packet.
         */
 
-        //the checksum field is the first UINT16 after the main GRE header
+        //the checksum covers the whole GRE payload, so it is verified by Gre_VerifyChecksum, when the packet is decapsulated:
+        //here we may have only the header
         ULONG checksumSize = sizeof(OVS_GRE2784_HEADER_OPT_CHECKSUM) + sizeof(OVS_GRE2784_HEADER_OPT_RESERVED1);
-        UINT16* pChecksum = (UINT16*)(pGreBuffer + sizeof(OVS_GRE_HEADER_2890));
-        UINT16 old_checksum = RtlUshortByteSwap(*pChecksum);
-
-        *pChecksum = 0;
-
-        UINT16 new_checksum = (UINT16)ComputeIpChecksum(pGreBuffer, outerIpPayloadLen);
-
-        if (new_checksum != old_checksum)
-        {
-            DEBUGP(LOG_ERROR, "GRE header has incorrect checksum: 0x%x; correct checksum = 0x%x\n", old_checksum, new_checksum);
-            return FALSE;
-        }
-
-        *pChecksum = RtlUshortByteSwap(old_checksum);
 
         addOffset += checksumSize;
         pTunnelInfo->tunnelFlags |= OVS_TUNNEL_FLAG_CHECKSUM;
@@ -367,7 +408,13 @@ BOOLEAN Gre_ReadHeader(const VOID* pEncapHeader, ULONG* pOffset, ULONG outerIpPa
         not present in the GRE header.
         */
 
-        key = *(UINT32*)(pGreBuffer + addOffset);
+        key = *(const UINT32*)(pGreBuffer + addOffset);
+
+        //the FlowID is per flow, not per tunnel: the tunnel is found by the rest of the key
+        if (g_greFlowId)
+        {
+            ((BYTE*)&key)[OVS_GRE_KEY_FLOW_ID_OFFSET] = 0;
+        }
 
         addOffset += sizeof(OVS_GRE1701_HEADER_OPT_KEY);
         pTunnelInfo->tunnelFlags |= OVS_TUNNEL_FLAG_KEY;
@@ -381,7 +428,7 @@ BOOLEAN Gre_ReadHeader(const VOID* pEncapHeader, ULONG* pOffset, ULONG outerIpPa
         Sequence Number field is not present in the GRE header.
         */
 
-        sequence = *(UINT32*)(pGreBuffer + addOffset);
+        sequence = *(const UINT32*)(pGreBuffer + addOffset);
 
         addOffset += sizeof(OVS_GRE1701_HEADER_OPT_SEQNUMBER);
         pTunnelInfo->tunnelFlags |= OVS_TUNNEL_FLAG_SEQ;
@@ -390,5 +437,26 @@ BOOLEAN Gre_ReadHeader(const VOID* pEncapHeader, ULONG* pOffset, ULONG outerIpPa
     pTunnelInfo->tunnelId = MAKEQWORD(sequence, key);
     *pOffset += addOffset;
 
+    return TRUE;
+}
+
+_Use_decl_annotations_
+BOOLEAN Gre_VerifyChecksum(NET_BUFFER* pNb, ULONG greOffset, ULONG greFrameSize)
+{
+    UINT checksum = 0;
+
+    //the gre frame need not be contiguous: the checksum is computed over the mdl chain
+    if (!ComputeIpChecksum_Nb(pNb, greOffset, greFrameSize, &checksum))
+    {
+        return FALSE;
+    }
+
+    //with the checksum field included, the one's complement sum of a correct frame is 0xFFFF, i.e. its complement is 0
+    if ((UINT16)checksum != 0)
+    {
+        DEBUGP(LOG_ERROR, "GRE frame has incorrect checksum: remainder = 0x%x\n", (UINT16)checksum);
+        return FALSE;
+    }
+
     return TRUE;
 }
\ No newline at end of file
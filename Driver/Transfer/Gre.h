@@ -241,8 +241,16 @@ C_ASSERT(sizeof(OVS_GRE_HEADER_2890) == 4);
 //NOTE: the fields: checksum, key, etc. follow the base gre header
 #define OVS_MAX_GRE_HEADER_SIZE 16
 
+//the driver's registry Parameters value: if non-zero, the low 8 bits of the GRE key carry the hash of the inner flow, as the
+//FlowID of NVGRE (RFC 7637), and they are ignored on receive: the keys of the gre tunnels must then fit in their upper 24 bits (the VSID).
+//Off by default: it changes the key the remote end sees.
+#define OVS_GRE_FLOW_ID_VALUE       L"GreFlowId"
+
 /****************************************/
 
+//reads the FlowID setting from the driver's registry key. Called once, at driver load.
+VOID Gre_Initialize(_In_ PUNICODE_STRING pRegistryPath);
+
 //encapsulation size in bytes required by Gre (i.e. gre + ipv4 + ethernet headers)
 ULONG Gre_BytesNeeded(UINT16 tunnelFlags);
 
@@ -256,10 +264,17 @@ ULONG Gre_FrameHeaderSize(_In_ const OVS_GRE_HEADER_2890* pGre);
 
 BYTE* VerifyGreHeader(_In_ BYTE* buffer, _Inout_ ULONG* pLength, _Inout_ UINT16* ethType);
 
-OVS_GRE_HEADER_2890* Gre_BuildHeader(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _In_ const OVS_TUNNELING_PORT_OPTIONS* pPortOptions,
-    ULONG payloadLength, ULONG greHeaderSize, _Out_ BOOLEAN* pHaveChecksum);
+//writes the GRE header of the outer header template: it does not depend on the payload, except for the checksum and the FlowID
+BOOLEAN Gre_BuildHeader(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _In_ const OVS_TUNNELING_PORT_OPTIONS* pPortOptions,
+    ULONG greHeaderSize, _Out_writes_bytes_(greHeaderSize) VOID* pEncapHeader, _Out_ BOOLEAN* pHaveChecksum);
+//writes the FlowID in the key, if enabled (see OVS_GRE_FLOW_ID_VALUE) and if the header has a key. Must precede the checksum.
+VOID Gre_SetFlowEntropy(_Inout_ VOID* pEncapHeader, UINT32 flowHash);
 
 BOOLEAN Gre_ReadHeader(_In_ const VOID* pEncapHeader, _Inout_ ULONG* pOffset, ULONG outerIpPayloadLen, _Out_ OF_PI_IPV4_TUNNEL* pTunnelInfo);
+//writes the checksum of the GRE header at greOffset in the NET_BUFFER data (pGreHeader), which covers its payload as well
+BOOLEAN Gre_ComputeChecksum(_In_ NET_BUFFER* pNb, ULONG greOffset, ULONG greHeaderSize, ULONG grePayloadSize, _Inout_ VOID* pGreHeader);
+//greOffset: the offset of the GRE header in the NET_BUFFER data; greFrameSize: the GRE header + the GRE payload
+BOOLEAN Gre_VerifyChecksum(_In_ NET_BUFFER* pNb, ULONG greOffset, ULONG greFrameSize);
 
 //buffer: the net buffer starting with the GRE protocol
 //dbg prints GRE info and calls ReadIpv4ProtocolFrame
@@ -0,0 +1,635 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "precomp.h"
+#include "Ipv4Reassembly.h"
+#include "OvsNetBuffer.h"
+#include "Nbls.h"
+#include "Ipv4.h"
+#include "Checksum.h"
+#include "Encapsulator.h"
+#include "TunnelDemux.h"
+#include "Switch.h"
+#include "Driver.h"
+#include "SeqTable.h"
+
+typedef struct _OVS_IPV4_REASSEMBLY_KEY
+{
+    BE32        ipv4Source;
+    BE32        ipv4Destination;
+    BE16        identification;
+    UINT8       protocol;
+    UINT8       reserved;
+}OVS_IPV4_REASSEMBLY_KEY, *POVS_IPV4_REASSEMBLY_KEY;
+
+C_ASSERT(sizeof(OVS_IPV4_REASSEMBLY_KEY) == 12);
+
+//the fragment being added
+typedef struct _OVS_IPV4_FRAGMENT
+{
+    OVS_IPV4_REASSEMBLY_KEY key;
+
+    //in bytes, from the start of the ip payload of the packet
+    ULONG       offset;
+    ULONG       payloadSize;
+    BOOLEAN     isLast;
+
+    //what the fragment is charged to the memory limit: its buffer, including the headroom
+    ULONG       bufferSize;
+}OVS_IPV4_FRAGMENT, *POVS_IPV4_FRAGMENT;
+
+typedef struct _OVS_IPV4_REASSEMBLY_ENTRY
+{
+    //KeQueryInterruptTime when the first fragment was held; 0 = free entry
+    LONG64              created;
+
+    OVS_IPV4_REASSEMBLY_KEY key;
+
+    //the fragments held, sorted by offset; and, for each, its offset, size and charge
+    OVS_NET_BUFFER*     fragments[OVS_IPV4_REASSEMBLY_MAX_FRAGMENTS];
+    ULONG               offsets[OVS_IPV4_REASSEMBLY_MAX_FRAGMENTS];
+    ULONG               payloadSizes[OVS_IPV4_REASSEMBLY_MAX_FRAGMENTS];
+    ULONG               count;
+
+    //the size of the ip payload of the packet: known once the last fragment is held; 0 until then
+    ULONG               totalPayloadSize;
+    //the ip payload bytes held: the fragments do not overlap, so the packet is complete when this is totalPayloadSize
+    ULONG               payloadBytes;
+    ULONG               bufferBytes;
+}OVS_IPV4_REASSEMBLY_ENTRY, *POVS_IPV4_REASSEMBLY_ENTRY;
+
+typedef struct _OVS_IPV4_REASSEMBLY
+{
+    //set at driver load. maxBytes = 0: reassembly is disabled
+    ULONG                       maxBytes;
+    //100ns units
+    LONG64                      timeout;
+
+    //serializes all the access to the entries: only fragments take it
+    NDIS_SPIN_LOCK              lock;
+    ULONG                       bufferBytes;
+    OVS_IPV4_REASSEMBLY_ENTRY   entries[OVS_IPV4_REASSEMBLY_BUCKETS][OVS_IPV4_REASSEMBLY_WAYS];
+
+    //updated with interlocked operations
+    OVS_IPV4_REASSEMBLY_STATS   stats;
+}OVS_IPV4_REASSEMBLY, *POVS_IPV4_REASSEMBLY;
+
+static OVS_IPV4_REASSEMBLY g_ipv4Reassembly;
+
+static OVS_IPV4_REASSEMBLY_ENTRY* _Ipv4Reassembly_GetBucket(_In_ const OVS_IPV4_REASSEMBLY_KEY* pKey)
+{
+    UINT64 hash = ((UINT64)pKey->ipv4Source << 32) | pKey->ipv4Destination;
+
+    hash ^= ((UINT64)pKey->identification << 8) | pKey->protocol;
+
+    return g_ipv4Reassembly.entries[SeqTable_GetBucketIndex(hash, OVS_IPV4_REASSEMBLY_BUCKETS)];
+}
+
+static __inline BOOLEAN _Ipv4Reassembly_HasTimedOut(_In_ const OVS_IPV4_REASSEMBLY_ENTRY* pEntry, LONG64 now)
+{
+    return pEntry->created != 0 && !SeqTable_IsAlive(pEntry->created, now, g_ipv4Reassembly.timeout);
+}
+
+/* Only the GRE / UDP fragments addressed to the host (i.e. to the mac of the management os) are held, and only while
+there are tunnel ports: the tunnel endpoint of the host is an address of the management os. */
+static BOOLEAN _Ipv4Reassembly_ParseFragment(_In_ OVS_NET_BUFFER* pOvsNb, _In_ const BYTE hostMac[OVS_ETHERNET_ADDRESS_LENGTH],
+    _Out_ OVS_IPV4_FRAGMENT* pFragment)
+{
+    const OVS_ETHERNET_HEADER* pEthHeader = NULL;
+    const OVS_IPV4_HEADER* pIpv4Header = NULL;
+    ULONG frameSize = 0, ipHeaderSize = 0, totalLength = 0;
+
+    RtlZeroMemory(pFragment, sizeof(OVS_IPV4_FRAGMENT));
+
+    frameSize = ONB_GetDataLength(pOvsNb);
+    if (frameSize < sizeof(OVS_ETHERNET_HEADER) + sizeof(OVS_IPV4_HEADER))
+    {
+        return FALSE;
+    }
+
+    pEthHeader = ONB_GetDataOfSize(pOvsNb, sizeof(OVS_ETHERNET_HEADER) + sizeof(OVS_IPV4_HEADER));
+    if (pEthHeader->type != RtlUshortByteSwap(OVS_ETHERTYPE_IPV4) ||
+        memcmp(pEthHeader->destination_addr, hostMac, OVS_ETHERNET_ADDRESS_LENGTH))
+    {
+        return FALSE;
+    }
+
+    pIpv4Header = (const OVS_IPV4_HEADER*)(pEthHeader + 1);
+
+    if (!pIpv4Header->MoreFragments && Ipv4_GetFragmentOffset(pIpv4Header) == 0)
+    {
+        return FALSE;
+    }
+
+    if (pIpv4Header->Protocol != OVS_IPPROTO_GRE && pIpv4Header->Protocol != OVS_IPPROTO_UDP)
+    {
+        return FALSE;
+    }
+
+    if (!TunnelDemux_HavePorts())
+    {
+        return FALSE;
+    }
+
+    ipHeaderSize = pIpv4Header->HeaderLength * sizeof(DWORD);
+    totalLength = RtlUshortByteSwap(pIpv4Header->TotalLength);
+
+    //the frame may be longer, if it was padded
+    if (ipHeaderSize < sizeof(OVS_IPV4_HEADER) || totalLength <= ipHeaderSize || totalLength > frameSize - sizeof(OVS_ETHERNET_HEADER))
+    {
+        return FALSE;
+    }
+
+    pFragment->key.ipv4Source = pIpv4Header->SourceAddress.S_un.S_addr;
+    pFragment->key.ipv4Destination = pIpv4Header->DestinationAddress.S_un.S_addr;
+    pFragment->key.identification = pIpv4Header->Identification;
+    pFragment->key.protocol = pIpv4Header->Protocol;
+
+    pFragment->offset = Ipv4_GetFragmentOffset(pIpv4Header) * 8;
+    pFragment->payloadSize = totalLength - ipHeaderSize;
+    pFragment->isLast = !pIpv4Header->MoreFragments;
+    pFragment->bufferSize = ONB_GetDataOffset(pOvsNb) + frameSize;
+
+    return TRUE;
+}
+
+//must be called under the lock. The fragments are moved to pFragments, if given; otherwise, they are destroyed
+static VOID _Ipv4Reassembly_FreeEntry_Unsafe(_Inout_ OVS_IPV4_REASSEMBLY_ENTRY* pEntry, _Out_opt_ OVS_IPV4_REASSEMBLY_FRAGMENTS* pFragments)
+{
+    ULONG i = 0;
+
+    if (pFragments)
+    {
+        RtlCopyMemory(pFragments->fragments, pEntry->fragments, pEntry->count * sizeof(OVS_NET_BUFFER*));
+        pFragments->count = pEntry->count;
+    }
+    else
+    {
+        for (i = 0; i < pEntry->count; ++i)
+        {
+            ONB_Destroy(pEntry->fragments[i]->pSwitchInfo, &pEntry->fragments[i]);
+        }
+    }
+
+    OVS_CHECK(g_ipv4Reassembly.bufferBytes >= pEntry->bufferBytes);
+    g_ipv4Reassembly.bufferBytes -= pEntry->bufferBytes;
+
+    RtlZeroMemory(pEntry, sizeof(OVS_IPV4_REASSEMBLY_ENTRY));
+}
+
+//must be called under the lock. Drops the packets that timed out, in all buckets
+static VOID _Ipv4Reassembly_Expire_Unsafe(LONG64 now)
+{
+    ULONG i = 0, j = 0;
+
+    for (i = 0; i < OVS_IPV4_REASSEMBLY_BUCKETS; ++i)
+    {
+        for (j = 0; j < OVS_IPV4_REASSEMBLY_WAYS; ++j)
+        {
+            OVS_IPV4_REASSEMBLY_ENTRY* pEntry = &g_ipv4Reassembly.entries[i][j];
+
+            if (_Ipv4Reassembly_HasTimedOut(pEntry, now))
+            {
+                InterlockedIncrement64(&g_ipv4Reassembly.stats.packetsTimedOut);
+                _Ipv4Reassembly_FreeEntry_Unsafe(pEntry, NULL);
+            }
+        }
+    }
+}
+
+//must be called under the lock. Finds the entry of the packet; or takes a free one, dropping the packets that timed out
+//or, if the bucket is full, the oldest one
+static OVS_IPV4_REASSEMBLY_ENTRY* _Ipv4Reassembly_GetEntry_Unsafe(_In_ const OVS_IPV4_REASSEMBLY_KEY* pKey, LONG64 now)
+{
+    OVS_IPV4_REASSEMBLY_ENTRY* pBucket = _Ipv4Reassembly_GetBucket(pKey);
+    OVS_IPV4_REASSEMBLY_ENTRY* pTarget = NULL;
+    ULONG i = 0;
+
+    for (i = 0; i < OVS_IPV4_REASSEMBLY_WAYS; ++i)
+    {
+        OVS_IPV4_REASSEMBLY_ENTRY* pEntry = &pBucket[i];
+
+        if (_Ipv4Reassembly_HasTimedOut(pEntry, now))
+        {
+            InterlockedIncrement64(&g_ipv4Reassembly.stats.packetsTimedOut);
+            _Ipv4Reassembly_FreeEntry_Unsafe(pEntry, NULL);
+        }
+
+        if (pEntry->created != 0 && RtlEqualMemory(&pEntry->key, pKey, sizeof(OVS_IPV4_REASSEMBLY_KEY)))
+        {
+            return pEntry;
+        }
+
+        //free entries have created = 0: they are the oldest
+        if (!pTarget || pEntry->created < pTarget->created)
+        {
+            pTarget = pEntry;
+        }
+    }
+
+    OVS_CHECK(pTarget);
+
+    if (pTarget->created != 0)
+    {
+        InterlockedIncrement64(&g_ipv4Reassembly.stats.packetsEvicted);
+        _Ipv4Reassembly_FreeEntry_Unsafe(pTarget, NULL);
+    }
+
+    pTarget->key = *pKey;
+    pTarget->created = now;
+
+    return pTarget;
+}
+
+typedef enum
+{
+    OVS_IPV4_FRAGMENT_INSERTED,
+    OVS_IPV4_FRAGMENT_DUPLICATE,
+    OVS_IPV4_FRAGMENT_INVALID
+}OVS_IPV4_FRAGMENT_INSERT;
+
+//must be called under the lock. Overlapping fragments are not expected from a tunnel endpoint: they invalidate the packet
+static OVS_IPV4_FRAGMENT_INSERT _Ipv4Reassembly_Insert_Unsafe(_Inout_ OVS_IPV4_REASSEMBLY_ENTRY* pEntry, _In_ OVS_NET_BUFFER* pOvsNb,
+    _In_ const OVS_IPV4_FRAGMENT* pFragment)
+{
+    ULONG end = pFragment->offset + pFragment->payloadSize;
+    ULONG i = 0, position = 0;
+
+    //the ip payload of the reassembled packet must fit in the total length
+    if (end > MAXUINT16 - sizeof(OVS_IPV4_HEADER))
+    {
+        return OVS_IPV4_FRAGMENT_INVALID;
+    }
+
+    //only the last fragment may have a size that is not a multiple of 8
+    if (!pFragment->isLast && (pFragment->payloadSize % 8))
+    {
+        return OVS_IPV4_FRAGMENT_INVALID;
+    }
+
+    if (pFragment->isLast)
+    {
+        if (pEntry->totalPayloadSize && pEntry->totalPayloadSize != end)
+        {
+            return OVS_IPV4_FRAGMENT_INVALID;
+        }
+    }
+    else if (pEntry->totalPayloadSize && end > pEntry->totalPayloadSize)
+    {
+        return OVS_IPV4_FRAGMENT_INVALID;
+    }
+
+    for (position = 0; position < pEntry->count && pEntry->offsets[position] < pFragment->offset; ++position)
+    {
+        continue;
+    }
+
+    if (position < pEntry->count && pEntry->offsets[position] == pFragment->offset &&
+        pEntry->payloadSizes[position] == pFragment->payloadSize)
+    {
+        return OVS_IPV4_FRAGMENT_DUPLICATE;
+    }
+
+    if (position > 0 && pEntry->offsets[position - 1] + pEntry->payloadSizes[position - 1] > pFragment->offset)
+    {
+        return OVS_IPV4_FRAGMENT_INVALID;
+    }
+
+    if (position < pEntry->count && end > pEntry->offsets[position])
+    {
+        return OVS_IPV4_FRAGMENT_INVALID;
+    }
+
+    //the last fragment must be the one with the highest offset
+    if (pEntry->totalPayloadSize == 0 && pFragment->isLast && position < pEntry->count)
+    {
+        return OVS_IPV4_FRAGMENT_INVALID;
+    }
+
+    if (pEntry->count == OVS_IPV4_REASSEMBLY_MAX_FRAGMENTS)
+    {
+        return OVS_IPV4_FRAGMENT_INVALID;
+    }
+
+    for (i = pEntry->count; i > position; --i)
+    {
+        pEntry->fragments[i] = pEntry->fragments[i - 1];
+        pEntry->offsets[i] = pEntry->offsets[i - 1];
+        pEntry->payloadSizes[i] = pEntry->payloadSizes[i - 1];
+    }
+
+    pEntry->fragments[position] = pOvsNb;
+    pEntry->offsets[position] = pFragment->offset;
+    pEntry->payloadSizes[position] = pFragment->payloadSize;
+    ++pEntry->count;
+
+    if (pFragment->isLast)
+    {
+        pEntry->totalPayloadSize = end;
+    }
+
+    pEntry->payloadBytes += pFragment->payloadSize;
+    pEntry->bufferBytes += pFragment->bufferSize;
+    g_ipv4Reassembly.bufferBytes += pFragment->bufferSize;
+
+    return OVS_IPV4_FRAGMENT_INSERTED;
+}
+
+/* Builds the packet: the eth and ipv4 headers of the first fragment, followed by the payloads of all fragments; the ipv4 total length,
+flags and fragment offset are fixed, and the header checksum is updated incrementally. The first ONB gets the new NBL, with the NBL info
+of the first fragment; the others are destroyed. Returns NULL if the packet cannot be allocated: the fragments are kept. */
+static OVS_NET_BUFFER* _Ipv4Reassembly_Build(_Inout_ OVS_IPV4_REASSEMBLY_FRAGMENTS* pFragments)
+{
+    OVS_NET_BUFFER* pFirstOnb = pFragments->fragments[0];
+    OVS_SWITCH_INFO* pSwitchInfo = pFirstOnb->pSwitchInfo;
+    const BYTE* pFirstFrame = NULL;
+    const OVS_IPV4_HEADER* pFirstIpv4Header = NULL;
+    OVS_IPV4_HEADER* pIpv4Header = NULL;
+    NET_BUFFER* pNb = NULL;
+    NET_BUFFER_LIST* pNbl = NULL;
+    PNDIS_SWITCH_FORWARDING_DETAIL_NET_BUFFER_LIST_INFO pFwdDetail = NULL;
+    NDIS_STATUS status = NDIS_STATUS_SUCCESS;
+    OVS_CHECKSUM_DELTA delta = 0;
+    BYTE* pFrame = NULL;
+    ULONG headersSize = 0, frameSize = 0, offset = 0, i = 0;
+    BE16 totalLength = 0, flagsAndOffset = 0;
+
+    pFirstFrame = ONB_GetDataOfSize(pFirstOnb, sizeof(OVS_ETHERNET_HEADER) + sizeof(OVS_IPV4_HEADER));
+    pFirstIpv4Header = (const OVS_IPV4_HEADER*)(pFirstFrame + sizeof(OVS_ETHERNET_HEADER));
+    headersSize = sizeof(OVS_ETHERNET_HEADER) + pFirstIpv4Header->HeaderLength * sizeof(DWORD);
+
+    frameSize = headersSize;
+    for (i = 0; i < pFragments->count; ++i)
+    {
+        const OVS_IPV4_HEADER* pFragmentHeader = (const OVS_IPV4_HEADER*)((const BYTE*)ONB_GetDataOfSize(pFragments->fragments[i],
+            sizeof(OVS_ETHERNET_HEADER) + sizeof(OVS_IPV4_HEADER)) + sizeof(OVS_ETHERNET_HEADER));
+
+        frameSize += RtlUshortByteSwap(pFragmentHeader->TotalLength) - pFragmentHeader->HeaderLength * sizeof(DWORD);
+    }
+
+    if (frameSize - sizeof(OVS_ETHERNET_HEADER) > MAXUINT16)
+    {
+        return NULL;
+    }
+
+    //the same headroom as the received packets, for a later encapsulation
+    pNb = ONB_CreateNb(frameSize, ONB_GetDataOffset(pFirstOnb));
+    if (!pNb)
+    {
+        return NULL;
+    }
+
+    //the buffer was allocated by us, so its data is contiguous => NdisGetDataBuffer will succeed
+    pFrame = NdisGetDataBuffer(pNb, frameSize, NULL, 1, 0);
+    OVS_CHECK(pFrame);
+
+    pFirstFrame = ONB_GetDataOfSize(pFirstOnb, headersSize);
+    RtlCopyMemory(pFrame, pFirstFrame, headersSize);
+    offset = headersSize;
+
+    //the fragments are sorted and do not overlap: their payloads are contiguous
+    for (i = 0; i < pFragments->count; ++i)
+    {
+        const BYTE* pFragmentFrame = ONB_GetData(pFragments->fragments[i]);
+        const OVS_IPV4_HEADER* pFragmentHeader = (const OVS_IPV4_HEADER*)(pFragmentFrame + sizeof(OVS_ETHERNET_HEADER));
+        ULONG ipHeaderSize = pFragmentHeader->HeaderLength * sizeof(DWORD);
+        ULONG payloadSize = RtlUshortByteSwap(pFragmentHeader->TotalLength) - ipHeaderSize;
+
+        OVS_CHECK(offset - headersSize == Ipv4_GetFragmentOffset(pFragmentHeader) * 8);
+
+        RtlCopyMemory(pFrame + offset, (const BYTE*)pFragmentHeader + ipHeaderSize, payloadSize);
+        offset += payloadSize;
+    }
+
+    OVS_CHECK(offset == frameSize);
+
+    pIpv4Header = (OVS_IPV4_HEADER*)(pFrame + sizeof(OVS_ETHERNET_HEADER));
+    totalLength = RtlUshortByteSwap((UINT16)(frameSize - sizeof(OVS_ETHERNET_HEADER)));
+
+    //keeps DF; clears MF and the fragment offset
+    flagsAndOffset = pIpv4Header->FlagsAndOffset;
+    pIpv4Header->MoreFragments = 0;
+    Ipv4_SetFragmentOffset(pIpv4Header, 0);
+
+    ChecksumDelta_Replace2(&delta, flagsAndOffset, pIpv4Header->FlagsAndOffset);
+    ChecksumDelta_Replace2(&delta, pIpv4Header->TotalLength, totalLength);
+    pIpv4Header->TotalLength = totalLength;
+    pIpv4Header->HeaderChecksum = Checksum_ApplyDelta(pIpv4Header->HeaderChecksum, delta);
+
+    pNbl = ONB_CreateNblFromNb(pNb, MEMORY_ALLOCATION_ALIGNMENT);
+    if (!pNbl)
+    {
+        ONB_FreeNbChain(pNb);
+        return NULL;
+    }
+
+    status = pSwitchInfo->switchHandlers.CopyNetBufferListInfo(pSwitchInfo->switchContext, pNbl, pFirstOnb->pNbl, 0);
+    if (status != NDIS_STATUS_SUCCESS)
+    {
+        OVS_CHECK(0);
+        FreeDuplicateNbl(pSwitchInfo, pNbl);
+        return NULL;
+    }
+
+    pFwdDetail = NET_BUFFER_LIST_SWITCH_FORWARDING_DETAIL(pNbl);
+    pFwdDetail->IsPacketDataSafe = TRUE;
+
+    ONB_DestroyNbl(pFirstOnb);
+    pFirstOnb->pNbl = pNbl;
+
+    for (i = 1; i < pFragments->count; ++i)
+    {
+        ONB_Destroy(pSwitchInfo, &pFragments->fragments[i]);
+    }
+
+    pFragments->fragments[0] = NULL;
+    pFragments->count = 0;
+
+    return pFirstOnb;
+}
+
+_Use_decl_annotations_
+VOID Ipv4Reassembly_Initialize(PUNICODE_STRING pRegistryPath)
+{
+    ULONG maxBytes = 0, timeout = 0;
+
+    RtlZeroMemory(&g_ipv4Reassembly, sizeof(OVS_IPV4_REASSEMBLY));
+    NdisAllocateSpinLock(&g_ipv4Reassembly.lock);
+
+    maxBytes = Driver_ReadParameter(pRegistryPath, OVS_IPV4_REASSEMBLY_MAX_BYTES_VALUE, OVS_IPV4_REASSEMBLY_DEFAULT_MAX_BYTES);
+    timeout = Driver_ReadParameter(pRegistryPath, OVS_IPV4_REASSEMBLY_TIMEOUT_VALUE, OVS_IPV4_REASSEMBLY_DEFAULT_TIMEOUT);
+
+    g_ipv4Reassembly.maxBytes = maxBytes;
+    g_ipv4Reassembly.timeout = (LONG64)max(timeout, 1) * 10000;
+
+    DEBUGP(LOG_INFO, "outer ipv4 reassembly: max bytes = %d; timeout = %d ms\n", maxBytes, timeout);
+}
+
+VOID Ipv4Reassembly_Uninitialize()
+{
+    OVS_CHECK(g_ipv4Reassembly.bufferBytes == 0);
+
+    NdisFreeSpinLock(&g_ipv4Reassembly.lock);
+}
+
+_Use_decl_annotations_
+VOID Ipv4Reassembly_GetStats(OVS_IPV4_REASSEMBLY_STATS* pStats)
+{
+    pStats->packetsReassembled = InterlockedCompareExchange64(&g_ipv4Reassembly.stats.packetsReassembled, 0, 0);
+    pStats->fragmentsReassembled = InterlockedCompareExchange64(&g_ipv4Reassembly.stats.fragmentsReassembled, 0, 0);
+    pStats->packetsReleased = InterlockedCompareExchange64(&g_ipv4Reassembly.stats.packetsReleased, 0, 0);
+    pStats->packetsTimedOut = InterlockedCompareExchange64(&g_ipv4Reassembly.stats.packetsTimedOut, 0, 0);
+    pStats->packetsEvicted = InterlockedCompareExchange64(&g_ipv4Reassembly.stats.packetsEvicted, 0, 0);
+    pStats->packetsMalformed = InterlockedCompareExchange64(&g_ipv4Reassembly.stats.packetsMalformed, 0, 0);
+    pStats->buildFailures = InterlockedCompareExchange64(&g_ipv4Reassembly.stats.buildFailures, 0, 0);
+    pStats->fragmentsDropped = InterlockedCompareExchange64(&g_ipv4Reassembly.stats.fragmentsDropped, 0, 0);
+}
+
+_Use_decl_annotations_
+OVS_IPV4_REASSEMBLY_RESULT Ipv4Reassembly_Add(OVS_NET_BUFFER** ppOvsNb, const BYTE hostMac[OVS_ETHERNET_ADDRESS_LENGTH],
+    OVS_IPV4_REASSEMBLY_FRAGMENTS* pReleased)
+{
+    OVS_NET_BUFFER* pOvsNb = *ppOvsNb;
+    OVS_IPV4_FRAGMENT fragment = { 0 };
+    OVS_IPV4_REASSEMBLY_ENTRY* pEntry = NULL;
+    OVS_OUTER_HEADERS outerHeaders = { 0 };
+    OVS_NET_BUFFER* pPacket = NULL;
+    LONG64 now = 0;
+    BOOLEAN complete = FALSE;
+
+    pReleased->count = 0;
+
+    if (g_ipv4Reassembly.maxBytes == 0 || !_Ipv4Reassembly_ParseFragment(pOvsNb, hostMac, &fragment))
+    {
+        return OVS_IPV4_REASSEMBLY_NONE;
+    }
+
+    //from here on, the fragment is owned by the cache, or dropped
+    *ppOvsNb = NULL;
+    now = (LONG64)KeQueryInterruptTime();
+
+    NdisAcquireSpinLock(&g_ipv4Reassembly.lock);
+
+    if (g_ipv4Reassembly.bufferBytes + fragment.bufferSize > g_ipv4Reassembly.maxBytes)
+    {
+        _Ipv4Reassembly_Expire_Unsafe(now);
+
+        if (g_ipv4Reassembly.bufferBytes + fragment.bufferSize > g_ipv4Reassembly.maxBytes)
+        {
+            NdisReleaseSpinLock(&g_ipv4Reassembly.lock);
+
+            InterlockedIncrement64(&g_ipv4Reassembly.stats.fragmentsDropped);
+            ONB_Destroy(pOvsNb->pSwitchInfo, &pOvsNb);
+            return OVS_IPV4_REASSEMBLY_HELD;
+        }
+    }
+
+    pEntry = _Ipv4Reassembly_GetEntry_Unsafe(&fragment.key, now);
+
+    switch (_Ipv4Reassembly_Insert_Unsafe(pEntry, pOvsNb, &fragment))
+    {
+    case OVS_IPV4_FRAGMENT_INSERTED:
+        complete = (pEntry->totalPayloadSize && pEntry->payloadBytes == pEntry->totalPayloadSize);
+
+        if (complete)
+        {
+            _Ipv4Reassembly_FreeEntry_Unsafe(pEntry, pReleased);
+        }
+
+        pOvsNb = NULL;
+        break;
+
+    case OVS_IPV4_FRAGMENT_DUPLICATE:
+        InterlockedIncrement64(&g_ipv4Reassembly.stats.fragmentsDropped);
+        break;
+
+    default:
+        InterlockedIncrement64(&g_ipv4Reassembly.stats.packetsMalformed);
+        _Ipv4Reassembly_FreeEntry_Unsafe(pEntry, NULL);
+        break;
+    }
+
+    NdisReleaseSpinLock(&g_ipv4Reassembly.lock);
+
+    //the fragment was not held
+    if (pOvsNb)
+    {
+        ONB_Destroy(pOvsNb->pSwitchInfo, &pOvsNb);
+    }
+
+    if (!complete)
+    {
+        return OVS_IPV4_REASSEMBLY_HELD;
+    }
+
+    //only the first fragment has the encapsulation header
+    Encap_ParseOuterHeaders(ONB_GetNetBuffer(pReleased->fragments[0]), &outerHeaders);
+
+    if (!outerHeaders.pDecapsulator)
+    {
+        InterlockedIncrement64(&g_ipv4Reassembly.stats.packetsReleased);
+        return OVS_IPV4_REASSEMBLY_RELEASED;
+    }
+
+    InterlockedAdd64(&g_ipv4Reassembly.stats.fragmentsReassembled, pReleased->count);
+
+    pPacket = _Ipv4Reassembly_Build(pReleased);
+    if (!pPacket)
+    {
+        ULONG i = 0;
+
+        DEBUGP(LOG_ERROR, __FUNCTION__ " could not allocate the reassembled packet\n");
+
+        InterlockedIncrement64(&g_ipv4Reassembly.stats.buildFailures);
+
+        for (i = 0; i < pReleased->count; ++i)
+        {
+            ONB_Destroy(pReleased->fragments[i]->pSwitchInfo, &pReleased->fragments[i]);
+        }
+
+        pReleased->count = 0;
+        return OVS_IPV4_REASSEMBLY_HELD;
+    }
+
+    InterlockedIncrement64(&g_ipv4Reassembly.stats.packetsReassembled);
+
+    *ppOvsNb = pPacket;
+    return OVS_IPV4_REASSEMBLY_DONE;
+}
+
+_Use_decl_annotations_
+VOID Ipv4Reassembly_DropSwitch(const OVS_SWITCH_INFO* pSwitchInfo)
+{
+    ULONG i = 0, j = 0;
+
+    NdisAcquireSpinLock(&g_ipv4Reassembly.lock);
+
+    for (i = 0; i < OVS_IPV4_REASSEMBLY_BUCKETS; ++i)
+    {
+        for (j = 0; j < OVS_IPV4_REASSEMBLY_WAYS; ++j)
+        {
+            OVS_IPV4_REASSEMBLY_ENTRY* pEntry = &g_ipv4Reassembly.entries[i][j];
+
+            //all the fragments of a packet come from the same external nic
+            if (pEntry->created != 0 && pEntry->fragments[0]->pSwitchInfo == pSwitchInfo)
+            {
+                _Ipv4Reassembly_FreeEntry_Unsafe(pEntry, NULL);
+            }
+        }
+    }
+
+    NdisReleaseSpinLock(&g_ipv4Reassembly.lock);
+}
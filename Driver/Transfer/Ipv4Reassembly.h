@@ -0,0 +1,98 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "precomp.h"
+#include "Ethernet.h"
+
+typedef struct _OVS_NET_BUFFER OVS_NET_BUFFER;
+typedef struct _OVS_SWITCH_INFO OVS_SWITCH_INFO;
+
+/* OUTER IPV4 REASSEMBLY: when the underlay fragments a GRE / VXLAN packet, only its first fragment has the encapsulation header.
+The GRE / UDP fragments received from the external nic, addressed to the host, are held until the whole outer packet can be rebuilt
+and decapsulated. The fragments of packets that turn out not to be tunneled are delivered as they were received. */
+
+//the driver's registry Parameters values. Reassembly is disabled if Ipv4ReassemblyMaxBytes is 0.
+//Ipv4ReassemblyMaxBytes: the max size of all the fragments held (bytes)
+//Ipv4ReassemblyTimeout: how long the first fragment of a packet may wait for the others (milliseconds)
+#define OVS_IPV4_REASSEMBLY_MAX_BYTES_VALUE     L"Ipv4ReassemblyMaxBytes"
+#define OVS_IPV4_REASSEMBLY_TIMEOUT_VALUE       L"Ipv4ReassemblyTimeout"
+
+#define OVS_IPV4_REASSEMBLY_DEFAULT_MAX_BYTES   (4 * 1024 * 1024)
+#define OVS_IPV4_REASSEMBLY_DEFAULT_TIMEOUT     1000
+
+//must be a power of 2
+#define OVS_IPV4_REASSEMBLY_BUCKETS             64
+#define OVS_IPV4_REASSEMBLY_WAYS                4
+//a packet fragmented in more pieces is dropped
+#define OVS_IPV4_REASSEMBLY_MAX_FRAGMENTS       32
+
+typedef struct _OVS_IPV4_REASSEMBLY_STATS
+{
+    //packets rebuilt from fragments, and the fragments they were rebuilt from
+    LONG64      packetsReassembled;
+    LONG64      fragmentsReassembled;
+
+    //complete packets that were not tunneled: their fragments were delivered as they were
+    LONG64      packetsReleased;
+
+    //packets dropped with the fragments held: incomplete at the timeout; evicted for a newer packet;
+    //with overlapping or inconsistent fragments; or that could not be allocated, once complete
+    LONG64      packetsTimedOut;
+    LONG64      packetsEvicted;
+    LONG64      packetsMalformed;
+    LONG64      buildFailures;
+
+    //fragments dropped alone: duplicates, or over the memory limit
+    LONG64      fragmentsDropped;
+}OVS_IPV4_REASSEMBLY_STATS, *POVS_IPV4_REASSEMBLY_STATS;
+
+typedef enum _OVS_IPV4_REASSEMBLY_RESULT
+{
+    //not a fragment the cache handles: the packet is processed as usual
+    OVS_IPV4_REASSEMBLY_NONE,
+    //the cache took the fragment; or dropped it
+    OVS_IPV4_REASSEMBLY_HELD,
+    //the fragment completed the packet, which replaces it
+    OVS_IPV4_REASSEMBLY_DONE,
+    //the fragment completed a packet that is not tunneled: its fragments are returned, to be processed as usual
+    OVS_IPV4_REASSEMBLY_RELEASED,
+}OVS_IPV4_REASSEMBLY_RESULT;
+
+//the fragments of a complete packet, sorted by offset
+typedef struct _OVS_IPV4_REASSEMBLY_FRAGMENTS
+{
+    OVS_NET_BUFFER*     fragments[OVS_IPV4_REASSEMBLY_MAX_FRAGMENTS];
+    ULONG               count;
+}OVS_IPV4_REASSEMBLY_FRAGMENTS, *POVS_IPV4_REASSEMBLY_FRAGMENTS;
+
+//reads the limits from the driver's registry key. Called once, at driver load.
+VOID Ipv4Reassembly_Initialize(_In_ PUNICODE_STRING pRegistryPath);
+//the switches are paused before the driver unloads: no fragment is held anymore
+VOID Ipv4Reassembly_Uninitialize();
+
+//read by OVS_IOCTL_RECEIVE_STATS
+VOID Ipv4Reassembly_GetStats(_Out_ OVS_IPV4_REASSEMBLY_STATS* pStats);
+
+//pOvsNb: a packet received from the external nic; hostMac: the mac of the management os.
+//HELD: the cache owns *ppOvsNb (or has dropped it), which is set to NULL. DONE: *ppOvsNb is the reassembled packet.
+//RELEASED: *ppOvsNb is set to NULL; the caller owns the fragments returned in pReleased.
+OVS_IPV4_REASSEMBLY_RESULT Ipv4Reassembly_Add(_Inout_ OVS_NET_BUFFER** ppOvsNb, _In_ const BYTE hostMac[OVS_ETHERNET_ADDRESS_LENGTH],
+    _Out_ OVS_IPV4_REASSEMBLY_FRAGMENTS* pReleased);
+
+//drops the fragments held for a switch that is paused
+VOID Ipv4Reassembly_DropSwitch(_In_ const OVS_SWITCH_INFO* pSwitchInfo);
@@ -0,0 +1,216 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "NbCursor.h"
+
+static BOOLEAN _NbCursor_MapMdl(_Inout_ OVS_NB_CURSOR* pCursor, _In_ MDL* pMdl)
+{
+    pCursor->pMdl = pMdl;
+    pCursor->mdlLength = MmGetMdlByteCount(pMdl);
+    pCursor->pMdlBuffer = MmGetSystemAddressForMdlSafe(pMdl, LowPagePriority | MdlMappingNoExecute);
+
+    if (!pCursor->pMdlBuffer)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " could not map mdl: %p\n", pMdl);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//if the cursor is at the end of the current MDL, moves it to the beginning of the next non-empty MDL
+static BOOLEAN _NbCursor_Normalize(_Inout_ OVS_NB_CURSOR* pCursor)
+{
+    while (pCursor->mdlOffset >= pCursor->mdlLength && pCursor->bytesLeft > 0)
+    {
+        MDL* pNextMdl = NULL;
+
+        //a flat buffer has all its bytes in the 'current mdl'
+        OVS_CHECK_RET(pCursor->pMdl, FALSE);
+
+        pNextMdl = pCursor->pMdl->Next;
+        if (!pNextMdl)
+        {
+            DEBUGP(LOG_ERROR, __FUNCTION__ " mdl chain is shorter than the nb data length\n");
+            return FALSE;
+        }
+
+        pCursor->mdlOffset -= pCursor->mdlLength;
+
+        if (!_NbCursor_MapMdl(pCursor, pNextMdl))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//moves the cursor within the MDL chain. If read / write buffer is given, it copies the bytes passed over.
+static BOOLEAN _NbCursor_Walk(_Inout_ OVS_NB_CURSOR* pCursor, ULONG size, _Out_opt_ BYTE* pReadBuffer, _In_opt_ const BYTE* pWriteBuffer)
+{
+    if (size > pCursor->bytesLeft)
+    {
+        return FALSE;
+    }
+
+    while (size > 0)
+    {
+        ULONG chunkSize = 0;
+
+        if (!_NbCursor_Normalize(pCursor))
+        {
+            return FALSE;
+        }
+
+        chunkSize = min(pCursor->mdlLength - pCursor->mdlOffset, size);
+
+        if (pReadBuffer)
+        {
+            RtlCopyMemory(pReadBuffer, pCursor->pMdlBuffer + pCursor->mdlOffset, chunkSize);
+            pReadBuffer += chunkSize;
+        }
+        else if (pWriteBuffer)
+        {
+            RtlCopyMemory(pCursor->pMdlBuffer + pCursor->mdlOffset, pWriteBuffer, chunkSize);
+            pWriteBuffer += chunkSize;
+        }
+
+        pCursor->mdlOffset += chunkSize;
+        pCursor->offset += chunkSize;
+        pCursor->bytesLeft -= chunkSize;
+        size -= chunkSize;
+    }
+
+    return _NbCursor_Normalize(pCursor);
+}
+
+_Use_decl_annotations_
+BOOLEAN NbCursor_InitFromNb(OVS_NB_CURSOR* pCursor, NET_BUFFER* pNb)
+{
+    OVS_CHECK(pCursor);
+    OVS_CHECK(pNb);
+
+    RtlZeroMemory(pCursor, sizeof(OVS_NB_CURSOR));
+
+    pCursor->bytesLeft = NET_BUFFER_DATA_LENGTH(pNb);
+    pCursor->mdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(pNb);
+
+    if (!_NbCursor_MapMdl(pCursor, NET_BUFFER_CURRENT_MDL(pNb)))
+    {
+        return FALSE;
+    }
+
+    return _NbCursor_Normalize(pCursor);
+}
+
+_Use_decl_annotations_
+VOID NbCursor_InitFromBuffer(OVS_NB_CURSOR* pCursor, VOID* buffer, ULONG length)
+{
+    OVS_CHECK(pCursor);
+
+    RtlZeroMemory(pCursor, sizeof(OVS_NB_CURSOR));
+
+    pCursor->pMdlBuffer = buffer;
+    pCursor->mdlLength = length;
+    pCursor->bytesLeft = length;
+}
+
+_Use_decl_annotations_
+VOID* NbCursor_Peek(const OVS_NB_CURSOR* pCursor, ULONG size, VOID* scratch)
+{
+    OVS_NB_CURSOR cursor = *pCursor;
+
+    if (size > pCursor->bytesLeft)
+    {
+        return NULL;
+    }
+
+    if (pCursor->mdlLength - pCursor->mdlOffset >= size)
+    {
+        return pCursor->pMdlBuffer + pCursor->mdlOffset;
+    }
+
+    if (!scratch)
+    {
+        return NULL;
+    }
+
+    //the header straddles an mdl boundary: copy only the header
+    if (!_NbCursor_Walk(&cursor, size, scratch, NULL))
+    {
+        return NULL;
+    }
+
+    return scratch;
+}
+
+_Use_decl_annotations_
+VOID* NbCursor_PeekContiguous(const OVS_NB_CURSOR* pCursor, ULONG maxSize, ULONG* pSize)
+{
+    ULONG size = 0;
+
+    //the cursor is kept normalized: if there are bytes left, the current mdl has at least one of them
+    size = min(pCursor->mdlLength - pCursor->mdlOffset, pCursor->bytesLeft);
+    size = min(size, maxSize);
+
+    *pSize = size;
+
+    if (!size)
+    {
+        return NULL;
+    }
+
+    return pCursor->pMdlBuffer + pCursor->mdlOffset;
+}
+
+_Use_decl_annotations_
+BOOLEAN NbCursor_Advance(OVS_NB_CURSOR* pCursor, ULONG size)
+{
+    return _NbCursor_Walk(pCursor, size, NULL, NULL);
+}
+
+_Use_decl_annotations_
+VOID* NbCursor_Pull(OVS_NB_CURSOR* pCursor, ULONG size, VOID* scratch)
+{
+    VOID* pHeader = NbCursor_Peek(pCursor, size, scratch);
+
+    if (!pHeader)
+    {
+        return NULL;
+    }
+
+    if (!NbCursor_Advance(pCursor, size))
+    {
+        return NULL;
+    }
+
+    return pHeader;
+}
+
+_Use_decl_annotations_
+BOOLEAN NbCursor_Write(const OVS_NB_CURSOR* pCursor, const VOID* data, ULONG size)
+{
+    OVS_NB_CURSOR cursor = *pCursor;
+
+    //the data was peeked in place: nothing to write back
+    if (data == pCursor->pMdlBuffer + pCursor->mdlOffset)
+    {
+        return TRUE;
+    }
+
+    return _NbCursor_Walk(&cursor, size, NULL, data);
+}
\ No newline at end of file
@@ -0,0 +1,76 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "precomp.h"
+
+//the largest header we ever need to see contiguously while parsing a frame:
+//an ICMP 'dest unreachable' carrying an ipv4 header with options, followed by a GRE header
+#define OVS_NB_CURSOR_MAX_HEADER_SIZE       128
+
+//A read cursor over the data of a NET_BUFFER, which may be spread over an MDL chain.
+//Headers are read with NbCursor_Peek / NbCursor_Pull: if the requested bytes lie within a single MDL,
+//a pointer into the MDL is returned; otherwise, only the requested bytes are copied into the caller's scratch buffer.
+//The payload of the frame is never copied.
+//A cursor can also be created over a flat buffer (e.g. a packet received from userspace).
+typedef struct _OVS_NB_CURSOR
+{
+    //the current MDL; NULL if the cursor walks a flat buffer
+    MDL*        pMdl;
+    //the virtual address of pMdl, or the flat buffer
+    BYTE*       pMdlBuffer;
+    //the number of bytes of pMdlBuffer that belong to the frame
+    ULONG       mdlLength;
+    //the position of the cursor within pMdlBuffer
+    ULONG       mdlOffset;
+
+    //the position of the cursor, relative to the beginning of the frame
+    ULONG       offset;
+    //number of bytes of the frame, starting at the cursor
+    ULONG       bytesLeft;
+}OVS_NB_CURSOR, *POVS_NB_CURSOR;
+
+BOOLEAN NbCursor_InitFromNb(_Out_ OVS_NB_CURSOR* pCursor, _In_ NET_BUFFER* pNb);
+VOID NbCursor_InitFromBuffer(_Out_ OVS_NB_CURSOR* pCursor, _In_ VOID* buffer, ULONG length);
+
+//returns a pointer to 'size' bytes starting at the cursor, or NULL if the frame does not have 'size' bytes left.
+//if the bytes straddle an MDL boundary, they are copied to 'scratch' (which must hold 'size' bytes) and 'scratch' is returned.
+//if scratch == NULL, NULL is returned for data that is not contiguous.
+VOID* NbCursor_Peek(_In_ const OVS_NB_CURSOR* pCursor, ULONG size, _Inout_opt_ VOID* scratch);
+
+//returns a pointer to the bytes at the cursor that lie in the current MDL, without copying: at most maxSize of them.
+//*pSize receives their number. Used to walk the payload chunk by chunk (e.g. for checksums).
+VOID* NbCursor_PeekContiguous(_In_ const OVS_NB_CURSOR* pCursor, ULONG maxSize, _Out_ ULONG* pSize);
+
+//moves the cursor 'size' bytes forward. Returns FALSE if the frame has less than 'size' bytes left.
+BOOLEAN NbCursor_Advance(_Inout_ OVS_NB_CURSOR* pCursor, ULONG size);
+
+//NbCursor_Peek followed by NbCursor_Advance
+VOID* NbCursor_Pull(_Inout_ OVS_NB_CURSOR* pCursor, ULONG size, _Inout_opt_ VOID* scratch);
+
+//writes 'size' bytes at the cursor. Used to write back a header that was modified after being peeked into a scratch buffer.
+BOOLEAN NbCursor_Write(_In_ const OVS_NB_CURSOR* pCursor, _In_ const VOID* data, ULONG size);
+
+static __inline ULONG NbCursor_GetOffset(_In_ const OVS_NB_CURSOR* pCursor)
+{
+    return pCursor->offset;
+}
+
+static __inline ULONG NbCursor_BytesLeft(_In_ const OVS_NB_CURSOR* pCursor)
+{
+    return pCursor->bytesLeft;
+}
\ No newline at end of file
@@ -26,6 +26,9 @@ limitations under the License.
 #include "Igmp.h"
 #include "Sctp.h"
 #include "Tcp.h"
+#include "Udp.h"
+#include "NbCursor.h"
+#include "OvsNetBuffer.h"
 
 extern NDIS_HANDLE g_hNblPool;
 extern NDIS_HANDLE g_hNbPool;
@@ -246,7 +249,7 @@ NET_BUFFER_LIST* DuplicateNbl(const OVS_SWITCH_INFO* pSwitchInfo, NET_BUFFER_LIS
     {
         nbLen = NET_BUFFER_DATA_LENGTH(pNb);
 
-        pBuffer = KAlloc(nbLen);
+        pBuffer = ONB_AllocateNbData(nbLen);
         if (!pBuffer)
         {
             break;
@@ -332,25 +335,9 @@ NET_BUFFER_LIST* DuplicateNbl(const OVS_SWITCH_INFO* pSwitchInfo, NET_BUFFER_LIS
 _Use_decl_annotations_
 VOID FreeDuplicateNbl(const OVS_SWITCH_INFO* pSwitchInfo, NET_BUFFER_LIST* pNbl)
 {
-    NET_BUFFER* pNb = NULL, *pNextNb = NULL;
-    MDL* pMdl = NULL;
-    VOID* buffer = NULL;
-
     pSwitchInfo->switchHandlers.FreeNetBufferListForwardingContext(pSwitchInfo->switchContext, pNbl);
 
-    for (pNb = NET_BUFFER_LIST_FIRST_NB(pNbl); pNb != NULL; pNb = pNextNb)
-    {
-        pNextNb = NET_BUFFER_NEXT_NB(pNb);
-        pMdl = NET_BUFFER_CURRENT_MDL(pNb);
-
-        OVS_CHECK(pMdl->Next == NULL);
-
-        buffer = MmGetMdlVirtualAddress(pMdl);
-        KFree(buffer);
-
-        IoFreeMdl(pMdl);
-        NdisFreeNetBuffer(pNb);
-    }
+    ONB_FreeNbChain(NET_BUFFER_LIST_FIRST_NB(pNbl));
 
     NdisFreeNetBufferList(pNbl);
 }
@@ -721,37 +708,77 @@ void DbgPrintArp(OVS_ARP_HEADER* pArpHeader)
     }
 }
 
-static BOOLEAN _VerifyTransportHeader(VOID* buffer, ULONG* pLength, UINT16 ethType, BYTE protoType);
+static BOOLEAN _VerifyTransportHeader(_Inout_ OVS_NB_CURSOR* pCursor, UINT16 ethType, BYTE protoType);
+
+//returns the header found at the cursor; *pLength receives the number of bytes that can be read from it:
+//all the bytes left in the frame, if they are contiguous; otherwise, the first OVS_NB_CURSOR_MAX_HEADER_SIZE bytes,
+//copied into scratch. Headers which span more than that over an MDL boundary will fail verification.
+static BYTE* _PeekHeader(_In_ const OVS_NB_CURSOR* pCursor, _Out_writes_(OVS_NB_CURSOR_MAX_HEADER_SIZE) BYTE* scratch, _Out_ ULONG* pLength)
+{
+    ULONG size = NbCursor_BytesLeft(pCursor);
+    BYTE* buffer = NULL;
+
+    buffer = NbCursor_Peek(pCursor, size, NULL);
+    if (!buffer)
+    {
+        size = min(size, OVS_NB_CURSOR_MAX_HEADER_SIZE);
+        buffer = NbCursor_Peek(pCursor, size, scratch);
+    }
+
+    *pLength = (buffer ? size : 0);
+    return buffer;
+}
+
+//a Verify* function returns the position of the next header in the buffer it was given: move the cursor there.
+static BOOLEAN _AdvanceToNextHeader(_Inout_ OVS_NB_CURSOR* pCursor, _In_ const BYTE* buffer, _In_ const BYTE* nextHeader)
+{
+    OVS_CHECK(nextHeader >= buffer);
+
+    return NbCursor_Advance(pCursor, (ULONG)(nextHeader - buffer));
+}
 
-BOOLEAN VerifyProtocolHeader(BYTE* buffer, ULONG* pLength, UINT16* pEthType)
+static BOOLEAN _VerifyProtocolHeader(_Inout_ OVS_NB_CURSOR* pCursor, UINT16 ethType)
 {
+    BYTE scratch[OVS_NB_CURSOR_MAX_HEADER_SIZE];
+    BYTE* buffer = NULL;
     BYTE* nextHeader = NULL;
+    ULONG length = 0;
     BYTE protoType = 0;
 
-    switch (RtlUshortByteSwap(*pEthType))
+    switch (RtlUshortByteSwap(ethType))
     {
     case OVS_ETHERTYPE_ARP:
     case OVS_ETHERTYPE_RARP:
-        nextHeader = VerifyArpFrame(buffer, pLength);
-        if (!nextHeader)
+        buffer = _PeekHeader(pCursor, scratch, &length);
+        if (!buffer || length < sizeof(OVS_ARP_HEADER))
         {
+            DEBUGP(LOG_ERROR, "size left=0x%x < arp header size\n", length);
             return FALSE;
         }
 
-        if (*pLength > 0)
+        nextHeader = VerifyArpFrame(buffer, &length);
+        if (!nextHeader)
         {
-            /*DEBUGP(LOG_ERROR, "size left=0x%x > 0", *pLength);
-            return FALSE;*/
+            return FALSE;
         }
 
         break;
 
     case OVS_ETHERTYPE_IPV4:
     {
-        OVS_IPV4_HEADER* pIpv4Header = (OVS_IPV4_HEADER*)buffer;
+        OVS_IPV4_HEADER* pIpv4Header = NULL;
         UINT16 offset = 0;
 
-        nextHeader = VerifyIpv4Frame(buffer, pLength, &protoType);
+        buffer = _PeekHeader(pCursor, scratch, &length);
+        if (!buffer || length < sizeof(OVS_IPV4_HEADER))
+        {
+            DEBUGP(LOG_ERROR, "size left=0x%x < ipv4 header size\n", length);
+            return FALSE;
+        }
+
+        pIpv4Header = (OVS_IPV4_HEADER*)buffer;
+
+        nextHeader = VerifyIpv4Frame(buffer, &length, &protoType);
         if (!nextHeader)
         {
             return FALSE;
@@ -761,7 +788,12 @@ BOOLEAN VerifyProtocolHeader(BYTE* buffer, ULONG* pLength, UINT16* pEthType)
 
         if (offset == 0)
         {
-            if (!_VerifyTransportHeader(nextHeader, pLength, *pEthType, protoType))
+            if (!_AdvanceToNextHeader(pCursor, buffer, nextHeader))
+            {
+                return FALSE;
+            }
+
+            if (!_VerifyTransportHeader(pCursor, ethType, protoType))
             {
                 return FALSE;
             }
@@ -770,13 +802,24 @@ BOOLEAN VerifyProtocolHeader(BYTE* buffer, ULONG* pLength, UINT16* pEthType)
         break;
 
     case OVS_ETHERTYPE_IPV6:
-        nextHeader = VerifyIpv6Frame(buffer, pLength, &protoType);
+        buffer = _PeekHeader(pCursor, scratch, &length);
+        if (!buffer)
+        {
+            return FALSE;
+        }
+
+        nextHeader = VerifyIpv6Frame(buffer, &length, &protoType);
         if (!nextHeader)
         {
             return FALSE;
         }
 
-        if (!_VerifyTransportHeader(nextHeader, pLength, *pEthType, protoType))
+        if (!_AdvanceToNextHeader(pCursor, buffer, nextHeader))
+        {
+            return FALSE;
+        }
+
+        if (!_VerifyTransportHeader(pCursor, ethType, protoType))
         {
             return FALSE;
         }
@@ -789,19 +832,31 @@ BOOLEAN VerifyProtocolHeader(BYTE* buffer, ULONG* pLength, UINT16* pEthType)
         break;
 
     default:
-        DEBUGP(LOG_ERROR, "invalid / unknown eth type: 0x%x", RtlUshortByteSwap(*pEthType));
+        DEBUGP(LOG_ERROR, "invalid / unknown eth type: 0x%x", RtlUshortByteSwap(ethType));
     }
 
     return TRUE;
 }
 
-static BOOLEAN _VerifyTransportHeader(VOID* buffer, ULONG* pLength, UINT16 ethType, BYTE protoType)
+static BOOLEAN _VerifyTransportHeader(_Inout_ OVS_NB_CURSOR* pCursor, UINT16 ethType, BYTE protoType)
 {
-    BYTE* advancedBuffer = buffer;
+    BYTE scratch[OVS_NB_CURSOR_MAX_HEADER_SIZE];
+    BYTE* buffer = NULL;
+    BYTE* advancedBuffer = NULL;
+    ULONG length = 0;
+
+    buffer = _PeekHeader(pCursor, scratch, &length);
+    if (!buffer)
+    {
+        //no transport header: nothing else to verify
+        return TRUE;
+    }
+
+    advancedBuffer = buffer;
 
     if (IsIpv6Extension(protoType))
     {
-        advancedBuffer = VerifyIpv6Extension(buffer, pLength, &protoType);
+        advancedBuffer = VerifyIpv6Extension(buffer, &length, &protoType);
         if (!advancedBuffer)
         {
             return FALSE;
@@ -811,13 +866,18 @@ static BOOLEAN _VerifyTransportHeader(VOID* buffer, ULONG* pLength, UINT16 ethTy
     switch (protoType)
     {
     case OVS_IPPROTO_GRE:
-        advancedBuffer = VerifyGreHeader(advancedBuffer, pLength, &ethType);
+        advancedBuffer = VerifyGreHeader(advancedBuffer, &length, &ethType);
         if (!advancedBuffer)
         {
             return FALSE;
         }
 
-        return VerifyProtocolHeader(advancedBuffer, pLength, &ethType);
+        if (!_AdvanceToNextHeader(pCursor, buffer, advancedBuffer))
+        {
+            return FALSE;
+        }
+
+        return _VerifyProtocolHeader(pCursor, ethType);
 
     case OVS_IPPROTO_ICMP:
         if (RtlUshortByteSwap(ethType) != OVS_ETHERTYPE_IPV4)
@@ -826,7 +886,7 @@ static BOOLEAN _VerifyTransportHeader(VOID* buffer, ULONG* pLength, UINT16 ethTy
             return FALSE;
         }
 
-        if (!VerifyIcmpHeader(advancedBuffer, pLength))
+        if (!VerifyIcmpHeader(advancedBuffer, &length))
         {
             return FALSE;
         }
@@ -840,7 +900,7 @@ static BOOLEAN _VerifyTransportHeader(VOID* buffer, ULONG* pLength, UINT16 ethTy
             return FALSE;
         }
 
-        if (!VerifyIcmp6Header(advancedBuffer, pLength))
+        if (!VerifyIcmp6Header(advancedBuffer, &length))
         {
             return FALSE;
         }
@@ -848,7 +908,7 @@ static BOOLEAN _VerifyTransportHeader(VOID* buffer, ULONG* pLength, UINT16 ethTy
         break;
 
     case OVS_IPPROTO_IGMP:
-        if (!VerifyIgmpHeader(advancedBuffer, pLength))
+        if (!VerifyIgmpHeader(advancedBuffer, &length))
         {
             return FALSE;
         }
@@ -856,7 +916,7 @@ static BOOLEAN _VerifyTransportHeader(VOID* buffer, ULONG* pLength, UINT16 ethTy
         break;
 
     case OVS_IPPROTO_SCTP:
-        if (!VerifySctpHeader(advancedBuffer, pLength))
+        if (!VerifySctpHeader(advancedBuffer, &length))
         {
             return FALSE;
         }
@@ -864,7 +924,7 @@ static BOOLEAN _VerifyTransportHeader(VOID* buffer, ULONG* pLength, UINT16 ethTy
         break;
 
     case OVS_IPPROTO_TCP:
-        if (!VerifyTcpHeader(advancedBuffer, pLength))
+        if (!VerifyTcpHeader(advancedBuffer, &length))
         {
             return FALSE;
         }
@@ -872,7 +932,7 @@ static BOOLEAN _VerifyTransportHeader(VOID* buffer, ULONG* pLength, UINT16 ethTy
         break;
 
     case OVS_IPPROTO_UDP:
-        if (!VerifyTcpHeader(advancedBuffer, pLength))
+        if (!VerifyUdpHeader(advancedBuffer, &length))
         {
             return FALSE;
         }
@@ -883,20 +943,54 @@ static BOOLEAN _VerifyTransportHeader(VOID* buffer, ULONG* pLength, UINT16 ethTy
     return TRUE;
 }
 
-BOOLEAN VerifyNetBuffer(VOID* buffer, ULONG length)
+static BOOLEAN _VerifyFrame(_Inout_ OVS_NB_CURSOR* pCursor)
 {
+    BYTE scratch[OVS_NB_CURSOR_MAX_HEADER_SIZE];
+    BYTE* buffer = NULL;
     BYTE* nextHeader = NULL;
-    ULONG sizeLeft = length;
+    ULONG length = 0;
     UINT16 ethType = 0;
 
-    nextHeader = VerifyEthernetFrame(buffer, &sizeLeft, &ethType);
+    buffer = _PeekHeader(pCursor, scratch, &length);
+    if (!buffer || length < sizeof(OVS_ETHERNET_HEADER))
+    {
+        DEBUGP(LOG_ERROR, "frame size=0x%x is too small for an ethernet header\n", length);
+        return FALSE;
+    }
 
+    nextHeader = VerifyEthernetFrame(buffer, &length, &ethType);
     if (!nextHeader)
     {
         return FALSE;
     }
 
-    return VerifyProtocolHeader(nextHeader, &length, &ethType);
+    if (!_AdvanceToNextHeader(pCursor, buffer, nextHeader))
+    {
+        return FALSE;
+    }
+
+    return _VerifyProtocolHeader(pCursor, ethType);
+}
+
+BOOLEAN VerifyNetBuffer(VOID* buffer, ULONG length)
+{
+    OVS_NB_CURSOR cursor = { 0 };
+
+    NbCursor_InitFromBuffer(&cursor, buffer, length);
+
+    return _VerifyFrame(&cursor);
+}
+
+BOOLEAN VerifyNb(_In_ NET_BUFFER* pNb)
+{
+    OVS_NB_CURSOR cursor = { 0 };
+
+    if (!NbCursor_InitFromNb(&cursor, pNb))
+    {
+        return FALSE;
+    }
+
+    return _VerifyFrame(&cursor);
 }
 
 NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO* GetChecksumOffloadInfo(_In_ NET_BUFFER_LIST* pNbl)
@@ -34,7 +34,8 @@ ULONG CountNbs(_In_ NET_BUFFER_LIST* pNbl);
 ULONG CountNbls(_In_ NET_BUFFER_LIST* pNbl);
 
 BOOLEAN VerifyNetBuffer(VOID* buffer, ULONG length);
-BOOLEAN VerifyProtocolHeader(BYTE* buffer, ULONG* pLength, UINT16* pEthType);
+//verifies the headers of a frame that may be spread over multiple MDLs
+BOOLEAN VerifyNb(_In_ NET_BUFFER* pNb);
 
 NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO* GetChecksumOffloadInfo(_In_ NET_BUFFER_LIST* pNbl);
 
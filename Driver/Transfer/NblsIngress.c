@@ -20,6 +20,7 @@ limitations under the License.
 #include "NblsIngress.h"
 #include "SendIngressBasic.h"
 #include "Sctx_Nic.h"
+#include "Sctx_MacTable.h"
 #include "SwitchContext.h"
 #include "Gre.h"
 #include "Vxlan.h"
@@ -37,6 +38,8 @@ limitations under the License.
 #include "OFPort.h"
 #include "OFFlowTable.h"
 #include "Checksum.h"
+#include "RxCoalesce.h"
+#include "Ipv4Reassembly.h"
 
 static BOOLEAN _GetSourceInfo(_In_ const OVS_GLOBAL_FORWARD_INFO* pForwardInfo, _In_ NET_BUFFER_LIST* pNetBufferLists, _Out_ OVS_NIC_INFO* pSourceInfo,
     _Inout_ OVS_NBL_FAIL_REASON* failReason)
@@ -124,7 +127,7 @@ OVS_NBL_FAIL_REASON* pFailReason)
 }
 
 _Use_decl_annotations_
-BOOLEAN GetDestinationInfo(const OVS_GLOBAL_FORWARD_INFO* pForwardInfo, const BYTE* pDestMac, NDIS_SWITCH_PORT_ID sourcePort,
+BOOLEAN GetDestinationInfo(const OVS_GLOBAL_FORWARD_INFO* pForwardInfo, const BYTE* pDestMac, UINT16 vlanId, NDIS_SWITCH_PORT_ID sourcePort,
 OVS_NIC_INFO* pCurDestination, OVS_NBL_FAIL_REASON* pFailReason)
 {
     OVS_NIC_LIST_ENTRY* pDestinationNicEntry = NULL;
@@ -133,6 +136,22 @@ OVS_NIC_INFO* pCurDestination, OVS_NBL_FAIL_REASON* pFailReason)
 
     RtlZeroMemory(pCurDestination, sizeof(OVS_NIC_INFO));
 
+    //learned macs: a nic is flushed from the table when it disconnects, so a hit is a connected nic
+    if (Sctx_MacTable_Find(pForwardInfo->pMacTable, pDestMac, vlanId, &pCurDestination->portId, &pCurDestination->nicIndex))
+    {
+        if (pCurDestination->portId == sourcePort)
+        {
+            *pFailReason = OVS_NBL_FAIL_DESTINATION_IS_SOURCE;
+            return FALSE;
+        }
+
+        RtlCopyMemory(pCurDestination->mac, pDestMac, OVS_ETHERNET_ADDRESS_LENGTH);
+        pCurDestination->nicConnected = TRUE;
+
+        return TRUE;
+    }
+
+    //not learned yet: look among the permanent macs of the switch nics
     FWDINFO_LOCK_READ(pForwardInfo, &lockState);
 
     pDestinationNicEntry = Sctx_FindNicByMacAddressUnsafe(pForwardInfo, pDestMac);
@@ -310,9 +329,9 @@ static BOOLEAN _FragmentAndEncapsulateIpv4Packet(_In_ OVS_NET_BUFFER* pOvsNb, OV
     maxIpPacketSize = pEncapsData->mtu - pEncapsData->encapsHeadersSize;
     dataOffset = pEncapsData->encapsHeadersSize + sizeof(OVS_ETHERNET_HEADER);
 
-    HandleChecksumOffload(pOvsNb, pEncapsData->isFromExternal, pEncapsData->encapsHeadersSize, pEncapsData->mtu);
-    //TODO: we do not currently support fragmentation of LSO packets
-    //NOTE that TCP packets should normally not be concerned with LSO because Tcp's MSS is being negociated
+    //the fragments need their checksums computed before the packet is split
+    HandleChecksumOffload(pOvsNb, pEncapsData->isFromExternal, pEncapsData->encapsHeadersSize, pEncapsData->mtu, /*keep offload*/ FALSE);
+    //LSO packets are segmented, not fragmented: see _SegmentAndEncapsulateTcpPacket
     OVS_CHECK(!NblIsLso(pOvsNb->pNbl));
 
     //This function will fragment the ipv4 packet, having dataOffset bytes as unused bytes in the beginning of the packet.
@@ -326,9 +345,13 @@ static BOOLEAN _FragmentAndEncapsulateIpv4Packet(_In_ OVS_NET_BUFFER* pOvsNb, OV
     if (status != NDIS_STATUS_SUCCESS)
     {
         OVS_CHECK(0);
+        FreeDuplicateNbl(pOvsNb->pSwitchInfo, pFragmentedNbl);
         return FALSE;
     }
 
+    //the checksums were computed above: the fragments, whose payload is not contiguous with their headers, must not ask for offload
+    NET_BUFFER_LIST_INFO(pFragmentedNbl, TcpIpChecksumNetBufferListInfo) = 0;
+
     pFwdDetail = NET_BUFFER_LIST_SWITCH_FORWARDING_DETAIL(pFragmentedNbl);
     pFwdDetail->IsPacketDataSafe = TRUE;
 
@@ -348,13 +371,98 @@ static BOOLEAN _FragmentAndEncapsulateIpv4Packet(_In_ OVS_NET_BUFFER* pOvsNb, OV
     return TRUE;
 }
 
+//NVGRE task offload: the nic computes the inner checksums of GRE packets that carry eth frames, have a key,
+//and have no GRE checksum (which would cover the inner checksums) and no sequence number
+static BOOLEAN _CanOffloadEncapsulatedChecksums(_In_ const OVS_NIC_INFO* pExternalNicInfo, BYTE encapProtocol, UINT16 tunnelFlags)
+{
+    if (encapProtocol != OVS_IPPROTO_GRE || !(pExternalNicInfo->encapsOffload & OVS_NIC_OFFLOAD_NVGRE_CHECKSUM))
+    {
+        return FALSE;
+    }
+
+    return (tunnelFlags & (OVS_TUNNEL_FLAG_KEY | OVS_TUNNEL_FLAG_CHECKSUM | OVS_TUNNEL_FLAG_SEQ)) == OVS_TUNNEL_FLAG_KEY;
+}
+
+//the packet is a large send (LSO) tcp packet, or a frame we coalesced on receive: the NIC cannot segment it once it is encapsulated, so we segment it in software,
+//in segments that fit the mtu after encapsulation, and we encapsulate each segment.
+static BOOLEAN _SegmentAndEncapsulateTcpPacket(_In_ OVS_NET_BUFFER* pOvsNb, OVS_ENCAPSULATOR* pEncapsulator, OVS_OUTER_ENCAPSULATION_DATA* pEncapsData,
+    ULONG lsoMss, ULONG tcpHeaderOffset)
+{
+    NET_BUFFER_LIST* pSegmentedNbl = NULL;
+    NDIS_STATUS status = NDIS_STATUS_SUCCESS;
+    PNDIS_SWITCH_FORWARDING_DETAIL_NET_BUFFER_LIST_INFO pFwdDetail = NULL;
+    const OVS_TCP_HEADER* pTcpHeader = NULL;
+    BYTE* pBuffer = NULL;
+    ULONG maxIpPacketSize = 0, headersSize = 0, mss = 0;
+    //the amount of bytes to reserve, for encapsulation. For gre, it is: eth delivery + ipv4 delivery + gre + eth payload.
+    ULONG dataOffset = 0;
+
+    maxIpPacketSize = pEncapsData->mtu - pEncapsData->encapsHeadersSize;
+    dataOffset = pEncapsData->encapsHeadersSize + sizeof(OVS_ETHERNET_HEADER);
+
+    //the mss of the guest does not account for the encapsulation headers
+    pBuffer = ONB_GetDataOfSize(pOvsNb, tcpHeaderOffset + sizeof(OVS_TCP_HEADER));
+    if (!pBuffer)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " lso packet too small for its tcp header offset: %d\n", tcpHeaderOffset);
+        return FALSE;
+    }
+
+    pTcpHeader = (const OVS_TCP_HEADER*)(pBuffer + tcpHeaderOffset);
+    headersSize = tcpHeaderOffset - sizeof(OVS_ETHERNET_HEADER) + GetTcpDataOffset(pTcpHeader->flagsAndOffset) * sizeof(DWORD);
+
+    if (headersSize >= maxIpPacketSize)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " headers size (%d) leaves no room for payload (mtu after encapsulation: %d)\n", headersSize, maxIpPacketSize);
+        return FALSE;
+    }
+
+    mss = min(lsoMss, maxIpPacketSize - headersSize);
+
+    pSegmentedNbl = ONB_SegmentTcp(pOvsNb, tcpHeaderOffset, mss, dataOffset);
+    if (!pSegmentedNbl)
+    {
+        return FALSE;
+    }
+
+    status = pOvsNb->pSwitchInfo->switchHandlers.CopyNetBufferListInfo(pOvsNb->pSwitchInfo->switchContext, pSegmentedNbl, pOvsNb->pNbl, 0);
+    if (status != NDIS_STATUS_SUCCESS)
+    {
+        OVS_CHECK(0);
+        FreeDuplicateNbl(pOvsNb->pSwitchInfo, pSegmentedNbl);
+        return FALSE;
+    }
+
+    //the segments are complete packets: neither large send, nor checksum offload is requested for them anymore
+    NET_BUFFER_LIST_INFO(pSegmentedNbl, TcpLargeSendNetBufferListInfo) = 0;
+    NET_BUFFER_LIST_INFO(pSegmentedNbl, TcpIpChecksumNetBufferListInfo) = 0;
+    NET_BUFFER_LIST_INFO(pSegmentedNbl, TcpRecvSegCoalesceInfo) = 0;
+
+    pFwdDetail = NET_BUFFER_LIST_SWITCH_FORWARDING_DETAIL(pSegmentedNbl);
+    pFwdDetail->IsPacketDataSafe = TRUE;
+
+    DbgPrintNblInfo(pSegmentedNbl);
+
+    ONB_DestroyNbl(pOvsNb);
+    pOvsNb->pNbl = pSegmentedNbl;
+
+    //encapsulate each segment
+    if (!Encaps_EncapsulateOnb(pEncapsulator, pEncapsData))
+    {
+        DEBUGP(LOG_ERROR, "encapsulation of the tcp segments failed. returning FALSE\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 static BOOLEAN _OutputPacketToPort_Encaps(OVS_NET_BUFFER* pOvsNb)
 {
     BOOLEAN ok = FALSE;
     OVS_NBL_FAIL_REASON failReason = { 0 };
     OVS_NIC_INFO externalNicInfo = { 0 };
-    OVS_ETHERNET_HEADER* pOriginalEthHeader = NULL, payloadEthHeader = { 0 }, outerEthHeader = { 0 };
-    ULONG nbLen = 0;
+    OVS_ETHERNET_HEADER* pOriginalEthHeader = NULL, payloadEthHeader = { 0 };
+    ULONG nbLen = 0, lsoMss = 0, lsoTcpHeaderOffset = 0;
     OVS_ENCAPSULATOR encapsulator = { 0 };
     OVS_OUTER_ENCAPSULATION_DATA encapData = { 0 };
     OF_PI_IPV4_TUNNEL tunnelInfo = { 0 };
@@ -378,6 +486,12 @@ static BOOLEAN _OutputPacketToPort_Encaps(OVS_NET_BUFFER* pOvsNb)
         return FALSE;
     }
 
+    //encapsulation writes the outer headers in front of the packet: the packet data must not be shared with other ONBs
+    if (!ONB_MakeWritable(pOvsNb))
+    {
+        return FALSE;
+    }
+
     DEBUGP(LOG_LOUD, "Sending unicast to: nic index: %d; port id: %d; adap name: \"%s\"; vm name: \"%s\"\n",
         externalNicInfo.nicIndex, externalNicInfo.portId, externalNicInfo.nicName, externalNicInfo.vmName);
 
@@ -403,12 +517,6 @@ static BOOLEAN _OutputPacketToPort_Encaps(OVS_NET_BUFFER* pOvsNb)
 
     OVS_CHECK(pOvsNb->pTunnelInfo);
 
-    ok = Encaps_ComputeOuterEthHeader(externalNicInfo.mac, (BYTE*)&pOvsNb->pTunnelInfo->ipv4Destination, &outerEthHeader);
-    if (!ok)
-    {
-        return FALSE;
-    }
-
     /*******************************/
     DbgPrintOnbFrames(pOvsNb, "before encaps");
     pOriginalEthHeader = ReadEthernetHeaderOnly(ONB_GetNetBuffer(pOvsNb));
@@ -445,6 +553,8 @@ static BOOLEAN _OutputPacketToPort_Encaps(OVS_NET_BUFFER* pOvsNb)
     {
         encapsulator.BuildEncapsulationHeader = Gre_BuildHeader;
         encapsulator.BytesNeeded = Gre_BytesNeeded;
+        encapsulator.SetPayloadLength = NULL;
+        encapsulator.SetFlowEntropy = Gre_SetFlowEntropy;
         encapsulator.ComputeChecksum = Gre_ComputeChecksum;
 
         encapData.encapProtocol = OVS_IPPROTO_GRE;
@@ -455,6 +565,8 @@ static BOOLEAN _OutputPacketToPort_Encaps(OVS_NET_BUFFER* pOvsNb)
 
         encapsulator.BuildEncapsulationHeader = Vxlan_BuildHeader;
         encapsulator.BytesNeeded = Vxlan_BytesNeeded;
+        encapsulator.SetPayloadLength = Vxlan_SetPayloadLength;
+        encapsulator.SetFlowEntropy = Vxlan_SetFlowEntropy;
         encapsulator.ComputeChecksum = NULL;
 
         encapData.encapProtocol = OVS_IPPROTO_UDP;
@@ -479,21 +591,33 @@ static BOOLEAN _OutputPacketToPort_Encaps(OVS_NET_BUFFER* pOvsNb)
     }
 
     encapData.mtu = externalNicInfo.mtu;
-    encapData.pDeliveryEthHeader = &outerEthHeader;
     encapData.pPayloadEthHeader = &payloadEthHeader;
     encapData.pOvsNb = pOvsNb;
     encapData.isFromExternal = (pOvsNb->pSourcePort->portId == externalNicInfo.portId);
     encapData.encapsHeadersSize = encapsulator.BytesNeeded(pOvsNb->pTunnelInfo->tunnelFlags);
+    encapData.offloadChecksums = _CanOffloadEncapsulatedChecksums(&externalNicInfo, encapData.encapProtocol, pOvsNb->pTunnelInfo->tunnelFlags) &&
+        !encapData.isFromExternal;
+
+    //the outer headers are built once per tunnel, and cached
+    if (!Encaps_PrepareOuterHeaders(&encapsulator, externalNicInfo.mac, &encapData))
+    {
+        return FALSE;
+    }
 
     //TODO: should we use the DF of the packet to see if we should fragment or not,
     //or use the tunnel info's flag DON'T FRAGMENT?
 
+    //LSO packets are larger than the mtu by design: they are segmented, whatever their DF flag. So are the received frames we coalesced.
+    if (NblGetLsoInfo(pOvsNb->pNbl, &lsoMss, &lsoTcpHeaderOffset) || RxCoalesce_GetSegmentation(pOvsNb, &lsoMss, &lsoTcpHeaderOffset))
+    {
+        ok = _SegmentAndEncapsulateTcpPacket(pOvsNb, &encapsulator, &encapData, lsoMss, lsoTcpHeaderOffset);
+    }
     //try to encapsulate. if it fails, and the cause is encaps_size + payload size > mtu:
     //        if ipv4:
     //            if DF is set: originate icmp4 "packet too big and DF is set"
     //            if DF is not set: fragment the buffer, and encapsulate each buffer
     //        if ipv6: originate icmp6 "Packet Too Big"
-    if (nbLen + encapData.encapsHeadersSize <= encapData.mtu)
+    else if (nbLen + encapData.encapsHeadersSize <= encapData.mtu)
     {
         ok = Encaps_EncapsulateOnb(&encapsulator, &encapData);
     }
@@ -586,7 +710,16 @@ static BOOLEAN _OutputPacketToPort_Normal(OVS_NET_BUFFER* pOvsNb)
     }
     else
     {
-        ok = ProcessPacket_Normal_SendUnicast(pOvsNb, pEthHeader->destination_addr);
+        UINT16 vlanId = 0;
+
+        if (RtlUshortByteSwap(pEthHeader->type) == OVS_ETHERTYPE_QTAG)
+        {
+            const OVS_ETHERNET_HEADER_TAGGED* pTaggedHeader = ONB_GetDataOfSize(pOvsNb, sizeof(OVS_ETHERNET_HEADER_TAGGED));
+
+            vlanId = Sctx_MacTable_VlanIdFromTci(pTaggedHeader->tci);
+        }
+
+        ok = ProcessPacket_Normal_SendUnicast(pOvsNb, pEthHeader->destination_addr, vlanId);
     }
 
     return ok;
@@ -635,15 +768,93 @@ static BOOLEAN _OutputPacketToPort_Physical(OVS_NET_BUFFER* pOvsNb)
     return ok;
 }
 
+//several destination ports (physical / management os), for a single NBL: set all the destinations at once
+static BOOLEAN _OutputPacketToPort_Multiple(OVS_NET_BUFFER* pOvsNb)
+{
+    OVS_SWITCH_INFO* pSwitchInfo = pOvsNb->pSwitchInfo;
+    OVS_GLOBAL_FORWARD_INFO* pForwardInfo = pSwitchInfo->pForwardInfo;
+    NDIS_SWITCH_FORWARDING_DETAIL_NET_BUFFER_LIST_INFO* pForwardDetail = NULL;
+    NDIS_SWITCH_FORWARDING_DESTINATION_ARRAY* pDestinations = NULL;
+    NDIS_STATUS status = NDIS_STATUS_SUCCESS;
+    LOCK_STATE_EX lockState = { 0 };
+    ULONG bytesSent = 0;
+    UINT32 index = 0, countAdded = 0;
+
+    OVS_CHECK(pOvsNb->ppDestinationPorts);
+    OVS_CHECK(pOvsNb->countDestinationPorts > 1);
+
+    bytesSent = ONB_GetDataLength(pOvsNb);
+    pForwardDetail = NET_BUFFER_LIST_SWITCH_FORWARDING_DETAIL(pOvsNb->pNbl);
+
+    if (pForwardDetail->NumAvailableDestinations < pOvsNb->countDestinationPorts)
+    {
+        status = pSwitchInfo->switchHandlers.GrowNetBufferListDestinations(pSwitchInfo->switchContext, pOvsNb->pNbl,
+            pOvsNb->countDestinationPorts - pForwardDetail->NumAvailableDestinations, &pDestinations);
+
+        if (status != NDIS_STATUS_SUCCESS)
+        {
+            DEBUGP(LOG_ERROR, __FUNCTION__ " cannot grow nbl destinations: %u\n", pOvsNb->countDestinationPorts);
+            return FALSE;
+        }
+    }
+    else
+    {
+        pSwitchInfo->switchHandlers.GetNetBufferListDestinations(pSwitchInfo->switchContext, pOvsNb->pNbl, &pDestinations);
+    }
+
+    index = pDestinations->NumDestinations;
+
+    FWDINFO_LOCK_READ(pForwardInfo, &lockState);
+
+    for (ULONG i = 0; i < pOvsNb->countDestinationPorts; ++i)
+    {
+        OVS_OFPORT* pDestPort = pOvsNb->ppDestinationPorts[i];
+        OVS_NIC_LIST_ENTRY* pNicEntry = NULL;
+        NDIS_SWITCH_PORT_DESTINATION* pDestination = NULL;
+
+        //we don't need to lock pDestPort, because its field, portId, never changed
+        pNicEntry = Sctx_FindNicByPortId_Unsafe(pForwardInfo, pDestPort->portId);
+        if (!pNicEntry)
+        {
+            DEBUGP(LOG_LOUD, "of port %s does not have a nic associated!\n", pDestPort->ofPortName);
+            continue;
+        }
+
+        pDestination = NDIS_SWITCH_PORT_DESTINATION_AT_ARRAY_INDEX(pDestinations, index);
+        NdisZeroMemory(pDestination, sizeof(NDIS_SWITCH_PORT_DESTINATION));
+
+        pDestination->PortId = pNicEntry->portId;
+        pDestination->NicIndex = pNicEntry->nicIndex;
+        pDestination->PreserveVLAN = TRUE;
+        pDestination->PreservePriority = TRUE;
+
+        //TODO: stats lock
+        pDestPort->stats.packetsSent++;
+        pDestPort->stats.bytesSent += bytesSent;
+
+        ++index;
+        ++countAdded;
+    }
+
+    FWDINFO_UNLOCK(pForwardInfo, &lockState);
+
+    if (!countAdded)
+    {
+        return FALSE;
+    }
+
+    status = pSwitchInfo->switchHandlers.UpdateNetBufferListDestinations(pSwitchInfo->switchContext, pOvsNb->pNbl, countAdded, pDestinations);
+    OVS_CHECK(status == NDIS_STATUS_SUCCESS);
+
+    return (status == NDIS_STATUS_SUCCESS);
+}
+
 _Use_decl_annotations_
 BOOLEAN OutputPacketToPort(OVS_NET_BUFFER* pOvsNb)
 {
     BOOLEAN ok = FALSE;
-    OVS_DATAPATH* pDatapath = NULL;
     ULONG packetsSent = 0, bytesSent = 0;
 
-    pDatapath = GetDefaultDatapath_Ref(__FUNCTION__);
-
     //NOTE: it is no longer used.
     //It used to be used when a dest port was not provided by the userspace
     //And the kernel was supposed to find a dest port -- the kernel taking the role of port type NORMAL
@@ -655,6 +866,13 @@ BOOLEAN OutputPacketToPort(OVS_NET_BUFFER* pOvsNb)
 
     OVS_CHECK(pOvsNb->pDestinationPort);
 
+    //consecutive output actions, collapsed by ExecuteActions into a single NBL
+    if (pOvsNb->countDestinationPorts > 1)
+    {
+        ok = _OutputPacketToPort_Multiple(pOvsNb);
+        goto Cleanup;
+    }
+
     switch (pOvsNb->pDestinationPort->ofPortType)
     {
     case OVS_OFPORT_TYPE_GRE:
@@ -710,8 +928,6 @@ BOOLEAN OutputPacketToPort(OVS_NET_BUFFER* pOvsNb)
     }
 
 Cleanup:
-    OVS_REFCOUNT_DEREFERENCE(pDatapath);
-
     if (ok)
     {
         Nbls_SendIngressBasic(pOvsNb->pSwitchInfo, pOvsNb->pNbl, pOvsNb->sendFlags, 1);
@@ -720,6 +936,67 @@ Cleanup:
     return ok;
 }
 
+//the objects an NDIS send callback needs for all of its packets.
+//They are resolved once per callback (i.e. per batch of NBLs), and the references are held until the whole batch has been processed:
+//a flow table or datapath replaced meanwhile stays alive until the batch ends, and the next batch sees the new one.
+typedef struct _OVS_INGRESS_BATCH
+{
+    OVS_DATAPATH*       pDatapath;
+    OVS_FLOW_TABLE*     pFlowTable;
+
+    //datapath statistics, added to the datapath's once, when the batch ends
+    UINT64              flowTableMatches;
+    UINT64              flowTableMissed;
+}OVS_INGRESS_BATCH, *POVS_INGRESS_BATCH;
+
+static BOOLEAN _IngressBatch_Begin(_Out_ OVS_INGRESS_BATCH* pBatch)
+{
+    RtlZeroMemory(pBatch, sizeof(OVS_INGRESS_BATCH));
+
+    pBatch->pDatapath = GetDefaultDatapath_Ref(__FUNCTION__);
+    if (!pBatch->pDatapath)
+    {
+        return FALSE;
+    }
+
+    //the pFlowTable will not be deleted by a different thread until we call deref.
+    pBatch->pFlowTable = Datapath_ReferenceFlowTable(pBatch->pDatapath);
+    if (!pBatch->pFlowTable)
+    {
+        OVS_REFCOUNT_DEREFERENCE(pBatch->pDatapath);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static VOID _IngressBatch_End(_Inout_ OVS_INGRESS_BATCH* pBatch)
+{
+    LOCK_STATE_EX lockState = { 0 };
+
+    if (!pBatch->pDatapath)
+    {
+        return;
+    }
+
+    DATAPATH_LOCK_WRITE(pBatch->pDatapath, &lockState);
+
+    pBatch->pDatapath->statistics.flowTableMatches += pBatch->flowTableMatches;
+    pBatch->pDatapath->statistics.flowTableMissed += pBatch->flowTableMissed;
+
+    //TODO: don't know when exactly to increase this
+    pBatch->pDatapath->statistics.masksMatched += pBatch->flowTableMatches;
+
+    DATAPATH_UNLOCK(pBatch->pDatapath, &lockState);
+
+    //the sample upcalls are written in batches: those held for too long are written now
+    FlushSamplesToUserspace();
+
+    //we don't use the pFlowTable anymore.
+    OVS_REFCOUNT_DEREFERENCE(pBatch->pFlowTable);
+    OVS_REFCOUNT_DEREFERENCE(pBatch->pDatapath);
+}
+
 /*    extract packet info / packet info from ONB
     find if the packet info matches any registered flow
     if no match is found:
@@ -732,25 +1009,20 @@ Cleanup:
     update datapath statistics
 
     */
-static BOOLEAN _ProcessPacket(OVS_NET_BUFFER* pOvsNb, _In_ const OVS_OFPORT* pSourcePort, const OF_PI_IPV4_TUNNEL* pTunnelInfo)
+//pLearnSource: the nic the frame came in through, to learn its source mac on; NULL if the source mac must not be learned
+static BOOLEAN _ProcessPacket(_Inout_ OVS_INGRESS_BATCH* pBatch, OVS_NET_BUFFER* pOvsNb, _In_ const OVS_OFPORT* pSourcePort, const OF_PI_IPV4_TUNNEL* pTunnelInfo,
+    _In_opt_ const OVS_NIC_INFO* pLearnSource)
 {
     OVS_OFPACKET_INFO packetInfo = { 0 };
-    OVS_DATAPATH* pDatapath = NULL;
+    OVS_DATAPATH* pDatapath = pBatch->pDatapath;
     OVS_FLOW* pFlow = NULL;
     BOOLEAN sent = FALSE;
     BOOLEAN dbgPrintPacket = FALSE;
     ULONG nbLen = 0;
     LOCK_STATE_EX lockState = { 0 };
-    VOID* pNbBuffer = NULL;
     UINT16 ofInPortNumber = OVS_INVALID_PORT_NUMBER;
-    OVS_FLOW_TABLE* pFlowTable = NULL;
-
-    pDatapath = GetDefaultDatapath_Ref(__FUNCTION__);
-    if (!pDatapath)
-    {
-        return FALSE;
-    }
 
+    //the batch holds the reference to the datapath
     pOvsNb->pDatapath = pDatapath;
 
     //note: no need to set pOvsNb->pTunnelInfo because:
@@ -758,21 +1030,23 @@ static BOOLEAN _ProcessPacket(OVS_NET_BUFFER* pOvsNb, _In_ const OVS_OFPORT* pSo
     //b) it's for 'set tunnel', not for 'received tunnel'
     //pOvsNb->pTunnelInfo = pTunnelInfo;
 
-    pNbBuffer = ONB_GetData(pOvsNb);
-    OVS_CHECK(pNbBuffer);
-    nbLen = ONB_GetDataLength(pOvsNb);
-
     if (pSourcePort)
     {
         ofInPortNumber = pSourcePort->ofPortNumber;
     }
 
-    if (!PacketInfo_Extract(pNbBuffer, nbLen, ofInPortNumber, &packetInfo))
+    if (!PacketInfo_ExtractFromNb(ONB_GetNetBuffer(pOvsNb), ofInPortNumber, &packetInfo))
     {
         sent = FALSE;
         goto Cleanup;
     }
 
+    if (pLearnSource)
+    {
+        Sctx_MacTable_Learn(pOvsNb->pSwitchInfo->pForwardInfo->pMacTable, packetInfo.ethInfo.source,
+            Sctx_MacTable_VlanIdFromTci(packetInfo.ethInfo.tci), pLearnSource->portId, pLearnSource->nicIndex);
+    }
+
     //we do this after PacketInfo_Extract, because PacketInfo_Extract updates the ARP table
     if (!pSourcePort)
     {
@@ -787,9 +1061,7 @@ static BOOLEAN _ProcessPacket(OVS_NET_BUFFER* pOvsNb, _In_ const OVS_OFPORT* pSo
         packetInfo.tunnelInfo = *pTunnelInfo;
     }
 
-    //the pFlowTable will not be deleted by a different thread until we call deref.
-    pFlowTable = Datapath_ReferenceFlowTable(pDatapath);
-    pFlow = FlowTable_FindFlowMatchingMaskedPI_Ref(pDatapath->pFlowTable, &packetInfo);
+    pFlow = FlowTable_FindFlowMatchingMaskedPI_Ref(pBatch->pFlowTable, &packetInfo);
 
     pOvsNb->pOriginalPacketInfo = &packetInfo;
 
@@ -802,8 +1074,7 @@ static BOOLEAN _ProcessPacket(OVS_NET_BUFFER* pOvsNb, _In_ const OVS_OFPORT* pSo
 
         if (pSourcePort)
         {
-            //TODO: normally, we should do a "find"
-            upcallInfo.portId = (pSourcePort->upcallPortIds.count > 0) ? pSourcePort->upcallPortIds.ids[0] : 0;
+            upcallInfo.portId = OFPort_GetUpcallPortId(pSourcePort);
         }
 
         else
@@ -842,14 +1113,9 @@ static BOOLEAN _ProcessPacket(OVS_NET_BUFFER* pOvsNb, _In_ const OVS_OFPORT* pSo
     sent = ExecuteActions(pOvsNb, OutputPacketToPort);
 
 Cleanup:
-    DATAPATH_LOCK_WRITE(pDatapath, &lockState);
-
     if (pFlow)
     {
-        ++pDatapath->statistics.flowTableMatches;
-
-        //TODO: don't know when exactly to increase this
-        ++pDatapath->statistics.masksMatched;
+        ++pBatch->flowTableMatches;
 
         //we don't use the pActions anymore
         //the actions are not modified, once set in a flow, so there's no need to lock the pFlow to dereference pActions
@@ -858,26 +1124,17 @@ Cleanup:
     }
     else
     {
-        ++pDatapath->statistics.flowTableMissed;
+        ++pBatch->flowTableMissed;
     }
 
-    //we don't use the pFlowTable anymore.
-    OVS_REFCOUNT_DEREFERENCE(pFlowTable);
-
-    DATAPATH_UNLOCK(pDatapath, &lockState);
-
-    OVS_REFCOUNT_DEREFERENCE(pDatapath);
-
     return sent;
 }
 
-static BOOLEAN _DecapsulateIfNeeded_Ref(_In_ const BYTE managOsMac[OVS_ETHERNET_ADDRESS_LENGTH],
+static BOOLEAN _DecapsulateIfNeeded_Ref(_In_ const OVS_SWITCH_INFO* pSwitchInfo, _In_ const BYTE managOsMac[OVS_ETHERNET_ADDRESS_LENGTH],
     OVS_NET_BUFFER* pOvsNb, _Out_ OF_PI_IPV4_TUNNEL* pTunnelInfo, BOOLEAN* pWasEncapsulated, _Out_ OVS_OFPORT** ppOFPort)
 {
     BOOLEAN ok = TRUE;
-    const OVS_DECAPSULATOR* pDecapsulator = NULL;
-    BYTE encapProtocolType = 0;
-    LE16 udpDestPort = 0;
+    OVS_OUTER_HEADERS outerHeaders = { 0 };
 
     OVS_CHECK(ppOFPort);
     OVS_CHECK(pWasEncapsulated);
@@ -888,40 +1145,37 @@ static BOOLEAN _DecapsulateIfNeeded_Ref(_In_ const BYTE managOsMac[OVS_ETHERNET_
 
     RtlZeroMemory(pTunnelInfo, sizeof(OF_PI_IPV4_TUNNEL));
 
-    pDecapsulator = Encap_FindDecapsulator(ONB_GetNetBuffer(pOvsNb), &encapProtocolType, &udpDestPort);
+    //the outer headers are parsed only once: the decapsulation only strips them
+    ok = Encap_ParseOuterHeaders(ONB_GetNetBuffer(pOvsNb), &outerHeaders);
 
-    if (Encap_GetDecapsulator_Gre() == pDecapsulator)
+    if (outerHeaders.pDecapsulator)
     {
-        OVS_OFPORT* pGrePort = NULL;
+        OVS_OFPORT* pTunnelPort = NULL;
 
         *pWasEncapsulated = TRUE;
-        ok = Encaps_DecapsulateOnb(pDecapsulator, pOvsNb, pTunnelInfo, encapProtocolType);
 
-        pGrePort = OFPort_FindGre_Ref(NULL);
-        if (pGrePort)
+        if (ok)
         {
-            pGrePort->stats.packetsReceived++;
-            pGrePort->stats.bytesReceived += ONB_GetDataLength(pOvsNb);
+            ok = Encaps_DecapsulateOnb(pOvsNb, &outerHeaders);
         }
 
-        *ppOFPort = pGrePort;
-    }
-    else if (Encap_GetDecapsulator_Vxlan() == pDecapsulator)
-    {
-        OVS_OFPORT* pVxlanPort = NULL;
-
-        *pWasEncapsulated = TRUE;
-        ok = Encaps_DecapsulateOnb(pDecapsulator, pOvsNb, pTunnelInfo, encapProtocolType);
+        if (ok)
+        {
+            *pTunnelInfo = outerHeaders.tunnelInfo;
+        }
 
-        pVxlanPort = OFPort_FindVxlan_Ref(udpDestPort);
+        if (outerHeaders.ofPortNumber != OVS_INVALID_PORT_NUMBER)
+        {
+            pTunnelPort = OFPort_FindByNumber_Ref(outerHeaders.ofPortNumber);
+        }
 
-        if (pVxlanPort)
+        if (pTunnelPort)
         {
-            pVxlanPort->stats.packetsReceived++;
-            pVxlanPort->stats.bytesReceived += ONB_GetDataLength(pOvsNb);
+            pTunnelPort->stats.packetsReceived++;
+            pTunnelPort->stats.bytesReceived += ONB_GetDataLength(pOvsNb);
         }
 
-        *ppOFPort = pVxlanPort;
+        *ppOFPort = pTunnelPort;
     }
     else
     {
@@ -929,10 +1183,10 @@ static BOOLEAN _DecapsulateIfNeeded_Ref(_In_ const BYTE managOsMac[OVS_ETHERNET_
         OVS_OFPORT* pExternalPort = NULL;
         OVS_ETHERNET_HEADER* pEthHeader = NULL;
 
-        OVS_CHECK(!pDecapsulator);
+        OVS_CHECK(ok);
 
-        pInternalPort = OFPort_FindInternal_Ref();
-        pExternalPort = OFPort_FindExternal_Ref();
+        pInternalPort = OFPort_FindInternalOnSwitch_Ref(pSwitchInfo);
+        pExternalPort = OFPort_FindExternalOnSwitch_Ref(pSwitchInfo);
 
         pEthHeader = (OVS_ETHERNET_HEADER*)ONB_GetDataOfSize(pOvsNb, sizeof(OVS_ETHERNET_HEADER));
 
@@ -964,13 +1218,146 @@ static BOOLEAN _DecapsulateIfNeeded_Ref(_In_ const BYTE managOsMac[OVS_ETHERNET_
     return ok;
 }
 
+//coalesced frames are larger than the mtu: only the frames for a vm or for the management os may be coalesced, not those that
+//go out again through the external nic. The nic of the destination mac is known if it sent packets.
+//pOvsNb: a decapsulated frame, not validated yet
+static BOOLEAN _IsForSwitchNic(_In_ const OVS_GLOBAL_FORWARD_INFO* pForwardInfo, _In_ OVS_NET_BUFFER* pOvsNb, NDIS_SWITCH_PORT_ID externalPortId)
+{
+    const OVS_ETHERNET_HEADER* pEthHeader = NULL;
+    NDIS_SWITCH_PORT_ID portId = NDIS_SWITCH_DEFAULT_PORT_ID;
+    NDIS_SWITCH_NIC_INDEX nicIndex = 0;
+
+    //checks the length of the headers; and a segment is untagged, so its mac was learned in vlan 0
+    if (!RxCoalesce_IsSegment(pOvsNb))
+    {
+        return FALSE;
+    }
+
+    pEthHeader = ONB_GetDataOfSize(pOvsNb, sizeof(OVS_ETHERNET_HEADER));
+    if (!pEthHeader)
+    {
+        return FALSE;
+    }
+
+    if (!Sctx_MacTable_Find(pForwardInfo->pMacTable, pEthHeader->destination_addr, 0, &portId, &nicIndex))
+    {
+        return FALSE;
+    }
+
+    return (portId != externalPortId);
+}
+
+//processes the frame held for coalescing, if any
+static VOID _ProcessCoalescedPackets(_Inout_ OVS_INGRESS_BATCH* pBatch, _Inout_ OVS_RX_COALESCE_CONTEXT* pCoalesce)
+{
+    OVS_NET_BUFFER* pOvsNb = NULL;
+
+    while ((pOvsNb = RxCoalesce_Flush(pCoalesce)) != NULL)
+    {
+        OVS_SWITCH_INFO* pSwitchInfo = pOvsNb->pSwitchInfo;
+        OVS_OFPORT* pOFPort = pOvsNb->pSourcePort;
+
+        //the inner macs of tunneled frames are not learned
+        if (!_ProcessPacket(pBatch, pOvsNb, pOFPort, &pCoalesce->tunnelInfo, NULL))
+        {
+            ONB_Destroy(pSwitchInfo, &pOvsNb);
+        }
+        else
+        {
+            KFree(pOvsNb);
+        }
+
+        OVS_REFCOUNT_DEREFERENCE(pOFPort);
+    }
+}
+
+//decapsulates the packet, if it comes from the external nic; then processes it, or holds it for coalescing. The caller gives up the packet.
+static VOID _ProcessIngressOnb(_Inout_ OVS_INGRESS_BATCH* pBatch, _Inout_ OVS_RX_COALESCE_CONTEXT* pCoalesce, _In_ const OVS_GLOBAL_FORWARD_INFO* pForwardInfo,
+    _In_ const OVS_NIC_INFO* pSourceInfo, BOOLEAN isFromExternal, _In_ const BYTE managOsMac[OVS_ETHERNET_ADDRESS_LENGTH], ULONG sendFlags,
+    _In_ OVS_NET_BUFFER* pOvsNb)
+{
+    OVS_SWITCH_INFO* pSwitchInfo = pOvsNb->pSwitchInfo;
+    OF_PI_IPV4_TUNNEL tunnelInfo = { 0 }, *pTunnelInfo = NULL;
+    BOOLEAN wasEncapsulated = FALSE;
+    OVS_OFPORT* pOFPort = NULL;
+    const OVS_NIC_INFO* pLearnSource = pSourceInfo;
+
+    if (isFromExternal)
+    {
+        //if has gre / vxlan => decapsulates
+        BOOLEAN ok = _DecapsulateIfNeeded_Ref(pSwitchInfo, managOsMac, pOvsNb, &tunnelInfo, &wasEncapsulated, &pOFPort);
+        if (!ok)
+        {
+            OVS_REFCOUNT_DEREFERENCE(pOFPort);
+
+            ONB_Destroy(pSwitchInfo, &pOvsNb);
+            return;
+        }
+
+        if (wasEncapsulated)
+        {
+            pTunnelInfo = &tunnelInfo;
+        }
+
+        //the inner macs of tunneled frames and the frames of the management os do not live behind the external nic
+        if (wasEncapsulated || (pOFPort && pOFPort->portId != pSourceInfo->portId))
+        {
+            pLearnSource = NULL;
+        }
+    }
+    else
+    {
+        pOFPort = OFPort_FindByIdOnSwitch_Ref(pSwitchInfo, pSourceInfo->portId);
+    }
+
+    //pDatapath will be set by _ProcessPacket, from the batch
+    pOvsNb->pDatapath = NULL;
+    pOvsNb->pDestinationPort = NULL;
+    pOvsNb->sendToPortNormal = FALSE;
+    pOvsNb->sendFlags = sendFlags;
+    pOvsNb->pSourcePort = pOFPort;
+
+    //on success, the coalescing context owns the packet and its reference to pOFPort
+    if (wasEncapsulated && RxCoalesce_IsEnabled(pCoalesce) && _IsForSwitchNic(pForwardInfo, pOvsNb, pSourceInfo->portId))
+    {
+        if (RxCoalesce_Append(pCoalesce, pOvsNb, &tunnelInfo))
+        {
+            return;
+        }
+
+        _ProcessCoalescedPackets(pBatch, pCoalesce);
+
+        if (RxCoalesce_Hold(pCoalesce, pOvsNb, &tunnelInfo))
+        {
+            return;
+        }
+    }
+    else
+    {
+        //keeps the order of the packets of the flow being coalesced
+        _ProcessCoalescedPackets(pBatch, pCoalesce);
+    }
+
+    if (!_ProcessPacket(pBatch, pOvsNb, pOFPort, pTunnelInfo, pLearnSource))
+    {
+        ONB_Destroy(pSwitchInfo, &pOvsNb);
+    }
+    else
+    {
+        KFree(pOvsNb);
+    }
+
+    OVS_REFCOUNT_DEREFERENCE(pOFPort);
+}
+
 /* for each nbl in list:
         try to extract src info, if we don't have it; drop the nbl if fail
         find: isFromExternal?
         for each nb in nbl:
         create an OVS_NET_BUFFER from it
-        if isFromExternal: decapsulate if needed
-        call _ProcessPacket to process the OVS_NET_BUFFER
+        if isFromExternal: hold it, if it is a fragment of an outer packet (see Ipv4Reassembly.h); decapsulate if needed
+        if the decapsulated packet continues a tcp flow: hold it for coalescing (see RxCoalesce.h)
+        call _ProcessPacket to process the OVS_NET_BUFFER (and, before it, the frame held for coalescing)
 
         drop all original packets
 
@@ -989,6 +1376,8 @@ static VOID _ProcessAllNblsIngress(_In_ OVS_SWITCH_INFO* pSwitchInfo, _In_ OVS_G
     BOOLEAN isFromExternal = FALSE;
     BOOLEAN isFromInternal = FALSE;
     BYTE managOsMac[OVS_ETHERNET_ADDRESS_LENGTH] = { 0 };
+    OVS_INGRESS_BATCH batch = { 0 };
+    OVS_RX_COALESCE_CONTEXT coalesce;
 
     UNREFERENCED_PARAMETER(sendFlags);
 
@@ -996,6 +1385,15 @@ static VOID _ProcessAllNblsIngress(_In_ OVS_SWITCH_INFO* pSwitchInfo, _In_ OVS_G
     //NOTE: this function is called by NDIS callback, and therefore, nbls cannot be null.
     OVS_CHECK(nbls);
 
+    //the datapath and its flow table are resolved once for all the NBLs of this callback
+    if (!_IngressBatch_Begin(&batch))
+    {
+        Nbls_DropAllIngress(pSwitchInfo, nbls, completeFlags, OVS_NBL_FAIL_SUCCESS);
+        return;
+    }
+
+    RxCoalesce_Begin(&coalesce);
+
     //loop over each NBL in the list. put the the send buffers in the send list.
     //the drop buffers are dropped each when needed.
     //the mustSend ones are being linked (pPrev->Next = pNbl);
@@ -1039,17 +1437,18 @@ static VOID _ProcessAllNblsIngress(_In_ OVS_SWITCH_INFO* pSwitchInfo, _In_ OVS_G
         {
             isFromExternal = FALSE;
 
-            if (pForwardInfo->pInternalNic)
+            if (pForwardInfo->pInternalNic && pSourceInfo->portId == pForwardInfo->pInternalNic->portId)
             {
-                RtlCopyMemory(managOsMac, pForwardInfo->pInternalNic->macAddress, OVS_ETHERNET_ADDRESS_LENGTH);
-
-                if (pSourceInfo->portId == pForwardInfo->pInternalNic->portId)
-                {
-                    isFromInternal = TRUE;
-                }
+                isFromInternal = TRUE;
             }
         }
 
+        //needed for the packets from external, to tell the ones sent by the management os
+        if (pForwardInfo->pInternalNic)
+        {
+            RtlCopyMemory(managOsMac, pForwardInfo->pInternalNic->macAddress, OVS_ETHERNET_ADDRESS_LENGTH);
+        }
+
         FWDINFO_UNLOCK(pForwardInfo, &lockState);
 
         OVS_CHECK(mustTransfer);
@@ -1057,9 +1456,8 @@ static VOID _ProcessAllNblsIngress(_In_ OVS_SWITCH_INFO* pSwitchInfo, _In_ OVS_G
         for (pNb = NET_BUFFER_LIST_FIRST_NB(pNbl); pNb != NULL; pNb = NET_BUFFER_NEXT_NB(pNb))
         {
             ULONG additionalSize = max(Gre_BytesNeeded(0xFFFF), Vxlan_BytesNeeded(0xFFFF));
-            OF_PI_IPV4_TUNNEL tunnelInfo = { 0 }, *pTunnelInfo = NULL;
-            BOOLEAN wasEncapsulated = FALSE;
-            OVS_OFPORT* pOFPort = NULL;
+            OVS_IPV4_REASSEMBLY_FRAGMENTS released;
+            ULONG i = 0;
 
             OVS_NET_BUFFER* pOvsNb = ONB_CreateFromNbAndNbl(pSwitchInfo, pNbl, pNb, additionalSize);
             if (!pOvsNb)
@@ -1067,53 +1465,35 @@ static VOID _ProcessAllNblsIngress(_In_ OVS_SWITCH_INFO* pSwitchInfo, _In_ OVS_G
                 break;
             }
 
+            //the fragments of the outer packets are held until the whole packet can be decapsulated
             if (isFromExternal)
             {
-                //if has gre / vxlan => decapsulates
-                BOOLEAN ok = _DecapsulateIfNeeded_Ref(managOsMac, pOvsNb, &tunnelInfo, &wasEncapsulated, &pOFPort);
-                if (!ok)
+                switch (Ipv4Reassembly_Add(&pOvsNb, managOsMac, &released))
                 {
-                    OVS_REFCOUNT_DEREFERENCE(pOFPort);
-
-                    ONB_Destroy(pSwitchInfo, &pOvsNb);
+                case OVS_IPV4_REASSEMBLY_HELD:
                     continue;
-                }
 
-                if (wasEncapsulated)
-                {
-                    pTunnelInfo = &tunnelInfo;
-                }
-            }
-            else
-            {
-                pOFPort = OFPort_FindById_Ref(pSourceInfo->portId);
-            }
-
-            pOvsNb->pSwitchInfo = pSwitchInfo;
-            //pDatapath will be set later
-            pOvsNb->pDatapath = NULL;
-            pOvsNb->pDestinationPort = NULL;
-            pOvsNb->sendToPortNormal = FALSE;
-            pOvsNb->sendFlags = sendFlags;
-            pOvsNb->pSourcePort = pOFPort;
-
-            if (!_ProcessPacket(pOvsNb, pOFPort, pTunnelInfo))
-            {
-                OVS_CHECK(pOvsNb->pNbl != pNbl);
+                case OVS_IPV4_REASSEMBLY_RELEASED:
+                    for (i = 0; i < released.count; ++i)
+                    {
+                        _ProcessIngressOnb(&batch, &coalesce, pForwardInfo, pSourceInfo, isFromExternal, managOsMac, sendFlags, released.fragments[i]);
+                    }
 
-                ONB_Destroy(pSwitchInfo, &pOvsNb);
-            }
-            else
-            {
-                OVS_CHECK(pOvsNb->pNbl != pNbl);
+                    continue;
 
-                KFree(pOvsNb);
+                default:
+                    break;
+                }
             }
 
-            OVS_REFCOUNT_DEREFERENCE(pOFPort);
+            _ProcessIngressOnb(&batch, &coalesce, pForwardInfo, pSourceInfo, isFromExternal, managOsMac, sendFlags, pOvsNb);
         }
     }
 
+    _ProcessCoalescedPackets(&batch, &coalesce);
+
+    _IngressBatch_End(&batch);
+
     Nbls_DropAllIngress(pSwitchInfo, nbls, completeFlags, OVS_NBL_FAIL_SUCCESS);
 }
 
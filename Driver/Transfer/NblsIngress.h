@@ -136,7 +136,8 @@ __inline NDIS_STATUS NblFailReasonToNdisStatus(OVS_NBL_FAIL_REASON reason)
     }
 }
 
-BOOLEAN GetDestinationInfo(_In_ const OVS_GLOBAL_FORWARD_INFO* pForwardInfo, _In_reads_bytes_(6) const BYTE* pDestMac, _In_ NDIS_SWITCH_PORT_ID sourcePort,
+//vlanId: 0 if the frame is not tagged. Only used by the NORMAL path (sendToPortNormal), which is no longer taken.
+BOOLEAN GetDestinationInfo(_In_ const OVS_GLOBAL_FORWARD_INFO* pForwardInfo, _In_reads_bytes_(6) const BYTE* pDestMac, UINT16 vlanId, _In_ NDIS_SWITCH_PORT_ID sourcePort,
     _Out_ OVS_NIC_INFO* pCurDestination, _Inout_ OVS_NBL_FAIL_REASON* pFailReason);
 
 BOOLEAN SetOneDestination(_In_ const OVS_SWITCH_INFO* pSwitchInfo, NET_BUFFER_LIST* pNbl, _Out_ OVS_NBL_FAIL_REASON* pFailReason, NDIS_SWITCH_PORT_ID portId,
@@ -20,14 +20,14 @@ limitations under the License.
 #include "OvsNetBuffer.h"
 
 _Use_decl_annotations_
-BOOLEAN ProcessPacket_Normal_SendUnicast(OVS_NET_BUFFER* pOvsNb, const BYTE* destMac)
+BOOLEAN ProcessPacket_Normal_SendUnicast(OVS_NET_BUFFER* pOvsNb, const BYTE* destMac, UINT16 vlanId)
 {
     BOOLEAN mustTransfer = FALSE;
     OVS_NIC_INFO curDestination = { 0 };
     OVS_NBL_FAIL_REASON failReason = OVS_NBL_FAIL_SUCCESS;
     OVS_GLOBAL_FORWARD_INFO* pForwardInfo = pOvsNb->pSwitchInfo->pForwardInfo;
 
-    mustTransfer = GetDestinationInfo(pForwardInfo, destMac, pOvsNb->pSourcePort->portId, &curDestination, &failReason);
+    mustTransfer = GetDestinationInfo(pForwardInfo, destMac, vlanId, pOvsNb->pSourcePort->portId, &curDestination, &failReason);
     if (!mustTransfer)
     {
         if (failReason != OVS_NBL_FAIL_DESTINATION_IS_SOURCE)
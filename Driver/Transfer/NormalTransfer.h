@@ -18,5 +18,5 @@ limitations under the License.
 
 typedef struct _OVS_NET_BUFFER OVS_NET_BUFFER;
 
-BOOLEAN ProcessPacket_Normal_SendUnicast(_Inout_ OVS_NET_BUFFER* pOvsNb, _In_reads_bytes_(6) const BYTE* destMac);
+BOOLEAN ProcessPacket_Normal_SendUnicast(_Inout_ OVS_NET_BUFFER* pOvsNb, _In_reads_bytes_(6) const BYTE* destMac, UINT16 vlanId);
 BOOLEAN ProcessPacket_Normal_SendMulticast(_Inout_ OVS_NET_BUFFER* pOvsNb);
\ No newline at end of file
@@ -25,6 +25,7 @@ limitations under the License.
 #include "Tcp.h"
 #include "Udp.h"
 #include "Nbls.h"
+#include "Ipv6.h"
 
 extern NDIS_HANDLE g_ndisFilterHandle;
 
@@ -33,60 +34,232 @@ extern NDIS_HANDLE g_hNbPool;
 
 extern NDIS_SPIN_LOCK g_nbPoolLock;
 
-BOOLEAN NblIsLso(_In_ NET_BUFFER_LIST* pNbl)
+//precedes the data buffer of each NET_BUFFER we allocate
+typedef union _OVS_NB_DATA_HEADER
 {
-    NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO* pLsoInfo = NULL;
-    OVS_CHECK(pNbl);
+    struct
+    {
+        //the number of NET_BUFFER-s (MDLs) using the data buffer
+        volatile LONG   refCount;
+        //the size of the data buffer, excluding this header
+        ULONG           size;
+        //the data buffer that the partial MDLs chained after ours point into (see ONB_FragmentBuffer_Ipv4); released along with this one
+        VOID*           pChainedData;
+    };
 
-    //break the first time we have an LSO NBL. Just to see it happen.
+    //keeps the data buffer aligned the way a KAlloc-ed buffer would be
+    UINT8 alignment[MEMORY_ALLOCATION_ALIGNMENT];
+}OVS_NB_DATA_HEADER, *POVS_NB_DATA_HEADER;
 
-    pLsoInfo = (NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO*)&
-        (NET_BUFFER_LIST_INFO(pNbl, TcpLargeSendNetBufferListInfo));
+C_ASSERT(sizeof(OVS_NB_DATA_HEADER) == MEMORY_ALLOCATION_ALIGNMENT);
+
+static __inline OVS_NB_DATA_HEADER* _ONB_GetNbDataHeader(const VOID* buffer)
+{
+    return (OVS_NB_DATA_HEADER*)buffer - 1;
+}
+
+_Use_decl_annotations_
+VOID* ONB_AllocateNbData(ULONG size)
+{
+    OVS_NB_DATA_HEADER* pHeader = NULL;
 
-    if (pLsoInfo->Value)
+    pHeader = KAlloc(sizeof(OVS_NB_DATA_HEADER) + size);
+    if (!pHeader)
     {
-        OVS_CHECK(0);
-        if (pLsoInfo->Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V1_TYPE ||
-            pLsoInfo->Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE)
-        {
-            return TRUE;
-        }
-        else
-        {
-            //TODO: if there is no LSO, should NET_BUFFER_LIST_INFO return a NULL ptr or set some invalid value?
-            OVS_CHECK(0);
-        }
+        return NULL;
     }
-    else
+
+    pHeader->refCount = 1;
+    pHeader->size = size;
+    pHeader->pChainedData = NULL;
+
+    return pHeader + 1;
+}
+
+static VOID _ONB_ReferenceNbData(_In_ VOID* buffer)
+{
+    InterlockedIncrement(&_ONB_GetNbDataHeader(buffer)->refCount);
+}
+
+_Use_decl_annotations_
+VOID ONB_ReleaseNbData(VOID* buffer)
+{
+    OVS_NB_DATA_HEADER* pHeader = NULL;
+    VOID* chainedBuffer = NULL;
+    LONG refCount = 0;
+
+    if (!buffer)
     {
-        return FALSE;//no LSO
+        return;
     }
 
-    return FALSE;
+    pHeader = _ONB_GetNbDataHeader(buffer);
+
+    refCount = InterlockedDecrement(&pHeader->refCount);
+    OVS_CHECK(refCount >= 0);
+
+    if (refCount == 0)
+    {
+        chainedBuffer = pHeader->pChainedData;
+        KFree(pHeader);
+
+        ONB_ReleaseNbData(chainedBuffer);
+    }
+}
+
+//the MDLs chained after the one of buffer point into chainedBuffer: buffer keeps a reference to it, until buffer itself is released
+static VOID _ONB_ChainNbData(_Inout_ VOID* buffer, _In_ VOID* chainedBuffer)
+{
+    OVS_NB_DATA_HEADER* pHeader = _ONB_GetNbDataHeader(buffer);
+
+    OVS_CHECK(!pHeader->pChainedData);
+
+    _ONB_ReferenceNbData(chainedBuffer);
+    pHeader->pChainedData = chainedBuffer;
 }
 
 _Use_decl_annotations_
-VOID ONB_DestroyNbl(OVS_NET_BUFFER* pOvsNb)
+VOID ONB_FreeNbChain(NET_BUFFER* pFirstNb)
 {
-    MDL* pMdl = NULL;
-    VOID* buffer = NULL, *onbBuffer = NULL;
-    NET_BUFFER* pNb = NULL;
-    ULONG dataOffset = 0;
+    NET_BUFFER* pNb = NULL, *pNextNb = NULL;
 
-    pOvsNb->pSwitchInfo->switchHandlers.FreeNetBufferListForwardingContext(pOvsNb->pSwitchInfo->switchContext, pOvsNb->pNbl);
+    for (pNb = pFirstNb; pNb != NULL; pNb = pNextNb)
+    {
+        MDL* pMdl = NET_BUFFER_FIRST_MDL(pNb), *pNextMdl = NULL;
 
-    pNb = ONB_GetNetBuffer(pOvsNb);
-    onbBuffer = ONB_GetData(pOvsNb);
+        pNextNb = NET_BUFFER_NEXT_NB(pNb);
+
+        //only the first MDL maps the start of a data buffer: the others are partial MDLs, whose data the first one references
+        ONB_ReleaseNbData(MmGetMdlVirtualAddress(pMdl));
+
+        for (; pMdl != NULL; pMdl = pNextMdl)
+        {
+            pNextMdl = pMdl->Next;
+            IoFreeMdl(pMdl);
+        }
+
+        NdisFreeNetBuffer(pNb);
+    }
+}
+
+_Use_decl_annotations_
+BOOLEAN ONB_IsNbDataShared(const VOID* buffer)
+{
+    return (_ONB_GetNbDataHeader(buffer)->refCount > 1);
+}
+
+static VOID _ONB_SetPacketDataSafe(_In_ NET_BUFFER_LIST* pNbl, BOOLEAN isSafe)
+{
+    PNDIS_SWITCH_FORWARDING_DETAIL_NET_BUFFER_LIST_INFO pFwdDetail = NET_BUFFER_LIST_SWITCH_FORWARDING_DETAIL(pNbl);
+
+    //if the data is shared, the extensions below us must copy the packet before modifying it
+    pFwdDetail->IsPacketDataSafe = isSafe;
+}
+
+_Use_decl_annotations_
+BOOLEAN ONB_MakeWritable(OVS_NET_BUFFER* pOvsNb)
+{
+    NET_BUFFER* pNb = ONB_GetNetBuffer(pOvsNb);
+    MDL* pMdl = NULL, *pPrivateMdl = NULL;
+    BYTE* buffer = NULL, *privateBuffer = NULL;
+    ULONG size = 0, dataOffset = 0;
+
+    OVS_CHECK(pNb->Next == NULL);
 
     pMdl = NET_BUFFER_CURRENT_MDL(pNb);
-    dataOffset = ONB_GetDataOffset(pOvsNb);
+    OVS_CHECK(pMdl == NET_BUFFER_FIRST_MDL(pNb));
+    OVS_CHECK(pMdl->Next == NULL);
 
     buffer = MmGetMdlVirtualAddress(pMdl);
-    OVS_CHECK((BYTE*)buffer == (BYTE*)onbBuffer - dataOffset);
-    KFree(buffer);
+    if (!ONB_IsNbDataShared(buffer))
+    {
+        return TRUE;
+    }
+
+    size = MmGetMdlByteCount(pMdl);
+    dataOffset = NET_BUFFER_DATA_OFFSET(pNb);
+
+    privateBuffer = ONB_AllocateNbData(size);
+    if (!privateBuffer)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to allocate a private copy of the packet\n");
+        return FALSE;
+    }
+
+    pPrivateMdl = IoAllocateMdl(privateBuffer, size, FALSE, FALSE, NULL);
+    if (!pPrivateMdl)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to allocate mdl\n");
+        ONB_ReleaseNbData(privateBuffer);
+        return FALSE;
+    }
+
+    MmBuildMdlForNonPagedPool(pPrivateMdl);
+
+    //the bytes before the data offset are backfill: only the packet itself needs to be copied
+    RtlCopyMemory(privateBuffer + dataOffset, buffer + dataOffset, NET_BUFFER_DATA_LENGTH(pNb));
+
+    //the layout of the private buffer is the same as the one of the shared buffer, so the data offset remains valid
+    NET_BUFFER_FIRST_MDL(pNb) = pPrivateMdl;
+    NET_BUFFER_CURRENT_MDL(pNb) = pPrivateMdl;
+
+    _ONB_SetPacketDataSafe(pOvsNb->pNbl, TRUE);
 
     IoFreeMdl(pMdl);
-    NdisFreeNetBuffer(pNb);
+    ONB_ReleaseNbData(buffer);
+
+    return TRUE;
+}
+
+_Use_decl_annotations_
+BOOLEAN NblGetLsoInfo(NET_BUFFER_LIST* pNbl, ULONG* pMss, ULONG* pTcpHeaderOffset)
+{
+    NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO* pLsoInfo = NULL;
+
+    OVS_CHECK(pNbl);
+
+    pLsoInfo = (NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO*)&
+        (NET_BUFFER_LIST_INFO(pNbl, TcpLargeSendNetBufferListInfo));
+
+    if (!pLsoInfo->Value)
+    {
+        //no LSO
+        return FALSE;
+    }
+
+    if (pLsoInfo->Transmit.Type != NDIS_TCP_LARGE_SEND_OFFLOAD_V1_TYPE &&
+        pLsoInfo->Transmit.Type != NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " unknown lso type: %d\n", pLsoInfo->Transmit.Type);
+        return FALSE;
+    }
+
+    //LSO v1 and v2 have the MSS and the tcp header offset at the same position
+    if (pMss)
+    {
+        *pMss = pLsoInfo->Transmit.MSS;
+    }
+
+    if (pTcpHeaderOffset)
+    {
+        *pTcpHeaderOffset = pLsoInfo->Transmit.TcpHeaderOffset;
+    }
+
+    return TRUE;
+}
+
+BOOLEAN NblIsLso(_In_ NET_BUFFER_LIST* pNbl)
+{
+    return NblGetLsoInfo(pNbl, NULL, NULL);
+}
+
+_Use_decl_annotations_
+VOID ONB_DestroyNbl(OVS_NET_BUFFER* pOvsNb)
+{
+    pOvsNb->pSwitchInfo->switchHandlers.FreeNetBufferListForwardingContext(pOvsNb->pSwitchInfo->switchContext, pOvsNb->pNbl);
+
+    //the NBL may have several NET_BUFFER-s, if the packet was fragmented or segmented
+    ONB_FreeNbChain(NET_BUFFER_LIST_FIRST_NB(pOvsNb->pNbl));
 
     NdisFreeNetBufferList(pOvsNb->pNbl);
     pOvsNb->pNbl = NULL;
@@ -95,28 +268,11 @@ VOID ONB_DestroyNbl(OVS_NET_BUFFER* pOvsNb)
 _Use_decl_annotations_
 void ONB_Destroy(const OVS_SWITCH_INFO* pSwitchInfo, OVS_NET_BUFFER** ppOvsNb)
 {
-    MDL* pMdl = NULL;
     OVS_NET_BUFFER* pOvsNb = *ppOvsNb;
-    VOID* buffer = NULL, *onbBuffer = NULL;
-    NET_BUFFER* pNb = NULL;
-    ULONG dataOffset = 0;
 
     pSwitchInfo->switchHandlers.FreeNetBufferListForwardingContext(pSwitchInfo->switchContext, pOvsNb->pNbl);
 
-    OVS_CHECK(NET_BUFFER_LIST_FIRST_NB(pOvsNb->pNbl)->Next == NULL);
-
-    pNb = ONB_GetNetBuffer(pOvsNb);
-    onbBuffer = ONB_GetData(pOvsNb);
-
-    pMdl = NET_BUFFER_CURRENT_MDL(pNb);
-    dataOffset = ONB_GetDataOffset(pOvsNb);
-
-    buffer = MmGetMdlVirtualAddress(pMdl);
-    OVS_CHECK((BYTE*)buffer == (BYTE*)onbBuffer - dataOffset);
-    KFree(buffer);
-
-    IoFreeMdl(pMdl);
-    NdisFreeNetBuffer(pNb);
+    ONB_FreeNbChain(NET_BUFFER_LIST_FIRST_NB(pOvsNb->pNbl));
 
     NdisFreeNetBufferList(pOvsNb->pNbl);
 
@@ -163,7 +319,7 @@ OVS_NET_BUFFER* ONB_CreateFromNbAndNbl(const OVS_SWITCH_INFO* pSwitchInfo, NET_B
     //2. Allocate buffer
     //assume there is no mdl size > 1500
     nbLen = NET_BUFFER_DATA_LENGTH(pNb);
-    pDestBuffer = KAlloc(nbLen + addSize);
+    pDestBuffer = ONB_AllocateNbData(nbLen + addSize);
     OVS_CHECK(pDestBuffer);
 
     //3. Allocate MDL
@@ -261,13 +417,101 @@ _Use_decl_annotations_
 OVS_NET_BUFFER* ONB_Duplicate(const OVS_NET_BUFFER* pOriginalOnb)
 {
     OVS_NET_BUFFER* pDuplicateOnb = NULL;
+    OVS_SWITCH_INFO* pSwitchInfo = pOriginalOnb->pSwitchInfo;
+    USHORT contextSize = NET_BUFFER_LIST_CONTEXT_DATA_SIZE(pOriginalOnb->pNbl);
+    NET_BUFFER_LIST* pDuplicateNbl = NULL;
+    NET_BUFFER* pOriginalNb = NULL, *pDuplicateNb = NULL;
+    MDL* pOriginalMdl = NULL, *pDuplicateMdl = NULL;
+    VOID* buffer = NULL;
+    NDIS_STATUS status = NDIS_STATUS_SUCCESS;
+    BOOLEAN haveContext = FALSE;
+    BOOLEAN ok = TRUE;
+
+    pOriginalNb = NET_BUFFER_LIST_FIRST_NB(pOriginalOnb->pNbl);
+    OVS_CHECK(pOriginalNb->Next == NULL);
+
+    pOriginalMdl = NET_BUFFER_CURRENT_MDL(pOriginalNb);
+    OVS_CHECK(pOriginalMdl == NET_BUFFER_FIRST_MDL(pOriginalNb));
+    OVS_CHECK(pOriginalMdl->Next == NULL);
 
-    pDuplicateOnb = ONB_CreateFromNbAndNbl(pOriginalOnb->pSwitchInfo, pOriginalOnb->pNbl, pOriginalOnb->pNbl->FirstNetBuffer, pOriginalOnb->pNbl->FirstNetBuffer->DataOffset);
+    buffer = MmGetMdlVirtualAddress(pOriginalMdl);
+
+    //"The ContextSize must be a multiple of the value defined by MEMORY_ALLOCATION_ALIGNMENT"
+    if (contextSize % MEMORY_ALLOCATION_ALIGNMENT != 0)
+    {
+        contextSize = (contextSize / MEMORY_ALLOCATION_ALIGNMENT) * MEMORY_ALLOCATION_ALIGNMENT + MEMORY_ALLOCATION_ALIGNMENT;
+    }
+
+    //1. Allocate NBL
+    NdisAcquireSpinLock(&g_nbPoolLock);
+    pDuplicateNbl = NdisAllocateNetBufferList(g_hNblPool, contextSize, contextSize);
+    NdisReleaseSpinLock(&g_nbPoolLock);
+
+    if (!pDuplicateNbl)
+    {
+        ok = FALSE;
+        goto Cleanup;
+    }
+
+    //2. Allocate an MDL describing the same data buffer
+    pDuplicateMdl = IoAllocateMdl(buffer, MmGetMdlByteCount(pOriginalMdl), FALSE, FALSE, NULL);
+    if (!pDuplicateMdl)
+    {
+        ok = FALSE;
+        goto Cleanup;
+    }
+
+    MmBuildMdlForNonPagedPool(pDuplicateMdl);
+
+    //3. Allocate / Create NB, with the same data offset and length as the original
+    NdisAcquireSpinLock(&g_nbPoolLock);
+    pDuplicateNb = NdisAllocateNetBuffer(g_hNbPool, pDuplicateMdl, NET_BUFFER_DATA_OFFSET(pOriginalNb), NET_BUFFER_DATA_LENGTH(pOriginalNb));
+    NdisReleaseSpinLock(&g_nbPoolLock);
+
+    if (!pDuplicateNb)
+    {
+        ok = FALSE;
+        goto Cleanup;
+    }
+
+    NET_BUFFER_LIST_FIRST_NB(pDuplicateNbl) = pDuplicateNb;
+    _ONB_ReferenceNbData(buffer);
+
+    //4. Set the rest of NBL stuff
+    pDuplicateNbl->SourceHandle = pSwitchInfo->filterHandle;
+
+    status = pSwitchInfo->switchHandlers.AllocateNetBufferListForwardingContext(pSwitchInfo->switchContext, pDuplicateNbl);
+    if (status != NDIS_STATUS_SUCCESS)
+    {
+        OVS_CHECK(0);
+        ok = FALSE;
+        goto Cleanup;
+    }
+
+    haveContext = TRUE;
+
+    status = pSwitchInfo->switchHandlers.CopyNetBufferListInfo(pSwitchInfo->switchContext, pDuplicateNbl, pOriginalOnb->pNbl, 0);
+    if (status != NDIS_STATUS_SUCCESS)
+    {
+        OVS_CHECK(0);
+        ok = FALSE;
+        goto Cleanup;
+    }
+
+    _ONB_SetPacketDataSafe(pDuplicateNbl, FALSE);
+    _ONB_SetPacketDataSafe(pOriginalOnb->pNbl, FALSE);
+
+    //5. Create the OVS_NET_BUFFER
+    pDuplicateOnb = KZAlloc(sizeof(OVS_NET_BUFFER));
     if (!pDuplicateOnb)
     {
-        return NULL;
+        ok = FALSE;
+        goto Cleanup;
     }
 
+    pDuplicateOnb->pNbl = pDuplicateNbl;
+    pDuplicateOnb->pSwitchInfo = pSwitchInfo;
+
     pDuplicateOnb->packetMark = pOriginalOnb->packetMark;
     pDuplicateOnb->packetPriority = pOriginalOnb->packetPriority;
 
@@ -278,6 +522,33 @@ OVS_NET_BUFFER* ONB_Duplicate(const OVS_NET_BUFFER* pOriginalOnb)
 
     pDuplicateOnb->pDatapath = pOriginalOnb->pDatapath;
 
+Cleanup:
+    if (!ok)
+    {
+        if (haveContext)
+        {
+            pSwitchInfo->switchHandlers.FreeNetBufferListForwardingContext(pSwitchInfo->switchContext, pDuplicateNbl);
+        }
+
+        if (pDuplicateNb)
+        {
+            ONB_ReleaseNbData(buffer);
+            NdisFreeNetBuffer(pDuplicateNb);
+        }
+
+        if (pDuplicateMdl)
+        {
+            IoFreeMdl(pDuplicateMdl);
+        }
+
+        if (pDuplicateNbl)
+        {
+            NdisFreeNetBufferList(pDuplicateNbl);
+        }
+
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to duplicate the ONB\n");
+    }
+
     return pDuplicateOnb;
 }
 
@@ -320,7 +591,7 @@ OVS_NET_BUFFER* ONB_CreateFromBuffer(_In_ const OVS_BUFFER* pBuffer, ULONG addSi
     //2. Allocate buffer
     //assume there is no mdl size > 1500
     nbLen = pBuffer->size;
-    pDestBuffer = KAlloc(nbLen + addSize);
+    pDestBuffer = ONB_AllocateNbData(nbLen + addSize);
     OVS_CHECK(pDestBuffer);
 
     //3. Allocate MDL
@@ -422,7 +693,7 @@ OVS_NET_BUFFER* ONB_Create(ULONG bufSize)
 
     //2. Allocate buffer
     //assume there is no mdl size > 1500
-    pDestBuffer = KAlloc(bufSize);
+    pDestBuffer = ONB_AllocateNbData(bufSize);
     OVS_CHECK(pDestBuffer);
 
     //3. Allocate MDL
@@ -496,7 +767,7 @@ NET_BUFFER* ONB_CreateNb(ULONG dataLen, ULONG dataOffset)
 
     //2. Allocate buffer
     //assume there is no mdl size > 1500
-    pDestBuffer = KAlloc(dataLen + dataOffset);
+    pDestBuffer = ONB_AllocateNbData(dataLen + dataOffset);
     OVS_CHECK(pDestBuffer);
 
     //3. Allocate MDL
@@ -779,6 +1050,88 @@ BOOLEAN ONB_OriginateIcmp6Packet_Type2Code0(OVS_NET_BUFFER* pOvsNb, ULONG mtu, _
     return mustTransfer;
 }
 
+//the max ipv4 header length (i.e. IHL = 0xF), in bytes
+#define OVS_IPV4_MAX_HEADER_SIZE    (0xF * sizeof(DWORD))
+
+/* A fragment copies only the headers: its NET_BUFFER has two MDLs:
+1. a data buffer of its own, with dataOffsetAdd bytes of backfill (for the encapsulation), the eth header and the ipv4 header of the fragment
+2. a partial MDL over the payload of the original packet, in the data buffer of the original packet (pOriginalMdl), which the first
+   data buffer references, so that the original NBL can be freed before the fragments are sent.
+*/
+static NET_BUFFER* _ONB_CreateFragmentNb(_In_ MDL* pOriginalMdl, _In_ const OVS_ETHERNET_HEADER* pEthHeader, _In_ const OVS_IPV4_HEADER* pFragIpv4Header,
+    _In_ const BYTE* pPayload, ULONG payloadSize, ULONG dataOffsetAdd)
+{
+    NET_BUFFER* pNb = NULL;
+    MDL* pHeadersMdl = NULL, *pPayloadMdl = NULL;
+    BYTE* headersBuffer = NULL;
+    ULONG ipv4HeaderSize = 0, headersSize = 0;
+    BOOLEAN ok = FALSE;
+
+    ipv4HeaderSize = pFragIpv4Header->HeaderLength * sizeof(DWORD);
+    headersSize = sizeof(OVS_ETHERNET_HEADER) + ipv4HeaderSize;
+
+    headersBuffer = ONB_AllocateNbData(dataOffsetAdd + headersSize);
+    if (!headersBuffer)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to allocate the headers of the fragment\n");
+        goto Cleanup;
+    }
+
+    RtlCopyMemory(headersBuffer + dataOffsetAdd, pEthHeader, sizeof(OVS_ETHERNET_HEADER));
+    RtlCopyMemory(headersBuffer + dataOffsetAdd + sizeof(OVS_ETHERNET_HEADER), pFragIpv4Header, ipv4HeaderSize);
+
+    pHeadersMdl = IoAllocateMdl(headersBuffer, dataOffsetAdd + headersSize, FALSE, FALSE, NULL);
+    if (!pHeadersMdl)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to allocate mdl\n");
+        goto Cleanup;
+    }
+
+    MmBuildMdlForNonPagedPool(pHeadersMdl);
+
+    pPayloadMdl = IoAllocateMdl((VOID*)pPayload, payloadSize, FALSE, FALSE, NULL);
+    if (!pPayloadMdl)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to allocate partial mdl\n");
+        goto Cleanup;
+    }
+
+    IoBuildPartialMdl(pOriginalMdl, pPayloadMdl, (VOID*)pPayload, payloadSize);
+    pHeadersMdl->Next = pPayloadMdl;
+
+    NdisAcquireSpinLock(&g_nbPoolLock);
+    pNb = NdisAllocateNetBuffer(g_hNbPool, pHeadersMdl, dataOffsetAdd, headersSize + payloadSize);
+    NdisReleaseSpinLock(&g_nbPoolLock);
+
+    if (!pNb)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to allocate net buffer\n");
+        goto Cleanup;
+    }
+
+    _ONB_ChainNbData(headersBuffer, MmGetMdlVirtualAddress(pOriginalMdl));
+
+    ok = TRUE;
+
+Cleanup:
+    if (!ok)
+    {
+        if (pPayloadMdl)
+        {
+            IoFreeMdl(pPayloadMdl);
+        }
+
+        if (pHeadersMdl)
+        {
+            IoFreeMdl(pHeadersMdl);
+        }
+
+        ONB_ReleaseNbData(headersBuffer);
+    }
+
+    return pNb;
+}
+
 /* RFC 791
 To produce the first fragment :
 (1)  Copy the original internet header;
@@ -791,8 +1144,8 @@ Recompute Checksum;
 (6)  Submit this fragment to the next step in
 datagram processing;
 */
-NET_BUFFER* _Ipv4_CreateFirstFragment(_In_ const OVS_IPV4_HEADER* pOldIpv4Header, ULONG maxIpPacketSize, _Out_ ULONG* pBytesRemaining, ULONG dataOffsetAdd,
-    _Inout_ ULONG* pNextSrcOffset)
+static NET_BUFFER* _Ipv4_CreateFirstFragment(_In_ MDL* pOriginalMdl, _In_ const OVS_ETHERNET_HEADER* pEthHeader, _In_ const OVS_IPV4_HEADER* pOldIpv4Header,
+    ULONG maxIpPacketSize, _Out_ ULONG* pBytesRemaining, ULONG dataOffsetAdd, _Inout_ ULONG* pNextSrcOffset)
 {
     //resulting NB
     NET_BUFFER* pNb = NULL;
@@ -802,9 +1155,9 @@ NET_BUFFER* _Ipv4_CreateFirstFragment(_In_ const OVS_IPV4_HEADER* pOldIpv4Header
     //packet size, including ipv4 header size
     ULONG curPacketSize = 0;
     ULONG oldIpv4TotalLength = 0;
-    //the buffer of the resulting NB
-    VOID* buffer = NULL;
-    OVS_IPV4_HEADER* pFragIpv4Header = NULL;
+    //the ipv4 header of the fragment, including the options
+    BYTE headerBuffer[OVS_IPV4_MAX_HEADER_SIZE];
+    OVS_IPV4_HEADER* pFragIpv4Header = (OVS_IPV4_HEADER*)headerBuffer;
 
     oldIpv4TotalLength = RtlUshortByteSwap(pOldIpv4Header->TotalLength);
     ipv4HeaderSize = Ipv4_GetHeaderSize(pOldIpv4Header);
@@ -816,29 +1169,31 @@ NET_BUFFER* _Ipv4_CreateFirstFragment(_In_ const OVS_IPV4_HEADER* pOldIpv4Header
     //we can only fragment if the size of the current packet is too big
     OVS_CHECK(oldIpv4TotalLength > maxIpPacketSize);
     OVS_CHECK(*pNextSrcOffset == 0);
+    OVS_CHECK(ipv4HeaderSize <= OVS_IPV4_MAX_HEADER_SIZE);
 
     //the ipv4 packet size must be <= maxIpPacketSize, but packet size (excluding ipv4 header) must be multiple of 8
     //(because of frag offset, which is in units of 8 bytes)
     ipFragmentSize = ((maxIpPacketSize - ipv4HeaderSize) / 8) * 8;
     curPacketSize = ipFragmentSize + ipv4HeaderSize;
 
-    pNb = ONB_CreateNb(curPacketSize, dataOffsetAdd);
-
-    //the buffer was allocated by us, so its data is contiguous => NdisGetDataBuffer will succeed
-    buffer = NdisGetDataBuffer(pNb, curPacketSize, NULL, 1, 0);
-    OVS_CHECK(buffer);
-
-    //1. Copy the ipv4 packet
-    RtlCopyMemory(buffer, pOldIpv4Header, curPacketSize);
-    pFragIpv4Header = (OVS_IPV4_HEADER*)buffer;
+    //1. Copy the ipv4 header
+    RtlCopyMemory(headerBuffer, pOldIpv4Header, ipv4HeaderSize);
 
     //2. correct the header: MF and TL, recompute checksum
     pFragIpv4Header->MoreFragments = 1;
     pFragIpv4Header->TotalLength = RtlUshortByteSwap((UINT16)curPacketSize);
 
+    pFragIpv4Header->HeaderChecksum = 0;
     pFragIpv4Header->HeaderChecksum = (UINT16)ComputeIpChecksum((BYTE*)pFragIpv4Header, ipv4HeaderSize);
     pFragIpv4Header->HeaderChecksum = RtlUshortByteSwap(pFragIpv4Header->HeaderChecksum);
 
+    //3. attach the first data octets: they are not copied
+    pNb = _ONB_CreateFragmentNb(pOriginalMdl, pEthHeader, pFragIpv4Header, (const BYTE*)pOldIpv4Header + ipv4HeaderSize, ipFragmentSize, dataOffsetAdd);
+    if (!pNb)
+    {
+        return NULL;
+    }
+
     *pBytesRemaining = oldIpv4TotalLength - curPacketSize;
     *pNextSrcOffset = ipFragmentSize / 8;
 
@@ -855,9 +1210,8 @@ TL <-OTL - NFB * 8 - (OIHL - IHL) * 4);
 FO <-OFO + NFB;  MF <-OMF;  Recompute Checksum;
 (10) Submit this fragment to the fragmentation test; DONE.
 */
-
-NET_BUFFER* _Ipv4_CreateNextFragment(_In_ const OVS_IPV4_HEADER* pOldIpv4Header, _In_opt_ const BYTE* pOptions, ULONG optionsSize,
-    ULONG maxIpPacketSize, _Inout_ ULONG* pBytesRemaining, ULONG dataOffsetAdd, _Inout_ ULONG* pSrcOffset)
+static NET_BUFFER* _Ipv4_CreateNextFragment(_In_ MDL* pOriginalMdl, _In_ const OVS_ETHERNET_HEADER* pEthHeader, _In_ const OVS_IPV4_HEADER* pOldIpv4Header,
+    _In_opt_ const BYTE* pOptions, ULONG optionsSize, ULONG maxIpPacketSize, _Inout_ ULONG* pBytesRemaining, ULONG dataOffsetAdd, _Inout_ ULONG* pSrcOffset)
 {
     //resulting NB
     NET_BUFFER* pNb = NULL;
@@ -866,13 +1220,12 @@ NET_BUFFER* _Ipv4_CreateNextFragment(_In_ const OVS_IPV4_HEADER* pOldIpv4Header,
     //the whole ipv4 packet for the current fragment: i.e., including ipv4 header
     ULONG curPacketSize = 0;
     ULONG ipv4HeaderSize = 0;
-    //the buffer of the resulting NB
-    VOID* buffer = NULL;
-    //the buffer of the source packet, the packet that is being fragmented
-    BYTE* pSrcBuffer = NULL;
-    OVS_IPV4_HEADER* pFragIpv4Header = NULL;
-    //where to copy from, and where to copy to
-    ULONG srcOffset = 0, destOffset = 0;
+    //the ipv4 header of the fragment, including the copied options
+    BYTE headerBuffer[OVS_IPV4_MAX_HEADER_SIZE];
+    OVS_IPV4_HEADER* pFragIpv4Header = (OVS_IPV4_HEADER*)headerBuffer;
+    //the payload of the fragment, in the source packet, the packet that is being fragmented
+    const BYTE* pSrcBuffer = NULL;
+    ULONG srcOffset = 0;
     //the ipv4's fragment offset, in units of 8 bytes
     UINT16 oldFragOffset = 0;
 
@@ -880,30 +1233,22 @@ NET_BUFFER* _Ipv4_CreateNextFragment(_In_ const OVS_IPV4_HEADER* pOldIpv4Header,
     OVS_CHECK(srcOffset > 0);
 
     ipv4HeaderSize = sizeof(OVS_IPV4_HEADER) + optionsSize;
+    OVS_CHECK(ipv4HeaderSize <= OVS_IPV4_MAX_HEADER_SIZE);
 
     //the ipv4 packet size must be <= maxIpPacketSize, but packet size (excluding ipv4 header) must be multiple of 8
     //(because of frag offset, which is in units of 8 bytes)
     ipFragmentSize = ((maxIpPacketSize - ipv4HeaderSize) / 8) * 8;
     curPacketSize = ipFragmentSize + ipv4HeaderSize;
 
-    //however, we may have left to copy only a few bytes
+    //however, we may have left only a few bytes
     if (*pBytesRemaining + ipv4HeaderSize <= maxIpPacketSize)
     {
         ipFragmentSize = *pBytesRemaining;
         curPacketSize = ipFragmentSize + ipv4HeaderSize;
     }
 
-    pNb = ONB_CreateNb(curPacketSize, dataOffsetAdd);
-
-    //the buffer was allocated by us, so its data is contiguous => NdisGetDataBuffer will succeed
-    buffer = NdisGetDataBuffer(pNb, curPacketSize, NULL, 1, 0);
-    OVS_CHECK(buffer);
-
     //1. Copy the ipv4 header
-    RtlCopyMemory(buffer, pOldIpv4Header, sizeof(OVS_IPV4_HEADER));
-    pFragIpv4Header = (OVS_IPV4_HEADER*)buffer;
-
-    destOffset = sizeof(OVS_IPV4_HEADER);
+    RtlCopyMemory(headerBuffer, pOldIpv4Header, sizeof(OVS_IPV4_HEADER));
 
     //2. copy the options
     if (optionsSize)
@@ -912,67 +1257,46 @@ NET_BUFFER* _Ipv4_CreateNextFragment(_In_ const OVS_IPV4_HEADER* pOldIpv4Header,
         //make sure the options size is a multiple of 4 bytes (requirement from header length, which is in 4 bytes)
         OVS_CHECK(optionsSize == (optionsSize / 4) * 4);
 
-        RtlCopyMemory((BYTE*)buffer + destOffset, pOptions, optionsSize);
-        destOffset += optionsSize;
+        RtlCopyMemory(headerBuffer + sizeof(OVS_IPV4_HEADER), pOptions, optionsSize);
     }
 
-    //3. copy payload, from last offset
     //NOTE: offset in src packet is relative to the beginning of the payload of the ipv4 header
     //therefore, we must compute the src offset as old ipv4 header size + computed src offset for this fragment
-    pSrcBuffer = (BYTE*)pOldIpv4Header + (pOldIpv4Header->HeaderLength * sizeof(DWORD)) + (srcOffset * 8);
+    pSrcBuffer = (const BYTE*)pOldIpv4Header + (pOldIpv4Header->HeaderLength * sizeof(DWORD)) + (srcOffset * 8);
 
-    RtlCopyMemory((BYTE*)buffer + destOffset, pSrcBuffer, ipFragmentSize);
     //the fragment size must either be multiple of 8 bytes, or, if it is the last fragment, it can be of any size, if it is small.
     OVS_CHECK(ipFragmentSize == (ipFragmentSize / 8) * 8 || *pBytesRemaining == ipFragmentSize && curPacketSize <= maxIpPacketSize);
-
-    //increase source offset, so that next time we copy, we'll copy from the next byte in the original packet, onward
-    *pSrcOffset += (ipFragmentSize / 8);
-
     OVS_CHECK(*pBytesRemaining >= ipFragmentSize);
-    *pBytesRemaining -= ipFragmentSize;
 
-    //4. correct the header: IHL, MF, Fragment Offset, TL
-    //ipv4 header's header length must be given in DWORDs
-    ipv4HeaderSize = ipv4HeaderSize / sizeof(DWORD);
-    //the header size is made of 4 bits
-    OVS_CHECK(ipv4HeaderSize <= 0xF);
-
-    pFragIpv4Header->HeaderLength = (UINT8)ipv4HeaderSize;
-    //if we have more bytes to copy in further fragments, MF = TRUE. Else, if we have fragmented a fragment other than the last fragment
+    //3. correct the header: IHL, MF, Fragment Offset, TL
+    //the header size is made of 4 bits, in DWORDs
+    pFragIpv4Header->HeaderLength = (UINT8)(ipv4HeaderSize / sizeof(DWORD));
+    //if we have more bytes to send in further fragments, MF = TRUE. Else, if we have fragmented a fragment other than the last fragment
     //(a packet that had MF set), then we need to set MF.
-    pFragIpv4Header->MoreFragments = (*pBytesRemaining > 0 || pOldIpv4Header->MoreFragments ? 1 : 0);
+    pFragIpv4Header->MoreFragments = (*pBytesRemaining > ipFragmentSize || pOldIpv4Header->MoreFragments ? 1 : 0);
 
     //we must take into account the old ipv4 offset, for the case where we further fragment a packet that had previously been fragmented.
     oldFragOffset = Ipv4_GetFragmentOffset(pOldIpv4Header);
     Ipv4_SetFragmentOffset(pFragIpv4Header, (UINT16)srcOffset + oldFragOffset);
     pFragIpv4Header->TotalLength = RtlUshortByteSwap((UINT16)curPacketSize);
 
-    //5. recompute checksum
+    //4. recompute checksum
+    pFragIpv4Header->HeaderChecksum = 0;
     pFragIpv4Header->HeaderChecksum = (UINT16)ComputeIpChecksum((BYTE*)pFragIpv4Header, ipv4HeaderSize);
     pFragIpv4Header->HeaderChecksum = RtlUshortByteSwap(pFragIpv4Header->HeaderChecksum);
 
-    return pNb;
-}
-
-VOID _ONB_AddEthHeader(_In_ NET_BUFFER* pNb, ULONG ethSize, _In_ const OVS_ETHERNET_HEADER* pEthHeader)
-{
-    VOID* buffer = NULL;
-
-    //1. insert eth header
-    if (NDIS_STATUS_SUCCESS != NdisRetreatNetBufferDataStart(pNb, ethSize, 0, NULL))
+    //5. append the payload, from the last offset: it is not copied
+    pNb = _ONB_CreateFragmentNb(pOriginalMdl, pEthHeader, pFragIpv4Header, pSrcBuffer, ipFragmentSize, dataOffsetAdd);
+    if (!pNb)
     {
-        OVS_CHECK(__UNEXPECTED__);
+        return NULL;
     }
 
-    buffer = NdisGetDataBuffer(pNb, ethSize, NULL, 1, 0);
-    OVS_CHECK(buffer);
-
-    RtlCopyMemory(buffer, pEthHeader, ethSize);
+    //increase source offset, so that the next fragment starts with the next byte in the original packet
+    *pSrcOffset += (ipFragmentSize / 8);
+    *pBytesRemaining -= ipFragmentSize;
 
-#if OVS_DBGPRINT_FRAMES
-    buffer = NdisGetDataBuffer(pNb, NET_BUFFER_DATA_LENGTH(pNb), NULL, 1, 0);
-    DbgPrintNb(pNb, "fragment: ");
-#endif
+    return pNb;
 }
 
 /* RFC 791
@@ -987,11 +1311,12 @@ Also, http://www.tcpipguide.com/free/t_IPMessageFragmentationProcess.htm might b
 //dataOffsetAdd:         how much space to allocate before the beginning of the buffer. This will be used to add the eth header + the encapsulation headers.
 //NOTE: checksum offloading must have been dealt with before.
 //NOTE: at the end, each resulting fragment will have its frist byte == the first byte of the eth header.
+//NOTE: the fragments share the payload with pOvsNb (see _ONB_CreateFragmentNb): only their eth and ipv4 headers may be modified.
 NET_BUFFER_LIST* ONB_FragmentBuffer_Ipv4(_Inout_ OVS_NET_BUFFER* pOvsNb, ULONG maxIpPacketSize, const OVS_ETHERNET_HEADER* pOldEthHeader, ULONG dataOffsetAdd)
 {
     //the buffer before fragmentation
     VOID* oldPacketBuffer = NULL;
-    //the amount of bytes that remain to be copied in further ipv4 fragments
+    //the amount of bytes that remain to be put in further ipv4 fragments
     ULONG bytesRemaining = 0;
     //resulting NBL
     NET_BUFFER_LIST* pNbl = NULL;
@@ -1000,13 +1325,17 @@ NET_BUFFER_LIST* ONB_FragmentBuffer_Ipv4(_Inout_ OVS_NET_BUFFER* pOvsNb, ULONG m
     ULONG optionsSize = 0;
     //the buffer where ipv4 "copied" options are put
     BYTE* pOptionsBuffer = NULL;
-    //NOTE: we assume - and it must be this way - that the eth size == size of simple eth header
-    ULONG ethSize = sizeof(OVS_ETHERNET_HEADER);
-    //the offset in the source packet, from where to copy bytes for the next fragment, in units of 8 bytes
+    //the offset in the source packet, from where to take bytes for the next fragment, in units of 8 bytes
     ULONG srcOffset = 0;
     //the ipv4 header of the original / old packet
     OVS_IPV4_HEADER* pOldIpv4Header = NULL;
     NET_BUFFER* pNb = NULL, *pCurNb = NULL, *pFirstNb = NULL;
+    //the single MDL of the original packet: the fragments point into it
+    MDL* pOriginalMdl = NULL;
+
+    pOriginalMdl = NET_BUFFER_CURRENT_MDL(ONB_GetNetBuffer(pOvsNb));
+    OVS_CHECK(pOriginalMdl == NET_BUFFER_FIRST_MDL(ONB_GetNetBuffer(pOvsNb)));
+    OVS_CHECK(pOriginalMdl->Next == NULL);
 
     ONB_Advance(pOvsNb, sizeof(OVS_ETHERNET_HEADER));
 
@@ -1019,38 +1348,201 @@ NET_BUFFER_LIST* ONB_FragmentBuffer_Ipv4(_Inout_ OVS_NET_BUFFER* pOvsNb, ULONG m
     OVS_CHECK(pOldIpv4Header->Version == 4);
     OVS_CHECK(pOldIpv4Header->HeaderLength >= 5);
 
-    pNb = _Ipv4_CreateFirstFragment(pOldIpv4Header, maxIpPacketSize, &bytesRemaining, dataOffsetAdd, &srcOffset);
-    if (!pNb)
+    pFirstNb = _Ipv4_CreateFirstFragment(pOriginalMdl, pOldEthHeader, pOldIpv4Header, maxIpPacketSize, &bytesRemaining, dataOffsetAdd, &srcOffset);
+    if (!pFirstNb)
     {
-        ONB_Retreat(pOvsNb, sizeof(OVS_ETHERNET_HEADER));
-        return NULL;
+        goto Cleanup;
     }
 
-    _ONB_AddEthHeader(pNb, ethSize, pOldEthHeader);
-
     pOptionsBuffer = Ipv4_CopyHeaderOptions(pOldIpv4Header, &optionsSize);
 
-    pFirstNb = pNb;
     pCurNb = pFirstNb;
 
     while (bytesRemaining > 0)
     {
-        pNb = _Ipv4_CreateNextFragment(pOldIpv4Header, pOptionsBuffer, optionsSize, maxIpPacketSize, &bytesRemaining, dataOffsetAdd, &srcOffset);
-        _ONB_AddEthHeader(pNb, ethSize, pOldEthHeader);
+        pNb = _Ipv4_CreateNextFragment(pOriginalMdl, pOldEthHeader, pOldIpv4Header, pOptionsBuffer, optionsSize, maxIpPacketSize, &bytesRemaining,
+            dataOffsetAdd, &srcOffset);
+        if (!pNb)
+        {
+            goto Cleanup;
+        }
 
         OVS_CHECK(pNb->Next == NULL);
         pCurNb->Next = pNb;
         pCurNb = pCurNb->Next;
     }
 
+    pNbl = ONB_CreateNblFromNb(pFirstNb, contextSize);
+
+    DEBUGP(LOG_INFO, "NBL: %p\n", pNbl);
+
+Cleanup:
     KFree(pOptionsBuffer);
 
     ONB_Retreat(pOvsNb, sizeof(OVS_ETHERNET_HEADER));
 
-    OVS_CHECK(pFirstNb);
-    pNbl = ONB_CreateNblFromNb(pFirstNb, contextSize);
+    if (!pNbl)
+    {
+        ONB_FreeNbChain(pFirstNb);
+    }
 
-    DEBUGP(LOG_INFO, "NBL: %p\n", pNbl);
+    return pNbl;
+}
+
+//fixes the ip and tcp headers of a segment that was just copied from the large send packet
+static VOID _ONB_FixTcpSegmentHeaders(_Inout_ BYTE* pSegment, LE16 ethType, ULONG tcpHeaderOffset, ULONG segmentPayloadSize,
+    UINT32 sequence, UINT16 segmentIndex, BOOLEAN isLast)
+{
+    BYTE* pNetHeader = pSegment + sizeof(OVS_ETHERNET_HEADER);
+    OVS_TCP_HEADER* pTcpHeader = (OVS_TCP_HEADER*)(pSegment + tcpHeaderOffset);
+    ULONG tcpSize = GetTcpDataOffset(pTcpHeader->flagsAndOffset) * sizeof(DWORD) + segmentPayloadSize;
+    UINT16 clearFlags = 0;
+
+    if (ethType == OVS_ETHERTYPE_IPV4)
+    {
+        OVS_IPV4_HEADER* pIpv4Header = (OVS_IPV4_HEADER*)pNetHeader;
+        ULONG ipv4HeaderSize = pIpv4Header->HeaderLength * sizeof(DWORD);
+
+        //a NIC doing the segmentation gives consecutive identifications to the segments
+        pIpv4Header->Identification = RtlUshortByteSwap((UINT16)(RtlUshortByteSwap(pIpv4Header->Identification) + segmentIndex));
+        pIpv4Header->TotalLength = RtlUshortByteSwap((UINT16)(ipv4HeaderSize + tcpSize));
+
+        pIpv4Header->HeaderChecksum = 0;
+        pIpv4Header->HeaderChecksum = (UINT16)ComputeIpChecksum((BYTE*)pIpv4Header, ipv4HeaderSize);
+        pIpv4Header->HeaderChecksum = RtlUshortByteSwap(pIpv4Header->HeaderChecksum);
+    }
+    else
+    {
+        OVS_IPV6_HEADER* pIpv6Header = (OVS_IPV6_HEADER*)pNetHeader;
+
+        //the payload includes the extension headers, which lie between the ipv6 header and the tcp header
+        pIpv6Header->payloadLength = RtlUshortByteSwap((UINT16)(pSegment + tcpHeaderOffset - (BYTE*)(pIpv6Header + 1) + tcpSize));
+    }
+
+    pTcpHeader->sequenceNo = RtlUlongByteSwap(sequence);
+
+    //FIN and PSH belong to the last segment only; CWR, to the first only
+    if (!isLast)
+    {
+        clearFlags |= OVS_TCP_FLAG_FIN | OVS_TCP_FLAG_PSH;
+    }
+
+    if (segmentIndex > 0)
+    {
+        clearFlags |= OVS_TCP_FLAG_CWR;
+    }
+
+    ClearTcpFlags(&pTcpHeader->flagsAndOffset, clearFlags);
+
+    //the large send packet has only the pseudo header checksum: the segment checksum is computed in full
+    pTcpHeader->checksum = 0;
+    pTcpHeader->checksum = RtlUshortByteSwap(ComputeTransportChecksum(pTcpHeader, pNetHeader, ethType));
+}
+
+/* Software segmentation of large send (LSO) tcp packets, as a NIC would do it (see "TCP Segmentation Offload" in the NDIS docs).
+Each segment gets a copy of the eth, ip and tcp headers (including options), and at most mss bytes of the tcp payload; then:
+ipv4: identification += segment index; total length; header checksum
+ipv6: payload length
+tcp: sequence number += payload offset; FIN / PSH only in the last segment, CWR only in the first; full checksum
+*/
+
+//pOvsNb:                the LSO packet. Must contain only one NET_BUFFER_LIST, with only one NET_BUFFER, starting with a non-vlan eth header
+//tcpHeaderOffset:       the offset of the tcp header, from the beginning of the eth header (the LSO info has it)
+//mss:                   the max tcp payload size of a segment
+//dataOffsetAdd:         how much space to allocate before the beginning of each segment, for the encapsulation headers.
+//returns a new NBL, with one NET_BUFFER per segment; each segment starts with the eth header.
+_Use_decl_annotations_
+NET_BUFFER_LIST* ONB_SegmentTcp(OVS_NET_BUFFER* pOvsNb, ULONG tcpHeaderOffset, ULONG mss, ULONG dataOffsetAdd)
+{
+    BYTE* pFrame = NULL;
+    ULONG frameSize = 0, headersSize = 0, payloadSize = 0, payloadOffset = 0;
+    const OVS_ETHERNET_HEADER* pEthHeader = NULL;
+    const OVS_TCP_HEADER* pTcpHeader = NULL;
+    LE16 ethType = 0;
+    UINT32 sequence = 0;
+    UINT16 segmentIndex = 0;
+    NET_BUFFER* pFirstNb = NULL, *pLastNb = NULL;
+    NET_BUFFER_LIST* pNbl = NULL;
+
+    OVS_CHECK(NET_BUFFER_NEXT_NB(ONB_GetNetBuffer(pOvsNb)) == NULL);
+
+    pFrame = ONB_GetData(pOvsNb);
+    frameSize = ONB_GetDataLength(pOvsNb);
+
+    pEthHeader = (const OVS_ETHERNET_HEADER*)pFrame;
+    ethType = RtlUshortByteSwap(pEthHeader->type);
+
+    if (ethType != OVS_ETHERTYPE_IPV4 && ethType != OVS_ETHERTYPE_IPV6)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " cannot segment packet of eth type: 0x%x\n", ethType);
+        return NULL;
+    }
+
+    if (mss == 0 || tcpHeaderOffset + sizeof(OVS_TCP_HEADER) > frameSize)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " invalid lso packet: mss = %d; tcp offset = %d; size = %d\n", mss, tcpHeaderOffset, frameSize);
+        return NULL;
+    }
+
+    pTcpHeader = (const OVS_TCP_HEADER*)(pFrame + tcpHeaderOffset);
+    headersSize = tcpHeaderOffset + GetTcpDataOffset(pTcpHeader->flagsAndOffset) * sizeof(DWORD);
+
+    if (headersSize > frameSize)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " invalid lso packet: headers size = %d; size = %d\n", headersSize, frameSize);
+        return NULL;
+    }
+
+    //NOTE: the ip total length / payload length of a LSO packet may be 0: the payload size is given by the NET_BUFFER
+    payloadSize = frameSize - headersSize;
+    sequence = RtlUlongByteSwap(pTcpHeader->sequenceNo);
+
+    do
+    {
+        ULONG segmentPayloadSize = min(mss, payloadSize - payloadOffset);
+        NET_BUFFER* pNb = NULL;
+        BYTE* pSegment = NULL;
+
+        pNb = ONB_CreateNb(headersSize + segmentPayloadSize, dataOffsetAdd);
+        if (!pNb)
+        {
+            ONB_FreeNbChain(pFirstNb);
+            return NULL;
+        }
+
+        //the buffer was allocated by us, so its data is contiguous => NdisGetDataBuffer will succeed
+        pSegment = NdisGetDataBuffer(pNb, headersSize + segmentPayloadSize, NULL, 1, 0);
+        OVS_CHECK(pSegment);
+
+        RtlCopyMemory(pSegment, pFrame, headersSize);
+        RtlCopyMemory(pSegment + headersSize, pFrame + headersSize + payloadOffset, segmentPayloadSize);
+
+        _ONB_FixTcpSegmentHeaders(pSegment, ethType, tcpHeaderOffset, segmentPayloadSize, sequence + payloadOffset, segmentIndex,
+            /*is last*/ payloadOffset + segmentPayloadSize == payloadSize);
+
+        if (pLastNb)
+        {
+            NET_BUFFER_NEXT_NB(pLastNb) = pNb;
+        }
+        else
+        {
+            pFirstNb = pNb;
+        }
+
+        pLastNb = pNb;
+
+        payloadOffset += segmentPayloadSize;
+        ++segmentIndex;
+    } while (payloadOffset < payloadSize);
+
+    pNbl = ONB_CreateNblFromNb(pFirstNb, MEMORY_ALLOCATION_ALIGNMENT);
+    if (!pNbl)
+    {
+        ONB_FreeNbChain(pFirstNb);
+        return NULL;
+    }
+
+    DEBUGP(LOG_INFO, "lso packet of %d bytes: %d segments\n", frameSize, segmentIndex);
 
     return pNbl;
 }
@@ -1164,4 +1656,4 @@ BOOLEAN ONB_NblEqual(_In_ NET_BUFFER_LIST* pLhsNbl, _In_ NET_BUFFER_LIST* pRhsNb
     OVS_CHECK(pRhBuffer);
 
     return !memcmp(pLhBuffer, pRhBuffer, nbLen);
-}
\ No newline at end of file
+}
@@ -33,6 +33,10 @@ typedef struct _OVS_NET_BUFFER
 
     OVS_OFPORT*    			pSourcePort;
     OVS_OFPORT*    			pDestinationPort;
+    //if several consecutive output actions were collapsed into a single NBL: all the destination ports (pDestinationPort is the first of them)
+    //set by ExecuteActions, and valid only while the packet is being output. Otherwise, NULL / 0.
+    OVS_OFPORT* const*      ppDestinationPorts;
+    ULONG                   countDestinationPorts;
 
     BOOLEAN                 sendToPortNormal;
     ULONG                   sendFlags;
@@ -42,7 +46,7 @@ typedef struct _OVS_NET_BUFFER
     OVS_ACTIONS*            pActions;
 
     //The flow information extracted from the packet (overwriting packet headers do not affect it). Must not be null.
-    //once set, cannot be modified
+    //once set, cannot be modified, except for flowHash, set by the hash action; a recirculation points it to the packet info of the new lookup
     OVS_OFPACKET_INFO*      pOriginalPacketInfo;
 
     //Key for the tunnel that encapsulated this packet. Can be NULL if the packet is not being tunneled.
@@ -149,16 +153,32 @@ static __inline ULONG ONB_GetDataOffset(OVS_NET_BUFFER* pOvsNb)
     return len;
 }
 
+//The data buffers of the NET_BUFFER-s we allocate are reference counted, so that the NBLs of several ONBs can share the same packet data
+//(see ONB_Duplicate). A shared data buffer is copied only when one of its users needs to modify it (see ONB_MakeWritable).
+//A data buffer is the virtual address of the NET_BUFFER's MDL, and must be released with ONB_ReleaseNbData, not KFree.
+VOID* ONB_AllocateNbData(ULONG size);
+VOID ONB_ReleaseNbData(_In_opt_ VOID* buffer);
+BOOLEAN ONB_IsNbDataShared(_In_ const VOID* buffer);
+//frees the NET_BUFFER-s we allocated, starting with pFirstNb and following NET_BUFFER_NEXT_NB: their MDLs and their references to the data
+VOID ONB_FreeNbChain(_In_opt_ NET_BUFFER* pFirstNb);
+
+//if the packet data of the ONB is shared with other ONBs, replaces it with a private copy.
+//It must be called before modifying the packet data (e.g. set actions, vlan push / pop, encapsulation).
+BOOLEAN ONB_MakeWritable(_Inout_ OVS_NET_BUFFER* pOvsNb);
+
 VOID ONB_Destroy(_In_ const OVS_SWITCH_INFO* pSwitchInfo, _Inout_ OVS_NET_BUFFER** ppOvsNb);
 VOID ONB_DestroyNbl(_Inout_ OVS_NET_BUFFER* pOvsNb);
 
 BOOLEAN NblIsLso(_In_ NET_BUFFER_LIST* pNbl);
+//returns TRUE if the NBL is a large send (LSO v1 / v2) packet, along with its mss and tcp header offset (from the eth header)
+BOOLEAN NblGetLsoInfo(_In_ NET_BUFFER_LIST* pNbl, _Out_opt_ ULONG* pMss, _Out_opt_ ULONG* pTcpHeaderOffset);
 
 //create an ovs net buffer as a duplicate of an (nbl, nb).
 //NOTE: must not be freed with FreeOvsNetBuffer! ReallocateOvsNetBuffer should also be changed for this.
 OVS_NET_BUFFER* ONB_CreateFromNbAndNbl(_In_ const OVS_SWITCH_INFO* pSwitchInfo, _In_ NET_BUFFER_LIST* pNbl, _In_ NET_BUFFER* pNb, ULONG addSize);
 OVS_NET_BUFFER* ONB_CreateFromBuffer(_In_ const OVS_BUFFER* pBuffer, ULONG addSize);
 
+//creates an ONB with a new NBL, which shares the packet data of pOriginalOnb (copy on write).
 OVS_NET_BUFFER* ONB_Duplicate(_In_ const OVS_NET_BUFFER* pOriginalOnb);
 
 BOOLEAN ONB_OriginateIcmpPacket_Ipv4_Type3Code4(_Inout_ OVS_NET_BUFFER* pOvsNb, ULONG mtu, OVS_OFPORT* pDestPort);
@@ -167,6 +187,8 @@ BOOLEAN ONB_OriginateIcmp6Packet_Type2Code0(_Inout_ OVS_NET_BUFFER* pOvsNb, ULON
 OVS_NET_BUFFER* ONB_Create(ULONG bufSize);
 
 NET_BUFFER_LIST* ONB_FragmentBuffer_Ipv4(_Inout_ OVS_NET_BUFFER* pOvsNb, ULONG maxIpPacketSize, const OVS_ETHERNET_HEADER* pEthHeader, ULONG dataOffset);
+//splits a large send tcp packet into segments of at most mss payload bytes each (see the .c file)
+NET_BUFFER_LIST* ONB_SegmentTcp(_In_ OVS_NET_BUFFER* pOvsNb, ULONG tcpHeaderOffset, ULONG mss, ULONG dataOffsetAdd);
 
 NET_BUFFER* ONB_CreateNb(ULONG dataLen, ULONG dataOffset);
 NET_BUFFER_LIST* ONB_CreateNblFromNb(_In_ NET_BUFFER* pNb, USHORT contextSize);
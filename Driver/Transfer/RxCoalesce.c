@@ -0,0 +1,518 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "precomp.h"
+#include "RxCoalesce.h"
+#include "OvsNetBuffer.h"
+#include "Nbls.h"
+#include "Ipv4.h"
+#include "Tcp.h"
+#include "Checksum.h"
+#include "OFPort.h"
+#include "Switch.h"
+#include "Driver.h"
+
+typedef struct _OVS_RX_COALESCE
+{
+    //set at driver load
+    ULONG                   maxFrameSize;
+    //100ns units
+    LONG64                  maxDelay;
+
+    //updated with interlocked operations
+    OVS_RX_COALESCE_STATS   stats;
+}OVS_RX_COALESCE, *POVS_RX_COALESCE;
+
+static OVS_RX_COALESCE g_rxCoalesce;
+
+//the headers of a segment that can be coalesced: eth, ipv4 without options, and tcp
+typedef struct _OVS_RX_SEGMENT
+{
+    BYTE*               pFrame;
+    OVS_IPV4_HEADER*    pIpv4Header;
+    OVS_TCP_HEADER*     pTcpHeader;
+
+    //eth + ipv4 + tcp headers, including the tcp options
+    ULONG               headersSize;
+    ULONG               payloadSize;
+}OVS_RX_SEGMENT, *POVS_RX_SEGMENT;
+
+//only the segments of an established connection, carrying data, are coalesced: not fragments, nor the segments with
+//control flags other than ACK and PSH
+static BOOLEAN _RxCoalesce_ParseSegment(_In_ OVS_NET_BUFFER* pOvsNb, _Out_ OVS_RX_SEGMENT* pSegment)
+{
+    const OVS_ETHERNET_HEADER* pEthHeader = NULL;
+    ULONG frameSize = 0, ipv4Size = 0, tcpHeaderSize = 0;
+    UINT16 tcpFlags = 0;
+
+    RtlZeroMemory(pSegment, sizeof(OVS_RX_SEGMENT));
+
+    frameSize = ONB_GetDataLength(pOvsNb);
+    if (frameSize < sizeof(OVS_ETHERNET_HEADER) + sizeof(OVS_IPV4_HEADER) + sizeof(OVS_TCP_HEADER))
+    {
+        return FALSE;
+    }
+
+    pSegment->pFrame = ONB_GetData(pOvsNb);
+
+    pEthHeader = (const OVS_ETHERNET_HEADER*)pSegment->pFrame;
+    if (RtlUshortByteSwap(pEthHeader->type) != OVS_ETHERTYPE_IPV4)
+    {
+        return FALSE;
+    }
+
+    pSegment->pIpv4Header = (OVS_IPV4_HEADER*)(pSegment->pFrame + sizeof(OVS_ETHERNET_HEADER));
+
+    if (pSegment->pIpv4Header->Version != OVS_IPPROTO_VERSION_4 || pSegment->pIpv4Header->HeaderLength != sizeof(OVS_IPV4_HEADER) / sizeof(DWORD) ||
+        pSegment->pIpv4Header->Protocol != OVS_IPPROTO_TCP)
+    {
+        return FALSE;
+    }
+
+    if (pSegment->pIpv4Header->MoreFragments || Ipv4_GetFragmentOffset(pSegment->pIpv4Header) != 0)
+    {
+        return FALSE;
+    }
+
+    //the ipv4 header of the coalesced frame is that of the first segment: the others are checked here, because they are dropped
+    if (Checksum_Sum(pSegment->pIpv4Header, sizeof(OVS_IPV4_HEADER)) != 0xFFFF)
+    {
+        return FALSE;
+    }
+
+    //the frame may be padded: the total length tells where the payload ends
+    ipv4Size = RtlUshortByteSwap(pSegment->pIpv4Header->TotalLength);
+    if (sizeof(OVS_ETHERNET_HEADER) + ipv4Size > frameSize)
+    {
+        return FALSE;
+    }
+
+    pSegment->pTcpHeader = (OVS_TCP_HEADER*)(pSegment->pIpv4Header + 1);
+    tcpHeaderSize = GetTcpDataOffset(pSegment->pTcpHeader->flagsAndOffset) * sizeof(DWORD);
+
+    if (tcpHeaderSize < sizeof(OVS_TCP_HEADER) || sizeof(OVS_IPV4_HEADER) + tcpHeaderSize >= ipv4Size)
+    {
+        return FALSE;
+    }
+
+    tcpFlags = GetTcpFlags(pSegment->pTcpHeader->flagsAndOffset);
+    if ((tcpFlags & ~OVS_TCP_FLAG_PSH) != OVS_TCP_FLAG_ACK)
+    {
+        return FALSE;
+    }
+
+    pSegment->headersSize = sizeof(OVS_ETHERNET_HEADER) + sizeof(OVS_IPV4_HEADER) + tcpHeaderSize;
+    pSegment->payloadSize = sizeof(OVS_ETHERNET_HEADER) + ipv4Size - pSegment->headersSize;
+
+    return TRUE;
+}
+
+//the segment has the same eth, ipv4 and tcp headers as the first one (options included), except for the ipv4 identification,
+//total length and checksum, and the tcp sequence number, PSH and checksum
+static BOOLEAN _RxCoalesce_SameFlow(_In_ const OVS_RX_SEGMENT* pFirst, _In_ const OVS_RX_SEGMENT* pSegment)
+{
+    const OVS_IPV4_HEADER* pFirstIpv4Header = pFirst->pIpv4Header;
+    const OVS_IPV4_HEADER* pIpv4Header = pSegment->pIpv4Header;
+    const OVS_TCP_HEADER* pFirstTcpHeader = pFirst->pTcpHeader;
+    const OVS_TCP_HEADER* pTcpHeader = pSegment->pTcpHeader;
+    UINT16 firstFlagsAndOffset = pFirstTcpHeader->flagsAndOffset;
+    UINT16 flagsAndOffset = pTcpHeader->flagsAndOffset;
+
+    if (pSegment->headersSize != pFirst->headersSize)
+    {
+        return FALSE;
+    }
+
+    if (!RtlEqualMemory(pSegment->pFrame, pFirst->pFrame, sizeof(OVS_ETHERNET_HEADER)))
+    {
+        return FALSE;
+    }
+
+    if (pIpv4Header->TypeOfServiceAndEcnField != pFirstIpv4Header->TypeOfServiceAndEcnField ||
+        pIpv4Header->FlagsAndOffset != pFirstIpv4Header->FlagsAndOffset ||
+        pIpv4Header->TimeToLive != pFirstIpv4Header->TimeToLive ||
+        !RtlEqualMemory(&pIpv4Header->SourceAddress, &pFirstIpv4Header->SourceAddress, sizeof(IN_ADDR)) ||
+        !RtlEqualMemory(&pIpv4Header->DestinationAddress, &pFirstIpv4Header->DestinationAddress, sizeof(IN_ADDR)))
+    {
+        return FALSE;
+    }
+
+    ClearTcpFlags(&firstFlagsAndOffset, OVS_TCP_FLAG_PSH);
+    ClearTcpFlags(&flagsAndOffset, OVS_TCP_FLAG_PSH);
+
+    if (pTcpHeader->sourcePort != pFirstTcpHeader->sourcePort || pTcpHeader->destinationPort != pFirstTcpHeader->destinationPort ||
+        pTcpHeader->acknowledgeNo != pFirstTcpHeader->acknowledgeNo || flagsAndOffset != firstFlagsAndOffset ||
+        pTcpHeader->window != pFirstTcpHeader->window || pTcpHeader->urgentPointer != pFirstTcpHeader->urgentPointer)
+    {
+        return FALSE;
+    }
+
+    //e.g. the timestamps: a segment with a newer timestamp starts a new frame
+    return RtlEqualMemory(pTcpHeader + 1, pFirstTcpHeader + 1,
+        pSegment->headersSize - sizeof(OVS_ETHERNET_HEADER) - sizeof(OVS_IPV4_HEADER) - sizeof(OVS_TCP_HEADER));
+}
+
+static UINT16 _RxCoalesce_PseudoHeaderSum(_In_ const OVS_IPV4_HEADER* pIpv4Header, ULONG tcpSize)
+{
+    OVS_TRANSPORT_PSEUDO_HEADER_IPV4 pseudoHeader = { 0 };
+
+    RtlCopyMemory(pseudoHeader.srcIp, &pIpv4Header->SourceAddress, sizeof(pseudoHeader.srcIp));
+    RtlCopyMemory(pseudoHeader.destIp, &pIpv4Header->DestinationAddress, sizeof(pseudoHeader.destIp));
+    pseudoHeader.protocol = OVS_IPPROTO_TCP;
+    pseudoHeader.tcpLen = RtlUshortByteSwap((UINT16)tcpSize);
+
+    return Checksum_Sum(&pseudoHeader, sizeof(OVS_TRANSPORT_PSEUDO_HEADER_IPV4));
+}
+
+//the sum of the payload, derived from the tcp checksum instead of read: pseudo header + tcp header + payload sum to -0,
+//so the payload sums to the negation of the others. If the segment was corrupted, so is the checksum of the coalesced frame.
+static UINT16 _RxCoalesce_PayloadSum(_In_ const OVS_RX_SEGMENT* pSegment)
+{
+    ULONG tcpHeaderSize = pSegment->headersSize - sizeof(OVS_ETHERNET_HEADER) - sizeof(OVS_IPV4_HEADER);
+    UINT64 sum = 0;
+
+    sum += _RxCoalesce_PseudoHeaderSum(pSegment->pIpv4Header, tcpHeaderSize + pSegment->payloadSize);
+    sum += Checksum_Sum(pSegment->pTcpHeader, tcpHeaderSize);
+
+    return (UINT16)~Checksum_Fold64(sum);
+}
+
+/* Builds the coalesced frame: the headers of the first segment, followed by the payloads of all segments; then:
+ipv4: total length, and header checksum (incrementally)
+tcp: PSH, if the last segment had it; the checksum, from the headers and the payload sums of the segments
+NBL: the info of the first segment, with the number of segments coalesced (RSC info)
+The first ONB gets the new NBL; the others are destroyed. Returns NULL if the frame cannot be allocated: the segments are kept. */
+static OVS_NET_BUFFER* _RxCoalesce_Merge(_Inout_ OVS_RX_COALESCE_CONTEXT* pContext)
+{
+    OVS_NET_BUFFER* pFirstOnb = pContext->segments[0];
+    OVS_SWITCH_INFO* pSwitchInfo = pFirstOnb->pSwitchInfo;
+    OVS_RX_SEGMENT first = { 0 };
+    NET_BUFFER* pNb = NULL;
+    NET_BUFFER_LIST* pNbl = NULL;
+    PNDIS_SWITCH_FORWARDING_DETAIL_NET_BUFFER_LIST_INFO pFwdDetail = NULL;
+    NDIS_STATUS status = NDIS_STATUS_SUCCESS;
+    OVS_IPV4_HEADER* pIpv4Header = NULL;
+    OVS_TCP_HEADER* pTcpHeader = NULL;
+    OVS_CHECKSUM_DELTA delta = 0;
+    BYTE* pFrame = NULL;
+    ULONG offset = 0, tcpHeaderSize = 0, i = 0;
+    UINT64 payloadSum = 0, sum = 0;
+    BE16 totalLength = 0;
+
+    if (!_RxCoalesce_ParseSegment(pFirstOnb, &first))
+    {
+        OVS_CHECK(__UNEXPECTED__);
+        return NULL;
+    }
+
+    //the same headroom as the received packets, for a later encapsulation
+    pNb = ONB_CreateNb(pContext->frameSize, ONB_GetDataOffset(pFirstOnb));
+    if (!pNb)
+    {
+        return NULL;
+    }
+
+    //the buffer was allocated by us, so its data is contiguous => NdisGetDataBuffer will succeed
+    pFrame = NdisGetDataBuffer(pNb, pContext->frameSize, NULL, 1, 0);
+    OVS_CHECK(pFrame);
+
+    RtlCopyMemory(pFrame, first.pFrame, first.headersSize);
+    offset = first.headersSize;
+
+    for (i = 0; i < pContext->countSegments; ++i)
+    {
+        OVS_RX_SEGMENT segment = { 0 };
+        UINT16 segmentSum = 0;
+
+        //the segments were parsed when they were held; they have not changed since
+        if (!_RxCoalesce_ParseSegment(pContext->segments[i], &segment))
+        {
+            OVS_CHECK(__UNEXPECTED__);
+            ONB_FreeNbChain(pNb);
+            return NULL;
+        }
+
+        segmentSum = _RxCoalesce_PayloadSum(&segment);
+
+        //a payload that starts at an odd offset has its bytes in the other halves of the 16-bit words
+        if ((offset - first.headersSize) & 1)
+        {
+            segmentSum = RtlUshortByteSwap(segmentSum);
+        }
+
+        payloadSum += segmentSum;
+
+        RtlCopyMemory(pFrame + offset, segment.pFrame + segment.headersSize, segment.payloadSize);
+        offset += segment.payloadSize;
+    }
+
+    OVS_CHECK(offset == pContext->frameSize);
+
+    pIpv4Header = (OVS_IPV4_HEADER*)(pFrame + sizeof(OVS_ETHERNET_HEADER));
+    totalLength = RtlUshortByteSwap((UINT16)(pContext->frameSize - sizeof(OVS_ETHERNET_HEADER)));
+
+    ChecksumDelta_Replace2(&delta, pIpv4Header->TotalLength, totalLength);
+    pIpv4Header->TotalLength = totalLength;
+    pIpv4Header->HeaderChecksum = Checksum_ApplyDelta(pIpv4Header->HeaderChecksum, delta);
+
+    pTcpHeader = (OVS_TCP_HEADER*)(pIpv4Header + 1);
+    tcpHeaderSize = first.headersSize - sizeof(OVS_ETHERNET_HEADER) - sizeof(OVS_IPV4_HEADER);
+
+    if (pContext->pushed)
+    {
+        SetTcpFlags(&pTcpHeader->flagsAndOffset, OVS_TCP_FLAG_PSH);
+    }
+
+    pTcpHeader->checksum = 0;
+
+    sum += _RxCoalesce_PseudoHeaderSum(pIpv4Header, pContext->frameSize - sizeof(OVS_ETHERNET_HEADER) - sizeof(OVS_IPV4_HEADER));
+    sum += Checksum_Sum(pTcpHeader, tcpHeaderSize);
+    sum += payloadSum;
+
+    pTcpHeader->checksum = (UINT16)~Checksum_Fold64(sum);
+
+    pNbl = ONB_CreateNblFromNb(pNb, MEMORY_ALLOCATION_ALIGNMENT);
+    if (!pNbl)
+    {
+        ONB_FreeNbChain(pNb);
+        return NULL;
+    }
+
+    status = pSwitchInfo->switchHandlers.CopyNetBufferListInfo(pSwitchInfo->switchContext, pNbl, pFirstOnb->pNbl, 0);
+    if (status != NDIS_STATUS_SUCCESS)
+    {
+        OVS_CHECK(0);
+        FreeDuplicateNbl(pSwitchInfo, pNbl);
+        return NULL;
+    }
+
+    NET_BUFFER_LIST_COALESCED_SEG_COUNT(pNbl) = (USHORT)pContext->countSegments;
+    NET_BUFFER_LIST_DUP_ACK_COUNT(pNbl) = 0;
+
+    pFwdDetail = NET_BUFFER_LIST_SWITCH_FORWARDING_DETAIL(pNbl);
+    pFwdDetail->IsPacketDataSafe = TRUE;
+
+    ONB_DestroyNbl(pFirstOnb);
+    pFirstOnb->pNbl = pNbl;
+
+    for (i = 1; i < pContext->countSegments; ++i)
+    {
+        OVS_REFCOUNT_DEREFERENCE(pContext->segments[i]->pSourcePort);
+        ONB_Destroy(pSwitchInfo, &pContext->segments[i]);
+    }
+
+    return pFirstOnb;
+}
+
+_Use_decl_annotations_
+VOID RxCoalesce_Initialize(PUNICODE_STRING pRegistryPath)
+{
+    ULONG maxSize = 0, maxDelay = 0;
+
+    RtlZeroMemory(&g_rxCoalesce, sizeof(OVS_RX_COALESCE));
+
+    //no RxCoalesceMaxSize: coalescing stays disabled
+    maxSize = Driver_ReadParameter(pRegistryPath, OVS_RX_COALESCE_MAX_SIZE_VALUE, 0);
+    maxDelay = Driver_ReadParameter(pRegistryPath, OVS_RX_COALESCE_MAX_DELAY_VALUE, OVS_RX_COALESCE_DEFAULT_MAX_DELAY);
+
+    g_rxCoalesce.maxFrameSize = min(maxSize, OVS_RX_COALESCE_MAX_FRAME_SIZE);
+    g_rxCoalesce.maxDelay = (LONG64)maxDelay * 10;
+
+    DEBUGP(LOG_INFO, "rx coalescing: max frame size = %d; max delay = %d us\n", g_rxCoalesce.maxFrameSize, maxDelay);
+}
+
+_Use_decl_annotations_
+VOID RxCoalesce_GetStats(OVS_RX_COALESCE_STATS* pStats)
+{
+    pStats->framesCoalesced = InterlockedCompareExchange64(&g_rxCoalesce.stats.framesCoalesced, 0, 0);
+    pStats->segmentsCoalesced = InterlockedCompareExchange64(&g_rxCoalesce.stats.segmentsCoalesced, 0, 0);
+    pStats->flushesSize = InterlockedCompareExchange64(&g_rxCoalesce.stats.flushesSize, 0, 0);
+    pStats->flushesDelay = InterlockedCompareExchange64(&g_rxCoalesce.stats.flushesDelay, 0, 0);
+    pStats->flushesOther = InterlockedCompareExchange64(&g_rxCoalesce.stats.flushesOther, 0, 0);
+    pStats->mergeFailures = InterlockedCompareExchange64(&g_rxCoalesce.stats.mergeFailures, 0, 0);
+}
+
+_Use_decl_annotations_
+VOID RxCoalesce_Begin(OVS_RX_COALESCE_CONTEXT* pContext)
+{
+    RtlZeroMemory(pContext, sizeof(OVS_RX_COALESCE_CONTEXT));
+
+    pContext->maxFrameSize = g_rxCoalesce.maxFrameSize;
+    pContext->maxDelay = g_rxCoalesce.maxDelay;
+}
+
+_Use_decl_annotations_
+BOOLEAN RxCoalesce_IsSegment(OVS_NET_BUFFER* pOvsNb)
+{
+    OVS_RX_SEGMENT segment = { 0 };
+
+    return _RxCoalesce_ParseSegment(pOvsNb, &segment);
+}
+
+_Use_decl_annotations_
+BOOLEAN RxCoalesce_Hold(OVS_RX_COALESCE_CONTEXT* pContext, OVS_NET_BUFFER* pOvsNb, const OF_PI_IPV4_TUNNEL* pTunnelInfo)
+{
+    OVS_RX_SEGMENT segment = { 0 };
+
+    OVS_CHECK(pContext->countSegments == 0);
+
+    if (!RxCoalesce_IsEnabled(pContext) || !_RxCoalesce_ParseSegment(pOvsNb, &segment))
+    {
+        return FALSE;
+    }
+
+    //nothing may be appended after PSH: there is no frame to build
+    if (GetTcpFlags(segment.pTcpHeader->flagsAndOffset) & OVS_TCP_FLAG_PSH)
+    {
+        return FALSE;
+    }
+
+    if (segment.headersSize + segment.payloadSize >= pContext->maxFrameSize)
+    {
+        return FALSE;
+    }
+
+    pContext->segments[0] = pOvsNb;
+    pContext->countSegments = 1;
+    pContext->countFlushed = 0;
+
+    pContext->frameSize = segment.headersSize + segment.payloadSize;
+    pContext->nextSequence = RtlUlongByteSwap(segment.pTcpHeader->sequenceNo) + segment.payloadSize;
+    pContext->pushed = FALSE;
+    pContext->firstHeldTime = (LONG64)KeQueryInterruptTime();
+    pContext->tunnelInfo = *pTunnelInfo;
+
+    return TRUE;
+}
+
+_Use_decl_annotations_
+BOOLEAN RxCoalesce_Append(OVS_RX_COALESCE_CONTEXT* pContext, OVS_NET_BUFFER* pOvsNb, const OF_PI_IPV4_TUNNEL* pTunnelInfo)
+{
+    OVS_RX_SEGMENT first = { 0 }, segment = { 0 };
+    OVS_NET_BUFFER* pFirstOnb = NULL;
+
+    if (pContext->countSegments == 0)
+    {
+        return FALSE;
+    }
+
+    pFirstOnb = pContext->segments[0];
+
+    if (pContext->pushed || pOvsNb->pSourcePort != pFirstOnb->pSourcePort ||
+        !RtlEqualMemory(pTunnelInfo, &pContext->tunnelInfo, sizeof(OF_PI_IPV4_TUNNEL)))
+    {
+        goto Flush_Other;
+    }
+
+    //the first segment was parsed when it was held
+    if (!_RxCoalesce_ParseSegment(pFirstOnb, &first))
+    {
+        OVS_CHECK(__UNEXPECTED__);
+        goto Flush_Other;
+    }
+
+    //a retransmission or a lost segment ends the frame
+    if (!_RxCoalesce_ParseSegment(pOvsNb, &segment) || !_RxCoalesce_SameFlow(&first, &segment) ||
+        RtlUlongByteSwap(segment.pTcpHeader->sequenceNo) != pContext->nextSequence)
+    {
+        goto Flush_Other;
+    }
+
+    if (pContext->countSegments == OVS_RX_COALESCE_MAX_SEGMENTS || pContext->frameSize + segment.payloadSize > pContext->maxFrameSize)
+    {
+        InterlockedIncrement64(&g_rxCoalesce.stats.flushesSize);
+        return FALSE;
+    }
+
+    if ((LONG64)KeQueryInterruptTime() - pContext->firstHeldTime > pContext->maxDelay)
+    {
+        InterlockedIncrement64(&g_rxCoalesce.stats.flushesDelay);
+        return FALSE;
+    }
+
+    pContext->segments[pContext->countSegments] = pOvsNb;
+    ++pContext->countSegments;
+
+    pContext->frameSize += segment.payloadSize;
+    pContext->nextSequence += segment.payloadSize;
+    pContext->pushed = (GetTcpFlags(segment.pTcpHeader->flagsAndOffset) & OVS_TCP_FLAG_PSH) != 0;
+
+    return TRUE;
+
+Flush_Other:
+    InterlockedIncrement64(&g_rxCoalesce.stats.flushesOther);
+    return FALSE;
+}
+
+_Use_decl_annotations_
+OVS_NET_BUFFER* RxCoalesce_Flush(OVS_RX_COALESCE_CONTEXT* pContext)
+{
+    OVS_NET_BUFFER* pOvsNb = NULL;
+
+    if (pContext->countFlushed == pContext->countSegments)
+    {
+        pContext->countSegments = pContext->countFlushed = 0;
+        return NULL;
+    }
+
+    if (pContext->countSegments > 1 && pContext->countFlushed == 0)
+    {
+        pOvsNb = _RxCoalesce_Merge(pContext);
+        if (pOvsNb)
+        {
+            InterlockedIncrement64(&g_rxCoalesce.stats.framesCoalesced);
+            InterlockedAdd64(&g_rxCoalesce.stats.segmentsCoalesced, pContext->countSegments);
+
+            pContext->countSegments = pContext->countFlushed = 0;
+            return pOvsNb;
+        }
+
+        InterlockedIncrement64(&g_rxCoalesce.stats.mergeFailures);
+    }
+
+    pOvsNb = pContext->segments[pContext->countFlushed];
+    pContext->segments[pContext->countFlushed] = NULL;
+    ++pContext->countFlushed;
+
+    return pOvsNb;
+}
+
+_Use_decl_annotations_
+BOOLEAN RxCoalesce_GetSegmentation(OVS_NET_BUFFER* pOvsNb, ULONG* pMss, ULONG* pTcpHeaderOffset)
+{
+    ULONG countSegments = NET_BUFFER_LIST_COALESCED_SEG_COUNT(pOvsNb->pNbl);
+    OVS_RX_SEGMENT frame = { 0 };
+
+    *pMss = 0;
+    *pTcpHeaderOffset = 0;
+
+    if (countSegments == 0)
+    {
+        return FALSE;
+    }
+
+    //the actions may have modified the frame since it was coalesced
+    if (!_RxCoalesce_ParseSegment(pOvsNb, &frame))
+    {
+        return FALSE;
+    }
+
+    //the average payload: no larger than the largest segment received
+    *pMss = (frame.payloadSize + countSegments - 1) / countSegments;
+    *pTcpHeaderOffset = sizeof(OVS_ETHERNET_HEADER) + sizeof(OVS_IPV4_HEADER);
+
+    return TRUE;
+}
@@ -0,0 +1,108 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "precomp.h"
+#include "Ethernet.h"
+#include "PacketInfo.h"
+
+typedef struct _OVS_NET_BUFFER OVS_NET_BUFFER;
+
+/* RECEIVE SEGMENT COALESCING: the in-order tcp segments of a flow, decapsulated from the same NBL chain, are merged into one
+larger frame (see "Receive Segment Coalescing" in the NDIS docs) before the flow lookup. One flow is coalesced at a time:
+any packet that does not continue the held frame makes it be delivered first, so that the order of the packets is kept. */
+
+//the driver's registry Parameters values. Coalescing is disabled unless RxCoalesceMaxSize is set.
+//RxCoalesceMaxSize: the max size of a coalesced frame, including the eth header (bytes)
+//RxCoalesceMaxDelay: how long the first segment of a frame may wait for the others (microseconds)
+#define OVS_RX_COALESCE_MAX_SIZE_VALUE      L"RxCoalesceMaxSize"
+#define OVS_RX_COALESCE_MAX_DELAY_VALUE     L"RxCoalesceMaxDelay"
+
+#define OVS_RX_COALESCE_DEFAULT_MAX_DELAY   50
+//a coalesced frame is a single ipv4 packet
+#define OVS_RX_COALESCE_MAX_FRAME_SIZE      ((ULONG)sizeof(OVS_ETHERNET_HEADER) + MAXUINT16)
+#define OVS_RX_COALESCE_MAX_SEGMENTS        64
+
+typedef struct _OVS_RX_COALESCE_STATS
+{
+    //frames built from several segments, and the segments they were built from
+    LONG64      framesCoalesced;
+    LONG64      segmentsCoalesced;
+
+    //why a held frame was delivered before the end of its NBL chain
+    LONG64      flushesSize;
+    LONG64      flushesDelay;
+    LONG64      flushesOther;
+
+    //the frame could not be allocated: its segments were delivered as they were
+    LONG64      mergeFailures;
+}OVS_RX_COALESCE_STATS, *POVS_RX_COALESCE_STATS;
+
+//the frame being coalesced, during the processing of one NBL chain
+typedef struct _OVS_RX_COALESCE_CONTEXT
+{
+    //the limits, read once per NBL chain. maxFrameSize = 0: coalescing is disabled
+    ULONG               maxFrameSize;
+    LONG64              maxDelay;
+
+    //the segments held, in order; each with the reference to its pSourcePort
+    OVS_NET_BUFFER*     segments[OVS_RX_COALESCE_MAX_SEGMENTS];
+    ULONG               countSegments;
+    //the next segment RxCoalesce_Flush returns, if they could not be merged
+    ULONG               countFlushed;
+
+    //the size the frame has, once merged
+    ULONG               frameSize;
+    UINT32              nextSequence;
+    //the last segment held had PSH: the frame is complete
+    BOOLEAN             pushed;
+    //KeQueryInterruptTime, when the first segment was held
+    LONG64              firstHeldTime;
+
+    //the tunnel all the segments held were received on
+    OF_PI_IPV4_TUNNEL   tunnelInfo;
+}OVS_RX_COALESCE_CONTEXT, *POVS_RX_COALESCE_CONTEXT;
+
+//reads the limits from the driver's registry key. Called once, at driver load.
+VOID RxCoalesce_Initialize(_In_ PUNICODE_STRING pRegistryPath);
+
+//read by OVS_IOCTL_RECEIVE_STATS
+VOID RxCoalesce_GetStats(_Out_ OVS_RX_COALESCE_STATS* pStats);
+
+VOID RxCoalesce_Begin(_Out_ OVS_RX_COALESCE_CONTEXT* pContext);
+
+static __inline BOOLEAN RxCoalesce_IsEnabled(_In_ const OVS_RX_COALESCE_CONTEXT* pContext)
+{
+    return pContext->maxFrameSize > 0;
+}
+
+//the frame is an untagged ipv4 tcp segment that may be coalesced: its headers are all in the frame, and valid
+BOOLEAN RxCoalesce_IsSegment(_In_ OVS_NET_BUFFER* pOvsNb);
+
+//appends the segment to the held frame, if it continues it within the limits. On success, the context takes the ONB and the reference
+//to its pSourcePort: the caller must not use them anymore.
+BOOLEAN RxCoalesce_Append(_Inout_ OVS_RX_COALESCE_CONTEXT* pContext, _In_ OVS_NET_BUFFER* pOvsNb, _In_ const OF_PI_IPV4_TUNNEL* pTunnelInfo);
+//starts a new frame with the segment, if it can be coalesced. Nothing must be held: see RxCoalesce_Flush.
+//On success, the context takes the ONB and the reference to its pSourcePort.
+BOOLEAN RxCoalesce_Hold(_Inout_ OVS_RX_COALESCE_CONTEXT* pContext, _In_ OVS_NET_BUFFER* pOvsNb, _In_ const OF_PI_IPV4_TUNNEL* pTunnelInfo);
+//must be called until it returns NULL: returns the held frame, merged; or, if it cannot be merged, each of its segments.
+//The caller owns each packet returned, and the reference to its pSourcePort. They were received on pContext->tunnelInfo.
+OVS_NET_BUFFER* RxCoalesce_Flush(_Inout_ OVS_RX_COALESCE_CONTEXT* pContext);
+
+//a coalesced frame that goes out through the external nic must be segmented again: gets the segment size and the tcp header offset
+//(from the beginning of the eth header). Fails if the packet is not a coalesced frame.
+BOOLEAN RxCoalesce_GetSegmentation(_In_ OVS_NET_BUFFER* pOvsNb, _Out_ ULONG* pMss, _Out_ ULONG* pTcpHeaderOffset);
@@ -23,6 +23,33 @@ limitations under the License.
 #include "OvsNetBuffer.h"
 #include "Argument.h"
 #include "OFPort.h"
+#include "Driver.h"
+
+//the outer udp source ports: [min, min + count)
+static UINT16 g_vxlanSourcePortMin = OVS_VXLAN_SOURCE_PORT_MIN_DEFAULT;
+static ULONG g_vxlanSourcePortCount = OVS_VXLAN_SOURCE_PORT_MAX_DEFAULT - OVS_VXLAN_SOURCE_PORT_MIN_DEFAULT + 1;
+
+_Use_decl_annotations_
+VOID Vxlan_Initialize(PUNICODE_STRING pRegistryPath)
+{
+    ULONG minPort = 0, maxPort = 0;
+
+    minPort = Driver_ReadParameter(pRegistryPath, OVS_VXLAN_SOURCE_PORT_MIN_VALUE, OVS_VXLAN_SOURCE_PORT_MIN_DEFAULT);
+    maxPort = Driver_ReadParameter(pRegistryPath, OVS_VXLAN_SOURCE_PORT_MAX_VALUE, OVS_VXLAN_SOURCE_PORT_MAX_DEFAULT);
+
+    if (minPort == 0 || minPort > maxPort || maxPort > MAXUINT16)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " invalid vxlan source port range: [%d, %d]. using the default\n", minPort, maxPort);
+
+        minPort = OVS_VXLAN_SOURCE_PORT_MIN_DEFAULT;
+        maxPort = OVS_VXLAN_SOURCE_PORT_MAX_DEFAULT;
+    }
+
+    g_vxlanSourcePortMin = (UINT16)minPort;
+    g_vxlanSourcePortCount = maxPort - minPort + 1;
+
+    DEBUGP(LOG_INFO, "vxlan source ports: [%d, %d]\n", minPort, maxPort);
+}
 
 ULONG Vxlan_BytesNeeded(UINT16 tunnelFlags)
 {
@@ -31,17 +58,16 @@ ULONG Vxlan_BytesNeeded(UINT16 tunnelFlags)
     return sizeof(OVS_ETHERNET_HEADER) + sizeof(OVS_IPV4_HEADER) + sizeof(OVS_UDP_HEADER) + sizeof(OVS_VXLAN_HEADER);
 }
 
-static void _BuildOuterUdpHeader(OVS_UDP_HEADER* pUdpHeader, LE16 udpPort, UINT16 oldPacketLength)
+static void _BuildOuterUdpHeader(OVS_UDP_HEADER* pUdpHeader, LE16 udpPort)
 {
-    UINT16 udpPayloadLength = 0;
     LE16 vxlanUdpPort = 0;
 
     OVS_CHECK(pUdpHeader);
 
     vxlanUdpPort = udpPort;
-    udpPayloadLength = (UINT16)(sizeof(OVS_UDP_HEADER) + oldPacketLength);
 
-    pUdpHeader->sourcePort = 0;//must be computed using a hash on eth or smth
+    //set for each packet: see Vxlan_SetFlowEntropy
+    pUdpHeader->sourcePort = 0;
     pUdpHeader->destinationPort = RtlUshortByteSwap(vxlanUdpPort);
 
     /*
@@ -61,61 +87,68 @@ static void _BuildOuterUdpHeader(OVS_UDP_HEADER* pUdpHeader, LE16 udpPort, UINT1
     */
     //TODO: we should compute the udp checksum.
     pUdpHeader->checksum = 0;
-    pUdpHeader->length = RtlUshortByteSwap(udpPayloadLength);
+    //set for each packet: see Vxlan_SetPayloadLength
+    pUdpHeader->length = 0;
 }
 
-VOID* Vxlan_BuildHeader(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _In_ const OVS_TUNNELING_PORT_OPTIONS* pOptions,
-    ULONG payloadLength, ULONG vxlanHeaderSize, _Out_ BOOLEAN* pHaveChecksum)
+_Use_decl_annotations_
+BOOLEAN Vxlan_BuildHeader(const OF_PI_IPV4_TUNNEL* pTunnel, const OVS_TUNNELING_PORT_OPTIONS* pOptions,
+    ULONG vxlanHeaderSize, VOID* pEncapHeader, BOOLEAN* pHaveChecksum)
 {
-    VOID* pVxlanFullHeader = NULL;
     BYTE* writeBuffer = NULL;
-    OVS_UDP_HEADER udpHeader = { 0 };
-    ULONG toWrite = 0;
-    OVS_VXLAN_HEADER vxlanHeader = { 0 };
+    OVS_VXLAN_HEADER* pVxlanHeader = NULL;
     UINT32 tunnelId = 0;
 
-    UNREFERENCED_PARAMETER(pTunnel);
     UNREFERENCED_PARAMETER(vxlanHeaderSize);
 
     OVS_CHECK(vxlanHeaderSize == sizeof(OVS_UDP_HEADER) + sizeof(OVS_VXLAN_HEADER));
     *pHaveChecksum = FALSE;
 
-    pVxlanFullHeader = KAlloc(vxlanHeaderSize);
-    if (!pVxlanFullHeader)
-    {
-        return NULL;
-    }
-
-    writeBuffer = pVxlanFullHeader;
+    writeBuffer = pEncapHeader;
+    RtlZeroMemory(writeBuffer, vxlanHeaderSize);
 
     //A. Add the UDP
     OVS_CHECK(pOptions);
     OVS_CHECK(pOptions->optionsFlags & OVS_TUNNEL_OPTIONS_HAVE_UDP_DST_PORT);
-    _BuildOuterUdpHeader(&udpHeader, pOptions->udpDestPort, (UINT16)(payloadLength + sizeof(OVS_VXLAN_HEADER)));
-    toWrite = sizeof(OVS_UDP_HEADER);
-
-    OVS_CHECK(writeBuffer);
-    RtlCopyMemory(writeBuffer, &udpHeader, toWrite);
-    writeBuffer += toWrite;
+    _BuildOuterUdpHeader((OVS_UDP_HEADER*)writeBuffer, pOptions->udpDestPort);
+    writeBuffer += sizeof(OVS_UDP_HEADER);
 
     //B. Add the Vxlan
-    RtlZeroMemory(&vxlanHeader, sizeof(vxlanHeader));
-    vxlanHeader.flags = 0x8;
+    pVxlanHeader = (OVS_VXLAN_HEADER*)writeBuffer;
+    pVxlanHeader->flags = 0x8;
 
     //the tunnel id must be put in a 24bit field, so its value must be max 2^24 - 1 = 0xFFFFFF
     OVS_CHECK(RtlUlonglongByteSwap(pTunnel->tunnelId) <= 0xFFFFFF);
 
     tunnelId = (UINT32)(pTunnel->tunnelId >> (64 - 24));
 
-    RtlCopyMemory(vxlanHeader.vni, &tunnelId, 3);
+    RtlCopyMemory(pVxlanHeader->vni, &tunnelId, 3);
     //copy 3 bytes, so the last byte must be 0x00
-    OVS_CHECK(vxlanHeader.reserved1 == 0);
+    OVS_CHECK(pVxlanHeader->reserved1 == 0);
+
+    return TRUE;
+}
+
+_Use_decl_annotations_
+VOID Vxlan_SetPayloadLength(VOID* pEncapHeader, ULONG payloadLength)
+{
+    OVS_UDP_HEADER* pUdpHeader = pEncapHeader;
+
+    OVS_CHECK(payloadLength + sizeof(OVS_UDP_HEADER) + sizeof(OVS_VXLAN_HEADER) <= 0xFFFF);
+
+    pUdpHeader->length = RtlUshortByteSwap((UINT16)(sizeof(OVS_UDP_HEADER) + sizeof(OVS_VXLAN_HEADER) + payloadLength));
+}
+
+_Use_decl_annotations_
+VOID Vxlan_SetFlowEntropy(VOID* pEncapHeader, UINT32 flowHash)
+{
+    OVS_UDP_HEADER* pUdpHeader = pEncapHeader;
+    UINT16 sourcePort = 0;
 
-    //vxlanHeader.vni - tunnel id
-    toWrite = sizeof(OVS_VXLAN_HEADER);
-    RtlCopyMemory(writeBuffer, &vxlanHeader, toWrite);
+    //scales the hash into the range, instead of taking it modulo the range: all the bits of the hash count
+    sourcePort = g_vxlanSourcePortMin + (UINT16)(((UINT64)flowHash * g_vxlanSourcePortCount) >> 32);
 
-    return pVxlanFullHeader;
+    pUdpHeader->sourcePort = RtlUshortByteSwap(sourcePort);
 }
 
 _Use_decl_annotations_
@@ -333,9 +333,25 @@ specific multicast address (see [RFC4541]).
 //TODO: the vxlan udp port must be made configurable
 enum { OVS_VXLAN_UDP_PORT_DEFAULT = 8472 /*4789*/ };
 
+//the driver's registry Parameters values: the range of the outer udp source ports, which carry the hash of the inner flow.
+//by default, the dynamic ports range (RFC 6335)
+#define OVS_VXLAN_SOURCE_PORT_MIN_VALUE     L"VxlanSourcePortMin"
+#define OVS_VXLAN_SOURCE_PORT_MAX_VALUE     L"VxlanSourcePortMax"
+
+#define OVS_VXLAN_SOURCE_PORT_MIN_DEFAULT   49152
+#define OVS_VXLAN_SOURCE_PORT_MAX_DEFAULT   65535
+
+//reads the source port range from the driver's registry key. Called once, at driver load.
+VOID Vxlan_Initialize(_In_ PUNICODE_STRING pRegistryPath);
+
 //encapsulation size in bytes required by Vxlan (i.e. vxlan + ipv4 + ethernet + udp headers)
 ULONG Vxlan_BytesNeeded(UINT16 tunnelFlags);
-VOID* Vxlan_BuildHeader(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _In_ const OVS_TUNNELING_PORT_OPTIONS* pOptions,
-    ULONG payloadLength, ULONG vxlanHeaderSize, _Out_ BOOLEAN* pHaveChecksum);
+//writes the UDP + VXLAN headers of the outer header template: the UDP length is set for each packet
+BOOLEAN Vxlan_BuildHeader(_In_ const OF_PI_IPV4_TUNNEL* pTunnel, _In_ const OVS_TUNNELING_PORT_OPTIONS* pOptions,
+    ULONG vxlanHeaderSize, _Out_writes_bytes_(vxlanHeaderSize) VOID* pEncapHeader, _Out_ BOOLEAN* pHaveChecksum);
+//pEncapHeader: the UDP header; payloadLength: the size of the encapsulated frame
+VOID Vxlan_SetPayloadLength(_Inout_ VOID* pEncapHeader, ULONG payloadLength);
+//pEncapHeader: the UDP header; sets the source port from the hash of the inner flow
+VOID Vxlan_SetFlowEntropy(_Inout_ VOID* pEncapHeader, UINT32 flowHash);
 
 BOOLEAN Vxlan_ReadHeader(_In_ const VOID* pDecapHeader, _Inout_ ULONG* pOffset, ULONG outerIpPayloadLen, _Inout_ OF_PI_IPV4_TUNNEL* pTunnelInfo);
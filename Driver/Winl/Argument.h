@@ -201,5 +201,5 @@ static __inline AddArgToArgGroup(OVS_ARGUMENT_GROUP* pArgGroup, OVS_ARGUMENT* pA
     pArgGroup->args[*pIndex] = *pArg;
     pArgGroup->groupSize += pArg->length;
 
-    ++pIndex;
+    ++(*pIndex);
 }
\ No newline at end of file
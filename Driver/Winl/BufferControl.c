@@ -20,8 +20,12 @@ limitations under the License.
 #include "Message.h"
 #include "OvsCore.h"
 #include "Winetlink.h"
+#include "OFPort.h"
+#include "UpcallRing.h"
 
-#define OVS_MAX_QUEUED_BUFFERS        50
+//the max number of upcalls queued on an upcall channel, for all the in ports.
+//an in port may hold at most its fair share of them: OVS_MAX_QUEUED_BUFFERS / the in ports that have upcalls queued
+#define OVS_MAX_QUEUED_BUFFERS        256
 
 /*****************************************/
 
@@ -51,13 +55,43 @@ typedef struct _OVS_MULTICAST_BUFFER_ENTRY
     //NOTE: each multicast group has port Ids -- should we consider them when working with groupId-s?
 } OVS_MULTICAST_BUFFER_ENTRY;
 
+//the upcalls of an in port, on an upcall channel
+typedef struct _OVS_UPCALL_SOURCE_QUEUE
+{
+    LIST_ENTRY    listEntry;
+    UINT16        ofSourcePort;
+
+    LIST_ENTRY    bufferQueue;
+    UINT          count;
+
+    UINT64        countQueued;
+    UINT64        countDropped;
+}OVS_UPCALL_SOURCE_QUEUE, *POVS_UPCALL_SOURCE_QUEUE;
+
+//an upcall channel: the upcalls for an upcall port id. It is created when a file sets its pid.
+//the writers hold the device lock shared, and the lock of the channel; the readers hold the device lock exclusively.
 typedef struct _OVS_QUEUED_BUFFER_ENTRY
 {
     LIST_ENTRY    listEntry;
     UINT          portId;
 
-    LIST_ENTRY    bufferQueue;
+    NDIS_SPIN_LOCK lock;
+
+    //a queue for each in port that had upcalls on the channel, read in turns: a port that misses a lot does not delay the others.
+    //the queues are kept, empty, until the channel is destroyed
+    LIST_ENTRY    sourceQueues;
+    //the queue read first, on the next read
+    OVS_UPCALL_SOURCE_QUEUE* pNextSource;
+
+    //the upcalls queued, in all the queues; and the queues that have any
     UINT          count;
+    UINT          countActiveSources;
+
+    //the ring mapped by the file pRingFileObject, in the process ringProcessId, if any: the upcalls are written to the ring while it has room; the queues hold the
+    //rest (the backlog), which is moved to the ring, in turns, as userspace makes room
+    OVS_UPCALL_RING*    pRing;
+    const FILE_OBJECT*  pRingFileObject;
+    HANDLE              ringProcessId;
 }OVS_QUEUED_BUFFER_ENTRY;
 
 typedef struct _OVS_DEVICE_FILE_INFO
@@ -69,6 +103,8 @@ typedef struct _OVS_DEVICE_FILE_INFO
     UINT               portId;
     //if none, it should be set to OVS_MULTICAST_GROUP_NONE
     UINT               groupId;
+    //the process that opened the file
+    HANDLE             processId;
 }OVS_DEVICE_FILE_INFO;
 
 typedef struct _OVS_DEVICE_FILE_INFO_ENTRY
@@ -162,21 +198,29 @@ VOID DbgPrintQueuedBuffers()
 
     OVS_LIST_FOR_EACH(OVS_QUEUED_BUFFER_ENTRY, pEntry, &g_queuedBufferList)
     {
-        OVS_BUFFER_ENTRY* pBufferEntry = NULL;
-        UINT j = 0;
+        OVS_UPCALL_SOURCE_QUEUE* pSource = NULL;
 
         DEBUGP_FILE(LOG_INFO, "queued buffer %d:\n", i);
         DEBUGP_FILE(LOG_INFO, "port id: %u\n", pEntry->portId);
         DEBUGP_FILE(LOG_INFO, "count: %u\n", pEntry->count);
 
-        OVS_LIST_FOR_EACH(OVS_BUFFER_ENTRY, pBufferEntry, &pEntry->bufferQueue)
+        OVS_LIST_FOR_EACH(OVS_UPCALL_SOURCE_QUEUE, pSource, &pEntry->sourceQueues)
         {
-            DEBUGP_FILE(LOG_INFO, "buffer %u ptr: %p\n", j, pBufferEntry->buffer.p);
-            DEBUGP_FILE(LOG_INFO, "buffer %u size: %u\n", j, pBufferEntry->buffer.size);
-            DEBUGP_FILE(LOG_INFO, "buffer %u offset: %u\n", j, pBufferEntry->buffer.offset);
-            DEBUGP_FILE(LOG_INFO, "\n");
+            OVS_BUFFER_ENTRY* pBufferEntry = NULL;
+            UINT j = 0;
 
-            ++j;
+            DEBUGP_FILE(LOG_INFO, "in port %u: count: %u; queued: %llu; dropped: %llu\n", pSource->ofSourcePort, pSource->count,
+                pSource->countQueued, pSource->countDropped);
+
+            OVS_LIST_FOR_EACH(OVS_BUFFER_ENTRY, pBufferEntry, &pSource->bufferQueue)
+            {
+                DEBUGP_FILE(LOG_INFO, "buffer %u ptr: %p\n", j, pBufferEntry->buffer.p);
+                DEBUGP_FILE(LOG_INFO, "buffer %u size: %u\n", j, pBufferEntry->buffer.size);
+                DEBUGP_FILE(LOG_INFO, "buffer %u offset: %u\n", j, pBufferEntry->buffer.offset);
+                DEBUGP_FILE(LOG_INFO, "\n");
+
+                ++j;
+            }
         }
 
         i++;
@@ -264,13 +308,13 @@ OVS_MULTICAST_BUFFER_ENTRY* _FindBufferMulticast_Unsafe(_In_ const OVS_DEVICE_FI
 }
 
 _Ret_maybenull_
-OVS_QUEUED_BUFFER_ENTRY* _FindQueuedBuffer_Unsafe(_In_ const OVS_DEVICE_FILE_INFO* pFileInfo)
+static OVS_QUEUED_BUFFER_ENTRY* _FindQueuedBufferByPortId_Unsafe(UINT portId)
 {
     OVS_QUEUED_BUFFER_ENTRY* pEntry = NULL;
 
     OVS_LIST_FOR_EACH(OVS_QUEUED_BUFFER_ENTRY, pEntry, &g_queuedBufferList)
     {
-        if (pEntry->portId == pFileInfo->portId)
+        if (pEntry->portId == portId)
         {
             return pEntry;
         }
@@ -279,6 +323,12 @@ OVS_QUEUED_BUFFER_ENTRY* _FindQueuedBuffer_Unsafe(_In_ const OVS_DEVICE_FILE_INF
     return NULL;
 }
 
+_Ret_maybenull_
+OVS_QUEUED_BUFFER_ENTRY* _FindQueuedBuffer_Unsafe(_In_ const OVS_DEVICE_FILE_INFO* pFileInfo)
+{
+    return _FindQueuedBufferByPortId_Unsafe(pFileInfo->portId);
+}
+
 BOOLEAN _RemoveMulticastBuffer_Unsafe(OVS_DEVICE_FILE_INFO* pFileInfo)
 {
     OVS_MULTICAST_BUFFER_ENTRY* pBufferEntry = _FindBufferMulticast_Unsafe(pFileInfo);
@@ -503,60 +553,313 @@ OVS_ERROR _BufferCtl_ReadMulticast_Unsafe(_Inout_ OVS_BUFFER* pBuffer, _Inout_ V
     return OVS_ERROR_NOERROR;
 }
 
-static OVS_ERROR _PushBufferToQueue_Unsafe(_Inout_ OVS_QUEUED_BUFFER_ENTRY* pQBufferEntry, _In_ const OVS_BUFFER* pBuffer)
+_Ret_maybenull_
+static OVS_UPCALL_SOURCE_QUEUE* _UpcallChannel_FindSource_Unsafe(_In_ const OVS_QUEUED_BUFFER_ENTRY* pChannel, UINT16 ofSourcePort)
 {
-    OVS_CHECK(pQBufferEntry);
+    OVS_UPCALL_SOURCE_QUEUE* pSource = NULL;
 
-    if (pQBufferEntry->count < OVS_MAX_QUEUED_BUFFERS)
+    OVS_LIST_FOR_EACH(OVS_UPCALL_SOURCE_QUEUE, pSource, &pChannel->sourceQueues)
     {
-        OVS_BUFFER_ENTRY* pBufferEntry = KAlloc(sizeof(OVS_BUFFER_ENTRY));
-        if (!pBufferEntry)
+        if (pSource->ofSourcePort == ofSourcePort)
         {
-            return OVS_ERROR_NOMEM;
+            return pSource;
         }
+    }
 
-        pBufferEntry->buffer = *pBuffer;
+    return NULL;
+}
 
-        InsertTailList(&pQBufferEntry->bufferQueue, &pBufferEntry->listEntry);
-        pQBufferEntry->count++;
+//creates the queue of the in port, if the port had no upcalls on the channel before
+_Ret_maybenull_
+static OVS_UPCALL_SOURCE_QUEUE* _UpcallChannel_GetSource_Unsafe(_Inout_ OVS_QUEUED_BUFFER_ENTRY* pChannel, UINT16 ofSourcePort)
+{
+    OVS_UPCALL_SOURCE_QUEUE* pSource = _UpcallChannel_FindSource_Unsafe(pChannel, ofSourcePort);
+
+    if (pSource)
+    {
+        return pSource;
     }
-    else
+
+    pSource = KZAlloc(sizeof(OVS_UPCALL_SOURCE_QUEUE));
+    if (!pSource)
     {
-        return OVS_ERROR_NOSPC;
+        return NULL;
     }
 
-    return OVS_ERROR_NOERROR;
+    pSource->ofSourcePort = ofSourcePort;
+    InitializeListHead(&pSource->bufferQueue);
+
+    InsertTailList(&pChannel->sourceQueues, &pSource->listEntry);
+
+    return pSource;
 }
 
-static OVS_ERROR _PopBufferFromQueue_Unsafe(_Inout_ OVS_QUEUED_BUFFER_ENTRY* pQBufferEntry, _Inout_ OVS_BUFFER* pBuffer)
+static OVS_UPCALL_SOURCE_QUEUE* _UpcallChannel_FindLongest_Unsafe(_In_ const OVS_QUEUED_BUFFER_ENTRY* pChannel)
 {
-    OVS_CHECK(pQBufferEntry);
-    OVS_CHECK(pBuffer);
+    OVS_UPCALL_SOURCE_QUEUE* pSource = NULL, *pLongest = NULL;
 
-    if (pQBufferEntry->count > 0)
+    OVS_LIST_FOR_EACH(OVS_UPCALL_SOURCE_QUEUE, pSource, &pChannel->sourceQueues)
     {
-        OVS_BUFFER_ENTRY* pBufferEntry = NULL;
-        LIST_ENTRY* pListEntry = NULL;
+        if (!pLongest || pSource->count > pLongest->count)
+        {
+            pLongest = pSource;
+        }
+    }
 
-        OVS_CHECK(!IsListEmpty(&pQBufferEntry->bufferQueue));
+    return pLongest;
+}
 
-        pListEntry = RemoveHeadList(&pQBufferEntry->bufferQueue);
-        OVS_CHECK(pListEntry);
+//the caller owns the buffer data
+static VOID _UpcallChannel_PopFromSource_Unsafe(_Inout_ OVS_QUEUED_BUFFER_ENTRY* pChannel, _Inout_ OVS_UPCALL_SOURCE_QUEUE* pSource,
+    _Out_ OVS_BUFFER* pBuffer)
+{
+    OVS_BUFFER_ENTRY* pBufferEntry = NULL;
+    LIST_ENTRY* pListEntry = NULL;
 
-        pBufferEntry = CONTAINING_RECORD(pListEntry, OVS_BUFFER_ENTRY, listEntry);
-        *pBuffer = pBufferEntry->buffer;
+    OVS_CHECK(pSource->count > 0);
+    OVS_CHECK(!IsListEmpty(&pSource->bufferQueue));
 
-        KFree(pBufferEntry);
-        pQBufferEntry->count--;
+    pListEntry = RemoveHeadList(&pSource->bufferQueue);
+    pBufferEntry = CONTAINING_RECORD(pListEntry, OVS_BUFFER_ENTRY, listEntry);
+    *pBuffer = pBufferEntry->buffer;
+
+    KFree(pBufferEntry);
+
+    --pSource->count;
+    --pChannel->count;
+
+    if (!pSource->count)
+    {
+        --pChannel->countActiveSources;
     }
-    else
+}
+
+//the queues are read in turns: each read takes the oldest upcall of the next queue that has any
+static OVS_UPCALL_SOURCE_QUEUE* _UpcallChannel_NextSource_Unsafe(_In_ const OVS_QUEUED_BUFFER_ENTRY* pChannel)
+{
+    OVS_UPCALL_SOURCE_QUEUE* pSource = NULL;
+    const LIST_ENTRY* pListEntry = NULL;
+
+    OVS_CHECK(pChannel->count > 0);
+
+    pListEntry = (pChannel->pNextSource ? &pChannel->pNextSource->listEntry : pChannel->sourceQueues.Flink);
+
+    //count > 0: some queue has upcalls
+    for (;;)
+    {
+        if (pListEntry != &pChannel->sourceQueues)
+        {
+            pSource = CONTAINING_RECORD(pListEntry, OVS_UPCALL_SOURCE_QUEUE, listEntry);
+            if (pSource->count)
+            {
+                return pSource;
+            }
+        }
+
+        pListEntry = pListEntry->Flink;
+    }
+}
+
+static VOID _UpcallChannel_AdvanceFrom_Unsafe(_Inout_ OVS_QUEUED_BUFFER_ENTRY* pChannel, _In_ const OVS_UPCALL_SOURCE_QUEUE* pSource)
+{
+    LIST_ENTRY* pListEntry = pSource->listEntry.Flink;
+
+    if (pListEntry == &pChannel->sourceQueues)
+    {
+        pListEntry = pListEntry->Flink;
+    }
+
+    pChannel->pNextSource = CONTAINING_RECORD(pListEntry, OVS_UPCALL_SOURCE_QUEUE, listEntry);
+}
+
+static OVS_ERROR _UpcallChannel_Pop_Unsafe(_Inout_ OVS_QUEUED_BUFFER_ENTRY* pChannel, _Out_ OVS_BUFFER* pBuffer)
+{
+    OVS_UPCALL_SOURCE_QUEUE* pSource = NULL;
+
+    if (!pChannel->count)
     {
         return OVS_ERROR_AGAIN;
     }
 
+    pSource = _UpcallChannel_NextSource_Unsafe(pChannel);
+
+    _UpcallChannel_PopFromSource_Unsafe(pChannel, pSource, pBuffer);
+    _UpcallChannel_AdvanceFrom_Unsafe(pChannel, pSource);
+
     return OVS_ERROR_NOERROR;
 }
 
+//moves the queued upcalls to the ring, in the order they would be read, until the ring is full. The lock of the channel is held.
+static VOID _UpcallChannel_PumpToRing_Unsafe(_Inout_ OVS_QUEUED_BUFFER_ENTRY* pChannel)
+{
+    BOOLEAN written = FALSE;
+
+    OVS_CHECK(pChannel->pRing);
+
+    while (pChannel->count)
+    {
+        OVS_UPCALL_SOURCE_QUEUE* pSource = _UpcallChannel_NextSource_Unsafe(pChannel);
+        OVS_BUFFER_ENTRY* pBufferEntry = CONTAINING_RECORD(pSource->bufferQueue.Flink, OVS_BUFFER_ENTRY, listEntry);
+        OVS_BUFFER buffer = { 0 };
+
+        if (!IsBufferEmpty(&pBufferEntry->buffer))
+        {
+            if (!UpcallRing_Write(pChannel->pRing, (BYTE*)pBufferEntry->buffer.p + pBufferEntry->buffer.offset,
+                pBufferEntry->buffer.size - pBufferEntry->buffer.offset))
+            {
+                break;
+            }
+
+            written = TRUE;
+        }
+
+        _UpcallChannel_PopFromSource_Unsafe(pChannel, pSource, &buffer);
+        _UpcallChannel_AdvanceFrom_Unsafe(pChannel, pSource);
+
+        FreeBufferData(&buffer);
+    }
+
+    if (written)
+    {
+        UpcallRing_Notify(pChannel->pRing);
+    }
+}
+
+//on failure, the caller still owns the buffer data
+static OVS_ERROR _UpcallChannel_Push(_Inout_ OVS_QUEUED_BUFFER_ENTRY* pChannel, _In_ const OVS_BUFFER* pBuffer, UINT16 ofSourcePort)
+{
+    OVS_UPCALL_SOURCE_QUEUE* pSource = NULL;
+    OVS_BUFFER_ENTRY* pBufferEntry = NULL;
+    OVS_ERROR error = OVS_ERROR_NOERROR;
+    UINT fairShare = 0;
+
+    pBufferEntry = KAlloc(sizeof(OVS_BUFFER_ENTRY));
+    if (!pBufferEntry)
+    {
+        return OVS_ERROR_NOMEM;
+    }
+
+    pBufferEntry->buffer = *pBuffer;
+
+    NdisAcquireSpinLock(&pChannel->lock);
+
+    pSource = _UpcallChannel_GetSource_Unsafe(pChannel, ofSourcePort);
+    if (!pSource)
+    {
+        error = OVS_ERROR_NOMEM;
+        goto Cleanup;
+    }
+
+    //the room userspace made in the ring is taken first: the share of the port is what remains queued
+    if (pChannel->pRing)
+    {
+        _UpcallChannel_PumpToRing_Unsafe(pChannel);
+    }
+
+    //the port counts as active, with this upcall
+    fairShare = OVS_MAX_QUEUED_BUFFERS / (pChannel->countActiveSources + (pSource->count ? 0 : 1));
+    fairShare = max(fairShare, 1);
+
+    if (pSource->count >= fairShare)
+    {
+        ++pSource->countDropped;
+
+        error = OVS_ERROR_NOSPC;
+        goto Cleanup;
+    }
+
+    //the channel is full, but the port is below its share: the port that has the most upcalls queued (i.e. above its share) loses its oldest
+    if (pChannel->count >= OVS_MAX_QUEUED_BUFFERS)
+    {
+        OVS_UPCALL_SOURCE_QUEUE* pLongest = _UpcallChannel_FindLongest_Unsafe(pChannel);
+        OVS_BUFFER droppedBuffer = { 0 };
+
+        OVS_CHECK(pLongest && pLongest != pSource && pLongest->count > pSource->count);
+
+        _UpcallChannel_PopFromSource_Unsafe(pChannel, pLongest, &droppedBuffer);
+        FreeBufferData(&droppedBuffer);
+
+        ++pLongest->countDropped;
+    }
+
+    if (!pSource->count)
+    {
+        ++pChannel->countActiveSources;
+    }
+
+    InsertTailList(&pSource->bufferQueue, &pBufferEntry->listEntry);
+    pBufferEntry = NULL;
+
+    ++pSource->count;
+    ++pSource->countQueued;
+    ++pChannel->count;
+
+    if (pChannel->pRing)
+    {
+        _UpcallChannel_PumpToRing_Unsafe(pChannel);
+    }
+
+Cleanup:
+    NdisReleaseSpinLock(&pChannel->lock);
+
+    KFree(pBufferEntry);
+
+    return error;
+}
+
+static BOOLEAN _UpcallChannel_Create_Unsafe(UINT portId)
+{
+    OVS_QUEUED_BUFFER_ENTRY* pChannel = _FindQueuedBufferByPortId_Unsafe(portId);
+
+    //several files may share a pid
+    if (pChannel)
+    {
+        return TRUE;
+    }
+
+    pChannel = KZAlloc(sizeof(OVS_QUEUED_BUFFER_ENTRY));
+    if (!pChannel)
+    {
+        return FALSE;
+    }
+
+    pChannel->portId = portId;
+    NdisAllocateSpinLock(&pChannel->lock);
+    InitializeListHead(&pChannel->sourceQueues);
+
+    InsertTailList(&g_queuedBufferList, &pChannel->listEntry);
+
+    return TRUE;
+}
+
+//drops the upcalls still queued
+static VOID _UpcallChannel_Destroy_Unsafe(_In_ OVS_QUEUED_BUFFER_ENTRY* pChannel)
+{
+    //the file that mapped the ring detached it, at cleanup
+    OVS_CHECK(!pChannel->pRing);
+
+    RemoveEntryList(&pChannel->listEntry);
+
+    while (!IsListEmpty(&pChannel->sourceQueues))
+    {
+        LIST_ENTRY* pListEntry = RemoveHeadList(&pChannel->sourceQueues);
+        OVS_UPCALL_SOURCE_QUEUE* pSource = CONTAINING_RECORD(pListEntry, OVS_UPCALL_SOURCE_QUEUE, listEntry);
+
+        while (!IsListEmpty(&pSource->bufferQueue))
+        {
+            OVS_BUFFER_ENTRY* pBufferEntry = CONTAINING_RECORD(RemoveHeadList(&pSource->bufferQueue), OVS_BUFFER_ENTRY, listEntry);
+
+            FreeBufferData(&pBufferEntry->buffer);
+            KFree(pBufferEntry);
+        }
+
+        KFree(pSource);
+    }
+
+    NdisFreeSpinLock(&pChannel->lock);
+    KFree(pChannel);
+}
+
 /****************************************/
 
 VOID BufferCtl_Init(NDIS_HANDLE ndishandle)
@@ -597,6 +900,13 @@ VOID BufferCtl_Uninit()
         KFree(pEntry);
     }
 
+    while (!IsListEmpty(&g_queuedBufferList))
+    {
+        OVS_QUEUED_BUFFER_ENTRY* pQBufferEntry = CONTAINING_RECORD(g_queuedBufferList.Flink, OVS_QUEUED_BUFFER_ENTRY, listEntry);
+
+        _UpcallChannel_Destroy_Unsafe(pQBufferEntry);
+    }
+
     OVS_CHECK(IsListEmpty(&g_unicastBufferList));
     OVS_CHECK(IsListEmpty(&g_multicastFileObjects));
 
@@ -658,7 +968,8 @@ OVS_BUFFER* BufferCtl_FindBuffer_Unsafe(_In_ const FILE_OBJECT* pFileObject)
     }
 }
 
-BOOLEAN BufferCtl_AddDeviceFile_Unsafe(_In_ const FILE_OBJECT* pFileObject)
+_Use_decl_annotations_
+BOOLEAN BufferCtl_AddDeviceFile_Unsafe(const FILE_OBJECT* pFileObject, HANDLE processId)
 {
     OVS_DEVICE_FILE_INFO_ENTRY* pEntry = _FindDeviceFileInfo_Unsafe(pFileObject);
 
@@ -679,6 +990,7 @@ BOOLEAN BufferCtl_AddDeviceFile_Unsafe(_In_ const FILE_OBJECT* pFileObject)
 
     RtlZeroMemory(pEntry, sizeof(OVS_DEVICE_FILE_INFO_ENTRY));
     pEntry->info.pFileObject = pFileObject;
+    pEntry->info.processId = processId;
 
     InsertTailList(&g_deviceFileInfoList, &pEntry->listEntry);
 
@@ -714,6 +1026,18 @@ BOOLEAN BufferCtl_RemoveDeviceFile_Unsafe(const FILE_OBJECT* pFileObject)
     DbgPrintFile("device will be removed\n", pEntry);
 
     RemoveEntryList(&pEntry->listEntry);
+
+    //the last file of the pid takes its upcall channel along
+    if (pEntry->info.portId && !_FindDeviceFileInfoByPortId_Unsafe(pEntry->info.portId))
+    {
+        OVS_QUEUED_BUFFER_ENTRY* pQBufferEntry = _FindQueuedBufferByPortId_Unsafe(pEntry->info.portId);
+
+        if (pQBufferEntry)
+        {
+            _UpcallChannel_Destroy_Unsafe(pQBufferEntry);
+        }
+    }
+
     KFree(pEntry);
 
     return okUcast && okMcast;
@@ -774,12 +1098,13 @@ OVS_ERROR BufferCtl_Read_Unsafe(const FILE_OBJECT* pFileObject, VOID* pOutBuf, U
                 return OVS_ERROR_AGAIN;
             }
 
+            //the device lock is held exclusively: no upcall is being queued
             do
             {
-                error = _PopBufferFromQueue_Unsafe(pQBufferEntry, &buffer);
+                error = _UpcallChannel_Pop_Unsafe(pQBufferEntry, &buffer);
                 if (error != OVS_ERROR_NOERROR)
                 {
-                    OVS_CHECK(__UNEXPECTED__);
+                    OVS_CHECK(error == OVS_ERROR_AGAIN);
                     return error;
                 }
 
@@ -807,42 +1132,7 @@ OVS_ERROR BufferCtl_Write_Unsafe(const FILE_OBJECT* pFileObject, const OVS_BUFFE
     //this case == send packet to userspace.
     if (!pFileObject)
     {
-        OVS_QUEUED_BUFFER_ENTRY* pQBufferEntry = NULL;
-
-        pFileEntry = _FindDeviceFileInfoByPortId_Unsafe(portId);
-        if (!pFileEntry)
-        {
-            return OVS_ERROR_NOENT;
-        }
-
-        pQBufferEntry = _FindQueuedBuffer_Unsafe(&pFileEntry->info);
-        if (!pQBufferEntry)
-        {
-            pQBufferEntry = KAlloc(sizeof(OVS_QUEUED_BUFFER_ENTRY));
-            RtlZeroMemory(pQBufferEntry, sizeof(OVS_QUEUED_BUFFER_ENTRY));
-
-            InitializeListHead(&pQBufferEntry->bufferQueue);
-
-            pQBufferEntry->portId = portId;
-            error = _PushBufferToQueue_Unsafe(pQBufferEntry, pBuffer);
-            if (error != OVS_ERROR_NOERROR)
-            {
-                KFree(pQBufferEntry);
-                return error;
-            }
-
-            InsertTailList(&g_queuedBufferList, &pQBufferEntry->listEntry);
-        }
-        else
-        {
-            error = _PushBufferToQueue_Unsafe(pQBufferEntry, pBuffer);
-            if (error != OVS_ERROR_NOERROR)
-            {
-                return error;
-            }
-        }
-
-        return OVS_ERROR_NOERROR;
+        return BufferCtl_WriteUpcall_Unsafe(pBuffer, portId, OVS_INVALID_PORT_NUMBER);
     }
 
     pFileEntry = _FindDeviceFileInfo_Unsafe(pFileObject);
@@ -929,6 +1219,258 @@ OVS_ERROR BufferCtl_Write_Unsafe(const FILE_OBJECT* pFileObject, const OVS_BUFFE
     return OVS_ERROR_INVAL;
 }
 
+_Use_decl_annotations_
+OVS_ERROR BufferCtl_WriteUpcall_Unsafe(const OVS_BUFFER* pBuffer, UINT portId, UINT16 ofSourcePort)
+{
+    OVS_QUEUED_BUFFER_ENTRY* pQBufferEntry = NULL;
+
+    if (portId == 0)
+    {
+        return OVS_ERROR_CONNREFUSED;
+    }
+
+    //the channel exists as long as a file has the port id as pid
+    pQBufferEntry = _FindQueuedBufferByPortId_Unsafe(portId);
+    if (!pQBufferEntry)
+    {
+        return OVS_ERROR_NOENT;
+    }
+
+    return _UpcallChannel_Push(pQBufferEntry, pBuffer, ofSourcePort);
+}
+
+_Use_decl_annotations_
+OVS_ERROR BufferCtl_WriteUpcallToRing_Unsafe(OVS_NLMSGHDR* pMsgs, int countMsgs, UINT size, UINT portId, UINT16 ofSourcePort)
+{
+    OVS_QUEUED_BUFFER_ENTRY* pChannel = NULL;
+    OVS_UPCALL_SOURCE_QUEUE* pSource = NULL;
+    OVS_ERROR error = OVS_ERROR_NOERROR;
+    VOID* pDest = NULL;
+    BOOLEAN ok = TRUE;
+
+    if (portId == 0)
+    {
+        return OVS_ERROR_CONNREFUSED;
+    }
+
+    pChannel = _FindQueuedBufferByPortId_Unsafe(portId);
+    if (!pChannel)
+    {
+        return OVS_ERROR_NOENT;
+    }
+
+    NdisAcquireSpinLock(&pChannel->lock);
+
+    //the upcalls queued go first
+    if (!pChannel->pRing || pChannel->count)
+    {
+        error = OVS_ERROR_AGAIN;
+        goto Cleanup;
+    }
+
+    pSource = _UpcallChannel_GetSource_Unsafe(pChannel, ofSourcePort);
+    if (!pSource)
+    {
+        error = OVS_ERROR_NOMEM;
+        goto Cleanup;
+    }
+
+    if (!UpcallRing_Reserve(pChannel->pRing, size, &pDest))
+    {
+        error = OVS_ERROR_AGAIN;
+        goto Cleanup;
+    }
+
+    ok = WriteMsgsAt(pMsgs, countMsgs, pDest, size);
+    UpcallRing_Commit(pChannel->pRing, ok);
+
+    if (!ok)
+    {
+        error = OVS_ERROR_INVAL;
+        goto Cleanup;
+    }
+
+    ++pSource->countQueued;
+
+    UpcallRing_Notify(pChannel->pRing);
+
+Cleanup:
+    NdisReleaseSpinLock(&pChannel->lock);
+
+    return error;
+}
+
+_Use_decl_annotations_
+OVS_ERROR BufferCtl_AttachUpcallRing(const FILE_OBJECT* pFileObject, OVS_UPCALL_RING* pRing, HANDLE processId)
+{
+    LOCK_STATE_EX lockState = { 0 };
+    OVS_DEVICE_FILE_INFO_ENTRY* pFileEntry = NULL;
+    OVS_QUEUED_BUFFER_ENTRY* pChannel = NULL;
+    OVS_ERROR error = OVS_ERROR_NOERROR;
+
+    BufferCtl_LockWrite(&lockState);
+
+    pFileEntry = _FindDeviceFileInfo_Unsafe(pFileObject);
+    if (!pFileEntry || !pFileEntry->info.portId)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " the file has not set its pid\n");
+        error = OVS_ERROR_NOENT;
+        goto Cleanup;
+    }
+
+    //a handle duplicated in, or inherited by, another process: the ring would outlive neither the file nor the process that maps it
+    if (pFileEntry->info.processId != processId)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " the file was opened by another process\n");
+        error = OVS_ERROR_PERM;
+        goto Cleanup;
+    }
+
+    pChannel = _FindQueuedBufferByPortId_Unsafe(pFileEntry->info.portId);
+    OVS_CHECK(pChannel);
+
+    if (!pChannel)
+    {
+        error = OVS_ERROR_NOENT;
+        goto Cleanup;
+    }
+
+    if (pChannel->pRing)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " the pid %u already has a ring\n", pChannel->portId);
+        error = OVS_ERROR_EXIST;
+        goto Cleanup;
+    }
+
+    //the device lock is held exclusively: no upcall is being written
+    pChannel->pRing = pRing;
+    pChannel->pRingFileObject = pFileObject;
+    pChannel->ringProcessId = processId;
+
+    _UpcallChannel_PumpToRing_Unsafe(pChannel);
+
+Cleanup:
+    BufferCtl_Unlock(&lockState);
+
+    return error;
+}
+
+_Use_decl_annotations_
+OVS_UPCALL_RING* BufferCtl_DetachUpcallRing(const FILE_OBJECT* pFileObject)
+{
+    LOCK_STATE_EX lockState = { 0 };
+    OVS_QUEUED_BUFFER_ENTRY* pChannel = NULL;
+    OVS_UPCALL_RING* pRing = NULL;
+
+    BufferCtl_LockWrite(&lockState);
+
+    OVS_LIST_FOR_EACH(OVS_QUEUED_BUFFER_ENTRY, pChannel, &g_queuedBufferList)
+    {
+        if (pChannel->pRingFileObject == pFileObject)
+        {
+            pRing = pChannel->pRing;
+
+            pChannel->pRing = NULL;
+            pChannel->pRingFileObject = NULL;
+            pChannel->ringProcessId = NULL;
+            break;
+        }
+    }
+
+    BufferCtl_Unlock(&lockState);
+
+    return pRing;
+}
+
+_Use_decl_annotations_
+OVS_UPCALL_RING* BufferCtl_DetachUpcallRingOfProcess(HANDLE processId)
+{
+    LOCK_STATE_EX lockState = { 0 };
+    OVS_QUEUED_BUFFER_ENTRY* pChannel = NULL;
+    OVS_UPCALL_RING* pRing = NULL;
+
+    BufferCtl_LockWrite(&lockState);
+
+    OVS_LIST_FOR_EACH(OVS_QUEUED_BUFFER_ENTRY, pChannel, &g_queuedBufferList)
+    {
+        if (pChannel->pRing && pChannel->ringProcessId == processId)
+        {
+            pRing = pChannel->pRing;
+
+            pChannel->pRing = NULL;
+            pChannel->pRingFileObject = NULL;
+            pChannel->ringProcessId = NULL;
+            break;
+        }
+    }
+
+    BufferCtl_Unlock(&lockState);
+
+    return pRing;
+}
+
+_Use_decl_annotations_
+OVS_ERROR BufferCtl_PumpUpcallRing(const FILE_OBJECT* pFileObject, ULONG* pCountQueued)
+{
+    LOCK_STATE_EX lockState = { 0 };
+    OVS_QUEUED_BUFFER_ENTRY* pChannel = NULL;
+    OVS_ERROR error = OVS_ERROR_NOENT;
+
+    *pCountQueued = 0;
+
+    BufferCtl_LockRead(&lockState);
+
+    OVS_LIST_FOR_EACH(OVS_QUEUED_BUFFER_ENTRY, pChannel, &g_queuedBufferList)
+    {
+        if (pChannel->pRingFileObject == pFileObject)
+        {
+            NdisDprAcquireSpinLock(&pChannel->lock);
+
+            _UpcallChannel_PumpToRing_Unsafe(pChannel);
+            *pCountQueued = pChannel->count;
+
+            NdisDprReleaseSpinLock(&pChannel->lock);
+
+            error = OVS_ERROR_NOERROR;
+            break;
+        }
+    }
+
+    BufferCtl_Unlock(&lockState);
+
+    return error;
+}
+
+_Use_decl_annotations_
+VOID BufferCtl_GetUpcallStats(UINT16 ofSourcePort, OVS_UPCALL_QUEUE_STATS* pStats)
+{
+    LOCK_STATE_EX lockState = { 0 };
+    OVS_QUEUED_BUFFER_ENTRY* pQBufferEntry = NULL;
+
+    RtlZeroMemory(pStats, sizeof(OVS_UPCALL_QUEUE_STATS));
+
+    BufferCtl_LockRead(&lockState);
+
+    OVS_LIST_FOR_EACH(OVS_QUEUED_BUFFER_ENTRY, pQBufferEntry, &g_queuedBufferList)
+    {
+        OVS_UPCALL_SOURCE_QUEUE* pSource = NULL;
+
+        NdisDprAcquireSpinLock(&pQBufferEntry->lock);
+
+        pSource = _UpcallChannel_FindSource_Unsafe(pQBufferEntry, ofSourcePort);
+        if (pSource)
+        {
+            pStats->countPending += pSource->count;
+            pStats->countQueued += pSource->countQueued;
+            pStats->countDropped += pSource->countDropped;
+        }
+
+        NdisDprReleaseSpinLock(&pQBufferEntry->lock);
+    }
+
+    BufferCtl_Unlock(&lockState);
+}
+
 _Use_decl_annotations_
 VOID McGroup_Change(OVS_MESSAGE_MULTICAST* pMulticastMsg, const FILE_OBJECT* pFileObject)
 {
@@ -965,6 +1507,15 @@ BOOLEAN BufferCtl_SetPidForFile(UINT32 pid, _In_ const FILE_OBJECT* pFileObject)
     }
 
     OVS_CHECK(pFileEntry->info.portId == 0);
+
+    //the upcalls for the pid can be queued from now on
+    if (!_UpcallChannel_Create_Unsafe(pid))
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " could not create the upcall channel of pid %u\n", pid);
+        ok = FALSE;
+        goto Cleanup;
+    }
+
     pFileEntry->info.portId = pid;
 
 Cleanup:
@@ -21,6 +21,8 @@ limitations under the License.
 
 typedef struct _OVS_BUFFER OVS_BUFFER;
 typedef struct _OVS_MESSAGE_MULTICAST OVS_MESSAGE_MULTICAST;
+typedef struct _OVS_NLMSGHDR OVS_NLMSGHDR;
+typedef struct _OVS_UPCALL_RING OVS_UPCALL_RING;
 
 extern NDIS_RW_LOCK_EX* g_pOvsDeviceRWLock;
 
@@ -30,9 +32,46 @@ BOOLEAN BufferCtl_WriteMulticast(_In_ const FILE_OBJECT* pFileObject, UINT portI
 OVS_ERROR BufferCtl_Read_Unsafe(_In_ const FILE_OBJECT* pFileObject, _Inout_ VOID* pOutBuf, ULONG toRead, _Inout_opt_ ULONG* pBytesRead);
 OVS_ERROR BufferCtl_Write_Unsafe(_In_ const FILE_OBJECT* pFileObject, _In_ const OVS_BUFFER* pBuffer, UINT portId, UINT groupId);
 
+/* UPCALL CHANNELS: each upcall port id (pid) has a channel, with a queue for each in port, read in turns. An in port may hold at most
+its fair share of the channel, so a port that misses a lot does not starve the upcalls of the other ports.
+A channel may also have a ring, mapped by userspace (see UpcallRing.h): the upcalls are written to the ring while it has room and nothing
+is queued; otherwise they are queued, and moved to the ring in turns. */
+
+typedef struct _OVS_UPCALL_QUEUE_STATS
+{
+    //the upcalls of the in port: waiting to be read (queued, not in a ring); queued or written to a ring; dropped, i.e. over the share of the port
+    UINT64      countPending;
+    UINT64      countQueued;
+    UINT64      countDropped;
+}OVS_UPCALL_QUEUE_STATS, *POVS_UPCALL_QUEUE_STATS;
+
+//queues pBuffer on the channel of portId, for the in port ofSourcePort. Needs the device lock only shared.
+//on success, the channel owns the buffer data; on failure, the caller does.
+OVS_ERROR BufferCtl_WriteUpcall_Unsafe(_In_ const OVS_BUFFER* pBuffer, UINT portId, UINT16 ofSourcePort);
+
+//writes the msgs (size bytes, see PrepareMsgsForBuffer) straight to the ring of the channel of portId. Needs the device lock only shared.
+//AGAIN: the channel has no ring, it has upcalls queued, or the ring is full: the upcall is to be queued, with BufferCtl_WriteUpcall_Unsafe
+OVS_ERROR BufferCtl_WriteUpcallToRing_Unsafe(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, UINT size, UINT portId, UINT16 ofSourcePort);
+
+//the file must have set its pid, and have been opened by processId, the process that maps the ring; a pid has at most one ring.
+//On success, the channel uses the ring until it is detached.
+OVS_ERROR BufferCtl_AttachUpcallRing(_In_ const FILE_OBJECT* pFileObject, _In_ OVS_UPCALL_RING* pRing, HANDLE processId);
+//returns the ring the file attached, if any: the caller destroys it
+_Ret_maybenull_
+OVS_UPCALL_RING* BufferCtl_DetachUpcallRing(_In_ const FILE_OBJECT* pFileObject);
+//returns one of the rings mapped in the process, if any: the caller destroys it, and calls again until none is left
+_Ret_maybenull_
+OVS_UPCALL_RING* BufferCtl_DetachUpcallRingOfProcess(HANDLE processId);
+//moves the upcalls queued to the ring of the file, as long as they fit; pCountQueued: the upcalls that remain queued
+OVS_ERROR BufferCtl_PumpUpcallRing(_In_ const FILE_OBJECT* pFileObject, _Out_ ULONG* pCountQueued);
+
+//the upcall counters of an in port, on all the channels. The drops are reported in the dropped on receive of the port's stats.
+VOID BufferCtl_GetUpcallStats(UINT16 ofSourcePort, _Out_ OVS_UPCALL_QUEUE_STATS* pStats);
+
 OVS_BUFFER* BufferCtl_FindBuffer_Unsafe(_In_ const FILE_OBJECT* pFileObject);
 
-BOOLEAN BufferCtl_AddDeviceFile_Unsafe(_In_ const FILE_OBJECT* pFileObject);
+//processId: the process that opens the file
+BOOLEAN BufferCtl_AddDeviceFile_Unsafe(_In_ const FILE_OBJECT* pFileObject, HANDLE processId);
 BOOLEAN BufferCtl_RemoveDeviceFile_Unsafe(_In_ const FILE_OBJECT* pFileObject);
 
 VOID BufferCtl_Init(NDIS_HANDLE ndishandle);
@@ -521,18 +521,12 @@ static ULONG _ComputeGroupAlignedSize_Recursive(OVS_ARGUMENT_GROUP* pGroup)
     return alignedSize;
 }
 
-BOOLEAN WriteMsgsToBuffer(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, OVS_BUFFER* pBuffer)
+UINT PrepareMsgsForBuffer(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs)
 {
     UINT bufSize = 0, groupSize = 0, totalBufSize = 0;
-    BYTE* pos = NULL;
-    UINT offset = 0;
-    OVS_ARGUMENT* pAttributes = NULL;
     OVS_NLMSGHDR* pNlMsg = NULL;
 
     OVS_CHECK(countMsgs);
-    OVS_CHECK(pBuffer);
-    OVS_CHECK(pBuffer->p == NULL && pBuffer->size == 0 && pBuffer->offset == 0);
-
     OVS_CHECK(pMsgs);
 
 #if DBG
@@ -594,12 +588,17 @@ BOOLEAN WriteMsgsToBuffer(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, OVS_BUFFER* p
         pNlMsg = AdvanceMessage(pNlMsg);
     }
 
-    if (!AllocateBuffer(pBuffer, totalBufSize))
-    {
-        return FALSE;
-    }
+    return totalBufSize;
+}
 
-    offset = 0;
+BOOLEAN WriteMsgsAt(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, _Out_writes_bytes_(size) BYTE* pDest, UINT size)
+{
+    BYTE* pos = NULL;
+    UINT offset = 0;
+    OVS_ARGUMENT* pAttributes = NULL;
+    OVS_NLMSGHDR* pNlMsg = NULL;
+
+    OVS_CHECK(pDest);
 
     pNlMsg = pMsgs;
     for (int i = 0; i < countMsgs; ++i)
@@ -619,7 +618,7 @@ BOOLEAN WriteMsgsToBuffer(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, OVS_BUFFER* p
             pGroup = ((OVS_MESSAGE*)pNlMsg)->pArgGroup;
         }
 
-        pos = (BYTE*)pBuffer->p + offset;
+        pos = pDest + offset;
         RtlCopyMemory(pos, pNlMsg, msgHeaderSize);
 
         pos += msgHeaderSize;
@@ -636,7 +635,6 @@ BOOLEAN WriteMsgsToBuffer(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, OVS_BUFFER* p
 
             if (!pAttributes)
             {
-                FreeBufferData(pBuffer);
                 return FALSE;
             }
 
@@ -647,14 +645,39 @@ BOOLEAN WriteMsgsToBuffer(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, OVS_BUFFER* p
 
             _DestroyAttributes(pAttributes, pMsg->pArgGroup->count);
 
-            pMsg = (OVS_MESSAGE*)((BYTE*)pBuffer->p + msgOffset);
+            pMsg = (OVS_MESSAGE*)(pDest + msgOffset);
             pMsg->length = offset - msgOffset;
         }
 
-        pBuffer->size = offset;
         pNlMsg = AdvanceMessage(pNlMsg);
     }
 
+    OVS_CHECK(offset == size);
+    UNREFERENCED_PARAMETER(size);
+
+    return TRUE;
+}
+
+BOOLEAN WriteMsgsToBuffer(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, OVS_BUFFER* pBuffer)
+{
+    UINT totalBufSize = 0;
+
+    OVS_CHECK(pBuffer);
+    OVS_CHECK(pBuffer->p == NULL && pBuffer->size == 0 && pBuffer->offset == 0);
+
+    totalBufSize = PrepareMsgsForBuffer(pMsgs, countMsgs);
+
+    if (!AllocateBuffer(pBuffer, totalBufSize))
+    {
+        return FALSE;
+    }
+
+    if (!WriteMsgsAt(pMsgs, countMsgs, (BYTE*)pBuffer->p, totalBufSize))
+    {
+        FreeBufferData(pBuffer);
+        return FALSE;
+    }
+
     return TRUE;
 }
 
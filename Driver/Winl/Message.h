@@ -199,6 +199,12 @@ BOOLEAN ParseReceivedMessage(VOID* buffer, UINT16 length, _Out_ OVS_NLMSGHDR** p
 //pBuffer: must be non-null. pBuffer->buffer must be NULL
 BOOLEAN WriteMsgsToBuffer(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, OVS_BUFFER* pBuffer);
 
+//the two steps of WriteMsgsToBuffer, for writing to memory the caller provides (e.g. an upcall ring).
+//returns the size the msgs take. It turns the packet commands into userspace commands: it must be called once per msgs.
+UINT PrepareMsgsForBuffer(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs);
+//pDest: size bytes, as returned by PrepareMsgsForBuffer
+BOOLEAN WriteMsgsAt(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, _Out_writes_bytes_(size) BYTE* pDest, UINT size);
+
 static __inline OVS_NLMSGHDR* AdvanceMessage(_In_ const OVS_NLMSGHDR* pMsg)
 {
     OVS_NLMSGHDR* pNextMsg = NULL;
@@ -0,0 +1,281 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "UpcallRing.h"
+#include "OvsCore.h"
+
+typedef struct _OVS_UPCALL_RING
+{
+    //the pages of the ring, mapped in the kernel and in the process that mapped it
+    MDL*                        pMdl;
+    OVS_UPCALL_RING_HEADER*     pHeader;
+    BYTE*                       pData;
+    VOID*                       pUserAddress;
+    PEPROCESS                   pProcess;
+
+    ULONG                       size;
+    ULONG                       dataSize;
+
+    //the kernel's own copy of producer: userspace can write to the shared header, so it is never read back from there
+    ULONG                       producer;
+    //the size of the record reserved, not yet committed
+    ULONG                       reservedSize;
+    OVS_UPCALL_RING_RECORD*     pReservedRecord;
+
+    KEVENT*                     pDoorbellEvent;
+}OVS_UPCALL_RING, *POVS_UPCALL_RING;
+
+_Use_decl_annotations_
+NTSTATUS UpcallRing_Create(ULONG dataSize, HANDLE hDoorbellEvent, OVS_UPCALL_RING** ppRing, OVS_UPCALL_RING_MAP_REPLY* pReply)
+{
+    OVS_UPCALL_RING* pRing = NULL;
+    PHYSICAL_ADDRESS lowAddress = { 0 }, highAddress = { 0 }, skipBytes = { 0 };
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    *ppRing = NULL;
+    RtlZeroMemory(pReply, sizeof(OVS_UPCALL_RING_MAP_REPLY));
+
+    if (dataSize < OVS_UPCALL_RING_MIN_DATA_SIZE || dataSize > OVS_UPCALL_RING_MAX_DATA_SIZE || (dataSize & (dataSize - 1)))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    pRing = KZAlloc(sizeof(OVS_UPCALL_RING));
+    if (!pRing)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    pRing->dataSize = dataSize;
+    pRing->size = (ULONG)ROUND_TO_PAGES(sizeof(OVS_UPCALL_RING_HEADER) + dataSize);
+
+    status = ObReferenceObjectByHandle(hDoorbellEvent, EVENT_MODIFY_STATE, *ExEventObjectType, UserMode, (VOID**)&pRing->pDoorbellEvent, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " the doorbell event is invalid: 0x%x\n", status);
+        pRing->pDoorbellEvent = NULL;
+        goto Cleanup;
+    }
+
+    //whole pages, not pool: nothing else of the kernel is visible to the process
+    highAddress.QuadPart = MAXLONG64;
+    pRing->pMdl = MmAllocatePagesForMdlEx(lowAddress, highAddress, skipBytes, pRing->size, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+    if (!pRing->pMdl)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    pRing->pHeader = MmGetSystemAddressForMdlSafe(pRing->pMdl, NormalPagePriority | MdlMappingNoExecute);
+    if (!pRing->pHeader)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    RtlZeroMemory(pRing->pHeader, pRing->size);
+    pRing->pHeader->dataSize = dataSize;
+    pRing->pData = (BYTE*)(pRing->pHeader + 1);
+
+    __try
+    {
+        pRing->pUserAddress = MmMapLockedPagesSpecifyCache(pRing->pMdl, UserMode, MmCached, NULL, FALSE, NormalPagePriority);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        pRing->pUserAddress = NULL;
+    }
+
+    if (!pRing->pUserAddress)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " could not map the ring in the process\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    //the ring is unmapped in the context of this process, whichever process closes the file
+    pRing->pProcess = PsGetCurrentProcess();
+    ObReferenceObject(pRing->pProcess);
+
+    pReply->address = (UINT64)(ULONG_PTR)pRing->pUserAddress;
+    pReply->size = pRing->size;
+    pReply->dataSize = dataSize;
+
+    *ppRing = pRing;
+    pRing = NULL;
+
+Cleanup:
+    if (pRing)
+    {
+        UpcallRing_Destroy(pRing);
+    }
+
+    return status;
+}
+
+_Use_decl_annotations_
+VOID UpcallRing_Destroy(OVS_UPCALL_RING* pRing)
+{
+    PAGED_CODE();
+
+    if (pRing->pUserAddress)
+    {
+        KAPC_STATE apcState = { 0 };
+        BOOLEAN attached = FALSE;
+
+        //the process has not exited: its exit notification would have destroyed the ring, and it waits while the ring is destroyed here
+        if (pRing->pProcess != PsGetCurrentProcess())
+        {
+            KeStackAttachProcess(pRing->pProcess, &apcState);
+            attached = TRUE;
+        }
+
+        MmUnmapLockedPages(pRing->pUserAddress, pRing->pMdl);
+
+        if (attached)
+        {
+            KeUnstackDetachProcess(&apcState);
+        }
+    }
+
+    if (pRing->pProcess)
+    {
+        ObDereferenceObject(pRing->pProcess);
+    }
+
+    if (pRing->pHeader)
+    {
+        MmUnmapLockedPages(pRing->pHeader, pRing->pMdl);
+    }
+
+    if (pRing->pMdl)
+    {
+        MmFreePagesFromMdl(pRing->pMdl);
+        ExFreePool(pRing->pMdl);
+    }
+
+    if (pRing->pDoorbellEvent)
+    {
+        ObDereferenceObject(pRing->pDoorbellEvent);
+    }
+
+    KFree(pRing);
+}
+
+_Use_decl_annotations_
+BOOLEAN UpcallRing_Reserve(OVS_UPCALL_RING* pRing, ULONG length, VOID** pp)
+{
+    ULONG consumer = 0, used = 0, offset = 0, bytesToEnd = 0, recordSize = 0, neededSize = 0;
+    OVS_UPCALL_RING_RECORD* pRecord = NULL;
+
+    OVS_CHECK(!pRing->pReservedRecord);
+
+    *pp = NULL;
+
+    //the consumer is read before the records it frees are overwritten
+    consumer = pRing->pHeader->consumer;
+    KeMemoryBarrier();
+
+    used = pRing->producer - consumer;
+    //userspace wrote a consumer it could not have: the ring is taken as full, and the upcalls are queued instead
+    if (used > pRing->dataSize)
+    {
+        return FALSE;
+    }
+
+    if (length > pRing->dataSize - sizeof(OVS_UPCALL_RING_RECORD))
+    {
+        return FALSE;
+    }
+
+    recordSize = OVS_UPCALL_RING_RECORD_ALIGN(sizeof(OVS_UPCALL_RING_RECORD) + length);
+    offset = pRing->producer & (pRing->dataSize - 1);
+    bytesToEnd = pRing->dataSize - offset;
+
+    //a record is never split at the end of the data: the end is filled with a pad record, and the record is written at the start
+    neededSize = (recordSize > bytesToEnd ? recordSize + bytesToEnd : recordSize);
+    if (neededSize > pRing->dataSize - used)
+    {
+        return FALSE;
+    }
+
+    if (recordSize > bytesToEnd)
+    {
+        pRecord = (OVS_UPCALL_RING_RECORD*)(pRing->pData + offset);
+        pRecord->length = bytesToEnd - sizeof(OVS_UPCALL_RING_RECORD);
+        pRecord->flags = OVS_UPCALL_RING_RECORD_PAD;
+
+        //published along with the record
+        pRing->producer += bytesToEnd;
+        offset = 0;
+    }
+
+    pRecord = (OVS_UPCALL_RING_RECORD*)(pRing->pData + offset);
+    pRecord->length = length;
+    pRecord->flags = 0;
+
+    pRing->pReservedRecord = pRecord;
+    pRing->reservedSize = recordSize;
+
+    *pp = pRecord + 1;
+
+    return TRUE;
+}
+
+_Use_decl_annotations_
+VOID UpcallRing_Commit(OVS_UPCALL_RING* pRing, BOOLEAN valid)
+{
+    OVS_CHECK(pRing->pReservedRecord);
+
+    if (!valid)
+    {
+        pRing->pReservedRecord->flags = OVS_UPCALL_RING_RECORD_PAD;
+    }
+
+    pRing->producer += pRing->reservedSize;
+    pRing->pReservedRecord = NULL;
+    pRing->reservedSize = 0;
+
+    //a full barrier: the records are visible before the producer is; and the producer is, before 'waiting' is read
+    InterlockedExchange((volatile LONG*)&pRing->pHeader->producer, (LONG)pRing->producer);
+}
+
+_Use_decl_annotations_
+BOOLEAN UpcallRing_Write(OVS_UPCALL_RING* pRing, const VOID* p, ULONG length)
+{
+    VOID* pDest = NULL;
+
+    if (!UpcallRing_Reserve(pRing, length, &pDest))
+    {
+        return FALSE;
+    }
+
+    RtlCopyMemory(pDest, p, length);
+    UpcallRing_Commit(pRing, /*valid*/ TRUE);
+
+    return TRUE;
+}
+
+_Use_decl_annotations_
+VOID UpcallRing_Notify(OVS_UPCALL_RING* pRing)
+{
+    if (InterlockedCompareExchange(&pRing->pHeader->waiting, 0, 1) == 1)
+    {
+        KeSetEvent(pRing->pDoorbellEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
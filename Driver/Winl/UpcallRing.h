@@ -0,0 +1,104 @@
+/*
+Copyright 2014 Cloudbase Solutions Srl
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http ://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "precomp.h"
+
+/* UPCALL RING: a single producer / single consumer ring of upcalls, mapped both in the kernel and in the address space of the process
+that reads the upcalls of a pid. The kernel writes the netlink messages of the upcalls straight into the ring; userspace reads them
+from there, without a read request per upcall. The device handle is only used to map the ring and for the doorbells:
+    - the kernel signals the event of the ring when it writes to it, if userspace has set 'waiting';
+    - userspace rings the kernel (OVS_IOCTL_UPCALL_RING_DOORBELL) when it has made room, so that the upcalls queued meanwhile are moved to the ring.
+
+The ring (header and data) is shared with userspace, so the layout below is part of the interface. */
+
+//the type of the openvswitch device
+#define OVS_UPCALL_RING_DEVICE_TYPE         0xB360
+
+//input: OVS_UPCALL_RING_MAP_REQUEST; output: OVS_UPCALL_RING_MAP_REPLY. The file must have set its pid: the ring is the one of the pid.
+//only the process that opened the file may map the ring. It is unmapped when the file is closed, or when that process exits.
+#define OVS_IOCTL_UPCALL_RING_MAP           CTL_CODE(OVS_UPCALL_RING_DEVICE_TYPE, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+//no input; output (optional): a ULONG, the upcalls still queued, that did not fit in the ring
+#define OVS_IOCTL_UPCALL_RING_DOORBELL      CTL_CODE(OVS_UPCALL_RING_DEVICE_TYPE, 0x802, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//the size of the data of the ring: a power of 2
+#define OVS_UPCALL_RING_MIN_DATA_SIZE       (64 * 1024)
+#define OVS_UPCALL_RING_MAX_DATA_SIZE       (16 * 1024 * 1024)
+
+typedef struct _OVS_UPCALL_RING_MAP_REQUEST
+{
+    ULONG       dataSize;
+    ULONG       reserved;
+    //an auto-reset event of the caller, signaled when upcalls are written to the ring while userspace waits
+    UINT64      doorbellEvent;
+}OVS_UPCALL_RING_MAP_REQUEST, *POVS_UPCALL_RING_MAP_REQUEST;
+
+typedef struct _OVS_UPCALL_RING_MAP_REPLY
+{
+    //the address of the OVS_UPCALL_RING_HEADER, in the address space of the caller; the data follows the header
+    UINT64      address;
+    ULONG       size;
+    ULONG       dataSize;
+}OVS_UPCALL_RING_MAP_REPLY, *POVS_UPCALL_RING_MAP_REPLY;
+
+//the counters are free running: (producer - consumer) bytes are unread. A record starts at (counter & (dataSize - 1)).
+//the kernel and userspace each write to their own cache line.
+typedef struct _OVS_UPCALL_RING_HEADER
+{
+    //written by the kernel only, after the records
+    volatile ULONG  producer;
+    ULONG           dataSize;
+    ULONG           reserved0[14];
+
+    //written by userspace only, after it has read the records
+    volatile ULONG  consumer;
+    //userspace sets it to 1, and checks the ring again, before waiting for the event; the kernel resets it when it signals the event
+    volatile LONG   waiting;
+    ULONG           reserved1[14];
+}OVS_UPCALL_RING_HEADER, *POVS_UPCALL_RING_HEADER;
+
+C_ASSERT(sizeof(OVS_UPCALL_RING_HEADER) == 128);
+
+//each record is 8-byte aligned: the header, followed by 'length' bytes, then the padding
+typedef struct _OVS_UPCALL_RING_RECORD
+{
+    ULONG       length;
+    ULONG       flags;
+}OVS_UPCALL_RING_RECORD, *POVS_UPCALL_RING_RECORD;
+
+//the record holds no upcall, and is skipped: e.g. it fills the end of the data, when the next record did not fit
+#define OVS_UPCALL_RING_RECORD_PAD          1
+
+#define OVS_UPCALL_RING_RECORD_ALIGN(length)    (((length) + 7) & ~7)
+
+typedef struct _OVS_UPCALL_RING OVS_UPCALL_RING;
+
+//PASSIVE_LEVEL, in the context of the process that maps the ring
+NTSTATUS UpcallRing_Create(ULONG dataSize, _In_ HANDLE hDoorbellEvent, _Out_ OVS_UPCALL_RING** ppRing, _Out_ OVS_UPCALL_RING_MAP_REPLY* pReply);
+//PASSIVE_LEVEL. The ring must be detached from its channel: no one writes to it anymore.
+//out of the context of the process that mapped it, the caller must keep that process from exiting meanwhile (see WinlDevice.c)
+VOID UpcallRing_Destroy(_In_ OVS_UPCALL_RING* pRing);
+
+//the writers are serialized by the caller (the lock of the channel).
+//reserves a record of length bytes; pp is set to where its data is to be written.
+BOOLEAN UpcallRing_Reserve(_Inout_ OVS_UPCALL_RING* pRing, ULONG length, _Out_ VOID** pp);
+//publishes the record reserved; if !valid, e.g. its data could not be written, it is turned into a pad record
+VOID UpcallRing_Commit(_Inout_ OVS_UPCALL_RING* pRing, BOOLEAN valid);
+BOOLEAN UpcallRing_Write(_Inout_ OVS_UPCALL_RING* pRing, _In_reads_bytes_(length) const VOID* p, ULONG length);
+
+//signals the event, if userspace waits for it. Called after one or more records were committed.
+VOID UpcallRing_Notify(_Inout_ OVS_UPCALL_RING* pRing);
@@ -29,6 +29,7 @@ limitations under the License.
 #include "OFDatapath.h"
 
 #include "MsgVerification.h"
+#include "UpcallRing.h"
 
 typedef struct _WINL_DEVICE_EXTENSION
 {
@@ -38,23 +39,24 @@ typedef struct _WINL_DEVICE_EXTENSION
     ULONG deviceState;
 }WINL_DEVICE_EXTENSION, *PWINL_DEVICE_EXTENSION;
 
-#define WINL_OVS_DEVICE_TYPE    0xB360
+#define WINL_OVS_DEVICE_TYPE    OVS_UPCALL_RING_DEVICE_TYPE
 
 static PDEVICE_OBJECT g_pOvsDeviceObject;
 
+//serializes the destruction of the upcall rings: a process that exits waits in its exit notification while one of its rings is unmapped
+//from another process, so that it is attached to while its address space still exists
+static FAST_MUTEX g_upcallRingMutex;
+//the rings are mapped only if their process exit is notified
+static BOOLEAN g_processNotifySet = FALSE;
+
 // {CEF35472-E7EE-4B4E-AB69-93ED0249377C}
 static const GUID g_ovsDeviceGuidName =
 { 0xcef35472, 0xe7ee, 0x4b4e, { 0xab, 0x69, 0x93, 0xed, 0x2, 0x49, 0x37, 0x7c } };
 
 /********************************************************************************************/
 
-//i.e. for userspace to read
-OVS_ERROR WriteMsgsToDevice(OVS_NLMSGHDR* pMsgs, int countMsgs, const FILE_OBJECT* pFileObject, UINT groupId)
+static BOOLEAN _VerifyMsgs(OVS_NLMSGHDR* pMsgs, int countMsgs)
 {
-    LOCK_STATE_EX lockState = { 0 };
-    OVS_BUFFER buffer = { 0 };
-    OVS_ERROR error = OVS_ERROR_NOERROR;
-
     OVS_CHECK(countMsgs > 0);
 
 #if OVS_VERIFY_WINL_MESSAGES
@@ -66,18 +68,48 @@ OVS_ERROR WriteMsgsToDevice(OVS_NLMSGHDR* pMsgs, int countMsgs, const FILE_OBJEC
         {
             DEBUGP(LOG_ERROR, "msg not written to device for userspace to read, because it failed verification\n");
             OVS_CHECK(__UNEXPECTED__);
-            return OVS_ERROR_INVAL;
+            return FALSE;
         }
 
         pMsg = AdvanceMessage(pMsg);
     }
+#else
+    UNREFERENCED_PARAMETER(pMsgs);
+    UNREFERENCED_PARAMETER(countMsgs);
 #endif
 
-    if (!WriteMsgsToBuffer(pMsgs, countMsgs, &buffer))
+    return TRUE;
+}
+
+static BOOLEAN _WriteMsgsToBuffer(OVS_NLMSGHDR* pMsgs, int countMsgs, _Out_ OVS_BUFFER* pBuffer)
+{
+    RtlZeroMemory(pBuffer, sizeof(OVS_BUFFER));
+
+    if (!_VerifyMsgs(pMsgs, countMsgs))
     {
-        FreeBufferData(&buffer);
+        return FALSE;
+    }
+
+    if (!WriteMsgsToBuffer(pMsgs, countMsgs, pBuffer))
+    {
+        FreeBufferData(pBuffer);
 
         DEBUGP(LOG_ERROR, "msg not written to devuce for userspace to read, because it failed to output to buffer\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//i.e. for userspace to read
+OVS_ERROR WriteMsgsToDevice(OVS_NLMSGHDR* pMsgs, int countMsgs, const FILE_OBJECT* pFileObject, UINT groupId)
+{
+    LOCK_STATE_EX lockState = { 0 };
+    OVS_BUFFER buffer = { 0 };
+    OVS_ERROR error = OVS_ERROR_NOERROR;
+
+    if (!_WriteMsgsToBuffer(pMsgs, countMsgs, &buffer))
+    {
         return OVS_ERROR_INVAL;
     }
 
@@ -91,6 +123,53 @@ OVS_ERROR WriteMsgsToDevice(OVS_NLMSGHDR* pMsgs, int countMsgs, const FILE_OBJEC
     return error;
 }
 
+_Use_decl_annotations_
+OVS_ERROR WriteUpcallsToDevice(OVS_NLMSGHDR* pMsgs, int countMsgs, UINT16 ofSourcePort)
+{
+    LOCK_STATE_EX lockState = { 0 };
+    OVS_BUFFER buffer = { 0 };
+    OVS_ERROR error = OVS_ERROR_NOERROR;
+    UINT size = 0;
+
+    if (!_VerifyMsgs(pMsgs, countMsgs))
+    {
+        return OVS_ERROR_INVAL;
+    }
+
+    size = PrepareMsgsForBuffer(pMsgs, countMsgs);
+
+    //the upcalls of different processors only contend on the lock of their channel
+    BufferCtl_LockRead(&lockState);
+
+    //if userspace mapped a ring for the pid, the msgs are written there, without a copy
+    error = BufferCtl_WriteUpcallToRing_Unsafe(pMsgs, countMsgs, size, pMsgs[0].pid, ofSourcePort);
+
+    if (error == OVS_ERROR_AGAIN)
+    {
+        if (!AllocateBuffer(&buffer, size))
+        {
+            error = OVS_ERROR_NOMEM;
+        }
+        else if (!WriteMsgsAt(pMsgs, countMsgs, buffer.p, size))
+        {
+            error = OVS_ERROR_INVAL;
+        }
+        else
+        {
+            error = BufferCtl_WriteUpcall_Unsafe(&buffer, pMsgs[0].pid, ofSourcePort);
+        }
+    }
+
+    BufferCtl_Unlock(&lockState);
+
+    if (error != OVS_ERROR_NOERROR)
+    {
+        FreeBufferData(&buffer);
+    }
+
+    return error;
+}
+
 _Use_decl_annotations_
 VOID WriteErrorToDevice(const OVS_NLMSGHDR* pOriginalMsg, UINT errorCode, const FILE_OBJECT* pFileObject, UINT groupId)
 {
@@ -137,7 +216,8 @@ NTSTATUS _WinlIrpCreate(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 
     BufferCtl_LockWrite(&lockState);
 
-    ok = BufferCtl_AddDeviceFile_Unsafe(pFileObject);
+    //IRP_MJ_CREATE comes in the context of the process that opens the file
+    ok = BufferCtl_AddDeviceFile_Unsafe(pFileObject, PsGetCurrentProcessId());
 
     BufferCtl_Unlock(&lockState);
 
@@ -160,9 +240,25 @@ Cleanup:
 _Function_class_(DRIVER_DISPATCH)
 NTSTATUS _WinlIrpCleanup(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 {
+    FILE_OBJECT* pFileObject = NULL;
+    OVS_UPCALL_RING* pRing = NULL;
+
     UNREFERENCED_PARAMETER(pDeviceObject);
 
-    DEBUGP_FILE(LOG_INFO, "cleanup file: %p\n", IoGetCurrentIrpStackLocation(pIrp)->FileObject);
+    pFileObject = IoGetCurrentIrpStackLocation(pIrp)->FileObject;
+
+    DEBUGP_FILE(LOG_INFO, "cleanup file: %p\n", pFileObject);
+
+    //the ring is unmapped here, while the process that mapped it still exists; the close may come later, from another context
+    ExAcquireFastMutex(&g_upcallRingMutex);
+
+    pRing = BufferCtl_DetachUpcallRing(pFileObject);
+    if (pRing)
+    {
+        UpcallRing_Destroy(pRing);
+    }
+
+    ExReleaseFastMutex(&g_upcallRingMutex);
 
     pIrp->IoStatus.Status = STATUS_SUCCESS;
     pIrp->IoStatus.Information = 0;
@@ -214,16 +310,124 @@ Cleanup:
     return status;
 }
 
+static NTSTATUS _WinlMapUpcallRing(_In_ const FILE_OBJECT* pFileObject, _Inout_ IRP* pIrp, _In_ const IO_STACK_LOCATION* pStack)
+{
+    const OVS_UPCALL_RING_MAP_REQUEST* pRequest = pIrp->AssociatedIrp.SystemBuffer;
+    OVS_UPCALL_RING_MAP_REPLY reply = { 0 };
+    OVS_UPCALL_RING* pRing = NULL;
+    OVS_ERROR error = OVS_ERROR_NOERROR;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (pStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(OVS_UPCALL_RING_MAP_REQUEST) ||
+        pStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(OVS_UPCALL_RING_MAP_REPLY))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (!g_processNotifySet)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    status = UpcallRing_Create(pRequest->dataSize, (HANDLE)(ULONG_PTR)pRequest->doorbellEvent, &pRing, &reply);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    error = BufferCtl_AttachUpcallRing(pFileObject, pRing, PsGetCurrentProcessId());
+    if (error != OVS_ERROR_NOERROR)
+    {
+        UpcallRing_Destroy(pRing);
+
+        switch (error)
+        {
+        case OVS_ERROR_EXIST:
+            return STATUS_DEVICE_BUSY;
+
+        case OVS_ERROR_PERM:
+            return STATUS_ACCESS_DENIED;
+
+        default:
+            return STATUS_INVALID_DEVICE_STATE;
+        }
+    }
+
+    RtlCopyMemory(pIrp->AssociatedIrp.SystemBuffer, &reply, sizeof(OVS_UPCALL_RING_MAP_REPLY));
+    pIrp->IoStatus.Information = sizeof(OVS_UPCALL_RING_MAP_REPLY);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS _WinlUpcallRingDoorbell(_In_ const FILE_OBJECT* pFileObject, _Inout_ IRP* pIrp, _In_ const IO_STACK_LOCATION* pStack)
+{
+    ULONG countQueued = 0;
+
+    if (BufferCtl_PumpUpcallRing(pFileObject, &countQueued) != OVS_ERROR_NOERROR)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (pStack->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(ULONG))
+    {
+        *(ULONG*)pIrp->AssociatedIrp.SystemBuffer = countQueued;
+        pIrp->IoStatus.Information = sizeof(ULONG);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS _WinlGetReceiveStats(_Inout_ IRP* pIrp, _In_ const IO_STACK_LOCATION* pStack)
+{
+    OVS_RECEIVE_STATS stats = { 0 };
+
+    if (pStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(OVS_RECEIVE_STATS))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    RxCoalesce_GetStats(&stats.rxCoalesce);
+    Ipv4Reassembly_GetStats(&stats.ipv4Reassembly);
+
+    RtlCopyMemory(pIrp->AssociatedIrp.SystemBuffer, &stats, sizeof(OVS_RECEIVE_STATS));
+    pIrp->IoStatus.Information = sizeof(OVS_RECEIVE_STATS);
+
+    return STATUS_SUCCESS;
+}
+
 _Function_class_(DRIVER_DISPATCH)
 NTSTATUS _WinlIrpControl(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 {
+    IO_STACK_LOCATION* pStack = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+
     UNREFERENCED_PARAMETER(pDeviceObject);
 
-    pIrp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+    pStack = IoGetCurrentIrpStackLocation(pIrp);
     pIrp->IoStatus.Information = 0;
+
+    switch (pStack->Parameters.DeviceIoControl.IoControlCode)
+    {
+    case OVS_IOCTL_UPCALL_RING_MAP:
+        status = _WinlMapUpcallRing(pStack->FileObject, pIrp, pStack);
+        break;
+
+    case OVS_IOCTL_UPCALL_RING_DOORBELL:
+        status = _WinlUpcallRingDoorbell(pStack->FileObject, pIrp, pStack);
+        break;
+
+    case OVS_IOCTL_RECEIVE_STATS:
+        status = _WinlGetReceiveStats(pIrp, pStack);
+        break;
+
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    pIrp->IoStatus.Status = status;
     IoCompleteRequest(pIrp, IO_NO_INCREMENT);
 
-    return STATUS_INVALID_DEVICE_REQUEST;
+    return status;
 }
 
 _Function_class_(DRIVER_DISPATCH)
@@ -756,6 +960,29 @@ Cleanup:
     return status;
 }
 
+//the process exits: it is called in the context of the process, before its address space is torn down, so its rings are unmapped
+//here; the files that mapped them may be closed later, e.g. by a process that had their handles duplicated
+static VOID _WinlProcessNotify(HANDLE parentId, HANDLE processId, BOOLEAN create)
+{
+    OVS_UPCALL_RING* pRing = NULL;
+
+    UNREFERENCED_PARAMETER(parentId);
+
+    if (create)
+    {
+        return;
+    }
+
+    ExAcquireFastMutex(&g_upcallRingMutex);
+
+    while ((pRing = BufferCtl_DetachUpcallRingOfProcess(processId)) != NULL)
+    {
+        UpcallRing_Destroy(pRing);
+    }
+
+    ExReleaseFastMutex(&g_upcallRingMutex);
+}
+
 static NTSTATUS _WinlCreateOneDevice(_In_ PDRIVER_OBJECT pDriverObject, UINT type, _Out_ PDEVICE_OBJECT* ppDeviceObj,
     const WCHAR* wsDeviceName, const WCHAR* wsSymbolicName, _In_ const GUID* pGuid)
 {
@@ -801,6 +1028,8 @@ NTSTATUS WinlCreateDevices(PDRIVER_OBJECT pDriverObject, NDIS_HANDLE ndishandle)
 
     BufferCtl_Init(ndishandle);
 
+    ExInitializeFastMutex(&g_upcallRingMutex);
+
     status = _WinlCreateOneDevice(pDriverObject, WINL_OVS_DEVICE_TYPE, &g_pOvsDeviceObject,
         L"\\Device\\OpenVSwitchDevice", L"\\DosDevices\\OpenVSwitchDevice", &g_ovsDeviceGuidName);
 
@@ -809,6 +1038,18 @@ NTSTATUS WinlCreateDevices(PDRIVER_OBJECT pDriverObject, NDIS_HANDLE ndishandle)
         return status;
     }
 
+    //set last: on failure above, DriverEntry does not call WinlDeleteDevices, which removes it.
+    //without it, the devices work, but no upcall ring can be mapped
+    status = PsSetCreateProcessNotifyRoutine(_WinlProcessNotify, /*remove*/ FALSE);
+    if (NT_SUCCESS(status))
+    {
+        g_processNotifySet = TRUE;
+    }
+    else
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " could not set the process notify routine: 0x%x\n", status);
+    }
+
     // Now, set up entry points
     pDriverObject->MajorFunction[IRP_MJ_CREATE] = _WinlIrpCreate;
     pDriverObject->MajorFunction[IRP_MJ_CLEANUP] = _WinlIrpCleanup;
@@ -837,5 +1078,12 @@ VOID WinlDeleteDevices()
         IoDeleteDevice(g_pOvsDeviceObject);
     }
 
+    //all the files are closed by now: no ring is left
+    if (g_processNotifySet)
+    {
+        PsSetCreateProcessNotifyRoutine(_WinlProcessNotify, /*remove*/ TRUE);
+        g_processNotifySet = FALSE;
+    }
+
     BufferCtl_Uninit();
 }
\ No newline at end of file
@@ -19,6 +19,18 @@ limitations under the License.
 #include "precomp.h"
 #include "Message.h"
 #include "Error.h"
+#include "UpcallRing.h"
+#include "RxCoalesce.h"
+#include "Ipv4Reassembly.h"
+
+//no input; output: OVS_RECEIVE_STATS, the counters of the receive path of the driver, since it was loaded
+#define OVS_IOCTL_RECEIVE_STATS             CTL_CODE(OVS_UPCALL_RING_DEVICE_TYPE, 0x803, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+typedef struct _OVS_RECEIVE_STATS
+{
+    OVS_RX_COALESCE_STATS       rxCoalesce;
+    OVS_IPV4_REASSEMBLY_STATS   ipv4Reassembly;
+}OVS_RECEIVE_STATS, *POVS_RECEIVE_STATS;
 
 typedef struct _OVS_MESSAGE OVS_MESSAGE;
 typedef struct _OVS_NLMSGHDR OVS_NLMSGHDR;
@@ -27,4 +39,8 @@ NTSTATUS WinlCreateDevices(PDRIVER_OBJECT pDriverObject, NDIS_HANDLE ndisHandle)
 VOID WinlDeleteDevices();
 
 OVS_ERROR WriteMsgsToDevice(OVS_NLMSGHDR* pMsgs, int countMsgs, const FILE_OBJECT* pFileObject, UINT groupId);
+//upcalls, i.e. packets sent to userspace: all the messages go to the upcall port id of the first.
+//ofSourcePort: the in port of the packets, for the fairness between the ports. They are written to the upcall ring of the pid, if userspace
+//mapped one and it has room; else, they are queued
+OVS_ERROR WriteUpcallsToDevice(_In_ OVS_NLMSGHDR* pMsgs, int countMsgs, UINT16 ofSourcePort);
 VOID WriteErrorToDevice(_In_ const OVS_NLMSGHDR* pOriginalMsg, UINT errorCode, _In_ const FILE_OBJECT* pFileObject, UINT groupId);
\ No newline at end of file
@@ -46,6 +46,7 @@ static OVS_ERROR _CreateActionsFromArgGroup(OVS_ARGUMENT_GROUP* pOriginalActions
 
     CHECK_B_E(CopyArgumentGroup(pActions->pActionGroup, pOriginalActionsGroup, /*actionsToAdd*/0), OVS_ERROR_NOMEM);
     CHECK_B_E(ProcessReceivedActions(pActions->pActionGroup, pMaskedPI, /*recursivity depth*/0), OVS_ERROR_INVAL);
+    CHECK_B_E(Actions_Compile(pActions), OVS_ERROR_INVAL);
 
 Cleanup:
     if (error == OVS_ERROR_NOERROR)
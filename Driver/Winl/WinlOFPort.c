@@ -29,6 +29,7 @@ limitations under the License.
 #include "Sctx_Nic.h"
 #include "OFPort.h"
 #include "Error.h"
+#include "BufferControl.h"
 
 typedef struct _OVS_WINL_PORT
 {
@@ -143,6 +144,7 @@ static OVS_ERROR _CreateMsgFromOFPort(OVS_OFPORT* pOFPort, const OVS_MESSAGE* pI
     UINT16 argsCount = 5;
     ULONG i = 0;
     OVS_WINL_PORT winlPort = { 0 };
+    OVS_UPCALL_QUEUE_STATS upcallStats = { 0 };
 
     OVS_CHECK(pOutMsg);
     OVS_CHECK(pInMsg);
@@ -155,6 +157,10 @@ static OVS_ERROR _CreateMsgFromOFPort(OVS_OFPORT* pOFPort, const OVS_MESSAGE* pI
     winlPort.stats = pOFPort->stats;
     winlPort.upcallPortIds = pOFPort->upcallPortIds;
 
+    //the packets received on the port whose upcalls were dropped, over the share of the port in its channel
+    BufferCtl_GetUpcallStats(pOFPort->ofPortNumber, &upcallStats);
+    winlPort.stats.droppedOnReceive += upcallStats.countDropped;
+
     if (winlPort.pOptions)
     {
         ++argsCount;
@@ -316,22 +322,32 @@ Cleanup:
     return error;
 }
 
+//must not be called with the port locked
 OVS_ERROR _OFPort_SetOptions(OVS_OFPORT* pOFPort, OVS_ARGUMENT_GROUP* pArgGroup)
 {
     OVS_ARGUMENT_GROUP* pOptionsGroup = NULL;
+    OVS_TUNNELING_PORT_OPTIONS options = { 0 };
+    LOCK_STATE_EX portLockState = { 0 };
     OVS_ERROR error = OVS_ERROR_NOERROR;
 
     //OPTIONS: optional
     pOptionsGroup = FindArgumentGroup(pArgGroup, OVS_ARGTYPE_OFPORT_OPTIONS_GROUP);
     if (pOptionsGroup)
     {
-        if (!pOFPort->pOptions)
+        //the new options are built aside: the port keeps its options if they are refused
+        PORT_LOCK_READ(pOFPort, &portLockState);
+
+        if (pOFPort->pOptions)
         {
-            pOFPort->pOptions = KZAlloc(sizeof(OVS_TUNNELING_PORT_OPTIONS));
-            CHECK_B_E(pOFPort->pOptions, OVS_ERROR_NOMEM);
+            options = *pOFPort->pOptions;
         }
 
-        CHECK_B_E(_OFPort_GroupToOptions(pOptionsGroup, pOFPort->pOptions), OVS_ERROR_INVAL);
+        PORT_UNLOCK(pOFPort, &portLockState);
+
+        CHECK_B_E(_OFPort_GroupToOptions(pOptionsGroup, &options), OVS_ERROR_INVAL);
+
+        //e.g. a vxlan port receives packets only after it got its udp port
+        CHECK_E(OFPort_SetOptions(pOFPort, &options));
     }
 
 Cleanup:
@@ -377,7 +393,7 @@ Cleanup:
 _Use_decl_annotations_
 OVS_ERROR WinlOFPort_New(OVS_DATAPATH* pDatapath, const OVS_MESSAGE* pMsg, const FILE_OBJECT* pFileObject)
 {   
-    UINT32 portType = 0, upcallPortId = 0;
+    UINT32 upcallPortId = 0;
     OVS_ARGUMENT* pArg = NULL;
     OVS_OFPORT* pOFPort = NULL;
     OVS_MESSAGE replyMsg = { 0 };
@@ -399,12 +415,12 @@ OVS_ERROR WinlOFPort_New(OVS_DATAPATH* pDatapath, const OVS_MESSAGE* pMsg, const
     multiplePidsPerOFPort = (pDatapath->userFeatures & OVS_DATAPATH_FEATURE_MULITPLE_PIDS_PER_VPORT) ? TRUE : FALSE;
     DATAPATH_UNLOCK(pDatapath, &dpLockState);
 
+    //the port was created with its type
+    CHECK_E(_OFPort_SetOptions(pOFPort, pMsg->pArgGroup));
+
     PORT_LOCK_READ(pOFPort, &portLockState);
     locked = TRUE;
 
-    pOFPort->ofPortType = portType;
-
-    CHECK_E(_OFPort_SetOptions(pOFPort, pMsg->pArgGroup));
     CHECK_E(_OFPort_GetUpcallPids(pMsg->pArgGroup, multiplePidsPerOFPort, &upcallPids));
 
     CHECK_E(_CreateMsgFromOFPort(pOFPort, pMsg, &replyMsg, OVS_MESSAGE_COMMAND_NEW, multiplePidsPerOFPort));
@@ -460,10 +476,10 @@ OVS_ERROR WinlOFPort_Set(OVS_DATAPATH* pDatapath, const OVS_MESSAGE* pMsg, const
     multiplePidsPerOFPort = (pDatapath->userFeatures & OVS_DATAPATH_FEATURE_MULITPLE_PIDS_PER_VPORT) ? TRUE : FALSE;
     DATAPATH_UNLOCK(pDatapath, &dpLockState);
 
+    CHECK_E(_OFPort_SetOptions(pOFPort, pMsg->pArgGroup));
+
     PORT_LOCK_WRITE(pOFPort, &portLockState);
     locked = TRUE;
-
-    CHECK_E(_OFPort_SetOptions(pOFPort, pMsg->pArgGroup));
     CHECK_E(_OFPort_GetUpcallPids(pMsg->pArgGroup, multiplePidsPerOFPort, &upcallPids));
 
     CHECK_E(_CreateMsgFromOFPort(pOFPort, pMsg, &replyMsg, OVS_MESSAGE_COMMAND_NEW, multiplePidsPerOFPort));
@@ -34,6 +34,7 @@ limitations under the License.
 #include "Winetlink.h"
 #include "Gre.h"
 #include "Vxlan.h"
+#include "Driver.h"
 
 static volatile LONG g_upcallSequence = 0;
 
@@ -91,6 +92,9 @@ static OVS_FLOW* _CreateFlowFromArgs(OVS_NET_BUFFER* pOvsNb, OVS_ARGUMENT_GROUP*
     ok = ProcessReceivedActions(pTargetActions->pActionGroup, &pFlow->maskedPacketInfo, /*recursivity depth*/0);
     OVS_CHECK_GC(ok);
 
+    ok = Actions_Compile(pTargetActions);
+    OVS_CHECK_GC(ok);
+
     pFlow->pActions = pTargetActions;
 
 Cleanup:
@@ -163,6 +167,8 @@ VOID WinlPacket_Execute(OVS_SWITCH_INFO* pSwitchInfo, OVS_DATAPATH* pDatapath, _
 
     ok = ExecuteActions(pOvsNb, OutputPacketToPort);
 
+    FlushSamplesToUserspace();
+
 Cleanup:
     if (pFlow)
     {
@@ -184,63 +190,100 @@ Cleanup:
     }
 }
 
-static OVS_ERROR _QueueUserspacePacket(OVS_DATAPATH* pDatapath, _In_ NET_BUFFER* pNb, _In_ const OVS_UPCALL_INFO* pUpcallInfo)
+//copyData: the message owns a copy of the packet data and of the user data, so it may be written after the packet and its actions are gone.
+//maxBytes: the packet data is truncated to it; 0 = the whole packet
+static OVS_ERROR _CreateUpcallMsg(OVS_DATAPATH* pDatapath, _In_ NET_BUFFER* pNb, _In_ const OVS_UPCALL_INFO* pUpcallInfo, BOOLEAN copyData,
+    ULONG maxBytes, _Out_ OVS_MESSAGE* pMsg)
 {
     OVS_ERROR error = OVS_ERROR_NOERROR;
-    OVS_MESSAGE msg = { 0 };
     UINT16 countArgs = 0;
     OVS_ARGUMENT* pPacketInfoArg = NULL, *pNbArg = NULL, *pUserDataArg = NULL;
     ULONG i = 0;
-    VOID* nbBuffer = NULL;
+    VOID* nbBuffer = NULL, *nbCopy = NULL, *userDataCopy = NULL;
+    const VOID* userData = NULL;
     ULONG bufLen = NET_BUFFER_DATA_LENGTH(pNb);
     countArgs = (pUpcallInfo->pUserData ? 3 : 2);
     UINT32 sequence = _NextUpcallSequence();
 
-    nbBuffer = NdisGetDataBuffer(pNb, bufLen, NULL, 1, 0);
+    RtlZeroMemory(pMsg, sizeof(OVS_MESSAGE));
+
+    if (maxBytes && bufLen > maxBytes)
+    {
+        bufLen = maxBytes;
+    }
+
+    CHECK_B_E(bufLen <= USHORT_MAX, OVS_ERROR_INVAL);
+
+    if (copyData)
+    {
+        nbCopy = KAlloc(bufLen);
+        CHECK_B_E(nbCopy, OVS_ERROR_NOMEM);
 
-    CHECK_B_E(nbBuffer, OVS_ERROR_INVAL);
-    CHECK_B_E(bufLen > USHORT_MAX, OVS_ERROR_INVAL);
+        //the data is copied to nbCopy only if it is not contiguous
+        nbBuffer = NdisGetDataBuffer(pNb, bufLen, nbCopy, 1, 0);
+        CHECK_B_E(nbBuffer, OVS_ERROR_INVAL);
 
-    CHECK_E(CreateMsg(&msg, pUpcallInfo->portId, sequence, sizeof(OVS_MESSAGE), OVS_MESSAGE_TARGET_PACKET, pUpcallInfo->command,
+        if (nbBuffer != nbCopy)
+        {
+            RtlCopyMemory(nbCopy, nbBuffer, bufLen);
+            nbBuffer = nbCopy;
+        }
+    }
+    else
+    {
+        nbBuffer = NdisGetDataBuffer(pNb, bufLen, NULL, 1, 0);
+        CHECK_B_E(nbBuffer, OVS_ERROR_INVAL);
+    }
+
+    CHECK_E(CreateMsg(pMsg, pUpcallInfo->portId, sequence, sizeof(OVS_MESSAGE), OVS_MESSAGE_TARGET_PACKET, pUpcallInfo->command,
         pDatapath->switchIfIndex, countArgs));
 
     pPacketInfoArg = CreateArgFromPacketInfo(pUpcallInfo->pPacketInfo, NULL, OVS_ARGTYPE_PACKET_PI_GROUP);
     CHECK_B_E(pPacketInfoArg, OVS_ERROR_INVAL);
 
-    AddArgToArgGroup(msg.pArgGroup, pPacketInfoArg, &i);
+    AddArgToArgGroup(pMsg->pArgGroup, pPacketInfoArg, &i);
 
     if (pUpcallInfo->pUserData)
     {
-        pUserDataArg = CreateArgumentWithSize(OVS_ARGTYPE_PACKET_USERDATA, pUpcallInfo->pUserData->data, pUpcallInfo->pUserData->length);
+        userData = pUpcallInfo->pUserData->data;
+
+        if (copyData)
+        {
+            userDataCopy = KAlloc(pUpcallInfo->pUserData->length);
+            CHECK_B_E(userDataCopy, OVS_ERROR_NOMEM);
+
+            RtlCopyMemory(userDataCopy, userData, pUpcallInfo->pUserData->length);
+            userData = userDataCopy;
+        }
+
+        pUserDataArg = CreateArgumentWithSize(OVS_ARGTYPE_PACKET_USERDATA, userData, pUpcallInfo->pUserData->length);
         CHECK_B_E(pUserDataArg, OVS_ERROR_NOMEM);
 
-        AddArgToArgGroup(msg.pArgGroup, pUserDataArg, &i);
+        //from now on, the argument owns the copy
+        pUserDataArg->freeData = copyData;
+        userDataCopy = NULL;
+
+        AddArgToArgGroup(pMsg->pArgGroup, pUserDataArg, &i);
     }
 
     //we send the net buffer data and only it: starting from eth -> payload.
     pNbArg = CreateArgumentWithSize(OVS_ARGTYPE_PACKET_BUFFER, nbBuffer, bufLen);
     CHECK_B_E(pNbArg, OVS_ERROR_NOMEM);
 
-    AddArgToArgGroup(msg.pArgGroup, pNbArg, &i);
+    pNbArg->freeData = copyData;
+    nbCopy = NULL;
 
-    OVS_CHECK(msg.type == OVS_MESSAGE_TARGET_PACKET);
-    OVS_CHECK(msg.command == OVS_MESSAGE_COMMAND_PACKET_UPCALL_ACTION ||
-        msg.command == OVS_MESSAGE_COMMAND_PACKET_UPCALL_MISS);
+    AddArgToArgGroup(pMsg->pArgGroup, pNbArg, &i);
 
-    error = WriteMsgsToDevice((OVS_NLMSGHDR*)&msg, 1, /*pFileObject*/ NULL, OVS_MULTICAST_GROUP_NONE);
-    if (error)
+Cleanup:
+    if (pMsg->pArgGroup)
     {
-        //NOSPC = NO SPACE
-        if (error != OVS_ERROR_NOSPC)
+        //the group has its own copy of each argument: it destroys their data
+        if (error != OVS_ERROR_NOERROR)
         {
-            DEBUGP(LOG_ERROR, "failed to queue packet to userspace!\n");
+            DestroyArgumentGroup(pMsg->pArgGroup);
+            pMsg->pArgGroup = NULL;
         }
-    }
-
-Cleanup:
-    if (msg.pArgGroup)
-    {
-        DestroyArgumentGroup(msg.pArgGroup);
 
         KFree(pNbArg);
         KFree(pUserDataArg);
@@ -248,13 +291,42 @@ Cleanup:
     }
     else
     {
-        //we free, not destroy: the nb inside was not duplicated
-        KFree(pNbArg);
-
+        DestroyArgument(pNbArg);
         DestroyArgument(pUserDataArg);
         DestroyArgument(pPacketInfoArg);
     }
 
+    KFree(nbCopy);
+    KFree(userDataCopy);
+
+    return error;
+}
+
+static OVS_ERROR _QueueUserspacePacket(OVS_DATAPATH* pDatapath, _In_ NET_BUFFER* pNb, _In_ const OVS_UPCALL_INFO* pUpcallInfo)
+{
+    OVS_ERROR error = OVS_ERROR_NOERROR;
+    OVS_MESSAGE msg = { 0 };
+
+    CHECK_E(_CreateUpcallMsg(pDatapath, pNb, pUpcallInfo, /*copyData*/ FALSE, /*maxBytes*/ 0, &msg));
+
+    OVS_CHECK(msg.type == OVS_MESSAGE_TARGET_PACKET);
+    OVS_CHECK(msg.command == OVS_MESSAGE_COMMAND_PACKET_UPCALL_ACTION ||
+        msg.command == OVS_MESSAGE_COMMAND_PACKET_UPCALL_MISS);
+
+    error = WriteUpcallsToDevice((OVS_NLMSGHDR*)&msg, 1, pUpcallInfo->pPacketInfo->physical.ofInPort);
+    if (error)
+    {
+        //NOSPC = NO SPACE
+        if (error != OVS_ERROR_NOSPC)
+        {
+            DEBUGP(LOG_ERROR, "failed to queue packet to userspace!\n");
+        }
+    }
+
+Cleanup:
+    //the net buffer data was not duplicated: only the arguments are destroyed
+    DestroyArgumentGroup(msg.pArgGroup);
+
     return error;
 }
 
@@ -274,10 +346,11 @@ BOOLEAN QueuePacketToUserspace(OVS_DATAPATH* pDatapath, _In_ NET_BUFFER* pNb, _I
     OVS_ERROR error = _QueueUserspacePacket(pDatapath, pNb, pUpcallInfo);
     if (error != OVS_ERROR_NOERROR)
     {
-        //no other kind of error except 'no space' (for queued buffers) normally happen.
+        //no other kind of error except 'no space' (for queued buffers, or over the share of the in port) normally happen.
         //or NOENT = file not found (where to write the info to)
-        OVS_CHECK(error == OVS_ERROR_NOSPC || error == OVS_ERROR_NOENT);
+        OVS_CHECK(error == OVS_ERROR_NOSPC || error == OVS_ERROR_NOENT || error == OVS_ERROR_NOMEM);
 
+        ok = FALSE;
         goto Cleanup;
     }
 
@@ -294,4 +367,313 @@ Cleanup:
     }
 
     return ok;
-}
\ No newline at end of file
+}
+
+/********************************************* SAMPLE UPCALLS *********************************************/
+
+//the upcalls held on a processor: they all go to the same upcall port, and are all of packets received on the same in port
+typedef struct _OVS_SAMPLE_UPCALL_BATCH
+{
+    NDIS_SPIN_LOCK      lock;
+    UINT16              ofSourcePort;
+
+    //KeQueryInterruptTime when the first upcall was held
+    LONG64              firstHeldTime;
+    ULONG               count;
+    OVS_MESSAGE         msgs[OVS_SAMPLE_UPCALL_BATCH_SIZE];
+}OVS_SAMPLE_UPCALL_BATCH, *POVS_SAMPLE_UPCALL_BATCH;
+
+typedef struct _OVS_SAMPLE_UPCALLS
+{
+    //set at driver load
+    ULONG                       maxBytes;
+
+    //one per processor; NULL: the upcalls are not batched
+    OVS_SAMPLE_UPCALL_BATCH*    pBatches;
+    ULONG                       countBatches;
+
+    //flushes the batches when no packet is processed: set when a batch begins, while the timer is not set
+    NDIS_HANDLE                 hFlushTimer;
+    volatile LONG               flushTimerSet;
+    //the driver unloads: the timer is not set anymore
+    volatile BOOLEAN            stopping;
+}OVS_SAMPLE_UPCALLS, *POVS_SAMPLE_UPCALLS;
+
+static OVS_SAMPLE_UPCALLS g_sampleUpcalls = { OVS_SAMPLE_UPCALL_DEFAULT_MAX_BYTES, NULL, 0, NULL, 0, FALSE };
+
+//moves the upcalls of the batch to msgs, to be written after the lock is released
+static ULONG _SampleBatch_Detach_Unsafe(_Inout_ OVS_SAMPLE_UPCALL_BATCH* pBatch, _Out_ OVS_MESSAGE msgs[OVS_SAMPLE_UPCALL_BATCH_SIZE],
+    _Out_ UINT16* pOfSourcePort)
+{
+    ULONG count = pBatch->count;
+
+    RtlCopyMemory(msgs, pBatch->msgs, count * sizeof(OVS_MESSAGE));
+    *pOfSourcePort = pBatch->ofSourcePort;
+    pBatch->count = 0;
+
+    return count;
+}
+
+static VOID _SampleBatch_Write(_In_ OVS_MESSAGE msgs[OVS_SAMPLE_UPCALL_BATCH_SIZE], ULONG count, UINT16 ofSourcePort)
+{
+    OVS_ERROR error = OVS_ERROR_NOERROR;
+
+    if (!count)
+    {
+        return;
+    }
+
+    //a single buffer, for the upcall port of all of them
+    error = WriteUpcallsToDevice((OVS_NLMSGHDR*)msgs, count, ofSourcePort);
+    if (error && error != OVS_ERROR_NOSPC)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to queue %u sample upcalls to userspace: %d\n", count, error);
+    }
+
+    for (ULONG i = 0; i < count; ++i)
+    {
+        DestroyArgumentGroup(msgs[i].pArgGroup);
+    }
+}
+
+//sets the timer to fire after delay (100ns units), unless it is set already
+static VOID _SampleBatches_SetFlushTimer(LONG64 delay)
+{
+    LARGE_INTEGER dueTime = { 0 };
+
+    if (g_sampleUpcalls.stopping || InterlockedCompareExchange(&g_sampleUpcalls.flushTimerSet, 1, 0) != 0)
+    {
+        return;
+    }
+
+    //relative
+    dueTime.QuadPart = -max(delay, 1);
+    NdisSetTimerObject(g_sampleUpcalls.hFlushTimer, dueTime, 0, NULL);
+}
+
+_Function_class_(NDIS_TIMER_FUNCTION)
+static VOID _SampleBatches_FlushTimer(VOID* pSystemContext, VOID* pContext, VOID* pSystemArg1, VOID* pSystemArg2)
+{
+    LONG64 now = 0, oldestHeldTime = 0;
+    BOOLEAN held = FALSE;
+
+    UNREFERENCED_PARAMETER(pSystemContext);
+    UNREFERENCED_PARAMETER(pContext);
+    UNREFERENCED_PARAMETER(pSystemArg1);
+    UNREFERENCED_PARAMETER(pSystemArg2);
+
+    //a batch that begins from now on sets the timer again
+    InterlockedExchange(&g_sampleUpcalls.flushTimerSet, 0);
+
+    FlushSamplesToUserspace();
+
+    //the batches that began while the timer was set, and are not old enough yet: the timer is set for the oldest
+    now = (LONG64)KeQueryInterruptTime();
+
+    for (ULONG i = 0; i < g_sampleUpcalls.countBatches; ++i)
+    {
+        OVS_SAMPLE_UPCALL_BATCH* pBatch = g_sampleUpcalls.pBatches + i;
+
+        NdisAcquireSpinLock(&pBatch->lock);
+
+        if (pBatch->count && (!held || pBatch->firstHeldTime < oldestHeldTime))
+        {
+            oldestHeldTime = pBatch->firstHeldTime;
+            held = TRUE;
+        }
+
+        NdisReleaseSpinLock(&pBatch->lock);
+    }
+
+    if (held)
+    {
+        _SampleBatches_SetFlushTimer(OVS_SAMPLE_UPCALL_MAX_DELAY - (now - oldestHeldTime));
+    }
+}
+
+_Use_decl_annotations_
+VOID WinlPacket_InitializeSampling(NDIS_HANDLE ndisHandle, PUNICODE_STRING pRegistryPath)
+{
+    ULONG countProcessors = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    NDIS_TIMER_CHARACTERISTICS timerChars = { 0 };
+    NDIS_STATUS status = NDIS_STATUS_SUCCESS;
+
+    g_sampleUpcalls.maxBytes = Driver_ReadParameter(pRegistryPath, OVS_SAMPLE_UPCALL_MAX_BYTES_VALUE, OVS_SAMPLE_UPCALL_DEFAULT_MAX_BYTES);
+
+    timerChars.Header.Type = NDIS_OBJECT_TYPE_TIMER_CHARACTERISTICS;
+    timerChars.Header.Revision = NDIS_TIMER_CHARACTERISTICS_REVISION_1;
+    timerChars.Header.Size = NDIS_SIZEOF_TIMER_CHARACTERISTICS_REVISION_1;
+    timerChars.AllocationTag = g_extAllocationTag;
+    timerChars.TimerFunction = _SampleBatches_FlushTimer;
+    timerChars.FunctionContext = NULL;
+
+    status = NdisAllocateTimerObject(ndisHandle, &timerChars, &g_sampleUpcalls.hFlushTimer);
+    if (status != NDIS_STATUS_SUCCESS)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to allocate the sample upcall flush timer: 0x%x\n", status);
+        g_sampleUpcalls.hFlushTimer = NULL;
+        return;
+    }
+
+    g_sampleUpcalls.pBatches = KZAlloc(countProcessors * sizeof(OVS_SAMPLE_UPCALL_BATCH));
+    if (!g_sampleUpcalls.pBatches)
+    {
+        DEBUGP(LOG_ERROR, __FUNCTION__ " failed to allocate the sample upcall batches of %u processors\n", countProcessors);
+
+        NdisFreeTimerObject(g_sampleUpcalls.hFlushTimer);
+        g_sampleUpcalls.hFlushTimer = NULL;
+        return;
+    }
+
+    for (ULONG i = 0; i < countProcessors; ++i)
+    {
+        NdisAllocateSpinLock(&g_sampleUpcalls.pBatches[i].lock);
+    }
+
+    g_sampleUpcalls.countBatches = countProcessors;
+
+    DEBUGP(LOG_INFO, __FUNCTION__ " sample upcalls: max bytes=%u; batches of %u, on %u processors\n",
+        g_sampleUpcalls.maxBytes, OVS_SAMPLE_UPCALL_BATCH_SIZE, countProcessors);
+}
+
+VOID WinlPacket_UninitializeSampling()
+{
+    if (g_sampleUpcalls.hFlushTimer)
+    {
+        g_sampleUpcalls.stopping = TRUE;
+        KeMemoryBarrier();
+
+        //a timer function that runs may set the timer again, before it sees 'stopping': it is cancelled once the function returned
+        NdisCancelTimerObject(g_sampleUpcalls.hFlushTimer);
+        KeFlushQueuedDpcs();
+        NdisCancelTimerObject(g_sampleUpcalls.hFlushTimer);
+
+        NdisFreeTimerObject(g_sampleUpcalls.hFlushTimer);
+        g_sampleUpcalls.hFlushTimer = NULL;
+    }
+
+    for (ULONG i = 0; i < g_sampleUpcalls.countBatches; ++i)
+    {
+        OVS_SAMPLE_UPCALL_BATCH* pBatch = g_sampleUpcalls.pBatches + i;
+
+        for (ULONG j = 0; j < pBatch->count; ++j)
+        {
+            DestroyArgumentGroup(pBatch->msgs[j].pArgGroup);
+        }
+
+        NdisFreeSpinLock(&pBatch->lock);
+    }
+
+    KFree(g_sampleUpcalls.pBatches);
+
+    g_sampleUpcalls.pBatches = NULL;
+    g_sampleUpcalls.countBatches = 0;
+}
+
+BOOLEAN QueueSampleToUserspace(OVS_DATAPATH* pDatapath, _In_ NET_BUFFER* pNb, _In_ const OVS_UPCALL_INFO* pUpcallInfo)
+{
+    OVS_SAMPLE_UPCALL_BATCH* pBatch = NULL;
+    OVS_MESSAGE msg = { 0 };
+    OVS_MESSAGE detachedMsgs[OVS_SAMPLE_UPCALL_BATCH_SIZE];
+    ULONG countDetached = 0;
+    UINT16 ofSourcePort = pUpcallInfo->pPacketInfo->physical.ofInPort, detachedSourcePort = 0;
+    LONG64 now = 0;
+    BOOLEAN ok = TRUE;
+
+    if (!g_sampleUpcalls.pBatches)
+    {
+        return QueuePacketToUserspace(pDatapath, pNb, pUpcallInfo);
+    }
+
+    if (pUpcallInfo->portId == 0)
+    {
+        ok = FALSE;
+        goto Cleanup;
+    }
+
+    if (_CreateUpcallMsg(pDatapath, pNb, pUpcallInfo, /*copyData*/ TRUE, g_sampleUpcalls.maxBytes, &msg) != OVS_ERROR_NOERROR)
+    {
+        ok = FALSE;
+        goto Cleanup;
+    }
+
+    //the processor may change before the lock is taken: the upcall is then held in the batch of the previous one
+    pBatch = g_sampleUpcalls.pBatches + (KeGetCurrentProcessorNumberEx(NULL) % g_sampleUpcalls.countBatches);
+    now = (LONG64)KeQueryInterruptTime();
+
+    NdisAcquireSpinLock(&pBatch->lock);
+
+    if (pBatch->count > 0 && (pBatch->msgs[0].pid != msg.pid || pBatch->ofSourcePort != ofSourcePort))
+    {
+        countDetached = _SampleBatch_Detach_Unsafe(pBatch, detachedMsgs, &detachedSourcePort);
+    }
+
+    if (!pBatch->count)
+    {
+        pBatch->firstHeldTime = now;
+        pBatch->ofSourcePort = ofSourcePort;
+    }
+
+    pBatch->msgs[pBatch->count] = msg;
+    ++pBatch->count;
+
+    //if a batch was detached above, this one has just begun
+    if (!countDetached && (pBatch->count == OVS_SAMPLE_UPCALL_BATCH_SIZE || now - pBatch->firstHeldTime >= OVS_SAMPLE_UPCALL_MAX_DELAY))
+    {
+        countDetached = _SampleBatch_Detach_Unsafe(pBatch, detachedMsgs, &detachedSourcePort);
+    }
+
+    //the batch holds upcalls the packets to come might not flush
+    if (pBatch->count == 1)
+    {
+        _SampleBatches_SetFlushTimer(OVS_SAMPLE_UPCALL_MAX_DELAY);
+    }
+
+    NdisReleaseSpinLock(&pBatch->lock);
+
+    _SampleBatch_Write(detachedMsgs, countDetached, detachedSourcePort);
+
+Cleanup:
+    if (!ok)
+    {
+        LOCK_STATE_EX lockState = { 0 };
+
+        DATAPATH_LOCK_WRITE(pDatapath, &lockState);
+
+        ++pDatapath->statistics.countLost;
+
+        DATAPATH_UNLOCK(pDatapath, &lockState);
+    }
+
+    return ok;
+}
+
+VOID FlushSamplesToUserspace()
+{
+    LONG64 now = (LONG64)KeQueryInterruptTime();
+
+    for (ULONG i = 0; i < g_sampleUpcalls.countBatches; ++i)
+    {
+        OVS_SAMPLE_UPCALL_BATCH* pBatch = g_sampleUpcalls.pBatches + i;
+        OVS_MESSAGE detachedMsgs[OVS_SAMPLE_UPCALL_BATCH_SIZE];
+        ULONG countDetached = 0;
+        UINT16 detachedSourcePort = 0;
+
+        //read without the lock: a batch missed now is flushed by the next call
+        if (!pBatch->count || now - pBatch->firstHeldTime < OVS_SAMPLE_UPCALL_MAX_DELAY)
+        {
+            continue;
+        }
+
+        NdisAcquireSpinLock(&pBatch->lock);
+
+        if (pBatch->count && now - pBatch->firstHeldTime >= OVS_SAMPLE_UPCALL_MAX_DELAY)
+        {
+            countDetached = _SampleBatch_Detach_Unsafe(pBatch, detachedMsgs, &detachedSourcePort);
+        }
+
+        NdisReleaseSpinLock(&pBatch->lock);
+
+        _SampleBatch_Write(detachedMsgs, countDetached, detachedSourcePort);
+    }
+}
@@ -25,3 +25,27 @@ typedef struct _OVS_OFPACKET_INFO OVS_OFPACKET_INFO;
 VOID WinlPacket_Execute(OVS_SWITCH_INFO* pSwitchInfo, OVS_DATAPATH* pDatapath, _In_ OVS_ARGUMENT_GROUP* pArgGroup, const FILE_OBJECT* pFileObject);
 
 BOOLEAN QueuePacketToUserspace(OVS_DATAPATH* pDatapath, _In_ NET_BUFFER* pNb, _In_ const OVS_UPCALL_INFO* pUpcallInfo);
+
+/* SAMPLE UPCALLS: the upcalls of the sample actions carry only the first bytes of the packet, and are held in a batch per processor,
+written to userspace all at once: when the batch is full, when its upcall port or in port changes, or when its first upcall is too old.
+The batches are checked for old upcalls after each batch of packets processed, and by a timer, while upcalls are held. */
+
+//the driver's registry Parameters value: the max number of packet bytes a sample upcall carries. 0 = the whole packet.
+#define OVS_SAMPLE_UPCALL_MAX_BYTES_VALUE       L"SampleUpcallMaxBytes"
+#define OVS_SAMPLE_UPCALL_DEFAULT_MAX_BYTES     128
+
+#define OVS_SAMPLE_UPCALL_BATCH_SIZE            16
+//how long an upcall may be held in a batch (100ns units): 10ms
+#define OVS_SAMPLE_UPCALL_MAX_DELAY             (10 * 10000)
+
+//reads the limit from the driver's registry key and allocates the batches and their timer. Called once, at driver load.
+//if the allocation fails, the sample upcalls are queued one by one.
+VOID WinlPacket_InitializeSampling(NDIS_HANDLE ndisHandle, _In_ PUNICODE_STRING pRegistryPath);
+//stops the timer and drops the upcalls still held. Called before the devices are deleted: the timer writes to them.
+VOID WinlPacket_UninitializeSampling();
+
+//the upcall is truncated and its data is copied: the packet and the actions may be gone before it is written
+BOOLEAN QueueSampleToUserspace(OVS_DATAPATH* pDatapath, _In_ NET_BUFFER* pNb, _In_ const OVS_UPCALL_INFO* pUpcallInfo);
+
+//writes the batches held for longer than OVS_SAMPLE_UPCALL_MAX_DELAY. Called once per batch of packets processed, and by the timer.
+VOID FlushSamplesToUserspace();